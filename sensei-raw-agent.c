@@ -0,0 +1,245 @@
+/*
+ * sensei-raw-agent.c: wire protocol of the remote configuration agent
+ *
+ * Copyright (c) 2013, Přemysl Janouch <p.janouch@gmail.com>
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#include <string.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "sensei-raw-agent.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif // ! MSG_NOSIGNAL
+
+// --- Encoding ----------------------------------------------------------------
+
+/** A cursor over a frame. */
+struct frame
+{
+	unsigned char *data;                ///< The frame being written
+	const unsigned char *cdata;         ///< The frame being read
+	size_t len;                         ///< Length of the frame
+	size_t offset;                      ///< Current position
+	bool ok;                            ///< No overflow so far
+};
+
+static void
+put_u8 (struct frame *self, unsigned value)
+{
+	if (self->offset + 1 > self->len)
+		self->ok = false;
+	else
+		self->data[self->offset++] = value;
+}
+
+static void
+put_u32 (struct frame *self, uint32_t value)
+{
+	put_u8 (self, value >> 24);
+	put_u8 (self, value >> 16);
+	put_u8 (self, value >> 8);
+	put_u8 (self, value);
+}
+
+static void
+put_string (struct frame *self, const char *s)
+{
+	size_t len = strlen (s);
+	if (len >= SENSEI_AGENT_MAX_PATH)
+		self->ok = false;
+	put_u8 (self, len);
+	for (size_t i = 0; self->ok && i < len; i++)
+		put_u8 (self, s[i]);
+}
+
+/** Fill in the length prefix and return the length of the whole frame. */
+static size_t
+finish (struct frame *self)
+{
+	if (!self->ok)
+		return 0;
+
+	size_t len = self->offset;
+	self->offset = 0;
+	put_u32 (self, len - 4);
+	return len;
+}
+
+static unsigned
+get_u8 (struct frame *self)
+{
+	if (self->offset + 1 > self->len)
+	{
+		self->ok = false;
+		return 0;
+	}
+	return self->cdata[self->offset++];
+}
+
+static uint32_t
+get_u32 (struct frame *self)
+{
+	uint32_t value = get_u8 (self) << 24;
+	value |= get_u8 (self) << 16;
+	value |= get_u8 (self) << 8;
+	return value | get_u8 (self);
+}
+
+static void
+get_string (struct frame *self, char s[SENSEI_AGENT_MAX_PATH])
+{
+	size_t len = get_u8 (self);
+	if (len >= SENSEI_AGENT_MAX_PATH)
+		self->ok = false;
+	for (size_t i = 0; self->ok && i < len; i++)
+		s[i] = get_u8 (self);
+	s[self->ok ? len : 0] = '\0';
+}
+
+size_t
+sensei_agent_encode_request (const struct sensei_agent_request *request,
+	unsigned char buf[SENSEI_AGENT_MAX_FRAME])
+{
+	struct frame f = { .data = buf, .len = SENSEI_AGENT_MAX_FRAME,
+		.offset = 4, .ok = true };
+	if (request->n_targets > SENSEI_AGENT_MAX_TARGETS)
+		return 0;
+
+	put_u32 (&f, request->id);
+	put_u8 (&f, request->fields & SENSEI_FIELD_ALL);
+	put_u8 (&f, request->save ? SENSEI_AGENT_SAVE : 0);
+	put_u8 (&f, request->config.mode);
+	put_u8 (&f, request->config.polling);
+	put_u8 (&f, request->config.intensity);
+	put_u8 (&f, request->config.pulsation);
+	put_u8 (&f, request->config.cpi_off);
+	put_u8 (&f, request->config.cpi_on);
+
+	put_u8 (&f, request->n_targets);
+	for (size_t i = 0; i < request->n_targets; i++)
+		put_string (&f, request->targets[i]);
+	return finish (&f);
+}
+
+bool
+sensei_agent_decode_request (const unsigned char *data, size_t len,
+	struct sensei_agent_request *request)
+{
+	struct frame f = { .cdata = data, .len = len, .ok = true };
+	request->id        = get_u32 (&f);
+	request->fields    = get_u8 (&f) & SENSEI_FIELD_ALL;
+	request->save      = get_u8 (&f) & SENSEI_AGENT_SAVE;
+	request->config.mode      = get_u8 (&f);
+	request->config.polling   = get_u8 (&f);
+	request->config.intensity = get_u8 (&f);
+	request->config.pulsation = get_u8 (&f);
+	request->config.cpi_off   = get_u8 (&f);
+	request->config.cpi_on    = get_u8 (&f);
+
+	request->n_targets = get_u8 (&f);
+	if (request->n_targets > SENSEI_AGENT_MAX_TARGETS)
+		return false;
+	for (size_t i = 0; i < request->n_targets; i++)
+		get_string (&f, request->targets[i]);
+	return f.ok && f.offset == len;
+}
+
+size_t
+sensei_agent_encode_response (const struct sensei_agent_response *response,
+	unsigned char buf[SENSEI_AGENT_MAX_FRAME])
+{
+	struct frame f = { .data = buf, .len = SENSEI_AGENT_MAX_FRAME,
+		.offset = 4, .ok = true };
+	put_u32 (&f, response->id);
+	put_u8 (&f, response->last ? SENSEI_AGENT_LAST : 0);
+	put_u32 (&f, (uint32_t) response->result);
+	put_u8 (&f, response->failed);
+	put_string (&f, response->path);
+	return finish (&f);
+}
+
+bool
+sensei_agent_decode_response (const unsigned char *data, size_t len,
+	struct sensei_agent_response *response)
+{
+	struct frame f = { .cdata = data, .len = len, .ok = true };
+	response->id     = get_u32 (&f);
+	response->last   = get_u8 (&f) & SENSEI_AGENT_LAST;
+	response->result = (int32_t) get_u32 (&f);
+	response->failed = get_u8 (&f);
+	get_string (&f, response->path);
+	return f.ok && f.offset == len;
+}
+
+// --- I/O ---------------------------------------------------------------------
+
+static bool
+read_all (int fd, unsigned char *buf, size_t len)
+{
+	while (len)
+	{
+		ssize_t n = read (fd, buf, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		buf += n;
+		len -= n;
+	}
+	return true;
+}
+
+bool
+sensei_agent_read_frame (int fd,
+	unsigned char buf[SENSEI_AGENT_MAX_FRAME], size_t *len)
+{
+	unsigned char prefix[4];
+	if (!read_all (fd, prefix, sizeof prefix))
+		return false;
+
+	uint32_t frame_len = (uint32_t) prefix[0] << 24 | prefix[1] << 16
+		| prefix[2] << 8 | prefix[3];
+	if (frame_len > SENSEI_AGENT_MAX_FRAME || !read_all (fd, buf, frame_len))
+		return false;
+
+	*len = frame_len;
+	return true;
+}
+
+bool
+sensei_agent_write_all (int fd, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	while (len)
+	{
+		// Don't get killed by SIGPIPE when the other side hangs up
+		ssize_t n = send (fd, p, len, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		p += n;
+		len -= n;
+	}
+	return true;
+}
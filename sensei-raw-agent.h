@@ -0,0 +1,103 @@
+/*
+ * sensei-raw-agent.h: wire protocol of the remote configuration agent
+ *
+ * Every message is a frame starting with a 32-bit length of what follows.
+ * All integers are unsigned and big-endian.  A request looks like this:
+ *
+ *   u32 id          echoed back in all responses
+ *   u8  fields      SENSEI_FIELD_* bits of settings to change
+ *   u8  flags       SENSEI_AGENT_SAVE to also save them to ROM
+ *   u8  mode, polling, intensity, pulsation, cpi_off, cpi_on
+ *                   in device units, as in struct sensei_config
+ *   u8  n_targets   device nodes to apply it to, zero meaning all of them
+ *   n_targets times:
+ *     u8  length, followed by the device node
+ *
+ * For each target the agent sends back one response as soon as it's done,
+ * in no particular order, and then a final one with SENSEI_AGENT_LAST set
+ * and an empty device node:
+ *
+ *   u32 id
+ *   u8  flags       SENSEI_AGENT_LAST
+ *   u32 result      a negative libusb error code, or zero
+ *   u8  failed      index of the failed command, or 0xff
+ *   u8  length, followed by the device node
+ *
+ * Copyright (c) 2013, Přemysl Janouch <p.janouch@gmail.com>
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#ifndef SENSEI_RAW_AGENT_H
+#define SENSEI_RAW_AGENT_H
+
+#include "sensei-raw.h"
+
+/** Frames longer than this are rejected. */
+#define SENSEI_AGENT_MAX_FRAME  4096
+/** The most targets a single request may have. */
+#define SENSEI_AGENT_MAX_TARGETS  32
+/** Device nodes are short, this includes the terminating null. */
+#define SENSEI_AGENT_MAX_PATH  64
+
+/** Request flags. */
+#define SENSEI_AGENT_SAVE  0x01
+/** Response flags. */
+#define SENSEI_AGENT_LAST  0x01
+
+/** Marks responses without a failed command. */
+#define SENSEI_AGENT_NO_STEP  0xff
+
+struct sensei_agent_request
+{
+	uint32_t id;                        ///< Request ID
+	unsigned fields;                    ///< SENSEI_FIELD_* to change
+	bool save;                          ///< Whether to save to ROM
+	struct sensei_config config;        ///< New settings
+
+	size_t n_targets;                   ///< Zero for all devices
+	char targets[SENSEI_AGENT_MAX_TARGETS][SENSEI_AGENT_MAX_PATH];
+};
+
+struct sensei_agent_response
+{
+	uint32_t id;                        ///< Request ID
+	bool last;                          ///< No more responses will follow
+	int result;                         ///< Zero or a libusb error code
+	unsigned failed;                    ///< Failed command index
+	char path[SENSEI_AGENT_MAX_PATH];   ///< Device node
+};
+
+/** Serialize a request into a frame, returning its full length. */
+size_t sensei_agent_encode_request (const struct sensei_agent_request *request,
+	unsigned char buf[SENSEI_AGENT_MAX_FRAME]);
+/** Parse the contents of a frame, without the length prefix. */
+bool sensei_agent_decode_request (const unsigned char *data, size_t len,
+	struct sensei_agent_request *request);
+
+size_t sensei_agent_encode_response
+	(const struct sensei_agent_response *response,
+	unsigned char buf[SENSEI_AGENT_MAX_FRAME]);
+bool sensei_agent_decode_response (const unsigned char *data, size_t len,
+	struct sensei_agent_response *response);
+
+/** Read a frame, storing its contents without the length prefix.  Returns
+ *  false on errors, end of file and oversized frames. */
+bool sensei_agent_read_frame (int fd,
+	unsigned char buf[SENSEI_AGENT_MAX_FRAME], size_t *len);
+/** Write all of a buffer, retrying on short writes. */
+bool sensei_agent_write_all (int fd, const void *data, size_t len);
+
+#endif // ! SENSEI_RAW_AGENT_H
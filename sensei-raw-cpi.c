@@ -0,0 +1,118 @@
+/*
+ * sensei-raw-cpi.c: persisted CPI calibration
+ *
+ * The CPI that each step actually yields is produced by
+ * sensei-raw-ctl-calibrate and kept in a small text file with a line per
+ * device model and measured step:
+ *
+ *   <product ID in hex> <step> <measured CPI>
+ *
+ * Steps that haven't been measured are assumed to be exact.
+ *
+ * Copyright (c) 2013, Přemysl Janouch <p.janouch@gmail.com>
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+
+#include "sensei-raw.h"
+
+/** Longest line that we write. */
+#define LINE_MAX_LEN  32
+
+bool
+sensei_cpi_path (char *path, size_t path_len)
+{
+	return sensei_state_path ("cpi", !geteuid (), path, path_len);
+}
+
+/** What a line of the file is matched against. */
+struct cpi_key
+{
+	uint16_t product;                   ///< USB product ID
+	struct sensei_cpi_table *table;     ///< Where to put measurements
+};
+
+/** Parse a line, returning whether it's for the given model. */
+static bool
+parse_line (const char *line, void *user_data)
+{
+	struct cpi_key *key = user_data;
+	unsigned id, step;
+	double measured;
+	if (sscanf (line, "%x %u %lf", &id, &step, &measured) != 3
+	 || id != key->product || step < SENSEI_CPI_MIN || step > SENSEI_CPI_MAX
+	 || measured <= 0)
+		return false;
+
+	key->table->measured[step] = measured;
+	return true;
+}
+
+bool
+sensei_cpi_load (uint16_t product, struct sensei_cpi_table *table)
+{
+	memset (table, 0, sizeof *table);
+	struct cpi_key key = { product, table };
+	return sensei_state_read ("cpi", parse_line, &key);
+}
+
+bool
+sensei_cpi_store (uint16_t product, const struct sensei_cpi_table *table)
+{
+	char lines[(SENSEI_CPI_MAX + 1) * LINE_MAX_LEN] = "";
+	size_t len = 0;
+	for (int step = SENSEI_CPI_MIN;
+		step <= SENSEI_CPI_MAX && len < sizeof lines; step++)
+		if (table->measured[step] > 0)
+			len += snprintf (lines + len, sizeof lines - len,
+				"%04x %u %.1f\n", product, step, table->measured[step]);
+	if (len >= sizeof lines)
+		return false;
+
+	struct sensei_cpi_table unused;
+	struct cpi_key key = { product, &unused };
+	return sensei_state_replace ("cpi", parse_line, &key, lines);
+}
+
+double
+sensei_cpi_actual (const struct sensei_cpi_table *table, int step)
+{
+	if (table && table->measured[step] > 0)
+		return table->measured[step];
+	return step * SENSEI_CPI_STEP;
+}
+
+static double
+distance (double a, double b)
+{
+	return a > b ? a - b : b - a;
+}
+
+int
+sensei_cpi_nearest (const struct sensei_cpi_table *table, double cpi)
+{
+	int best = SENSEI_CPI_MIN;
+	for (int step = SENSEI_CPI_MIN + 1; step <= SENSEI_CPI_MAX; step++)
+		if (distance (sensei_cpi_actual (table, step), cpi)
+			< distance (sensei_cpi_actual (table, best), cpi))
+			best = step;
+	return best;
+}
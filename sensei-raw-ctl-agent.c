@@ -0,0 +1,782 @@
+/*
+ * sensei-raw-ctl-agent.c: remote configuration agent
+ *
+ * Listens on a Unix or TCP socket for requests as described in
+ * sensei-raw-agent.h and applies them to local devices, each target device
+ * in its own thread.  Requests for the same device are serialized.
+ *
+ * It can also be started by systemd on the first connection to a socket.
+ * With --idle-timeout, devices then stay open and claimed between requests
+ * and are kept in the file descriptor store, so that restarts don't need to
+ * go through all of that again, and the agent exits when nobody has been
+ * connected for a while.
+ *
+ * There is no authentication whatsoever, so only ever listen on the loopback
+ * or on networks that you trust completely, or tunnel through SSH.
+ *
+ * Copyright (c) 2013, Přemysl Janouch <p.janouch@gmail.com>
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+
+#include <getopt.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+// Only for the error codes, we don't link against the library
+#include <libusb.h>
+
+#include "config.h"
+#include "sensei-raw.h"
+#include "sensei-raw-agent.h"
+
+/** The first descriptor passed on by the service manager. */
+#define LISTEN_FDS_START  3
+
+// --- Service manager ---------------------------------------------------------
+
+/** Send a message to the service manager along with a descriptor, unless
+ *  it's negative, the way sd_pid_notify_with_fds() does.  Returns false
+ *  when we haven't been started by one. */
+static bool
+notify (const char *message, int fd)
+{
+	const char *path = getenv ("NOTIFY_SOCKET");
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (!path || (*path != '/' && *path != '@')
+	 || strlen (path) >= sizeof addr.sun_path)
+		return false;
+
+	// A leading @ stands for the abstract namespace
+	memcpy (addr.sun_path, path, strlen (path));
+	if (*path == '@')
+		addr.sun_path[0] = '\0';
+
+	int sock = socket (AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (sock < 0)
+		return false;
+
+	struct iovec iov = { .iov_base = (char *) message,
+		.iov_len = strlen (message) };
+	struct msghdr msg =
+	{
+		.msg_name = &addr,
+		.msg_namelen = offsetof (struct sockaddr_un, sun_path) + strlen (path),
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+	};
+
+	union
+	{
+		struct cmsghdr header;          ///< Forces alignment
+		char buf[CMSG_SPACE (sizeof (int))];  ///< The message
+	}
+	control;
+	if (fd >= 0)
+	{
+		memset (&control, 0, sizeof control);
+		msg.msg_control = control.buf;
+		msg.msg_controllen = sizeof control.buf;
+
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR (&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN (sizeof fd);
+		memcpy (CMSG_DATA (cmsg), &fd, sizeof fd);
+	}
+
+	bool ok = sendmsg (sock, &msg, MSG_NOSIGNAL) >= 0;
+	close (sock);
+	return ok;
+}
+
+/** Keep a device node in the file descriptor store under its path. */
+static bool
+store_fd (const char *path, int fd)
+{
+	char message[32 + SENSEI_AGENT_MAX_PATH];
+	snprintf (message, sizeof message, "FDSTORE=1\nFDNAME=%s", path);
+	return notify (message, fd);
+}
+
+static void
+unstore_fd (const char *path)
+{
+	char message[32 + SENSEI_AGENT_MAX_PATH];
+	snprintf (message, sizeof message, "FDSTOREREMOVE=1\nFDNAME=%s", path);
+	notify (message, -1);
+}
+
+// --- Devices -----------------------------------------------------------------
+
+/** Whether devices stay open and claimed between requests. */
+static bool g_keep_open;
+
+/** Serializes access to a single device node. */
+struct device_lock
+{
+	struct device_lock *next;           ///< Next item in the list
+	pthread_mutex_t mutex;              ///< The lock itself
+	char path[SENSEI_AGENT_MAX_PATH];   ///< Device node
+
+	struct sensei_device *device;       ///< Open, detached and claimed
+	bool stored;                        ///< In the file descriptor store
+};
+
+/** All device locks ever created, there's only going to be a few. */
+static struct device_lock *g_device_locks;
+static pthread_mutex_t g_device_locks_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static struct device_lock *
+device_lock_get (const char *path)
+{
+	pthread_mutex_lock (&g_device_locks_mutex);
+	struct device_lock *iter = g_device_locks;
+	while (iter && strcmp (iter->path, path))
+		iter = iter->next;
+	if (!iter && (iter = calloc (1, sizeof *iter)))
+	{
+		pthread_mutex_init (&iter->mutex, NULL);
+		snprintf (iter->path, sizeof iter->path, "%s", path);
+		iter->next = g_device_locks;
+		g_device_locks = iter;
+	}
+	pthread_mutex_unlock (&g_device_locks_mutex);
+	return iter;
+}
+
+/** Paths under /dev/bus/usb go through usbfs, anything else is hidraw. */
+static int
+open_device (const char *path, struct sensei_device **device)
+{
+	if (!strncmp (path, "/dev/bus/usb/", 13))
+		return sensei_usbfs_open (path, device);
+	return sensei_hidraw_open (path, device);
+}
+
+/** Take over a device node from the file descriptor store. */
+static int
+adopt_device (const char *path, int fd, struct sensei_device **device)
+{
+	if (!strncmp (path, "/dev/bus/usb/", 13))
+		return sensei_usbfs_open_fd (path, fd, device);
+	return sensei_hidraw_open_fd (path, fd, device);
+}
+
+/** Open, detach and claim the device, unless it's been kept from before. */
+static int
+device_lock_acquire (struct device_lock *self)
+{
+	if (self->device)
+		return 0;
+
+	int result = open_device (self->path, &self->device);
+	if (result)
+		return result;
+
+	sensei_use_pacing (self->device);
+	if (!(result = sensei_detach_kernel_driver (self->device))
+	 && (result = sensei_claim_interface (self->device)))
+		sensei_attach_kernel_driver (self->device);
+	if (result)
+	{
+		sensei_close (self->device);
+		self->device = NULL;
+		return result;
+	}
+
+	// Let the claim survive us for as long as the service manager wants
+	if (g_keep_open)
+		self->stored = store_fd (self->path, sensei_get_fd (self->device));
+	return 0;
+}
+
+/** Release the device and give it back to the kernel driver. */
+static int
+device_lock_release (struct device_lock *self)
+{
+	if (self->stored)
+		unstore_fd (self->path);
+	self->stored = false;
+
+	sensei_release_interface (self->device);
+	int result = sensei_attach_kernel_driver (self->device);
+	sensei_close (self->device);
+	self->device = NULL;
+	return result;
+}
+
+static int
+send_request (struct sensei_device *device,
+	const struct sensei_agent_request *request, unsigned *failed)
+{
+	struct sensei_command commands[SENSEI_MAX_COMMANDS];
+	size_t len = sensei_prepare_commands (&request->config,
+		request->fields, request->save, commands), index;
+
+	*failed = SENSEI_AGENT_NO_STEP;
+	int result = sensei_apply_commands (device,
+		PROJECT_NAME "-agent", commands, len, &index);
+	if (result)
+		*failed = index;
+	return result;
+}
+
+/** Apply a request to a device, returning the index of the failed command
+ *  in @a failed, or SENSEI_AGENT_NO_STEP. */
+static int
+apply_request (struct device_lock *lock,
+	const struct sensei_agent_request *request, unsigned *failed)
+{
+	*failed = SENSEI_AGENT_NO_STEP;
+
+	bool kept = lock->device != NULL;
+	int result = device_lock_acquire (lock);
+	if (!result)
+		result = send_request (lock->device, request, failed);
+
+	// The mouse may have been replugged since, try again with a new handle
+	if (kept
+	 && (result == LIBUSB_ERROR_NO_DEVICE || result == LIBUSB_ERROR_IO))
+	{
+		device_lock_release (lock);
+		if (!(result = device_lock_acquire (lock)))
+			result = send_request (lock->device, request, failed);
+	}
+
+	if (lock->device && (!g_keep_open || result == LIBUSB_ERROR_NO_DEVICE))
+	{
+		int release_result = device_lock_release (lock);
+		if (!result)
+			result = release_result;
+	}
+	return result;
+}
+
+// --- Clients -----------------------------------------------------------------
+
+static pthread_mutex_t g_activity_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned g_clients;              ///< Connected clients
+static double g_last_activity;          ///< When the last client has left
+
+static double
+now_seconds (void)
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/** A connected client. */
+struct client
+{
+	int fd;                             ///< The connection
+	pthread_mutex_t write_mutex;        ///< Responses come from many threads
+};
+
+static bool
+client_respond (struct client *self,
+	const struct sensei_agent_response *response)
+{
+	unsigned char buf[SENSEI_AGENT_MAX_FRAME];
+	size_t len = sensei_agent_encode_response (response, buf);
+
+	pthread_mutex_lock (&self->write_mutex);
+	bool ok = len && sensei_agent_write_all (self->fd, buf, len);
+	pthread_mutex_unlock (&self->write_mutex);
+	return ok;
+}
+
+/** A request being applied to a single device. */
+struct job
+{
+	struct client *client;              ///< Where to send the result
+	const struct sensei_agent_request *request;  ///< What to do
+	const char *path;                   ///< Which device to do it to
+	int result;                         ///< The outcome
+
+	pthread_t thread;                   ///< The thread doing the work
+	bool have_thread;                   ///< Whether the thread was started
+};
+
+static void *
+job_run (void *data)
+{
+	struct job *job = data;
+	struct sensei_agent_response response =
+		{ .id = job->request->id, .failed = SENSEI_AGENT_NO_STEP };
+	snprintf (response.path, sizeof response.path, "%s", job->path);
+
+	struct device_lock *lock = device_lock_get (job->path);
+	if (!lock)
+		job->result = LIBUSB_ERROR_NO_MEM;
+	else
+	{
+		pthread_mutex_lock (&lock->mutex);
+		job->result = apply_request (lock, job->request, &response.failed);
+		pthread_mutex_unlock (&lock->mutex);
+	}
+
+	// Stream the result back right away, the client can't do much else
+	// than disconnecting if this fails, which we'll notice soon enough
+	response.result = job->result;
+	client_respond (job->client, &response);
+	return NULL;
+}
+
+/** Run a request against all its targets in parallel. */
+static bool
+client_process (struct client *self, struct sensei_agent_request *request)
+{
+	struct sensei_device_info *list = NULL;
+	size_t len = request->n_targets;
+	if (!len)
+	{
+		int result = sensei_sysfs_list (&list, &len);
+		if (result)
+			len = 0;
+
+		// Prefer hidraw, where there's no kernel driver to detach
+		for (size_t i = 0; i < len && i < SENSEI_AGENT_MAX_TARGETS; i++)
+			snprintf (request->targets[i], sizeof request->targets[i], "%s",
+				list[i].hidraw_path ? list[i].hidraw_path : list[i].usb_path);
+		sensei_free_device_list (list, len);
+		if (len > SENSEI_AGENT_MAX_TARGETS)
+			len = SENSEI_AGENT_MAX_TARGETS;
+	}
+
+	struct job jobs[SENSEI_AGENT_MAX_TARGETS];
+	for (size_t i = 0; i < len; i++)
+	{
+		jobs[i] = (struct job) { .client = self, .request = request,
+			.path = request->targets[i] };
+		jobs[i].have_thread =
+			!pthread_create (&jobs[i].thread, NULL, job_run, &jobs[i]);
+		if (!jobs[i].have_thread)
+			job_run (&jobs[i]);
+	}
+
+	struct sensei_agent_response response = { .id = request->id,
+		.last = true, .failed = SENSEI_AGENT_NO_STEP };
+	if (!len)
+		response.result = LIBUSB_ERROR_NOT_FOUND;
+	for (size_t i = 0; i < len; i++)
+	{
+		if (jobs[i].have_thread)
+			pthread_join (jobs[i].thread, NULL);
+		if (!response.result)
+			response.result = jobs[i].result;
+	}
+	return client_respond (self, &response);
+}
+
+static void *
+client_run (void *data)
+{
+	struct client *self = data;
+	unsigned char buf[SENSEI_AGENT_MAX_FRAME];
+	size_t len;
+
+	// Requests on a single connection are processed in order
+	struct sensei_agent_request request;
+	while (sensei_agent_read_frame (self->fd, buf, &len)
+		&& sensei_agent_decode_request (buf, len, &request)
+		&& client_process (self, &request))
+		;
+
+	close (self->fd);
+	pthread_mutex_destroy (&self->write_mutex);
+	free (self);
+
+	pthread_mutex_lock (&g_activity_mutex);
+	g_clients--;
+	g_last_activity = now_seconds ();
+	pthread_mutex_unlock (&g_activity_mutex);
+	return NULL;
+}
+
+// --- Main --------------------------------------------------------------------
+
+static volatile sig_atomic_t g_terminated;
+
+static void
+on_terminate (int signum)
+{
+	(void) signum;
+	g_terminated = true;
+}
+
+static int
+listen_unix (const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	if (strlen (path) >= sizeof addr.sun_path)
+	{
+		fprintf (stderr, "Error: socket path too long: %s\n", path);
+		return -1;
+	}
+	strcpy (addr.sun_path, path);
+
+	int fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+	{
+		fprintf (stderr, "Error: socket: %s\n", strerror (errno));
+		return -1;
+	}
+
+	// A stale socket from a previous run would make bind() fail
+	unlink (path);
+	if (bind (fd, (struct sockaddr *) &addr, sizeof addr)
+	 || listen (fd, SOMAXCONN))
+	{
+		fprintf (stderr, "Error: %s: %s\n", path, strerror (errno));
+		close (fd);
+		return -1;
+	}
+	return fd;
+}
+
+/** Listen on [HOST:]PORT, the loopback by default. */
+static int
+listen_tcp (const char *address)
+{
+	char *host = strdup (address), *port;
+	if (!host)
+	{
+		fprintf (stderr, "Error: %s\n", strerror (errno));
+		return -1;
+	}
+	if ((port = strrchr (host, ':')))
+		*port++ = '\0';
+	else
+	{
+		port = host;
+		host = NULL;
+	}
+
+	struct addrinfo hints =
+	{
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+		.ai_flags = host ? AI_PASSIVE : 0,
+	}, *result;
+	int err = getaddrinfo (host, port, &hints, &result);
+	free (host ? host : port);
+	if (err)
+	{
+		fprintf (stderr, "Error: %s: %s\n", address, gai_strerror (err));
+		return -1;
+	}
+
+	int fd = -1;
+	for (struct addrinfo *ai = result; fd < 0 && ai; ai = ai->ai_next)
+	{
+		if ((fd = socket (ai->ai_family,
+			ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol)) < 0)
+			continue;
+
+		int yes = 1;
+		setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof yes);
+		if (bind (fd, ai->ai_addr, ai->ai_addrlen)
+		 || listen (fd, SOMAXCONN))
+		{
+			close (fd);
+			fd = -1;
+		}
+	}
+	if (fd < 0)
+		fprintf (stderr, "Error: %s: %s\n", address, strerror (errno));
+	freeaddrinfo (result);
+	return fd;
+}
+
+/** Take the descriptors passed on by the service manager, see
+ *  sd_listen_fds(): a listening socket and device nodes kept in the file
+ *  descriptor store, which are named after their paths.  Returns the socket,
+ *  or -1 if there's none. */
+static int
+take_passed_fds (void)
+{
+	const char *pid = getenv ("LISTEN_PID"), *fds = getenv ("LISTEN_FDS");
+	if (!pid || !fds || strtol (pid, NULL, 10) != (long) getpid ())
+		return -1;
+
+	const char *names = getenv ("LISTEN_FDNAMES");
+	char *names_copy = strdup (names ? names : ""), *cursor = names_copy;
+	int listen_fd = -1;
+	for (long i = 0, n = strtol (fds, NULL, 10); i < n; i++)
+	{
+		int fd = LISTEN_FDS_START + i;
+		fcntl (fd, F_SETFD, FD_CLOEXEC);
+
+		const char *name = cursor ? strsep (&cursor, ":") : NULL;
+		if (!name || *name != '/')
+		{
+			if (listen_fd < 0)
+				listen_fd = fd;
+			else
+				close (fd);
+			continue;
+		}
+
+		// The claim has been held by the store while we were away
+		struct device_lock *lock = device_lock_get (name);
+		int result = LIBUSB_ERROR_NO_MEM;
+		if (!lock)
+			close (fd);
+		else if (!(result = adopt_device (lock->path, fd, &lock->device)))
+		{
+			sensei_use_pacing (lock->device);
+			lock->stored = true;
+			continue;
+		}
+
+		fprintf (stderr, "Warning: couldn't take over %s: %s\n",
+			name, sensei_error_name (result));
+		unstore_fd (name);
+	}
+	free (names_copy);
+
+	unsetenv ("LISTEN_PID");
+	unsetenv ("LISTEN_FDS");
+	unsetenv ("LISTEN_FDNAMES");
+	return listen_fd;
+}
+
+/** Close all devices kept open.  Stored ones are left claimed for the next
+ *  instance, unless they're to be given back to their drivers. */
+static void
+close_devices (bool give_back)
+{
+	for (struct device_lock *iter = g_device_locks; iter; iter = iter->next)
+	{
+		pthread_mutex_lock (&iter->mutex);
+		if (iter->device && (give_back || !iter->stored))
+			device_lock_release (iter);
+		else if (iter->device)
+		{
+			sensei_close (iter->device);
+			iter->device = NULL;
+		}
+		pthread_mutex_unlock (&iter->mutex);
+	}
+}
+
+/** Wait for a connection while checking for inactivity.
+ *  Returns false when it's time to quit. */
+static bool
+wait_for_client (int listen_fd, unsigned idle_timeout)
+{
+	while (!g_terminated)
+	{
+		pthread_mutex_lock (&g_activity_mutex);
+		double remaining = g_clients ? idle_timeout
+			: g_last_activity + idle_timeout - now_seconds ();
+		pthread_mutex_unlock (&g_activity_mutex);
+		if (remaining <= 0)
+			return false;
+
+		// Clients leaving don't wake us up, so check again every so often
+		struct pollfd pfd = { .fd = listen_fd, .events = POLLIN };
+		int ready = poll (&pfd, 1, remaining * 1000 + 1);
+		if (ready > 0 || (ready < 0 && errno != EINTR))
+			return true;
+	}
+	return false;
+}
+
+static void
+show_usage (const char *program_name)
+{
+	printf ("Usage: %s [OPTION]...\n", program_name);
+	printf ("Apply settings to SteelSeries Sensei Raw devices on request.\n\n");
+	printf ("  -h, --help      Show this help\n");
+	printf ("  --version       Show program version and exit\n");
+	printf ("  --socket PATH   Listen on a Unix socket at PATH\n");
+	printf ("  --listen ADDR   Listen on TCP [HOST:]PORT, HOST defaults"
+	                         " to the loopback\n");
+	printf ("  --idle-timeout S\n"
+	        "                  Keep devices claimed between requests and exit"
+	                         " after S seconds\n"
+	        "                  without clients\n");
+	printf ("\nWhen started by systemd with a socket, neither --socket"
+	        " nor --listen is needed.\n");
+	printf ("\n");
+}
+
+int
+main (int argc, char *argv[])
+{
+	static struct option long_opts[] =
+	{
+		{ "help",      no_argument,       0, 'h' },
+		{ "version",   no_argument,       0, 'V' },
+		{ "socket",    required_argument, 0, 's' },
+		{ "listen",    required_argument, 0, 'l' },
+		{ "idle-timeout", required_argument, 0, 'i' },
+		{ 0,           0,                 0,  0  }
+	};
+
+	const char *socket_path = NULL, *address = NULL;
+	unsigned long idle_timeout = 0;
+	char *end;
+	int c;
+	while ((c = getopt_long (argc, argv, "h", long_opts, NULL)) != -1)
+	{
+	switch (c)
+	{
+	case 'h':
+		show_usage (argv[0]);
+		return EXIT_SUCCESS;
+	case 'V':
+		printf (PROJECT_NAME "-agent " PROJECT_VERSION "\n");
+		return EXIT_SUCCESS;
+	case 's':
+		socket_path = optarg;
+		break;
+	case 'l':
+		address = optarg;
+		break;
+	case 'i':
+		idle_timeout = strtoul (optarg, &end, 10);
+		if (!*optarg || *end || !idle_timeout || idle_timeout > 86400)
+		{
+			fprintf (stderr, "Error: invalid timeout: %s\n", optarg);
+			return EXIT_FAILURE;
+		}
+		break;
+	default:
+		return EXIT_FAILURE;
+	}
+	}
+
+	if (optind < argc)
+	{
+		fprintf (stderr, "Error: extra parameters\n");
+		return EXIT_FAILURE;
+	}
+
+	// Adopted devices have to know whether to stay open
+	g_keep_open = idle_timeout != 0;
+	g_last_activity = now_seconds ();
+
+	int listen_fd = take_passed_fds ();
+	bool activated = listen_fd >= 0;
+	if (!activated && !socket_path == !address)
+	{
+		fprintf (stderr, "Error: exactly one of --socket, --listen needed\n");
+		close_devices (true);
+		return EXIT_FAILURE;
+	}
+
+	if (!activated && (listen_fd = socket_path
+		? listen_unix (socket_path)
+		: listen_tcp (address)) < 0)
+	{
+		close_devices (true);
+		return EXIT_FAILURE;
+	}
+
+	// Without SA_RESTART, so that accept() gets interrupted
+	struct sigaction sa = { .sa_handler = on_terminate };
+	sigemptyset (&sa.sa_mask);
+	sigaction (SIGINT, &sa, NULL);
+	sigaction (SIGTERM, &sa, NULL);
+	signal (SIGPIPE, SIG_IGN);
+
+	pthread_attr_t attr;
+	pthread_attr_init (&attr);
+	pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED);
+
+	notify ("READY=1", -1);
+
+	int status = EXIT_SUCCESS;
+	bool idle = false;
+	while (!g_terminated)
+	{
+		if (idle_timeout && !wait_for_client (listen_fd, idle_timeout))
+		{
+			idle = !g_terminated;
+			break;
+		}
+
+		int fd = accept4 (listen_fd, NULL, NULL, SOCK_CLOEXEC);
+		if (fd < 0)
+		{
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			fprintf (stderr, "Error: accept: %s\n", strerror (errno));
+			status = EXIT_FAILURE;
+			break;
+		}
+
+		// Responses are small and latency matters more than throughput
+		int yes = 1;
+		setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof yes);
+
+		pthread_t thread;
+		struct client *client = calloc (1, sizeof *client);
+		if (!client)
+		{
+			close (fd);
+			continue;
+		}
+
+		client->fd = fd;
+		pthread_mutex_init (&client->write_mutex, NULL);
+
+		pthread_mutex_lock (&g_activity_mutex);
+		g_clients++;
+		pthread_mutex_unlock (&g_activity_mutex);
+		if (pthread_create (&thread, &attr, client_run, client))
+		{
+			pthread_mutex_destroy (&client->write_mutex);
+			close (fd);
+			free (client);
+
+			pthread_mutex_lock (&g_activity_mutex);
+			g_clients--;
+			pthread_mutex_unlock (&g_activity_mutex);
+		}
+	}
+
+	// Connections arriving from now on will start another instance;
+	// being stopped may well mean a restart, so stored claims are kept then
+	notify ("STOPPING=1", -1);
+	close_devices (idle);
+
+	pthread_attr_destroy (&attr);
+	close (listen_fd);
+	if (socket_path && !activated)
+		unlink (socket_path);
+	return status;
+}
@@ -0,0 +1,1917 @@
+/*
+ * sensei-raw-ctl-bench.c: SteelSeries Sensei Raw benchmarks
+ *
+ * Every benchmark prints a table of latency distributions in microseconds.
+ * Run them against a real mouse or against sensei-raw-ctl-emu.
+ *
+ * Copyright (c) 2013, Přemysl Janouch <p.janouch@gmail.com>
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <time.h>
+#include <errno.h>
+
+#include <getopt.h>
+#ifdef __linux__
+#include <unistd.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/ioctl.h>
+#include <poll.h>
+#include <dirent.h>
+#include <linux/uhid.h>
+#include <linux/input.h>
+#include <libusb.h>
+#endif // __linux__
+
+#include "config.h"
+#include "sensei-raw.h"
+#ifdef __linux__
+#include "sensei-raw-agent.h"
+#endif // __linux__
+
+/** Common benchmark settings. */
+struct bench_options
+{
+	long iterations;                    ///< How many times to repeat things
+	const char *device_path;            ///< Device node to use, if any
+	const char *hidraw_path;            ///< hidraw node to use, if any
+	const char *helper_path;            ///< The udev helper to run
+	const char *agent_path;             ///< The agent to run
+	const char *mount_path;             ///< Where the FUSE server is mounted
+	const char *gadget_path;            ///< USB HID gadget to feed reports to
+	long stress_cpu;                    ///< Spinning threads to run alongside
+	long stress_memory;                 ///< Megabytes of memory to sweep
+	long clients;                       ///< How many agent clients to run
+	long duration;                      ///< How long to soak, in seconds
+	unsigned long seed;                 ///< Random seed, zero for any
+};
+
+// --- Statistics --------------------------------------------------------------
+
+/** A growing array of measurements. */
+struct samples
+{
+	double *values;                     ///< The measurements
+	size_t len;                         ///< Number of measurements
+	size_t alloc;                       ///< Allocated length of the array
+};
+
+static double
+now_us (void)
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void
+samples_add (struct samples *self, double value)
+{
+	if (self->len == self->alloc)
+	{
+		self->alloc = self->alloc ? self->alloc * 2 : 64;
+		if (!(self->values =
+			realloc (self->values, self->alloc * sizeof *self->values)))
+			abort ();
+	}
+	self->values[self->len++] = value;
+}
+
+static void
+samples_free (struct samples *self)
+{
+	free (self->values);
+	memset (self, 0, sizeof *self);
+}
+
+static int
+compare_doubles (const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+	return (x > y) - (x < y);
+}
+
+/** Nearest-rank percentile of sorted samples. */
+static double
+samples_percentile (const struct samples *self, double percentile)
+{
+	size_t rank = percentile / 100 * self->len;
+	if (rank >= self->len)
+		rank = self->len - 1;
+	return self->values[rank];
+}
+
+static void
+print_table_header (void)
+{
+	printf ("%-24s %7s %9s %9s %9s %9s %9s %9s\n",
+		"", "n", "min", "p50", "p90", "p99", "max", "mean");
+}
+
+static void
+print_table_row (const char *label, struct samples *self)
+{
+	if (!self->len)
+	{
+		printf ("%-24s %7s\n", label, "-");
+		return;
+	}
+
+	qsort (self->values, self->len, sizeof *self->values, compare_doubles);
+	double sum = 0;
+	for (size_t i = 0; i < self->len; i++)
+		sum += self->values[i];
+
+	printf ("%-24s %7zu %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n", label,
+		self->len, self->values[0], samples_percentile (self, 50),
+		samples_percentile (self, 90), samples_percentile (self, 99),
+		self->values[self->len - 1], sum / self->len);
+}
+
+// --- Cold start --------------------------------------------------------------
+
+typedef int (*open_fn) (const char *path, struct sensei_device **device);
+
+/** Go through everything a one-shot invocation of the utility does. */
+static void
+cold_start_backend (const struct bench_options *options,
+	const char *name, open_fn open_device)
+{
+	struct samples open_us = { 0 }, claim_us = { 0 }, transfer_us = { 0 },
+		release_us = { 0 }, total_us = { 0 };
+
+	printf ("\n%s\n", name);
+	for (long i = 0; i < options->iterations; i++)
+	{
+		struct sensei_device *device = NULL;
+		unsigned char blob[SENSEI_BLOB_LENGTH];
+
+		double t0 = now_us ();
+		int result = open_device (options->device_path, &device);
+		double t1 = now_us ();
+		if (result)
+		{
+			printf ("  open failed: %s\n", sensei_error_name (result));
+			break;
+		}
+		if ((result = sensei_detach_kernel_driver (device))
+		 || (result = sensei_claim_interface (device)))
+		{
+			printf ("  claim failed: %s\n", sensei_error_name (result));
+			sensei_attach_kernel_driver (device);
+			sensei_close (device);
+			break;
+		}
+		double t2 = now_us ();
+		result = sensei_load_blob (device, blob);
+		double t3 = now_us ();
+		sensei_release_interface (device);
+		sensei_attach_kernel_driver (device);
+		sensei_close (device);
+		double t4 = now_us ();
+		if (result)
+		{
+			printf ("  transfer failed: %s\n", sensei_error_name (result));
+			break;
+		}
+
+		samples_add (&open_us, t1 - t0);
+		samples_add (&claim_us, t2 - t1);
+		samples_add (&transfer_us, t3 - t2);
+		samples_add (&release_us, t4 - t3);
+		samples_add (&total_us, t4 - t0);
+	}
+
+	print_table_header ();
+	print_table_row ("open", &open_us);
+	print_table_row ("detach and claim", &claim_us);
+	print_table_row ("GET_REPORT", &transfer_us);
+	print_table_row ("release and close", &release_us);
+	print_table_row ("total", &total_us);
+
+	samples_free (&open_us);
+	samples_free (&claim_us);
+	samples_free (&transfer_us);
+	samples_free (&release_us);
+	samples_free (&total_us);
+}
+
+static int
+bench_cold_start (const struct bench_options *options)
+{
+	cold_start_backend (options, "libusb", sensei_libusb_open);
+#ifdef __linux__
+	cold_start_backend (options, "usbfs", sensei_usbfs_open);
+#endif // __linux__
+	return 0;
+}
+
+// --- Batched submission ------------------------------------------------------
+
+#ifdef __linux__
+
+/** Compare a chain of commands sent one write() at a time with the same
+ *  chain submitted at once, which uses io_uring where it's available. */
+static int
+bench_batch (const struct bench_options *options)
+{
+	struct sensei_device *device = NULL;
+	int result = sensei_hidraw_open (options->hidraw_path, &device);
+	if (result)
+	{
+		printf ("open failed: %s\n", sensei_error_name (result));
+		return -1;
+	}
+
+	// Only re-set what's already there, so that this is harmless
+	struct sensei_config config;
+	if ((result = sensei_load_config (device, &config)))
+	{
+		printf ("reading settings failed: %s\n", sensei_error_name (result));
+		sensei_close (device);
+		return -1;
+	}
+
+	struct sensei_command commands[SENSEI_MAX_COMMANDS];
+	size_t len = sensei_prepare_commands (&config,
+		SENSEI_FIELD_ALL & ~SENSEI_FIELD_MODE, false, commands);
+
+	struct samples sequential_us = { 0 }, batched_us = { 0 };
+	unsigned long sequential_syscalls = 0, batched_syscalls = 0;
+
+	for (long i = 0; !result && i < options->iterations; i++)
+	{
+		unsigned long syscalls = device->stats.syscalls;
+		double t0 = now_us ();
+		for (size_t k = 0; !result && k < len; k++)
+		{
+			unsigned char data[SENSEI_COMMAND_LENGTH];
+			memcpy (data, commands[k].data, sizeof data);
+			result = sensei_send_command (device, data, sizeof data);
+		}
+		samples_add (&sequential_us, now_us () - t0);
+		sequential_syscalls += device->stats.syscalls - syscalls;
+	}
+
+	// The first submission sets up the ring, don't count that in
+	size_t failed = 0;
+	if (!result)
+		result = sensei_send_commands (device, commands, len, &failed);
+
+	for (long i = 0; !result && i < options->iterations; i++)
+	{
+		unsigned long syscalls = device->stats.syscalls;
+		double t0 = now_us ();
+		result = sensei_send_commands (device, commands, len, &failed);
+		samples_add (&batched_us, now_us () - t0);
+		batched_syscalls += device->stats.syscalls - syscalls;
+	}
+
+	if (result)
+		printf ("sending failed: %s\n", sensei_error_name (result));
+
+	printf ("%zu commands per chain via %s\n", len, device->path);
+	print_table_header ();
+	print_table_row ("sequential", &sequential_us);
+	print_table_row ("batched", &batched_us);
+	if (sequential_us.len)
+		printf ("syscalls per chain: sequential %.1f",
+			(double) sequential_syscalls / sequential_us.len);
+	if (batched_us.len)
+		printf (", batched %.1f",
+			(double) batched_syscalls / batched_us.len);
+	printf ("\n");
+
+	samples_free (&sequential_us);
+	samples_free (&batched_us);
+	sensei_close (device);
+	return result ? -1 : 0;
+}
+
+// --- udev helper -------------------------------------------------------------
+
+/** Run a program to completion, returning its exit status or -1.
+ *  Its output is thrown away, so as not to get mixed with ours. */
+static int
+spawn_and_wait (char *argv[], char *envp[])
+{
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init (&actions);
+	posix_spawn_file_actions_addopen (&actions,
+		STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+
+	pid_t pid;
+	int spawn_error = posix_spawn (&pid, argv[0], &actions, NULL, argv, envp);
+	posix_spawn_file_actions_destroy (&actions);
+	if (spawn_error)
+		return -1;
+
+	int status;
+	while (waitpid (pid, &status, 0) < 0)
+		if (errno != EINTR)
+			return -1;
+	return WIFEXITED (status) ? WEXITSTATUS (status) : -1;
+}
+
+/** Time a program from spawning it to its exit. */
+static bool
+time_program (const struct bench_options *options,
+	const char *label, char *argv[], char *envp[])
+{
+	struct samples total_us = { 0 };
+	int status = 0;
+	for (long i = 0; !status && i < options->iterations; i++)
+	{
+		double t0 = now_us ();
+		status = spawn_and_wait (argv, envp);
+		samples_add (&total_us, now_us () - t0);
+	}
+
+	print_table_row (label, &total_us);
+	if (status)
+		printf ("%s failed with status %d\n", argv[0], status);
+	samples_free (&total_us);
+	return !status;
+}
+
+/** Compare the udev helper applying a profile with the control utility
+ *  applying the same settings, both measured from start to exit. */
+static int
+bench_udev_helper (const struct bench_options *options)
+{
+	struct sensei_device *device = NULL;
+	int result = sensei_hidraw_open (options->hidraw_path, &device);
+	if (result)
+	{
+		printf ("open failed: %s\n", sensei_error_name (result));
+		return -1;
+	}
+
+	// Only re-set what's already there, so that this is harmless
+	struct sensei_config config;
+	result = sensei_load_config (device, &config);
+	char devname[64];
+	snprintf (devname, sizeof devname, "DEVNAME=%s", device->path);
+	sensei_close (device);
+	if (result)
+	{
+		printf ("reading settings failed: %s\n", sensei_error_name (result));
+		return -1;
+	}
+
+	char profile[] = "/tmp/" PROJECT_NAME "-bench.XXXXXX";
+	int fd = mkstemp (profile);
+	FILE *fp = fd < 0 ? NULL : fdopen (fd, "w");
+	if (!fp)
+	{
+		printf ("creating a profile failed: %s\n", strerror (errno));
+		return -1;
+	}
+
+	char polling[8], intensity[8], pulsation[8], cpi_off[8], cpi_on[8];
+	snprintf (polling, sizeof polling, "%s",
+		sensei_polling_name (config.polling));
+	snprintf (intensity, sizeof intensity, "%s",
+		sensei_intensity_name (config.intensity));
+	snprintf (pulsation, sizeof pulsation, "%s",
+		sensei_pulsation_name (config.pulsation));
+	snprintf (cpi_off, sizeof cpi_off, "%d", config.cpi_off * SENSEI_CPI_STEP);
+	snprintf (cpi_on, sizeof cpi_on, "%d", config.cpi_on * SENSEI_CPI_STEP);
+
+	fprintf (fp, "polling %s\nintensity %s\npulsation %s\n"
+		"cpi-off %s\ncpi-on %s\n",
+		polling, intensity, pulsation, cpi_off, cpi_on);
+	fclose (fp);
+
+	char *helper_argv[] =
+		{ (char *) options->helper_path, "--profile", profile, NULL };
+	char *helper_envp[] = { devname, NULL };
+
+	// The utility detaches usbhid, which recreates the hidraw node,
+	// so it has to go last
+	char *ctl_argv[] = { PROJECT_INSTALL_BINDIR "/" PROJECT_NAME,
+		"--polling", polling, "--intensity", intensity,
+		"--pulsation", pulsation, "--cpi-off", cpi_off, "--cpi-on", cpi_on,
+		NULL };
+	char *ctl_envp[] = { NULL };
+
+	printf ("spawn to exit, applying the current settings via %s\n",
+		devname + sizeof "DEVNAME=" - 1);
+	print_table_header ();
+	bool ok = time_program (options, "udev helper", helper_argv, helper_envp)
+		&& time_program (options, PROJECT_NAME, ctl_argv, ctl_envp);
+
+	unlink (profile);
+	return ok ? 0 : -1;
+}
+
+// --- Agent -------------------------------------------------------------------
+
+/** A client of the agent, doing requests one after another. */
+struct agent_client
+{
+	const struct bench_options *options;  ///< Iterations
+	const char *socket_path;            ///< Where the agent listens
+	const struct sensei_agent_request *request;  ///< What to send
+	pthread_t thread;                   ///< The thread running the client
+
+	struct samples latency_us;          ///< Request to final response
+	unsigned long failures;             ///< Requests that failed
+	bool broken;                        ///< The connection has failed
+};
+
+static int
+agent_connect (const char *socket_path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	snprintf (addr.sun_path, sizeof addr.sun_path, "%s", socket_path);
+
+	int fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd >= 0 && connect (fd, (struct sockaddr *) &addr, sizeof addr))
+	{
+		close (fd);
+		fd = -1;
+	}
+	return fd;
+}
+
+static void *
+agent_client_run (void *data)
+{
+	struct agent_client *self = data;
+	int fd = agent_connect (self->socket_path);
+	if (fd < 0)
+	{
+		self->broken = true;
+		return NULL;
+	}
+
+	unsigned char request[SENSEI_AGENT_MAX_FRAME];
+	size_t request_len = sensei_agent_encode_request (self->request, request);
+
+	unsigned char buf[SENSEI_AGENT_MAX_FRAME];
+	size_t len;
+	struct sensei_agent_response response;
+	for (long i = 0; !self->broken && i < self->options->iterations; i++)
+	{
+		double t0 = now_us ();
+		if (!sensei_agent_write_all (fd, request, request_len))
+			self->broken = true;
+
+		response.last = false;
+		while (!self->broken && !response.last)
+			if (!sensei_agent_read_frame (fd, buf, &len)
+			 || !sensei_agent_decode_response (buf, len, &response))
+				self->broken = true;
+		if (self->broken)
+			break;
+
+		samples_add (&self->latency_us, now_us () - t0);
+		if (response.result)
+			self->failures++;
+	}
+	close (fd);
+	return NULL;
+}
+
+/** Spawn the agent on a Unix socket and wait until it accepts connections. */
+static pid_t
+agent_spawn (const struct bench_options *options, char *socket_path)
+{
+	char *argv[] =
+		{ (char *) options->agent_path, "--socket", socket_path, NULL };
+	extern char **environ;
+
+	pid_t pid;
+	if (posix_spawn (&pid, argv[0], NULL, NULL, argv, environ))
+		return -1;
+
+	int fd = -1;
+	for (int i = 0; fd < 0 && i < 200; i++)
+	{
+		if ((fd = agent_connect (socket_path)) < 0)
+			usleep (10000);
+	}
+	if (fd < 0)
+	{
+		kill (pid, SIGTERM);
+		waitpid (pid, NULL, 0);
+		return -1;
+	}
+	close (fd);
+	return pid;
+}
+
+/** Many concurrent clients sending requests to an agent over the loopback,
+ *  which makes for requests per second and latency percentiles. */
+static int
+bench_agent (const struct bench_options *options)
+{
+	// Re-set the current polling rate, so that this is harmless
+	struct sensei_agent_request request = { .id = 1 };
+	struct sensei_device *device = NULL;
+	if (!sensei_hidraw_open (options->hidraw_path, &device))
+	{
+		if (!sensei_load_config (device, &request.config))
+		{
+			request.fields = SENSEI_FIELD_POLLING;
+			request.n_targets = 1;
+			snprintf (request.targets[0], sizeof request.targets[0],
+				"%s", device->path);
+		}
+		sensei_close (device);
+	}
+	if (!request.n_targets)
+		printf ("no device, measuring protocol overhead only\n");
+
+	char dir[] = "/tmp/" PROJECT_NAME "-bench.XXXXXX";
+	if (!mkdtemp (dir))
+	{
+		printf ("creating a directory failed: %s\n", strerror (errno));
+		return -1;
+	}
+
+	char socket_path[sizeof dir + sizeof "/agent"];
+	snprintf (socket_path, sizeof socket_path, "%s/agent", dir);
+	pid_t pid = agent_spawn (options, socket_path);
+	if (pid < 0)
+	{
+		printf ("starting %s failed\n", options->agent_path);
+		rmdir (dir);
+		return -1;
+	}
+
+	struct agent_client *clients = calloc (options->clients, sizeof *clients);
+	if (!clients)
+		abort ();
+
+	double t0 = now_us ();
+	for (long i = 0; i < options->clients; i++)
+	{
+		clients[i].options = options;
+		clients[i].socket_path = socket_path;
+		clients[i].request = &request;
+		if (pthread_create (&clients[i].thread, NULL,
+			agent_client_run, &clients[i]))
+			abort ();
+	}
+
+	struct samples latency_us = { 0 };
+	unsigned long failures = 0, broken = 0;
+	for (long i = 0; i < options->clients; i++)
+	{
+		pthread_join (clients[i].thread, NULL);
+		for (size_t k = 0; k < clients[i].latency_us.len; k++)
+			samples_add (&latency_us, clients[i].latency_us.values[k]);
+		failures += clients[i].failures;
+		broken += clients[i].broken;
+		samples_free (&clients[i].latency_us);
+	}
+	double elapsed_us = now_us () - t0;
+
+	kill (pid, SIGTERM);
+	waitpid (pid, NULL, 0);
+	rmdir (dir);
+
+	printf ("%ld clients, %ld requests each", options->clients,
+		options->iterations);
+	if (request.n_targets)
+		printf (" to %s", request.targets[0]);
+	printf ("\n");
+	print_table_header ();
+	print_table_row ("request", &latency_us);
+	printf ("requests per second: %.1f, failed: %lu, broken connections: %lu\n",
+		latency_us.len / (elapsed_us / 1e6), failures, broken);
+
+	samples_free (&latency_us);
+	free (clients);
+	return broken ? -1 : 0;
+}
+
+// --- Soak test ---------------------------------------------------------------
+
+/** xorshift64*, good enough and reproducible everywhere. */
+static uint32_t
+soak_random (uint64_t *state)
+{
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return (*state * 0x2545f4914f6cdd1d) >> 32;
+}
+
+/** Prepare a random command and apply it to the reference model. */
+static void
+soak_command (uint64_t *state, struct sensei_command *command,
+	struct sensei_config *model)
+{
+	int value = 1 + soak_random (state) % 4;
+	int cpi = SENSEI_CPI_MIN
+		+ soak_random (state) % (SENSEI_CPI_MAX - SENSEI_CPI_MIN + 1);
+	switch (soak_random (state) % 8)
+	{
+	case 0:
+		sensei_command_mode (command, model->mode = 1 + value % 2);
+		break;
+	case 1:
+		sensei_command_cpi (command, model->cpi_off = cpi, false);
+		break;
+	case 2:
+		sensei_command_cpi (command, model->cpi_on = cpi, true);
+		break;
+	case 3:
+		sensei_command_polling (command, model->polling = value);
+		break;
+	case 4:
+	case 5:
+		sensei_command_intensity (command, model->intensity = value);
+		break;
+	case 6:
+		sensei_command_pulsation (command, model->pulsation = value);
+		break;
+	default:
+		sensei_command_save (command);
+	}
+}
+
+/** Resident set size of this process, in kilobytes. */
+static long
+soak_rss_kb (void)
+{
+	long pages = 0;
+	FILE *fp = fopen ("/proc/self/statm", "r");
+	if (fp)
+	{
+		if (fscanf (fp, "%*s %ld", &pages) != 1)
+			pages = 0;
+		fclose (fp);
+	}
+	return pages * (sysconf (_SC_PAGESIZE) / 1024);
+}
+
+/** Whether a hidraw node belongs to an emulated device, with no USB device
+ *  behind it.  Real mice would have their ROM worn out by this. */
+static bool
+soak_is_emulated (const char *path)
+{
+	struct sensei_device_info *list;
+	size_t len;
+	if (sensei_sysfs_list (&list, &len))
+		return false;
+
+	bool emulated = false;
+	for (size_t i = 0; i < len; i++)
+		if (list[i].hidraw_path && !strcmp (list[i].hidraw_path, path))
+			emulated = !list[i].usb_path;
+	sensei_free_device_list (list, len);
+	return emulated;
+}
+
+/** Random chains of commands as fast as they go, each followed by checking
+ *  the GET_REPORT blob against a reference model. */
+static int
+bench_soak (const struct bench_options *options)
+{
+	struct sensei_device *device = NULL;
+	int result = sensei_hidraw_open (options->hidraw_path, &device);
+	if (result)
+	{
+		printf ("open failed: %s\n", sensei_error_name (result));
+		return -1;
+	}
+	if (!soak_is_emulated (device->path))
+	{
+		printf ("%s isn't an emulated device, refusing to soak it\n",
+			device->path);
+		sensei_close (device);
+		return -1;
+	}
+
+	struct sensei_config model;
+	if ((result = sensei_load_config (device, &model)))
+	{
+		printf ("reading settings failed: %s\n", sensei_error_name (result));
+		sensei_close (device);
+		return -1;
+	}
+
+	uint64_t seed = options->seed ? options->seed : (uint64_t) time (NULL);
+	uint64_t state = seed;
+	printf ("soaking %s for %ld s, seed %" PRIu64 "\n",
+		device->path, options->duration, seed);
+
+	struct samples batch_us = { 0 }, check_us = { 0 };
+	unsigned long commands = 0, batches = 0, divergences = 0;
+	long rss_start = soak_rss_kb ();
+
+	double start = now_us (), end = start + options->duration * 1e6;
+	while (!result && now_us () < end)
+	{
+		struct sensei_command chain[SENSEI_MAX_COMMANDS];
+		size_t len = 1 + soak_random (&state) % SENSEI_MAX_COMMANDS, failed;
+		for (size_t i = 0; i < len; i++)
+			soak_command (&state, &chain[i], &model);
+
+		double t0 = now_us ();
+		if ((result = sensei_send_commands (device, chain, len, &failed)))
+			break;
+		double t1 = now_us ();
+
+		struct sensei_config config;
+		if ((result = sensei_load_config (device, &config)))
+			break;
+		samples_add (&batch_us, t1 - t0);
+		samples_add (&check_us, now_us () - t1);
+		commands += len;
+		batches++;
+
+		// The mode isn't stored in the blob, there's no way to check it
+		if (config.intensity != model.intensity
+		 || config.pulsation != model.pulsation
+		 || config.cpi_off != model.cpi_off
+		 || config.cpi_on != model.cpi_on
+		 || config.polling != model.polling)
+		{
+			if (divergences++ < 10)
+				printf ("divergence after batch %lu: intensity %d/%d,"
+					" pulsation %d/%d, CPI %d/%d %d/%d, polling %d/%d\n",
+					batches, config.intensity, model.intensity,
+					config.pulsation, model.pulsation,
+					config.cpi_off, model.cpi_off, config.cpi_on, model.cpi_on,
+					config.polling, model.polling);
+			model = config;
+		}
+	}
+	double elapsed = (now_us () - start) / 1e6;
+	long rss_end = soak_rss_kb ();
+
+	if (result)
+		printf ("soak failed after %lu batches: %s\n",
+			batches, sensei_error_name (result));
+
+	print_table_header ();
+	print_table_row ("batch", &batch_us);
+	print_table_row ("check", &check_us);
+	printf ("%lu commands in %lu batches, %.1f commands per second\n",
+		commands, batches, commands / elapsed);
+	printf ("resident memory: %ld kB at start, %ld kB at end\n",
+		rss_start, rss_end);
+	printf ("divergences from the model: %lu\n", divergences);
+
+	samples_free (&batch_us);
+	samples_free (&check_us);
+	sensei_close (device);
+	return result || divergences ? -1 : 0;
+}
+
+// --- FUSE --------------------------------------------------------------------
+
+/** Compare reading a setting from the FUSE server, mostly from its cache,
+ *  with running the control utility to show settings through hidraw. */
+static int
+bench_fuse (const struct bench_options *options)
+{
+	if (!options->mount_path)
+	{
+		printf ("no mount point given, see --mount\n");
+		return -1;
+	}
+
+	char path[PATH_MAX], buf[64];
+	snprintf (path, sizeof path, "%s/0/cpi_on", options->mount_path);
+
+	struct samples read_us = { 0 };
+	bool ok = true;
+	for (long i = 0; ok && i < options->iterations; i++)
+	{
+		double t0 = now_us ();
+		int fd = open (path, O_RDONLY | O_CLOEXEC);
+		ok = fd >= 0 && read (fd, buf, sizeof buf) > 0;
+		if (fd >= 0)
+			close (fd);
+		samples_add (&read_us, now_us () - t0);
+	}
+	if (!ok)
+	{
+		printf ("reading %s failed: %s\n", path, strerror (errno));
+		samples_free (&read_us);
+		return -1;
+	}
+
+	// The server keeps the device open, which hidraw allows for
+	char *ctl_argv[] = { PROJECT_INSTALL_BINDIR "/" PROJECT_NAME,
+		"--show", "--backend", "hidraw", NULL, NULL, NULL };
+	if (options->hidraw_path)
+	{
+		ctl_argv[4] = "--device";
+		ctl_argv[5] = (char *) options->hidraw_path;
+	}
+	char *ctl_envp[] = { NULL };
+
+	printf ("reading the CPI setting, open to close or spawn to exit\n");
+	print_table_header ();
+	print_table_row ("fuse", &read_us);
+	samples_free (&read_us);
+	return time_program (options, PROJECT_NAME " --show", ctl_argv, ctl_envp)
+		? 0 : -1;
+}
+
+// --- Input latency -----------------------------------------------------------
+
+/** Buttons and 8-bit relative X and Y, like a boot protocol mouse. */
+static const unsigned char g_input_descriptor[] =
+{
+	0x05, 0x01,             // Usage Page (Generic Desktop)
+	0x09, 0x02,             // Usage (Mouse)
+	0xa1, 0x01,             // Collection (Application)
+	0x09, 0x01,             //   Usage (Pointer)
+	0xa1, 0x00,             //   Collection (Physical)
+	0x05, 0x09,             //     Usage Page (Button)
+	0x19, 0x01,             //     Usage Minimum (1)
+	0x29, 0x03,             //     Usage Maximum (3)
+	0x15, 0x00,             //     Logical Minimum (0)
+	0x25, 0x01,             //     Logical Maximum (1)
+	0x95, 0x03,             //     Report Count (3)
+	0x75, 0x01,             //     Report Size (1)
+	0x81, 0x02,             //     Input (Data, Variable, Absolute)
+	0x95, 0x01,             //     Report Count (1)
+	0x75, 0x05,             //     Report Size (5)
+	0x81, 0x01,             //     Input (Constant)
+	0x05, 0x01,             //     Usage Page (Generic Desktop)
+	0x09, 0x30,             //     Usage (X)
+	0x09, 0x31,             //     Usage (Y)
+	0x15, 0x81,             //     Logical Minimum (-127)
+	0x25, 0x7f,             //     Logical Maximum (127)
+	0x75, 0x08,             //     Report Size (8)
+	0x95, 0x02,             //     Report Count (2)
+	0x81, 0x06,             //     Input (Data, Variable, Relative)
+	0xc0,                   //   End Collection
+	0xc0,                   // End Collection
+};
+
+/** Length of a report according to the descriptor. */
+#define INPUT_REPORT_LENGTH  3
+/** How long to wait for a report to make it through. */
+#define INPUT_TIMEOUT_MS  1000
+/** Pause between reports, so that they don't queue up. */
+#define INPUT_GAP_US  2000
+
+/** Where test reports come from: a uhid device we create ourselves,
+ *  or a USB HID gadget, which also makes libusb usable. */
+struct input_source
+{
+	int fd;                             ///< /dev/uhid or /dev/hidgN
+	bool gadget;                        ///< Writing raw reports to a gadget
+	char phys[64];                      ///< uhid: how to recognize it
+	unsigned bus;                       ///< gadget: where it shows up
+	unsigned address;                   ///< gadget: where it shows up
+};
+
+/** A way of reading reports. */
+enum input_path
+{
+	INPUT_HIDRAW,                       ///< Reports through /dev/hidrawN
+	INPUT_EVDEV,                        ///< Events through /dev/input/eventN
+	INPUT_LIBUSB,                       ///< Interrupt transfers, gadget only
+};
+
+static const char *g_input_path_names[] = { "hidraw", "evdev", "libusb" };
+
+/** What's reading reports right now. */
+struct input_reader
+{
+	enum input_path path;               ///< Which way
+	int fd;                             ///< hidraw or evdev node
+	libusb_context *ctx;                ///< libusb only
+	libusb_device_handle *handle;       ///< libusb only
+	unsigned char endpoint;             ///< Interrupt IN endpoint
+	struct libusb_transfer *transfer;   ///< Kept submitted between reads
+	unsigned char buf[64];              ///< Where the transfer lands
+	volatile bool completed;            ///< The transfer has finished
+};
+
+static bool
+input_source_open (struct input_source *self,
+	const struct bench_options *options)
+{
+	if (options->gadget_path)
+	{
+		self->gadget = true;
+		if (!options->device_path || sscanf (options->device_path,
+			"/dev/bus/usb/%u/%u", &self->bus, &self->address) != 2)
+		{
+			printf ("the gadget needs --device /dev/bus/usb/BBB/DDD,"
+				" as seen by the host\n");
+			return false;
+		}
+		if ((self->fd = open (options->gadget_path,
+			O_WRONLY | O_CLOEXEC)) < 0)
+		{
+			printf ("%s: %s\n", options->gadget_path, strerror (errno));
+			return false;
+		}
+		return true;
+	}
+
+	if ((self->fd = open ("/dev/uhid", O_RDWR | O_CLOEXEC)) < 0)
+	{
+		printf ("/dev/uhid: %s\n", strerror (errno));
+		return false;
+	}
+
+	struct uhid_event ev;
+	memset (&ev, 0, sizeof ev);
+	ev.type = UHID_CREATE2;
+	snprintf (self->phys, sizeof self->phys,
+		PROJECT_NAME "-bench/%ld", (long) getpid ());
+	snprintf ((char *) ev.u.create2.name, sizeof ev.u.create2.name,
+		PROJECT_NAME " latency probe");
+	snprintf ((char *) ev.u.create2.phys, sizeof ev.u.create2.phys,
+		"%s", self->phys);
+	memcpy (ev.u.create2.rd_data,
+		g_input_descriptor, sizeof g_input_descriptor);
+	ev.u.create2.rd_size = sizeof g_input_descriptor;
+	ev.u.create2.bus = BUS_VIRTUAL;
+	if (write (self->fd, &ev, sizeof ev) != sizeof ev)
+	{
+		printf ("creating a uhid device failed: %s\n", strerror (errno));
+		close (self->fd);
+		return false;
+	}
+	return true;
+}
+
+static void
+input_source_close (struct input_source *self)
+{
+	if (!self->gadget)
+	{
+		struct uhid_event ev = { .type = UHID_DESTROY };
+		if (write (self->fd, &ev, sizeof ev) != sizeof ev)
+			printf ("destroying the uhid device failed\n");
+	}
+	close (self->fd);
+}
+
+/** Send a report that moves the pointer by a single pixel. */
+static bool
+input_source_inject (struct input_source *self, int dx)
+{
+	unsigned char report[INPUT_REPORT_LENGTH] = { 0, (unsigned char) dx, 0 };
+	if (self->gadget)
+		return write (self->fd, report, sizeof report) == sizeof report;
+
+	struct uhid_event ev;
+	memset (&ev, 0, sizeof ev);
+	ev.type = UHID_INPUT2;
+	ev.u.input2.size = sizeof report;
+	memcpy (ev.u.input2.data, report, sizeof report);
+	return write (self->fd, &ev, sizeof ev) == sizeof ev;
+}
+
+/** Read an unsigned number from a sysfs attribute. */
+static bool
+input_read_attribute (const char *dir, const char *name, unsigned *value)
+{
+	char path[PATH_MAX + 32];
+	snprintf (path, sizeof path, "%s/%s", dir, name);
+	FILE *fp = fopen (path, "r");
+	if (!fp)
+		return false;
+
+	bool ok = fscanf (fp, "%u", value) == 1;
+	fclose (fp);
+	return ok;
+}
+
+/** Check whether a HID device in sysfs is the one we're feeding. */
+static bool
+input_source_owns (const struct input_source *self, const char *hid_dir)
+{
+	char path[PATH_MAX], line[128];
+	if (self->gadget)
+	{
+		// Its parents are the USB interface and then the USB device
+		char resolved[PATH_MAX];
+		unsigned bus, address;
+		snprintf (path, sizeof path, "%s/../..", hid_dir);
+		return realpath (path, resolved)
+			&& input_read_attribute (resolved, "busnum", &bus)
+			&& input_read_attribute (resolved, "devnum", &address)
+			&& bus == self->bus && address == self->address;
+	}
+
+	snprintf (path, sizeof path, "%s/uevent", hid_dir);
+	FILE *fp = fopen (path, "r");
+	if (!fp)
+		return false;
+
+	bool found = false;
+	while (!found && fgets (line, sizeof line, fp))
+		found = !strncmp (line, "HID_PHYS=", 9)
+			&& !strncmp (line + 9, self->phys, strlen (self->phys));
+	fclose (fp);
+	return found;
+}
+
+/** Find the first entry in a directory starting with a prefix. */
+static bool
+input_find_entry (const char *dir_path, const char *prefix,
+	char *name, size_t name_len)
+{
+	DIR *dir = opendir (dir_path);
+	if (!dir)
+		return false;
+
+	bool found = false;
+	struct dirent *entry;
+	while (!found && (entry = readdir (dir)))
+		if (!strncmp (entry->d_name, prefix, strlen (prefix)))
+		{
+			snprintf (name, name_len, "%s", entry->d_name);
+			found = true;
+		}
+	closedir (dir);
+	return found;
+}
+
+/** Find the hidraw or evdev node of our device, waiting for udev to create
+ *  it for up to a few seconds. */
+static bool
+input_find_node (const struct input_source *source, enum input_path path,
+	char *node, size_t node_len)
+{
+	for (int attempt = 0; attempt < 30; attempt++)
+	{
+		DIR *dir = opendir ("/sys/bus/hid/devices");
+		struct dirent *entry;
+		bool found = false;
+		while (dir && !found && (entry = readdir (dir)))
+		{
+			char hid_dir[300], sub[PATH_MAX], name[64], input[64];
+			snprintf (hid_dir, sizeof hid_dir,
+				"/sys/bus/hid/devices/%s", entry->d_name);
+			if (entry->d_name[0] == '.'
+			 || !input_source_owns (source, hid_dir))
+				continue;
+
+			if (path == INPUT_HIDRAW)
+			{
+				snprintf (sub, sizeof sub, "%s/hidraw", hid_dir);
+				if ((found = input_find_entry (sub, "hidraw",
+					name, sizeof name)))
+					snprintf (node, node_len, "/dev/%s", name);
+				continue;
+			}
+
+			snprintf (sub, sizeof sub, "%s/input", hid_dir);
+			if (!input_find_entry (sub, "input", input, sizeof input))
+				continue;
+			snprintf (sub, sizeof sub, "%s/input/%s", hid_dir, input);
+			if ((found = input_find_entry (sub, "event", name, sizeof name)))
+				snprintf (node, node_len, "/dev/input/%s", name);
+		}
+		if (dir)
+			closedir (dir);
+		if (found && !access (node, R_OK))
+			return true;
+
+		struct timespec ts = { 0, 100000000 };
+		nanosleep (&ts, NULL);
+	}
+	return false;
+}
+
+static void LIBUSB_CALL
+input_on_transfer (struct libusb_transfer *transfer)
+{
+	struct input_reader *self = transfer->user_data;
+	self->completed = true;
+}
+
+/** Find the interrupt IN endpoint of the first interface. */
+static bool
+input_find_endpoint (struct input_reader *self)
+{
+	struct libusb_config_descriptor *config;
+	if (libusb_get_active_config_descriptor
+		(libusb_get_device (self->handle), &config))
+		return false;
+
+	bool found = false;
+	const struct libusb_interface_descriptor *iface =
+		config->bNumInterfaces ? config->interface[0].altsetting : NULL;
+	for (int i = 0; iface && !found && i < iface->bNumEndpoints; i++)
+	{
+		const struct libusb_endpoint_descriptor *ep = &iface->endpoint[i];
+		if ((ep->bmAttributes & 0x03) == LIBUSB_TRANSFER_TYPE_INTERRUPT
+		 && (ep->bEndpointAddress & LIBUSB_ENDPOINT_IN))
+		{
+			self->endpoint = ep->bEndpointAddress;
+			found = true;
+		}
+	}
+	libusb_free_config_descriptor (config);
+	return found;
+}
+
+/** Take the gadget's interface away from usbhid and keep a transfer
+ *  submitted at all times, as usbhid itself does. */
+static bool
+input_reader_open_libusb (struct input_reader *self,
+	const struct input_source *source)
+{
+	if (libusb_init (&self->ctx))
+		return false;
+
+	libusb_device **devices;
+	ssize_t len = libusb_get_device_list (self->ctx, &devices);
+	for (ssize_t i = 0; !self->handle && i < len; i++)
+		if (libusb_get_bus_number (devices[i]) == source->bus
+		 && libusb_get_device_address (devices[i]) == source->address
+		 && libusb_open (devices[i], &self->handle))
+			self->handle = NULL;
+	if (len >= 0)
+		libusb_free_device_list (devices, true);
+
+	if (!self->handle || !input_find_endpoint (self)
+	 || libusb_set_auto_detach_kernel_driver (self->handle, true)
+	 || libusb_claim_interface (self->handle, 0)
+	 || !(self->transfer = libusb_alloc_transfer (0)))
+		return false;
+
+	libusb_fill_interrupt_transfer (self->transfer, self->handle,
+		self->endpoint, self->buf, sizeof self->buf,
+		input_on_transfer, self, 0);
+	return !libusb_submit_transfer (self->transfer);
+}
+
+static bool
+input_reader_open (struct input_reader *self,
+	const struct input_source *source)
+{
+	self->fd = -1;
+	if (self->path == INPUT_LIBUSB)
+		return input_reader_open_libusb (self, source);
+
+	char node[PATH_MAX];
+	if (!input_find_node (source, self->path, node, sizeof node)
+	 || (self->fd = open (node, O_RDONLY | O_NONBLOCK | O_CLOEXEC)) < 0)
+		return false;
+
+	// Timestamps aren't used, but make them comparable anyway
+	int clock = CLOCK_MONOTONIC;
+	if (self->path == INPUT_EVDEV)
+		ioctl (self->fd, EVIOCSCLOCKID, &clock);
+	return true;
+}
+
+static void
+input_reader_close (struct input_reader *self)
+{
+	if (self->fd >= 0)
+		close (self->fd);
+	if (self->transfer)
+	{
+		// The transfer has to finish before it can be freed
+		if (!self->completed && !libusb_cancel_transfer (self->transfer))
+			while (!self->completed)
+				libusb_handle_events (self->ctx);
+		libusb_free_transfer (self->transfer);
+	}
+	if (self->handle)
+	{
+		libusb_release_interface (self->handle, 0);
+		libusb_close (self->handle);
+	}
+	if (self->ctx)
+		libusb_exit (self->ctx);
+}
+
+/** Wait until a whole report arrives. */
+static bool
+input_reader_wait (struct input_reader *self)
+{
+	if (self->path == INPUT_LIBUSB)
+	{
+		// Handling events returns zero on timeouts, so keep our own deadline
+		double deadline_us = now_us () + INPUT_TIMEOUT_MS * 1000;
+		while (!self->completed)
+		{
+			double left_us = deadline_us - now_us ();
+			struct timeval tv = { left_us / 1e6, (long) left_us % 1000000 };
+			if (left_us <= 0
+			 || libusb_handle_events_timeout (self->ctx, &tv))
+			{
+				// The transfer has to finish before it can be used again
+				if (!self->completed && !libusb_cancel_transfer (self->transfer))
+					while (!self->completed)
+						libusb_handle_events (self->ctx);
+				return false;
+			}
+		}
+
+		bool ok = self->transfer->status == LIBUSB_TRANSFER_COMPLETED;
+		self->completed = false;
+		return ok && !libusb_submit_transfer (self->transfer);
+	}
+
+	struct pollfd pfd = { .fd = self->fd, .events = POLLIN };
+	while (true)
+	{
+		if (poll (&pfd, 1, INPUT_TIMEOUT_MS) <= 0)
+			return false;
+
+		// evdev splits reports into events ended with a synchronization
+		struct input_event events[16];
+		unsigned char report[64];
+		ssize_t len = self->path == INPUT_EVDEV
+			? read (self->fd, events, sizeof events)
+			: read (self->fd, report, sizeof report);
+		if (len < 0 && (errno == EAGAIN || errno == EINTR))
+			continue;
+		if (len <= 0)
+			return false;
+		if (self->path == INPUT_HIDRAW)
+			return true;
+
+		for (size_t i = 0; i < len / sizeof *events; i++)
+			if (events[i].type == EV_SYN && events[i].code == SYN_REPORT)
+				return true;
+	}
+}
+
+// Background load while measuring
+
+static volatile bool g_stress_stop;
+
+static void *
+stress_spin (void *data)
+{
+	(void) data;
+	volatile unsigned long counter = 0;
+	while (!g_stress_stop)
+		counter++;
+	return NULL;
+}
+
+/** Keep sweeping a buffer larger than the caches. */
+static void *
+stress_sweep (void *data)
+{
+	size_t len = *(const long *) data * 1024 * 1024;
+	unsigned char *buf = malloc (len);
+	for (unsigned char value = 0; buf && !g_stress_stop; value++)
+		memset (buf, value, len);
+	free (buf);
+	return NULL;
+}
+
+/** Start the requested stress threads, returning how many there are. */
+static size_t
+stress_start (const struct bench_options *options, pthread_t *threads)
+{
+	size_t len = 0;
+	g_stress_stop = false;
+	for (long i = 0; i < options->stress_cpu; i++)
+		if (!pthread_create (&threads[len], NULL, stress_spin, NULL))
+			len++;
+	if (options->stress_memory
+	 && !pthread_create (&threads[len], NULL, stress_sweep,
+		(void *) &options->stress_memory))
+		len++;
+	return len;
+}
+
+static void
+stress_stop (pthread_t *threads, size_t len)
+{
+	g_stress_stop = true;
+	for (size_t i = 0; i < len; i++)
+		pthread_join (threads[i], NULL);
+}
+
+/** Time reports from injection to their arrival through one path. */
+static bool
+input_measure (const struct bench_options *options,
+	struct input_source *source, enum input_path path, struct samples *out)
+{
+	struct input_reader reader = { .path = path };
+	bool ok = input_reader_open (&reader, source);
+	if (!ok)
+		printf ("%s: couldn't open the device\n", g_input_path_names[path]);
+
+	for (long i = 0; ok && i < options->iterations; i++)
+	{
+		double t0 = now_us ();
+		if (!(ok = input_source_inject (source, i % 2 ? -1 : 1)))
+			printf ("%s: injecting failed\n", g_input_path_names[path]);
+		else if (!(ok = input_reader_wait (&reader)))
+			printf ("%s: report lost\n", g_input_path_names[path]);
+		else
+			samples_add (out, now_us () - t0);
+
+		struct timespec ts = { 0, INPUT_GAP_US * 1000 };
+		nanosleep (&ts, NULL);
+	}
+	input_reader_close (&reader);
+	return ok;
+}
+
+/** Measure how long it takes for an input report to reach userspace through
+ *  hidraw, evdev and, with a gadget, libusb.  Everything is measured on an
+ *  idle system, then again under load, if any has been requested. */
+static int
+bench_input (const struct bench_options *options)
+{
+	struct input_source source = { .fd = -1 };
+	if (!input_source_open (&source, options))
+		return -1;
+
+	bool stress = options->stress_cpu || options->stress_memory;
+	pthread_t threads[options->stress_cpu + 1];
+
+	printf ("report injection to arrival in userspace, via %s\n",
+		source.gadget ? options->gadget_path : "uhid");
+	print_table_header ();
+
+	// libusb goes last, it takes the interface away from usbhid
+	bool ok = true;
+	enum input_path last = source.gadget ? INPUT_LIBUSB : INPUT_EVDEV;
+	for (int path = INPUT_HIDRAW; ok && path <= (int) last; path++)
+	for (int stressed = 0; ok && stressed <= stress; stressed++)
+	{
+		size_t n_threads = stressed ? stress_start (options, threads) : 0;
+		struct samples latency_us = { 0 };
+		ok = input_measure (options, &source, path, &latency_us);
+		stress_stop (threads, n_threads);
+
+		char label[32];
+		snprintf (label, sizeof label, "%s%s",
+			g_input_path_names[path], stressed ? ", stressed" : "");
+		print_table_row (label, &latency_us);
+		samples_free (&latency_us);
+	}
+	if (!source.gadget)
+		printf ("libusb needs a USB device, see --gadget\n");
+
+	input_source_close (&source);
+	return ok ? 0 : -1;
+}
+
+// --- Configuration disruption ------------------------------------------------
+
+/** Steady motion to take the normal report interval from. */
+#define DISRUPTION_BASELINE_MS  500
+/** Motion has to keep going for this long after a change. */
+#define DISRUPTION_SETTLE_MS  500
+/** Give up on motion coming back after this long. */
+#define DISRUPTION_TIMEOUT_MS  5000
+/** Fewest reports that the report interval can be taken from. */
+#define DISRUPTION_MIN_REPORTS  10
+
+/** Collects arrival times of reports from the mouse's evdev node, which
+ *  goes away with usbhid and comes back under a different name. */
+struct disruption_watch
+{
+	pthread_mutex_t lock;               ///< Protects arrivals_us
+	struct samples arrivals_us;         ///< When reports have arrived
+	unsigned long reopens;              ///< How many times it's come back
+	volatile bool stop;                 ///< Time to end
+};
+
+/** How a single change has affected the input stream. */
+struct disruption
+{
+	double interval_us;                 ///< Normal report interval
+	double gap_us;                      ///< Longest time without reports
+	double recovery_us;                 ///< Until the last unusual gap ended
+	unsigned long lost;                 ///< Reports that should have come
+	bool recovered;                     ///< Reports have come back at all
+};
+
+/** Open the evdev node of a supported mouse that reports motion. */
+static int
+disruption_open_node (void)
+{
+	DIR *dir = opendir ("/dev/input");
+	if (!dir)
+		return -1;
+
+	int fd = -1;
+	struct dirent *entry;
+	while (fd < 0 && (entry = readdir (dir)))
+	{
+		char path[PATH_MAX];
+		if (strncmp (entry->d_name, "event", 5))
+			continue;
+		snprintf (path, sizeof path, "/dev/input/%s", entry->d_name);
+		if ((fd = open (path, O_RDONLY | O_NONBLOCK | O_CLOEXEC)) < 0)
+			continue;
+
+		struct input_id id;
+		unsigned long rel = 0;
+		int clock = CLOCK_MONOTONIC;
+		if (ioctl (fd, EVIOCGID, &id)
+		 || id.vendor != USB_VENDOR_STEELSERIES
+		 || !sensei_product_supported (id.product)
+		 || ioctl (fd, EVIOCGBIT (EV_REL, sizeof rel), &rel) < 0
+		 || !(rel & (1 << REL_X))
+		 || ioctl (fd, EVIOCSCLOCKID, &clock))
+		{
+			close (fd);
+			fd = -1;
+		}
+	}
+	closedir (dir);
+	return fd;
+}
+
+static void *
+disruption_watch_run (void *data)
+{
+	struct disruption_watch *self = data;
+	int fd = -1;
+	while (!self->stop)
+	{
+		// Applications learn of the new node from udev, we don't wait for it
+		if (fd < 0 && (fd = disruption_open_node ()) < 0)
+		{
+			struct timespec ts = { 0, 1000000 };
+			nanosleep (&ts, NULL);
+			continue;
+		}
+
+		struct pollfd pfd = { .fd = fd, .events = POLLIN };
+		if (poll (&pfd, 1, 50) <= 0)
+			continue;
+
+		struct input_event events[64];
+		ssize_t len = read (fd, events, sizeof events);
+		if (len < 0 && (errno == EAGAIN || errno == EINTR))
+			continue;
+		if (len <= 0)
+		{
+			close (fd);
+			fd = -1;
+			self->reopens++;
+			continue;
+		}
+
+		pthread_mutex_lock (&self->lock);
+		for (size_t i = 0; i < len / sizeof *events; i++)
+			if (events[i].type == EV_SYN && events[i].code == SYN_REPORT)
+				samples_add (&self->arrivals_us,
+					events[i].time.tv_sec * 1e6 + events[i].time.tv_usec);
+		pthread_mutex_unlock (&self->lock);
+	}
+	if (fd >= 0)
+		close (fd);
+	return NULL;
+}
+
+/** Forget about all reports so far and wait for new ones to pile up. */
+static void
+disruption_watch_restart (struct disruption_watch *self)
+{
+	pthread_mutex_lock (&self->lock);
+	self->arrivals_us.len = 0;
+	pthread_mutex_unlock (&self->lock);
+
+	struct timespec ts = { DISRUPTION_BASELINE_MS / 1000,
+		DISRUPTION_BASELINE_MS % 1000 * 1000000 };
+	nanosleep (&ts, NULL);
+}
+
+/** Whether reports have been coming again for long enough after a change,
+ *  or it's time to give up on them. */
+static bool
+disruption_watch_done (struct disruption_watch *self,
+	double change_us, double done_us)
+{
+	double now = now_us ();
+	if (now > change_us + DISRUPTION_TIMEOUT_MS * 1000)
+		return true;
+	if (now < done_us + DISRUPTION_SETTLE_MS * 1000)
+		return false;
+
+	pthread_mutex_lock (&self->lock);
+	const struct samples *arrivals = &self->arrivals_us;
+	bool resumed = arrivals->len
+		&& arrivals->values[arrivals->len - 1] > done_us;
+	pthread_mutex_unlock (&self->lock);
+	return resumed;
+}
+
+/** Compare reports around a change against the interval before it.
+ *  Returns false if there hasn't been enough steady motion. */
+static bool
+disruption_analyse (const struct samples *arrivals,
+	double change_us, double end_us, struct disruption *out)
+{
+	const double *a = arrivals->values;
+	size_t before = 0;
+	while (before < arrivals->len && a[before] < change_us)
+		before++;
+	if (before < DISRUPTION_MIN_REPORTS)
+		return false;
+
+	double intervals[before - 1];
+	for (size_t i = 1; i < before; i++)
+		intervals[i - 1] = a[i] - a[i - 1];
+	qsort (intervals, before - 1, sizeof *intervals, compare_doubles);
+
+	// Anything much longer than usual is where reports went missing
+	memset (out, 0, sizeof *out);
+	out->interval_us = intervals[(before - 1) / 2];
+	double threshold = 2 * out->interval_us;
+	for (size_t i = before; i <= arrivals->len; i++)
+	{
+		bool last = i == arrivals->len;
+		double gap = (last ? end_us : a[i]) - a[i - 1];
+		if (gap <= threshold)
+			continue;
+
+		out->lost += (unsigned long) (gap / out->interval_us + .5) - 1;
+		if (gap > out->gap_us)
+			out->gap_us = gap;
+		if (!last)
+			out->recovery_us = a[i] - change_us;
+	}
+	out->recovered = a[arrivals->len - 1] >= change_us
+		&& end_us - a[arrivals->len - 1] <= threshold;
+	return true;
+}
+
+/** Go through what a one-shot invocation of the utility does to change
+ *  a setting.  Only what's already there is set again. */
+static int
+disruption_apply (open_fn open_device, const char *path)
+{
+	struct sensei_device *device = NULL;
+	int result = open_device (path, &device);
+	if (result)
+		return result;
+
+	struct sensei_config config;
+	struct sensei_command commands[SENSEI_MAX_COMMANDS];
+	if (!(result = sensei_detach_kernel_driver (device))
+	 && !(result = sensei_claim_interface (device)))
+	{
+		if (!(result = sensei_load_config (device, &config)))
+			result = sensei_send_commands (device, commands,
+				sensei_prepare_commands (&config,
+					SENSEI_FIELD_INTENSITY, false, commands), NULL);
+		sensei_release_interface (device);
+	}
+	sensei_attach_kernel_driver (device);
+	sensei_close (device);
+	return result;
+}
+
+static void
+disruption_backend (const struct bench_options *options,
+	struct disruption_watch *watch, const char *name,
+	open_fn open_device, const char *path)
+{
+	struct samples apply_us = { 0 }, gap_us = { 0 }, recovery_us = { 0 };
+	unsigned long lost = 0, lost_max = 0, stalled = 0,
+		reopens = watch->reopens;
+
+	printf ("\n%s\n", name);
+	for (long i = 0; i < options->iterations; i++)
+	{
+		disruption_watch_restart (watch);
+		double change_us = now_us ();
+		int result = disruption_apply (open_device, path);
+		double done_us = now_us ();
+		if (result)
+		{
+			printf ("  change failed: %s\n", sensei_error_name (result));
+			break;
+		}
+
+		struct timespec ts = { 0, 10000000 };
+		while (!disruption_watch_done (watch, change_us, done_us))
+			nanosleep (&ts, NULL);
+
+		struct disruption d;
+		pthread_mutex_lock (&watch->lock);
+		bool ok = disruption_analyse (&watch->arrivals_us,
+			change_us, now_us (), &d);
+		pthread_mutex_unlock (&watch->lock);
+		if (!ok)
+		{
+			printf ("  the mouse has stopped moving\n");
+			break;
+		}
+
+		samples_add (&apply_us, done_us - change_us);
+		samples_add (&gap_us, d.gap_us);
+		if (d.recovered)
+			samples_add (&recovery_us, d.recovery_us);
+		else
+			stalled++;
+		lost += d.lost;
+		if (d.lost > lost_max)
+			lost_max = d.lost;
+	}
+
+	print_table_header ();
+	print_table_row ("configuration change", &apply_us);
+	print_table_row ("longest input gap", &gap_us);
+	print_table_row ("recovery", &recovery_us);
+	printf ("lost reports: %lu, at most %lu per change;"
+		" evdev node recreated %lu times\n",
+		lost, lost_max, watch->reopens - reopens);
+	if (stalled)
+		printf ("input didn't come back within %d ms after %lu changes\n",
+			DISRUPTION_TIMEOUT_MS, stalled);
+
+	samples_free (&apply_us);
+	samples_free (&gap_us);
+	samples_free (&recovery_us);
+}
+
+/** Measure how much a configuration change disrupts the input of the mouse
+ *  while it's moving steadily, with each backend.  libusb and usbfs take
+ *  the interface away from usbhid for the duration, hidraw doesn't. */
+static int
+bench_disruption (const struct bench_options *options)
+{
+	struct disruption_watch watch = { .lock = PTHREAD_MUTEX_INITIALIZER };
+	pthread_t thread;
+	if (pthread_create (&thread, NULL, disruption_watch_run, &watch))
+	{
+		printf ("couldn't start a thread\n");
+		return -1;
+	}
+
+	disruption_watch_restart (&watch);
+	pthread_mutex_lock (&watch.lock);
+	size_t reports = watch.arrivals_us.len;
+	pthread_mutex_unlock (&watch.lock);
+
+	int status = 0;
+	if (reports < DISRUPTION_MIN_REPORTS)
+	{
+		printf ("no motion from a supported mouse; move it steadily, or run"
+			" " PROJECT_NAME "-emu with --rate\n");
+		status = -1;
+	}
+	else
+	{
+		printf ("reports arriving through evdev around a change of settings,"
+			" after %d ms of motion\n", DISRUPTION_BASELINE_MS);
+		disruption_backend (options, &watch, "hidraw",
+			sensei_hidraw_open, options->hidraw_path);
+		disruption_backend (options, &watch, "usbfs",
+			sensei_usbfs_open, options->device_path);
+		disruption_backend (options, &watch, "libusb",
+			sensei_libusb_open, options->device_path);
+	}
+
+	watch.stop = true;
+	pthread_join (thread, NULL);
+	samples_free (&watch.arrivals_us);
+	return status;
+}
+
+#endif // __linux__
+
+// --- Main --------------------------------------------------------------------
+
+static struct benchmark
+{
+	const char *name;                   ///< Name on the command line
+	const char *description;            ///< Description for --help
+	int (*run) (const struct bench_options *options);
+}
+g_benchmarks[] =
+{
+	{ "cold-start", "open, claim, read settings and close per backend",
+		bench_cold_start },
+#ifdef __linux__
+	{ "batch",      "a chain of commands, one by one and batched (hidraw)",
+		bench_batch },
+	{ "udev-helper", "the udev helper against " PROJECT_NAME " (hidraw)",
+		bench_udev_helper },
+	{ "agent",      "concurrent clients of the agent over a Unix socket",
+		bench_agent },
+	{ "soak",       "random command chains checked against a model (emu)",
+		bench_soak },
+	{ "fuse",       "reading settings from the FUSE server and " PROJECT_NAME,
+		bench_fuse },
+	{ "input",      "input report latency via hidraw, evdev and libusb",
+		bench_input },
+	{ "disruption", "input lost to a configuration change per backend",
+		bench_disruption },
+#endif // __linux__
+};
+
+#define N_BENCHMARKS (sizeof g_benchmarks / sizeof g_benchmarks[0])
+
+static void
+show_usage (const char *program_name)
+{
+	printf ("Usage: %s [OPTION]... BENCHMARK...\n", program_name);
+	printf ("Benchmark access to SteelSeries Sensei Raw devices.\n\n");
+	printf ("  -h, --help      Show this help\n");
+	printf ("  --version       Show program version and exit\n");
+	printf ("  -n, --iterations N\n"
+	        "                  Repeat each measurement N times\n");
+	printf ("  --device PATH   Use the device at /dev/bus/usb/BBB/DDD\n");
+	printf ("  --hidraw PATH   Use the hidraw device at PATH\n");
+#ifdef __linux__
+	printf ("  --helper PATH   Run the udev helper at PATH\n");
+	printf ("  --agent PATH    Run the agent at PATH\n");
+	printf ("  --clients N     Run N concurrent agent clients\n");
+	printf ("  --duration S    Soak for S seconds\n");
+	printf ("  --seed N        Seed the soak test with N\n");
+	printf ("  --mount PATH    The FUSE server is mounted at PATH\n");
+	printf ("  --gadget PATH   Feed input to the HID gadget at PATH, which"
+	                         " is --device\n");
+	printf ("  --stress-cpu N  Also measure input with N spinning threads\n");
+	printf ("  --stress-memory MB\n"
+	        "                  Also measure input while sweeping MB"
+	                         " megabytes of memory\n");
+#endif // __linux__
+	printf ("\nBenchmarks:\n");
+	for (size_t i = 0; i < N_BENCHMARKS; i++)
+		printf ("  %-14s  %s\n",
+			g_benchmarks[i].name, g_benchmarks[i].description);
+	printf ("\n");
+}
+
+static void
+parse_options (int argc, char *argv[], struct bench_options *options)
+{
+	static struct option long_opts[] =
+	{
+		{ "help",       no_argument,       0, 'h' },
+		{ "version",    no_argument,       0, 'V' },
+		{ "iterations", required_argument, 0, 'n' },
+		{ "device",     required_argument, 0, 'd' },
+		{ "hidraw",     required_argument, 0, 'H' },
+		{ "helper",     required_argument, 0, 'u' },
+		{ "agent",      required_argument, 0, 'a' },
+		{ "clients",    required_argument, 0, 'c' },
+		{ "duration",   required_argument, 0, 't' },
+		{ "seed",       required_argument, 0, 's' },
+		{ "mount",      required_argument, 0, 'm' },
+		{ "gadget",     required_argument, 0, 'g' },
+		{ "stress-cpu", required_argument, 0, 'C' },
+		{ "stress-memory", required_argument, 0, 'M' },
+		{ 0,            0,                 0,  0  }
+	};
+
+	int c;
+	char *end;
+	while ((c = getopt_long (argc, argv, "hn:", long_opts, NULL)) != -1)
+	{
+	switch (c)
+	{
+	case 'h':
+		show_usage (argv[0]);
+		exit (EXIT_SUCCESS);
+	case 'V':
+		printf (PROJECT_NAME "-bench " PROJECT_VERSION "\n");
+		exit (EXIT_SUCCESS);
+	case 'n':
+		options->iterations = strtol (optarg, &end, 10);
+		if (!*optarg || *end || options->iterations <= 0)
+		{
+			fprintf (stderr, "Error: invalid iteration count: %s\n", optarg);
+			exit (EXIT_FAILURE);
+		}
+		break;
+	case 'd':
+		options->device_path = optarg;
+		break;
+	case 'H':
+		options->hidraw_path = optarg;
+		break;
+	case 'u':
+		options->helper_path = optarg;
+		break;
+	case 'a':
+		options->agent_path = optarg;
+		break;
+	case 'c':
+		options->clients = strtol (optarg, &end, 10);
+		if (!*optarg || *end || options->clients <= 0)
+		{
+			fprintf (stderr, "Error: invalid client count: %s\n", optarg);
+			exit (EXIT_FAILURE);
+		}
+		break;
+	case 't':
+		options->duration = strtol (optarg, &end, 10);
+		if (!*optarg || *end || options->duration <= 0)
+		{
+			fprintf (stderr, "Error: invalid duration: %s\n", optarg);
+			exit (EXIT_FAILURE);
+		}
+		break;
+	case 's':
+		options->seed = strtoul (optarg, &end, 10);
+		if (!*optarg || *end)
+		{
+			fprintf (stderr, "Error: invalid seed: %s\n", optarg);
+			exit (EXIT_FAILURE);
+		}
+		break;
+	case 'm':
+		options->mount_path = optarg;
+		break;
+	case 'g':
+		options->gadget_path = optarg;
+		break;
+	case 'C':
+		options->stress_cpu = strtol (optarg, &end, 10);
+		if (!*optarg || *end || options->stress_cpu < 0
+		 || options->stress_cpu > 1024)
+		{
+			fprintf (stderr, "Error: invalid thread count: %s\n", optarg);
+			exit (EXIT_FAILURE);
+		}
+		break;
+	case 'M':
+		options->stress_memory = strtol (optarg, &end, 10);
+		if (!*optarg || *end || options->stress_memory < 0)
+		{
+			fprintf (stderr, "Error: invalid memory size: %s\n", optarg);
+			exit (EXIT_FAILURE);
+		}
+		break;
+	case '?':
+		exit (EXIT_FAILURE);
+	}
+	}
+
+	if (optind == argc)
+	{
+		show_usage (argv[0]);
+		exit (EXIT_FAILURE);
+	}
+}
+
+int
+main (int argc, char *argv[])
+{
+	struct bench_options options =
+	{
+		.iterations = 100,
+		.helper_path = PROJECT_INSTALL_LIBEXECDIR "/" PROJECT_NAME "-udev",
+		.agent_path = PROJECT_INSTALL_BINDIR "/" PROJECT_NAME "-agent",
+		.clients = 16,
+		.duration = 60,
+	};
+	parse_options (argc, argv, &options);
+
+	int status = EXIT_SUCCESS;
+	for (int i = optind; i < argc; i++)
+	{
+		size_t k = 0;
+		while (k < N_BENCHMARKS && strcmp (g_benchmarks[k].name, argv[i]))
+			k++;
+		if (k == N_BENCHMARKS)
+		{
+			fprintf (stderr, "Error: unknown benchmark: %s\n", argv[i]);
+			exit (EXIT_FAILURE);
+		}
+
+		printf ("--- %s\n", g_benchmarks[k].name);
+		if (g_benchmarks[k].run (&options))
+			status = EXIT_FAILURE;
+		printf ("\n");
+	}
+	return status;
+}
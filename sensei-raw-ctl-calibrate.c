@@ -0,0 +1,716 @@
+/*
+ * sensei-raw-ctl-calibrate.c: CPI linearity calibration
+ *
+ * Steps through CPI values, recording motion from the mouse's evdev node
+ * while the same movement is repeated at each of them, be it by a motorized
+ * rig, a steady hand, or the emulator.  Counts are summed along both axes
+ * regardless of direction, so back-and-forth movements work as well, and as
+ * long as the movement is the same every time, counts are proportional to
+ * the CPI that the sensor actually has.  The scale is taken from the median
+ * ratio against nominal CPI, which the extremes, where sensors tend to be
+ * off, can't skew, unless the distance is known.  The result is stored as
+ * a table that sensei-raw-ctl uses to pick the truest step for a given CPI.
+ *
+ * Captures can be saved and analysed again later; they're streamed through
+ * once, so that their size doesn't matter.
+ *
+ * Copyright (c) 2013, Přemysl Janouch <p.janouch@gmail.com>
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <time.h>
+
+#include <getopt.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <linux/input.h>
+#include <libusb.h>
+
+#include "config.h"
+#include "sensei-raw.h"
+
+/** Movements at each step unless told otherwise. */
+#define DEFAULT_PASSES  3
+/** A movement ends after this long without motion unless told otherwise. */
+#define DEFAULT_GAP_MS  300
+/** Time for the sensor to switch to a new CPI. */
+#define SETTLE_MS  200
+
+/** Number of CPI steps, which are indexed directly. */
+#define N_STEPS  (SENSEI_CPI_MAX + 1)
+
+static volatile sig_atomic_t g_terminated;
+
+static void
+on_terminate (int signum)
+{
+	(void) signum;
+	g_terminated = true;
+}
+
+static uint64_t
+timeval_us (const struct timeval *tv)
+{
+	return (uint64_t) tv->tv_sec * 1000000 + tv->tv_usec;
+}
+
+/** Parse a list of steps like "1-10,20", as CPI step numbers. */
+static bool
+parse_steps (const char *list, bool steps[N_STEPS])
+{
+	memset (steps, 0, N_STEPS * sizeof *steps);
+	bool any = false;
+	while (*list)
+	{
+		char *end;
+		unsigned long first = strtoul (list, &end, 10), last = first;
+		if (end == list)
+			return false;
+		if (*end == '-')
+		{
+			list = end + 1;
+			last = strtoul (list, &end, 10);
+			if (end == list)
+				return false;
+		}
+		if (first < SENSEI_CPI_MIN || first > last || last > SENSEI_CPI_MAX)
+			return false;
+		for (; first <= last; first++)
+			steps[first] = any = true;
+
+		if (*end == ',' && end[1])
+			end++;
+		else if (*end)
+			return false;
+		list = end;
+	}
+	return any;
+}
+
+// --- Analysis ----------------------------------------------------------------
+
+/** Counts gathered at a single step. */
+struct step_stats
+{
+	unsigned passes;                    ///< Completed movements
+	uint64_t total;                     ///< Counts over all of them
+	uint64_t min;                       ///< Counts of the shortest one
+	uint64_t max;                       ///< Counts of the longest one
+};
+
+/** A whole sweep, built up one movement at a time. */
+struct sweep
+{
+	uint16_t product;                   ///< USB product ID, 0 if unknown
+	struct step_stats steps[N_STEPS];   ///< Indexed by step
+
+	int step;                           ///< Step of the current movement
+	unsigned long pass;                 ///< Its number, as recorded
+	uint64_t counts;                    ///< Its counts so far
+	bool moving;                        ///< Whether there is one
+	uint64_t frames;                    ///< Motion frames seen overall
+};
+
+/** Finish the current movement, if any. */
+static void
+sweep_end_pass (struct sweep *self)
+{
+	if (!self->moving)
+		return;
+
+	struct step_stats *s = &self->steps[self->step];
+	if (!s->passes || self->counts < s->min)
+		s->min = self->counts;
+	if (!s->passes || self->counts > s->max)
+		s->max = self->counts;
+	s->total += self->counts;
+	s->passes++;
+	self->moving = false;
+}
+
+/** Add a motion frame, which may start a new movement. */
+static void
+sweep_add (struct sweep *self, int step, unsigned long pass,
+	int32_t dx, int32_t dy)
+{
+	if (self->moving && (self->step != step || self->pass != pass))
+		sweep_end_pass (self);
+	if (!self->moving)
+	{
+		self->step = step;
+		self->pass = pass;
+		self->counts = 0;
+		self->moving = true;
+	}
+
+	self->counts += (dx < 0 ? -(int64_t) dx : dx)
+		+ (dy < 0 ? -(int64_t) dy : dy);
+	self->frames++;
+}
+
+/** Read a capture line by line, never keeping more than one of them. */
+static bool
+sweep_load (struct sweep *self, FILE *fp, const char *path)
+{
+	char *line = NULL;
+	size_t line_len = 0;
+	unsigned long number = 0;
+	bool ok = true;
+	while (ok && getline (&line, &line_len, fp) >= 0)
+	{
+		number++;
+		unsigned product;
+		if (*line == '#')
+		{
+			if (sscanf (line, "# product %x", &product) == 1)
+				self->product = product;
+			continue;
+		}
+
+		// This is the hot loop for big captures, sscanf() would dominate it
+		char *p = line, *end;
+		long step = strtol (p, &end, 10);
+		unsigned long pass = strtoul (p = end, &end, 10);
+		if (end != p)
+			strtoull (p = end, &end, 10);
+		long dx = end == p ? 0 : strtol (p = end, &end, 10);
+		long dy = end == p ? 0 : strtol (p = end, &end, 10);
+		if (end == p || (*end != '\n' && *end)
+		 || step < SENSEI_CPI_MIN || step > SENSEI_CPI_MAX
+		 || dx < INT32_MIN || dx > INT32_MAX
+		 || dy < INT32_MIN || dy > INT32_MAX)
+		{
+			fprintf (stderr, "Error: %s:%lu: invalid line\n", path, number);
+			ok = false;
+		}
+		else
+			sweep_add (self, step, pass, dx, dy);
+	}
+	sweep_end_pass (self);
+	free (line);
+	if (ok && ferror (fp))
+	{
+		fprintf (stderr, "Error: %s: %s\n", path, strerror (errno));
+		return false;
+	}
+	return ok;
+}
+
+static int
+compare_doubles (const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+	return (x > y) - (x < y);
+}
+
+/** Work out the CPI of every measured step.  Returns the number of them. */
+static size_t
+sweep_analyse (const struct sweep *self, double distance,
+	struct sensei_cpi_table *table)
+{
+	double ratios[N_STEPS];
+	size_t n = 0;
+	for (int step = SENSEI_CPI_MIN; step <= SENSEI_CPI_MAX; step++)
+		if (self->steps[step].passes)
+			ratios[n++] = (double) self->steps[step].total
+				/ self->steps[step].passes / (step * SENSEI_CPI_STEP);
+	if (!n)
+		return 0;
+
+	// Counts per unit of CPI, which is the distance when it's all one axis
+	double scale = distance;
+	if (!scale)
+	{
+		qsort (ratios, n, sizeof *ratios, compare_doubles);
+		scale = n % 2 ? ratios[n / 2] : (ratios[n / 2 - 1] + ratios[n / 2]) / 2;
+	}
+
+	memset (table, 0, sizeof *table);
+	for (int step = SENSEI_CPI_MIN; step <= SENSEI_CPI_MAX; step++)
+		if (self->steps[step].passes && scale > 0)
+			table->measured[step] = (double) self->steps[step].total
+				/ self->steps[step].passes / scale;
+	return n;
+}
+
+static void
+sweep_print (const struct sweep *self, const struct sensei_cpi_table *table)
+{
+	printf ("%4s %8s %9s %8s %6s %7s\n",
+		"step", "nominal", "measured", "error", "passes", "spread");
+
+	// Least squares of measured against nominal CPI
+	double sx = 0, sy = 0, sxx = 0, sxy = 0;
+	size_t n = 0;
+	for (int step = SENSEI_CPI_MIN; step <= SENSEI_CPI_MAX; step++)
+	{
+		const struct step_stats *s = &self->steps[step];
+		if (!s->passes)
+			continue;
+
+		double nominal = step * SENSEI_CPI_STEP,
+			measured = table->measured[step],
+			mean = (double) s->total / s->passes;
+		printf ("%4d %8.0f %9.1f %+7.2f%% %6u %6.2f%%\n", step, nominal,
+			measured, (measured / nominal - 1) * 100, s->passes,
+			mean ? (s->max - s->min) / mean * 100 : 0);
+
+		sx += nominal;
+		sy += measured;
+		sxx += nominal * nominal;
+		sxy += nominal * measured;
+		n++;
+	}
+
+	double denominator = n * sxx - sx * sx;
+	if (n > 1 && denominator)
+	{
+		double slope = (n * sxy - sx * sy) / denominator,
+			intercept = (sy - slope * sx) / n;
+		printf ("\nmeasured = %.4f * nominal %+.1f CPI, over %zu steps"
+			" and %" PRIu64 " motion frames\n",
+			slope, intercept, n, self->frames);
+	}
+}
+
+// --- Sweeping ----------------------------------------------------------------
+
+/** How movements are told apart. */
+struct movement
+{
+	uint64_t gap_us;                    ///< Idle time that ends a movement
+	uint64_t duration_us;               ///< Fixed length of movements, or 0
+	unsigned passes;                    ///< Movements per step
+};
+
+/** Collect a single movement from the evdev node, waiting for it to start.
+ *  Returns false on error or when interrupted. */
+static bool
+record_pass (int fd, const struct movement *movement, int step,
+	unsigned pass, struct sweep *sweep, FILE *capture)
+{
+	int32_t dx = 0, dy = 0;
+	uint64_t start_us = 0, last_us = 0;
+	bool started = false;
+	while (!g_terminated)
+	{
+		// Timestamps come from the monotonic clock, like ours
+		int timeout = -1;
+		if (started)
+		{
+			struct timespec ts;
+			clock_gettime (CLOCK_MONOTONIC, &ts);
+			uint64_t now_us = ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000,
+				deadline_us = last_us + movement->gap_us;
+			if (movement->duration_us
+			 && start_us + movement->duration_us < deadline_us)
+				deadline_us = start_us + movement->duration_us;
+			if (now_us >= deadline_us)
+				break;
+			timeout = (deadline_us - now_us + 999) / 1000;
+		}
+
+		struct pollfd pfd = { .fd = fd, .events = POLLIN };
+		int ready = poll (&pfd, 1, timeout);
+		if (ready < 0 && errno != EINTR)
+			return false;
+		if (ready <= 0)
+			continue;
+
+		struct input_event events[64];
+		ssize_t len = read (fd, events, sizeof events);
+		if (len < 0 && errno != EAGAIN && errno != EINTR)
+			return false;
+		for (ssize_t i = 0; i < len / (ssize_t) sizeof *events; i++)
+		{
+			const struct input_event *ev = &events[i];
+			if (ev->type == EV_REL && ev->code == REL_X)
+				dx += ev->value;
+			else if (ev->type == EV_REL && ev->code == REL_Y)
+				dy += ev->value;
+			else if (ev->type != EV_SYN || ev->code != SYN_REPORT
+				|| (!dx && !dy))
+				continue;
+			else
+			{
+				uint64_t time_us = timeval_us (&ev->time);
+				if (!started)
+					start_us = time_us;
+				started = true;
+				last_us = time_us;
+
+				// Motion past a fixed-length movement belongs to the next one
+				if (movement->duration_us
+				 && time_us >= start_us + movement->duration_us)
+					return true;
+
+				sweep_add (sweep, step, pass, dx, dy);
+				if (capture)
+					fprintf (capture, "%d %u %" PRIu64 " %" PRId32 " %" PRId32
+						"\n", step, pass, time_us - start_us, dx, dy);
+				dx = dy = 0;
+			}
+		}
+	}
+	return !g_terminated;
+}
+
+/** Throw away whatever motion has piled up. */
+static void
+drain (int fd)
+{
+	struct input_event events[64];
+	while (read (fd, events, sizeof events) > 0)
+		;
+}
+
+/** Set both CPI values, completing a journal entry if one is passed. */
+static int
+set_cpi (struct sensei_device *device, int cpi_off, int cpi_on,
+	struct sensei_journal_entry *entry)
+{
+	struct sensei_config config = { .cpi_off = cpi_off, .cpi_on = cpi_on };
+	struct sensei_command commands[SENSEI_MAX_COMMANDS];
+	size_t len = sensei_prepare_commands (&config,
+		SENSEI_FIELD_CPI_OFF | SENSEI_FIELD_CPI_ON, false, commands),
+		failed = len;
+	int result = sensei_send_commands (device, commands, len, &failed);
+	if (entry)
+		sensei_journal_commit (entry, commands, len,
+			result ? failed : len, result);
+	return result;
+}
+
+/** Go through the steps, with both CPI settings the same, so that it doesn't
+ *  matter which one is in effect.  Settings are restored afterwards. */
+static int
+sweep_run (struct sensei_device *device, int fd, const bool steps[N_STEPS],
+	const struct movement *movement, struct sweep *sweep, FILE *capture)
+{
+	struct sensei_config original;
+	int result = sensei_load_config (device, &original);
+	if (result)
+		return result;
+
+	// The steps are transient, only the net change of the sweep is recorded
+	struct sensei_journal_entry entry;
+	sensei_journal_begin (device, PROJECT_NAME "-calibrate", &entry);
+
+	for (int step = SENSEI_CPI_MIN; step <= SENSEI_CPI_MAX; step++)
+	{
+		if (!steps[step])
+			continue;
+		if ((result = set_cpi (device, step, step, NULL)))
+			break;
+
+		struct timespec ts = { SETTLE_MS / 1000, SETTLE_MS % 1000 * 1000000 };
+		while (nanosleep (&ts, &ts) && errno == EINTR && !g_terminated)
+			;
+		drain (fd);
+
+		fprintf (stderr, "Step %d, %d CPI: make %u movements\n",
+			step, step * SENSEI_CPI_STEP, movement->passes);
+		for (unsigned pass = 1; pass <= movement->passes; pass++)
+		{
+			uint64_t before = sweep->steps[step].total;
+			if (!record_pass (fd, movement, step, pass, sweep, capture))
+			{
+				// Mostly when the mouse has been unplugged
+				if (!g_terminated)
+					result = errno == ENODEV
+						? LIBUSB_ERROR_NO_DEVICE : LIBUSB_ERROR_IO;
+				goto out;
+			}
+
+			sweep_end_pass (sweep);
+			fprintf (stderr, "  %u: %" PRIu64 " counts\n",
+				pass, sweep->steps[step].total - before);
+		}
+	}
+
+out:
+	// Leave the mouse as we have found it, whatever happens
+	if (!result)
+		return set_cpi (device, original.cpi_off, original.cpi_on, &entry);
+	set_cpi (device, original.cpi_off, original.cpi_on, &entry);
+	return result;
+}
+
+// --- Main --------------------------------------------------------------------
+
+static void
+show_usage (const char *program_name)
+{
+	printf ("Usage: %s [OPTION]... EVENT-DEVICE\n"
+	        "       %s --analyze [OPTION]... CAPTURE\n",
+		program_name, program_name);
+	printf ("Measure the CPI that each step really yields.\n\n");
+	printf ("  -h, --help         Show this help\n");
+	printf ("  --version          Show program version and exit\n");
+	printf ("  --device PATH      Configure the mouse at /dev/hidrawN or"
+	                            " /dev/bus/usb/BBB/DDD\n");
+	printf ("  --steps LIST       Measure steps like 1-10,63, all by"
+	                            " default\n");
+	printf ("  --passes N         Repeat the movement N times at each step,"
+	                            " %d by default\n", DEFAULT_PASSES);
+	printf ("  --gap MS           End movements after MS without motion,"
+	                            " %d by default\n", DEFAULT_GAP_MS);
+	printf ("  --duration MS      Make movements MS long, for steady"
+	                            " motion\n");
+	printf ("  --distance INCHES  Length of movements along one axis,"
+	                            " if known\n");
+	printf ("  --capture FILE     Save motion for later analysis\n");
+	printf ("  --analyze          Analyze a saved capture\n");
+	printf ("  --dry-run          Don't store the results\n");
+	printf ("\nEVENT-DEVICE is the mouse's evdev node,"
+	        " such as one in /dev/input/by-id.\n"
+	        "CAPTURE is what --capture has written, standard input"
+	        " with `-'.\n");
+	printf ("\n");
+}
+
+/** Paths under /dev/bus/usb go through usbfs, anything else is hidraw. */
+static int
+open_device (const char *path, struct sensei_device **device)
+{
+	if (path && !strncmp (path, "/dev/bus/usb/", 13))
+		return sensei_usbfs_open (path, device);
+	return sensei_hidraw_open (path, device);
+}
+
+#define ERROR(label, ...)                         \
+	do {                                          \
+		fprintf (stderr, "Error: " __VA_ARGS__);  \
+		status = 1;                               \
+		goto label;                               \
+	} while (0)
+
+/** Sweep through the steps on a live mouse. */
+static int
+live (const char *event_path, const char *device_path,
+	const bool steps[N_STEPS], const struct movement *movement,
+	struct sweep *sweep, FILE *capture)
+{
+	int result, status = 0;
+	int fd = open (event_path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0)
+		ERROR (error_0, "%s: %s\n", event_path, strerror (errno));
+
+	// The pointer would fly all over the place
+	int clock = CLOCK_MONOTONIC;
+	if (ioctl (fd, EVIOCSCLOCKID, &clock))
+		ERROR (error_1, "%s: %s\n", event_path, strerror (errno));
+	if (ioctl (fd, EVIOCGRAB, 1))
+		ERROR (error_1, "%s: cannot grab: %s\n",
+			event_path, strerror (errno));
+
+	struct sensei_device *device = NULL;
+	result = open_device (device_path, &device);
+	if (result == LIBUSB_ERROR_NOT_FOUND)
+		ERROR (error_2, "no suitable device found\n");
+	if (result)
+		ERROR (error_2, "couldn't open device: %s\n",
+			sensei_error_name (result));
+	if ((result = sensei_detach_kernel_driver (device)))
+		ERROR (error_3, "couldn't detach kernel driver: %s\n",
+			sensei_error_name (result));
+	if ((result = sensei_claim_interface (device)))
+		ERROR (error_4, "couldn't claim interface: %s\n",
+			sensei_error_name (result));
+
+	sweep->product = device->product;
+	if (capture)
+		fprintf (capture, "# " PROJECT_NAME "-calibrate capture\n"
+			"# product %04x\n# step pass time_us dx dy\n", device->product);
+
+	struct sigaction sa = { .sa_handler = on_terminate };
+	sigemptyset (&sa.sa_mask);
+	sigaction (SIGINT, &sa, NULL);
+	sigaction (SIGTERM, &sa, NULL);
+
+	if ((result = sweep_run (device, fd, steps, movement, sweep, capture)))
+		ERROR (error_5, "sweep failed: %s\n", sensei_error_name (result));
+	if (g_terminated)
+		ERROR (error_5, "interrupted\n");
+
+error_5:
+	sensei_release_interface (device);
+error_4:
+	sensei_attach_kernel_driver (device);
+error_3:
+	sensei_close (device);
+error_2:
+	ioctl (fd, EVIOCGRAB, 0);
+error_1:
+	close (fd);
+error_0:
+	return status;
+}
+
+int
+main (int argc, char *argv[])
+{
+	static struct option long_opts[] =
+	{
+		{ "help",      no_argument,       0, 'h' },
+		{ "version",   no_argument,       0, 'V' },
+		{ "device",    required_argument, 0, 'd' },
+		{ "steps",     required_argument, 0, 's' },
+		{ "passes",    required_argument, 0, 'p' },
+		{ "gap",       required_argument, 0, 'g' },
+		{ "duration",  required_argument, 0, 'D' },
+		{ "distance",  required_argument, 0, 'i' },
+		{ "capture",   required_argument, 0, 'c' },
+		{ "analyze",   no_argument,       0, 'a' },
+		{ "dry-run",   no_argument,       0, 'n' },
+		{ 0,           0,                 0,  0  }
+	};
+
+	static bool steps[N_STEPS];
+	parse_steps ("1-63", steps);
+	struct movement movement =
+		{ .gap_us = DEFAULT_GAP_MS * 1000, .passes = DEFAULT_PASSES };
+	const char *device_path = NULL, *capture_path = NULL;
+	bool analysis = false, dry_run = false;
+	double distance = 0;
+	unsigned long value;
+	char *end;
+	int c;
+	while ((c = getopt_long (argc, argv, "h", long_opts, NULL)) != -1)
+	{
+	switch (c)
+	{
+	case 'h':
+		show_usage (argv[0]);
+		return EXIT_SUCCESS;
+	case 'V':
+		printf (PROJECT_NAME "-calibrate " PROJECT_VERSION "\n");
+		return EXIT_SUCCESS;
+	case 'd':
+		device_path = optarg;
+		break;
+	case 's':
+		if (!parse_steps (optarg, steps))
+		{
+			fprintf (stderr, "Error: invalid steps: %s\n", optarg);
+			return EXIT_FAILURE;
+		}
+		break;
+	case 'p':
+		movement.passes = value = strtoul (optarg, &end, 10);
+		if (!*optarg || *end || !value || value > 1000)
+		{
+			fprintf (stderr, "Error: invalid number of passes: %s\n", optarg);
+			return EXIT_FAILURE;
+		}
+		break;
+	case 'g':
+	case 'D':
+		value = strtoul (optarg, &end, 10);
+		if (!*optarg || *end || !value || value > 3600 * 1000)
+		{
+			fprintf (stderr, "Error: invalid time: %s\n", optarg);
+			return EXIT_FAILURE;
+		}
+		*(c == 'g' ? &movement.gap_us : &movement.duration_us) = value * 1000;
+		break;
+	case 'i':
+		if ((distance = strtod (optarg, &end)) <= 0 || !*optarg || *end)
+		{
+			fprintf (stderr, "Error: invalid distance: %s\n", optarg);
+			return EXIT_FAILURE;
+		}
+		break;
+	case 'c':
+		capture_path = optarg;
+		break;
+	case 'a':
+		analysis = true;
+		break;
+	case 'n':
+		dry_run = true;
+		break;
+	default:
+		return EXIT_FAILURE;
+	}
+	}
+
+	if (argc - optind != 1)
+	{
+		show_usage (argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	// With steady motion, there may never be a gap
+	if (movement.duration_us && movement.gap_us < movement.duration_us)
+		movement.gap_us = movement.duration_us;
+
+	int status = 0;
+	const char *path = argv[optind];
+	static struct sweep sweep;
+	FILE *fp = NULL;
+	if (analysis)
+	{
+		fp = strcmp (path, "-") ? fopen (path, "r") : stdin;
+		if (!fp)
+			ERROR (error_input, "%s: %s\n", path, strerror (errno));
+		if (!sweep_load (&sweep, fp, path))
+			status = 1;
+		if (fp != stdin)
+			fclose (fp);
+	}
+	else
+	{
+		if (capture_path && !(fp = fopen (capture_path, "w")))
+			ERROR (error_input, "%s: %s\n", capture_path, strerror (errno));
+		status = live (path, device_path, steps, &movement, &sweep, fp);
+		if (fp && fclose (fp))
+			ERROR (error_input, "%s: %s\n", capture_path, strerror (errno));
+	}
+	if (status)
+		goto error_input;
+
+	struct sensei_cpi_table table;
+	if (!sweep_analyse (&sweep, distance, &table))
+		ERROR (error_input, "no motion has been recorded\n");
+	sweep_print (&sweep, &table);
+	if (dry_run)
+		goto error_input;
+
+	char table_path[PATH_MAX];
+	if (!sweep.product)
+		ERROR (error_input, "the capture doesn't say which mouse it's of\n");
+	if (!sensei_cpi_store (sweep.product, &table))
+		ERROR (error_input, "couldn't store the table: %s\n", strerror (errno));
+	if (sensei_cpi_path (table_path, sizeof table_path))
+		printf ("Calibration stored in %s\n", table_path);
+
+error_input:
+	return status;
+}
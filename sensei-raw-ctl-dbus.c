@@ -0,0 +1,658 @@
+/*
+ * sensei-raw-ctl-dbus.c: settings of all mice over D-Bus
+ *
+ * Owns the name org.sensei_raw_ctl on the session bus and exports an object
+ * for each mouse, numbered from zero, with a property for each setting.
+ * Properties are served from a cache that is refreshed periodically and after
+ * every change, and PropertiesChanged is only emitted for values that have
+ * actually changed.  Apply changes any number of settings at once.
+ *
+ * Copyright (c) 2013, Přemysl Janouch <p.janouch@gmail.com>
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <signal.h>
+
+#include <getopt.h>
+#include <gio/gio.h>
+#include <glib-unix.h>
+
+// For the error codes
+#include <libusb.h>
+
+#include "config.h"
+#include "sensei-raw.h"
+
+#define BUS_NAME        "org.sensei_raw_ctl"
+#define INTERFACE_NAME  "org.sensei_raw_ctl.Mouse"
+#define OBJECT_PATH     "/org/sensei_raw_ctl/Mouse"
+
+/** How often the cache is refreshed by default, in milliseconds. */
+#define DEFAULT_REFRESH_MS  2000
+
+/** Field masks for Apply are the same as SENSEI_FIELD_*. */
+static const char g_introspection[] =
+	"<node>"
+	"  <interface name='" INTERFACE_NAME "'>"
+	"    <method name='Apply'>"
+	"      <arg name='fields' type='u' direction='in'/>"
+	"      <arg name='values' type='a{sv}' direction='in'/>"
+	"      <arg name='save' type='b' direction='in'/>"
+	"    </method>"
+	"    <property name='Path' type='s' access='read'/>"
+	"    <property name='Mode' type='s' access='write'/>"
+	"    <property name='Polling' type='u' access='readwrite'/>"
+	"    <property name='Intensity' type='s' access='readwrite'/>"
+	"    <property name='Pulsation' type='s' access='readwrite'/>"
+	"    <property name='CpiOff' type='u' access='readwrite'/>"
+	"    <property name='CpiOn' type='u' access='readwrite'/>"
+	"  </interface>"
+	"</node>";
+
+// --- Properties --------------------------------------------------------------
+
+/** A property backed by a setting. */
+struct property
+{
+	const char *name;                   ///< D-Bus property name
+	const char *setting;                ///< Name for sensei_parse_setting()
+	unsigned field;                     ///< SENSEI_FIELD_*
+	const char *type;                   ///< GVariant type string
+};
+
+/** The mode can only be set, it's not a part of the blob. */
+static const struct property g_properties[] =
+{
+	{ "Mode",      "mode",      SENSEI_FIELD_MODE,      "s" },
+	{ "Polling",   "polling",   SENSEI_FIELD_POLLING,   "u" },
+	{ "Intensity", "intensity", SENSEI_FIELD_INTENSITY, "s" },
+	{ "Pulsation", "pulsation", SENSEI_FIELD_PULSATION, "s" },
+	{ "CpiOff",    "cpi-off",   SENSEI_FIELD_CPI_OFF,   "u" },
+	{ "CpiOn",     "cpi-on",    SENSEI_FIELD_CPI_ON,    "u" },
+};
+
+#define N_PROPERTIES (sizeof g_properties / sizeof g_properties[0])
+
+static const struct property *
+find_property (const char *name)
+{
+	for (size_t i = 0; i < N_PROPERTIES; i++)
+		if (!strcmp (g_properties[i].name, name))
+			return &g_properties[i];
+	return NULL;
+}
+
+/** Return a floating reference to the value of a property,
+ *  or NULL if it can't be read or the device has returned garbage. */
+static GVariant *
+property_get (const struct property *self, const struct sensei_config *config)
+{
+	const char *name = NULL;
+	switch (self->field)
+	{
+	case SENSEI_FIELD_POLLING:
+		// The names are frequencies in Hz
+		name = sensei_polling_name (config->polling);
+		return name ? g_variant_new_uint32 (strtoul (name, NULL, 10)) : NULL;
+	case SENSEI_FIELD_INTENSITY:
+		name = sensei_intensity_name (config->intensity);
+		break;
+	case SENSEI_FIELD_PULSATION:
+		name = sensei_pulsation_name (config->pulsation);
+		break;
+	case SENSEI_FIELD_CPI_OFF:
+		return g_variant_new_uint32 (config->cpi_off * SENSEI_CPI_STEP);
+	case SENSEI_FIELD_CPI_ON:
+		return g_variant_new_uint32 (config->cpi_on * SENSEI_CPI_STEP);
+	}
+	return name ? g_variant_new_string (name) : NULL;
+}
+
+/** Parse a value the same way as on the command line. */
+static bool
+property_parse (const struct property *self, GVariant *value,
+	struct sensei_config *config, unsigned *fields)
+{
+	if (!g_variant_is_of_type (value, G_VARIANT_TYPE (self->type)))
+		return false;
+
+	char buf[16];
+	const char *s = buf;
+	if (g_variant_is_of_type (value, G_VARIANT_TYPE_STRING))
+		s = g_variant_get_string (value, NULL);
+	else
+		snprintf (buf, sizeof buf, "%lu",
+			(unsigned long) g_variant_get_uint32 (value));
+	return sensei_parse_setting (self->setting, s, config, fields);
+}
+
+/** Check whether a field has the same value in both configurations. */
+static bool
+unchanged (const struct sensei_config *a, const struct sensei_config *b,
+	unsigned field)
+{
+	switch (field)
+	{
+	case SENSEI_FIELD_POLLING:    return a->polling   == b->polling;
+	case SENSEI_FIELD_INTENSITY:  return a->intensity == b->intensity;
+	case SENSEI_FIELD_PULSATION:  return a->pulsation == b->pulsation;
+	case SENSEI_FIELD_CPI_OFF:    return a->cpi_off   == b->cpi_off;
+	case SENSEI_FIELD_CPI_ON:     return a->cpi_on    == b->cpi_on;
+	default:                      return false;
+	}
+}
+
+// --- Mice --------------------------------------------------------------------
+
+/** A mouse, for as long as the service runs. */
+struct mouse
+{
+	struct sensei_device *device;       ///< The open device
+	const char *path;                   ///< Where it has been opened
+	bool detached;                      ///< Whether we've detached a driver
+	bool claimed;                       ///< Whether we've claimed it
+
+	char object_path[64];               ///< Where it is on the bus
+	guint registration;                 ///< Registration ID of the object
+	struct sensei_config config;        ///< Cached configuration
+	bool cached;                        ///< Whether the cache is valid
+	bool failing;                       ///< Whether refreshing keeps failing
+};
+
+static GDBusConnection *g_connection;   ///< Where signals go
+static struct mouse *g_mice;            ///< One for each device found
+static size_t g_mice_len;               ///< Number of mice
+
+static GError *
+error_from_libusb (int error, const char *context)
+{
+	gint code = G_DBUS_ERROR_FAILED;
+	if (error == LIBUSB_ERROR_ACCESS)
+		code = G_DBUS_ERROR_ACCESS_DENIED;
+	else if (error == LIBUSB_ERROR_TIMEOUT)
+		code = G_DBUS_ERROR_TIMEOUT;
+	else if (error == LIBUSB_ERROR_NO_MEM)
+		code = G_DBUS_ERROR_NO_MEMORY;
+	return g_error_new (G_DBUS_ERROR, code, "%s: %s",
+		context, sensei_error_name (error));
+}
+
+/** Tell listeners about properties whose values differ between
+ *  the configurations. */
+static void
+mouse_emit_changes (struct mouse *self,
+	const struct sensei_config *before, const struct sensei_config *after)
+{
+	GVariantBuilder changed, invalidated;
+	g_variant_builder_init (&changed, G_VARIANT_TYPE ("a{sv}"));
+	g_variant_builder_init (&invalidated, G_VARIANT_TYPE ("as"));
+
+	bool any = false;
+	for (size_t i = 0; i < N_PROPERTIES; i++)
+	{
+		const struct property *property = &g_properties[i];
+		GVariant *old_value = property_get (property, before);
+		GVariant *new_value = property_get (property, after);
+		if (old_value)
+			g_variant_ref_sink (old_value);
+		if (new_value)
+			g_variant_ref_sink (new_value);
+
+		if (new_value
+		 && (!old_value || !g_variant_equal (old_value, new_value)))
+		{
+			g_variant_builder_add (&changed, "{sv}",
+				property->name, new_value);
+			any = true;
+		}
+		else if (!new_value && old_value)
+		{
+			g_variant_builder_add (&invalidated, "s", property->name);
+			any = true;
+		}
+
+		if (old_value)
+			g_variant_unref (old_value);
+		if (new_value)
+			g_variant_unref (new_value);
+	}
+
+	if (!any)
+	{
+		g_variant_builder_clear (&changed);
+		g_variant_builder_clear (&invalidated);
+		return;
+	}
+
+	GError *error = NULL;
+	if (!g_dbus_connection_emit_signal (g_connection, NULL, self->object_path,
+		"org.freedesktop.DBus.Properties", "PropertiesChanged",
+		g_variant_new ("(sa{sv}as)", INTERFACE_NAME, &changed, &invalidated),
+		&error))
+	{
+		fprintf (stderr, "Warning: %s\n", error->message);
+		g_error_free (error);
+	}
+}
+
+/** Read the configuration from the device and update the cache. */
+static int
+mouse_refresh (struct mouse *self)
+{
+	unsigned char blob[SENSEI_BLOB_LENGTH];
+	int result = sensei_load_blob (self->device, blob);
+	if (result)
+		return result;
+
+	struct sensei_config config = { 0 };
+	sensei_decode_blob (blob, &config);
+
+	// Nobody could have seen the values before the object got exported
+	if (self->cached && self->registration)
+		mouse_emit_changes (self, &self->config, &config);
+
+	self->config = config;
+	self->cached = true;
+	return 0;
+}
+
+/** Send whatever differs from the cache as a single chain of commands. */
+static bool
+mouse_apply (struct mouse *self, const struct sensei_config *config,
+	unsigned fields, bool save, GError **error)
+{
+	if (!self->device)
+	{
+		g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+			"%s: the device couldn't be opened", self->path);
+		return false;
+	}
+
+	// Don't bother the device with what it already has
+	for (size_t i = 0; self->cached && i < N_PROPERTIES; i++)
+		if (unchanged (config, &self->config, g_properties[i].field))
+			fields &= ~g_properties[i].field;
+	if (!fields && !save)
+		return true;
+
+	struct sensei_command commands[SENSEI_MAX_COMMANDS];
+	size_t len = sensei_prepare_commands (config, fields, save, commands),
+		failed;
+	int result = sensei_apply_commands (self->device,
+		PROJECT_NAME "-dbus", commands, len, &failed);
+
+	// Whether it's succeeded or not, the cache can't be trusted anymore
+	if (mouse_refresh (self))
+		self->cached = false;
+	if (!result)
+		return true;
+
+	*error = error_from_libusb (result, commands[failed].step);
+	return false;
+}
+
+static GVariant *
+on_get_property (GDBusConnection *connection, const gchar *sender,
+	const gchar *object_path, const gchar *interface_name,
+	const gchar *property_name, GError **error, gpointer user_data)
+{
+	(void) connection;
+	(void) sender;
+	(void) object_path;
+	(void) interface_name;
+
+	struct mouse *self = user_data;
+	if (!strcmp (property_name, "Path"))
+		return g_variant_new_string (self->path);
+
+	// Only go to the device when there's nothing better
+	int result = self->device ? 0 : LIBUSB_ERROR_NO_DEVICE;
+	if (!result && !self->cached)
+		result = mouse_refresh (self);
+	if (result)
+	{
+		*error = error_from_libusb (result, self->path);
+		return NULL;
+	}
+
+	const struct property *property = find_property (property_name);
+	GVariant *value = property ? property_get (property, &self->config) : NULL;
+	if (!value)
+		g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+			"%s: unknown value", property_name);
+	return value;
+}
+
+static gboolean
+on_set_property (GDBusConnection *connection, const gchar *sender,
+	const gchar *object_path, const gchar *interface_name,
+	const gchar *property_name, GVariant *value, GError **error,
+	gpointer user_data)
+{
+	(void) connection;
+	(void) sender;
+	(void) object_path;
+	(void) interface_name;
+
+	struct sensei_config config = { 0 };
+	unsigned fields = 0;
+	const struct property *property = find_property (property_name);
+	if (!property || !property_parse (property, value, &config, &fields))
+	{
+		g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+			"%s: invalid value", property_name);
+		return FALSE;
+	}
+	return mouse_apply (user_data, &config, fields, false, error);
+}
+
+/** Apply (u fields, a{sv} values, b save): set the fields selected by
+ *  the mask to values found under property names in the dictionary,
+ *  so that a copy of GetAll output may be passed in. */
+static void
+on_method_call (GDBusConnection *connection, const gchar *sender,
+	const gchar *object_path, const gchar *interface_name,
+	const gchar *method_name, GVariant *parameters,
+	GDBusMethodInvocation *invocation, gpointer user_data)
+{
+	(void) connection;
+	(void) sender;
+	(void) object_path;
+	(void) interface_name;
+	(void) method_name;
+
+	guint32 mask;
+	GVariant *values;
+	gboolean save;
+	g_variant_get (parameters, "(u@a{sv}b)", &mask, &values, &save);
+
+	struct sensei_config config = { 0 };
+	unsigned fields = 0;
+	GError *error = NULL;
+	if (mask & ~SENSEI_FIELD_ALL)
+		error = g_error_new (G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+			"unknown fields: %#x", (unsigned) (mask & ~SENSEI_FIELD_ALL));
+	for (size_t i = 0; !error && i < N_PROPERTIES; i++)
+	{
+		const struct property *property = &g_properties[i];
+		if (!(mask & property->field))
+			continue;
+
+		GVariant *value = g_variant_lookup_value (values, property->name, NULL);
+		if (!value || !property_parse (property, value, &config, &fields))
+			error = g_error_new (G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+				"%s: %s value", property->name, value ? "invalid" : "missing");
+		if (value)
+			g_variant_unref (value);
+	}
+	g_variant_unref (values);
+
+	if (!error && mouse_apply (user_data, &config, fields, save, &error))
+		g_dbus_method_invocation_return_value (invocation, NULL);
+	else
+		g_dbus_method_invocation_take_error (invocation, error);
+}
+
+static const GDBusInterfaceVTable g_vtable =
+{
+	.method_call  = on_method_call,
+	.get_property = on_get_property,
+	.set_property = on_set_property,
+};
+
+/** Keep the cache in line with changes made by other programs. */
+static gboolean
+on_refresh (gpointer user_data)
+{
+	(void) user_data;
+
+	for (size_t i = 0; i < g_mice_len; i++)
+	{
+		struct mouse *self = &g_mice[i];
+		if (!self->device)
+			continue;
+
+		// Only complain once, the mouse may well have been unplugged
+		int result = mouse_refresh (self);
+		if (result && !self->failing)
+			fprintf (stderr, "Warning: couldn't read %s: %s\n",
+				self->path, sensei_error_name (result));
+		self->failing = result != 0;
+	}
+	return G_SOURCE_CONTINUE;
+}
+
+/** Open a mouse and fill the cache.  Mice that fail to open are still
+ *  exported to keep the numbering stable, they just return errors. */
+static void
+mouse_open (struct mouse *self, const struct sensei_device_info *info)
+{
+	// hidraw leaves the kernel driver alone, so prefer it
+	const char *path = info->hidraw_path;
+	int result = path
+		? sensei_hidraw_open (path, &self->device)
+		: sensei_usbfs_open ((path = info->usb_path), &self->device);
+	self->path = path;
+	if (result)
+	{
+		fprintf (stderr, "Warning: couldn't open %s: %s\n",
+			path, sensei_error_name (result));
+		return;
+	}
+
+	sensei_use_pacing (self->device);
+	if (!(result = sensei_detach_kernel_driver (self->device)))
+		self->detached = true;
+	if (!result && !(result = sensei_claim_interface (self->device)))
+		self->claimed = true;
+	if (!result)
+	{
+		if ((result = mouse_refresh (self)))
+			fprintf (stderr, "Warning: couldn't read %s: %s\n",
+				path, sensei_error_name (result));
+		return;
+	}
+
+	fprintf (stderr, "Warning: couldn't set up %s: %s\n",
+		path, sensei_error_name (result));
+	if (self->detached)
+		sensei_attach_kernel_driver (self->device);
+	sensei_close (self->device);
+	self->device = NULL;
+	self->detached = false;
+}
+
+static void
+mouse_close (struct mouse *self)
+{
+	if (!self->device)
+		return;
+
+	if (self->claimed)
+		sensei_release_interface (self->device);
+	if (self->detached)
+		sensei_attach_kernel_driver (self->device);
+	sensei_close (self->device);
+	self->device = NULL;
+}
+
+// --- Bus ---------------------------------------------------------------------
+
+static GMainLoop *g_loop;               ///< The main loop
+static int g_status;                    ///< Exit status
+
+static void
+on_bus_acquired (GDBusConnection *connection, const gchar *name,
+	gpointer user_data)
+{
+	(void) name;
+
+	GError *error = NULL;
+	GDBusNodeInfo *node =
+		g_dbus_node_info_new_for_xml (g_introspection, &error);
+	g_assert_no_error (error);
+
+	g_connection = connection;
+	for (size_t i = 0; i < g_mice_len; i++)
+	{
+		struct mouse *self = &g_mice[i];
+		snprintf (self->object_path, sizeof self->object_path,
+			OBJECT_PATH "/%zu", i);
+		self->registration = g_dbus_connection_register_object (connection,
+			self->object_path, node->interfaces[0], &g_vtable,
+			self, NULL, &error);
+		if (self->registration)
+			continue;
+
+		fprintf (stderr, "Error: %s: %s\n", self->object_path, error->message);
+		g_clear_error (&error);
+		g_status = EXIT_FAILURE;
+		g_main_loop_quit (g_loop);
+	}
+	g_dbus_node_info_unref (node);
+
+	// Make the cache refresh itself only once anyone can be notified
+	guint refresh_ms = GPOINTER_TO_UINT (user_data);
+	if (refresh_ms)
+		g_timeout_add (refresh_ms, on_refresh, NULL);
+}
+
+static void
+on_name_lost (GDBusConnection *connection, const gchar *name,
+	gpointer user_data)
+{
+	(void) user_data;
+
+	fprintf (stderr, "Error: %s %s\n", connection
+		? "couldn't acquire the name" : "couldn't connect to the bus for",
+		name);
+	g_status = EXIT_FAILURE;
+	g_main_loop_quit (g_loop);
+}
+
+static gboolean
+on_quit (gpointer user_data)
+{
+	(void) user_data;
+	g_main_loop_quit (g_loop);
+	return G_SOURCE_CONTINUE;
+}
+
+// --- Main --------------------------------------------------------------------
+
+static void
+show_usage (const char *program_name)
+{
+	printf ("Usage: %s [OPTION]...\n", program_name);
+	printf ("Export SteelSeries Sensei Raw settings on the session bus.\n\n");
+	printf ("  -h, --help      Show this help\n");
+	printf ("  --version       Show program version and exit\n");
+	printf ("  --refresh-ms MS Reread settings every MS milliseconds,"
+	                         " %d by default,\n"
+	        "                  or only after changes if zero\n",
+	        DEFAULT_REFRESH_MS);
+	printf ("\nEach mouse is exported as " OBJECT_PATH "/N, numbered"
+	        " from zero,\nimplementing " INTERFACE_NAME " under the name "
+	        BUS_NAME ".\n");
+	printf ("\n");
+}
+
+int
+main (int argc, char *argv[])
+{
+	static struct option long_opts[] =
+	{
+		{ "help",       no_argument,       0, 'h' },
+		{ "version",    no_argument,       0, 'V' },
+		{ "refresh-ms", required_argument, 0, 'r' },
+		{ 0,            0,                 0,  0  }
+	};
+
+	unsigned long refresh_ms = DEFAULT_REFRESH_MS;
+	char *end;
+	int c;
+	while ((c = getopt_long (argc, argv, "h", long_opts, NULL)) != -1)
+	{
+	switch (c)
+	{
+	case 'h':
+		show_usage (argv[0]);
+		return EXIT_SUCCESS;
+	case 'V':
+		printf (PROJECT_NAME "-dbus " PROJECT_VERSION "\n");
+		return EXIT_SUCCESS;
+	case 'r':
+		refresh_ms = strtoul (optarg, &end, 10);
+		if (!*optarg || *end || refresh_ms > G_MAXUINT)
+		{
+			fprintf (stderr, "Error: invalid interval: %s\n", optarg);
+			return EXIT_FAILURE;
+		}
+		break;
+	default:
+		return EXIT_FAILURE;
+	}
+	}
+	if (optind < argc)
+	{
+		show_usage (argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	struct sensei_device_info *list;
+	size_t len;
+	int result = sensei_sysfs_list (&list, &len);
+	if (result)
+	{
+		fprintf (stderr, "Error: couldn't list devices: %s\n",
+			sensei_error_name (result));
+		return EXIT_FAILURE;
+	}
+	if (!len || !(g_mice = calloc (len, sizeof *g_mice)))
+	{
+		fprintf (stderr, "Error: %s\n", len
+			? sensei_error_name (LIBUSB_ERROR_NO_MEM)
+			: "no suitable device found");
+		sensei_free_device_list (list, len);
+		return EXIT_FAILURE;
+	}
+
+	g_mice_len = len;
+	for (size_t i = 0; i < g_mice_len; i++)
+		mouse_open (&g_mice[i], &list[i]);
+
+	// Devices need to be given back to their drivers when terminated
+	g_loop = g_main_loop_new (NULL, FALSE);
+	g_unix_signal_add (SIGINT, on_quit, NULL);
+	g_unix_signal_add (SIGTERM, on_quit, NULL);
+
+	guint owner = g_bus_own_name (G_BUS_TYPE_SESSION, BUS_NAME,
+		G_BUS_NAME_OWNER_FLAGS_NONE, on_bus_acquired, NULL, on_name_lost,
+		GUINT_TO_POINTER ((guint) refresh_ms), NULL);
+	g_main_loop_run (g_loop);
+	g_bus_unown_name (owner);
+	g_main_loop_unref (g_loop);
+
+	for (size_t i = 0; i < g_mice_len; i++)
+		mouse_close (&g_mice[i]);
+	free (g_mice);
+	sensei_free_device_list (list, len);
+	return g_status;
+}
@@ -0,0 +1,968 @@
+/*
+ * sensei-raw-ctl-debounce.c: per-button debounce filter for worn switches
+ *
+ * Grabs an evdev mouse and passes its events on through a uinput device,
+ * dropping the extra transitions of a bouncing switch.  The first edge of
+ * each button goes through right away and only what follows it within
+ * a debounce window gets held back, so clean clicks aren't delayed at all.
+ * Windows are either fixed, or adapt to the bounce observed on each button.
+ *
+ * Copyright (c) 2013, Přemysl Janouch <p.janouch@gmail.com>
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+
+#include <getopt.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <linux/uinput.h>
+
+#include "config.h"
+
+/** The fixed debounce window unless told otherwise. */
+#define DEFAULT_WINDOW_US  8000
+/** Adaptive windows are this many times the longest bounce seen. */
+#define ADAPT_MARGIN  2
+/** Clean edges shrink the bounce estimate by 1/2^BOUNCE_DECAY. */
+#define BOUNCE_DECAY  5
+/** How many of the latest forwarding latencies to keep for --stats. */
+#define N_LATENCIES  65536
+
+/** Buttons from BTN_MOUSE on get filtered, anything else passes through. */
+#define N_BUTTONS  16
+
+static volatile sig_atomic_t g_terminated;
+
+static void
+on_terminate (int signum)
+{
+	(void) signum;
+	g_terminated = true;
+}
+
+static uint64_t
+now_us (void)
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint64_t
+now_ns (void)
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static bool
+parse_ms (const char *s, uint64_t *us)
+{
+	char *end;
+	double ms = strtod (s, &end);
+	if (!*s || *end || ms < 0 || ms > 1000)
+		return false;
+	*us = ms * 1000 + .5;
+	return true;
+}
+
+/** Parse MIN:MAX in milliseconds. */
+static bool
+parse_ms_range (const char *s, uint64_t *min_us, uint64_t *max_us)
+{
+	const char *colon = strchr (s, ':');
+	char min[32];
+	if (!colon || colon - s >= (int) sizeof min)
+		return false;
+	snprintf (min, sizeof min, "%.*s", (int) (colon - s), s);
+	return parse_ms (min, min_us) && parse_ms (colon + 1, max_us)
+		&& *min_us <= *max_us;
+}
+
+// --- Filter ------------------------------------------------------------------
+
+struct debounce_config
+{
+	bool adaptive;                      ///< Adapt windows to the bounce
+	uint64_t window_us;                 ///< The fixed window
+	uint64_t min_us;                    ///< The shortest adaptive window
+	uint64_t max_us;                    ///< The longest adaptive window
+};
+
+struct button_state
+{
+	bool seen;                          ///< Any edge has gone through yet
+	bool raw;                           ///< What the switch says
+	bool reported;                      ///< What we've passed on
+	bool bounced;                       ///< The current window caught bounce
+	uint64_t edge_us;                   ///< When the last edge went through
+	uint64_t window_us;                 ///< Window following that edge
+	uint64_t bounce_us;                 ///< Estimated bounce duration
+};
+
+struct filter
+{
+	struct debounce_config config;      ///< Configuration
+	struct button_state buttons[N_BUTTONS]; ///< Per-button state
+
+	unsigned long passed;               ///< Edges passed on right away
+	unsigned long delayed;              ///< Edges passed on at window end
+	unsigned long suppressed;           ///< Transitions dropped as bounce
+};
+
+static void
+filter_init (struct filter *self, const struct debounce_config *config)
+{
+	memset (self, 0, sizeof *self);
+	self->config = *config;
+}
+
+static uint64_t
+filter_window (const struct filter *self, const struct button_state *b)
+{
+	if (!self->config.adaptive)
+		return self->config.window_us;
+
+	uint64_t window_us = b->bounce_us * ADAPT_MARGIN;
+	if (window_us < self->config.min_us)
+		return self->config.min_us;
+	if (window_us > self->config.max_us)
+		return self->config.max_us;
+	return window_us;
+}
+
+/** Let an edge through and open a new window after it. */
+static void
+filter_accept (struct filter *self, struct button_state *b, uint64_t time_us)
+{
+	if (self->config.adaptive && !b->bounced)
+		b->bounce_us -= b->bounce_us >> BOUNCE_DECAY;
+
+	b->seen = true;
+	b->bounced = false;
+	b->reported = b->raw;
+	b->edge_us = time_us;
+	b->window_us = filter_window (self, b);
+}
+
+/** Record a transition that followed the last edge after @a since_us. */
+static void
+filter_observe (struct filter *self, struct button_state *b, uint64_t since_us)
+{
+	if (!self->config.adaptive || since_us >= self->config.max_us)
+		return;
+	if (since_us > b->bounce_us)
+		b->bounce_us = since_us;
+	b->bounced = true;
+}
+
+/** Process a transition of a button, returning whether to pass it on. */
+static bool
+filter_input (struct filter *self, unsigned index, bool pressed,
+	uint64_t time_us)
+{
+	struct button_state *b = &self->buttons[index];
+	if (pressed == b->raw)
+		return false;
+
+	b->raw = pressed;
+	uint64_t since_us = time_us - b->edge_us;
+	if (b->seen && since_us < b->window_us)
+	{
+		filter_observe (self, b, since_us);
+		self->suppressed++;
+		return false;
+	}
+	if (pressed == b->reported)
+		return false;
+
+	// Bounce that has outlasted the window still teaches us something
+	if (b->seen)
+		filter_observe (self, b, since_us);
+	filter_accept (self, b, time_us);
+	self->passed++;
+	return true;
+}
+
+/** Find the button whose window ends first with a different state than what
+ *  has been passed on, returning its index, or -1 if there is none. */
+static int
+filter_next_deadline (const struct filter *self, uint64_t *deadline_us)
+{
+	int index = -1;
+	for (int i = 0; i < N_BUTTONS; i++)
+	{
+		const struct button_state *b = &self->buttons[i];
+		uint64_t end_us = b->edge_us + b->window_us;
+		if (b->seen && b->raw != b->reported
+		 && (index < 0 || end_us < *deadline_us))
+		{
+			index = i;
+			*deadline_us = end_us;
+		}
+	}
+	return index;
+}
+
+/** The window of a button has ended, pass on the state it has settled in. */
+static bool
+filter_expire (struct filter *self, unsigned index, uint64_t time_us)
+{
+	struct button_state *b = &self->buttons[index];
+	filter_accept (self, b, time_us);
+	self->delayed++;
+	return b->reported;
+}
+
+// --- Evaluation --------------------------------------------------------------
+
+/** Decisions within this time of a real edge count as finding it. */
+#define MATCH_US  50000
+
+/** A button transition. */
+struct edge
+{
+	uint64_t time_us;                   ///< When it happened
+	uint32_t order;                     ///< Breaks ties when sorting
+	uint8_t index;                      ///< Button number from BTN_MOUSE
+	bool pressed;                       ///< Whether it's been pressed
+};
+
+struct edges
+{
+	struct edge *edges;                 ///< The edges, in order
+	size_t len;                         ///< Number of edges
+	size_t alloc;                       ///< Allocated length of the array
+};
+
+static bool
+edges_add (struct edges *self, uint64_t time_us, unsigned index, bool pressed)
+{
+	if (self->len == self->alloc)
+	{
+		size_t alloc = self->alloc ? self->alloc * 2 : 1024;
+		struct edge *edges = realloc (self->edges, alloc * sizeof *edges);
+		if (!edges)
+			return false;
+		self->edges = edges;
+		self->alloc = alloc;
+	}
+	self->edges[self->len] = (struct edge)
+		{ time_us, self->len, index, pressed };
+	self->len++;
+	return true;
+}
+
+static int
+edge_compare (const void *a, const void *b)
+{
+	const struct edge *x = a, *y = b;
+	if (x->time_us != y->time_us)
+		return (x->time_us > y->time_us) - (x->time_us < y->time_us);
+	return (x->order > y->order) - (x->order < y->order);
+}
+
+/** Load button transitions in the format written by --record, keeping only
+ *  actual changes of state.  These are taken to be the truth. */
+static bool
+trace_load (struct edges *self, FILE *fp)
+{
+	bool held[N_BUTTONS] = { false };
+	char line[128];
+	uint64_t time_us;
+	unsigned code;
+	int value;
+	while (fgets (line, sizeof line, fp))
+	{
+		if (sscanf (line, "%" SCNu64 " %u %d", &time_us, &code, &value) != 3
+		 || code < BTN_MOUSE || code >= BTN_MOUSE + N_BUTTONS)
+			continue;
+
+		unsigned index = code - BTN_MOUSE;
+		if (held[index] == !!value)
+			continue;
+		held[index] = !!value;
+		if (!edges_add (self, time_us, index, !!value))
+			return false;
+	}
+	if (ferror (fp))
+		return false;
+
+	qsort (self->edges, self->len, sizeof *self->edges, edge_compare);
+	return true;
+}
+
+/** xorshift64*, good enough and reproducible everywhere. */
+static uint32_t
+chatter_random (uint64_t *state)
+{
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return (*state * 0x2545f4914f6cdd1d) >> 32;
+}
+
+/** Make switches bounce after some of the real edges, like worn ones do.
+ *  The bounce never reaches past half the time to the next edge. */
+static bool
+chatter_inject (const struct edges *truth, struct edges *out,
+	double probability, uint64_t chatter_us, uint64_t seed)
+{
+	uint64_t state = seed;
+	for (size_t i = 0; i < truth->len; i++)
+	{
+		const struct edge *e = &truth->edges[i];
+		if (!edges_add (out, e->time_us, e->index, e->pressed))
+			return false;
+
+		uint64_t limit_us = chatter_us;
+		for (size_t k = i + 1; k < truth->len; k++)
+			if (truth->edges[k].index == e->index)
+			{
+				uint64_t gap_us = truth->edges[k].time_us - e->time_us;
+				if (gap_us / 2 < limit_us)
+					limit_us = gap_us / 2;
+				break;
+			}
+		if (limit_us < 2
+		 || chatter_random (&state) / 4294967296. >= probability)
+			continue;
+
+		// Pairs of transitions away from the real state and back
+		uint64_t times[6];
+		size_t n = 2 * (1 + chatter_random (&state) % 3);
+		for (size_t k = 0; k < n; k++)
+			times[k] = 1 + chatter_random (&state) % limit_us;
+		for (size_t k = 1; k < n; k++)
+			for (size_t l = k; l && times[l - 1] > times[l]; l--)
+			{
+				uint64_t t = times[l];
+				times[l] = times[l - 1];
+				times[l - 1] = t;
+			}
+		for (size_t k = 0; k < n; k++)
+			if (!edges_add (out, e->time_us + times[k],
+				e->index, k % 2 ? e->pressed : !e->pressed))
+				return false;
+	}
+	qsort (out->edges, out->len, sizeof *out->edges, edge_compare);
+	return true;
+}
+
+struct evaluation
+{
+	unsigned long clicks;               ///< Real presses
+	unsigned long false_positives;      ///< Presses that weren't real
+	unsigned long false_negatives;      ///< Real presses that went missing
+	double delay_us;                    ///< Mean delay of found presses
+	double ns_per_event;                ///< Processing time per transition
+};
+
+/** Match the presses that came out against the real ones, button by button,
+ *  each within MATCH_US of a real press. */
+static void
+evaluate_match (const struct edges *truth, const struct edges *out,
+	struct evaluation *result)
+{
+	unsigned long matched = 0;
+	double delay_sum = 0;
+	for (unsigned index = 0; index < N_BUTTONS; index++)
+	{
+		size_t i = 0, j = 0;
+		while (true)
+		{
+			while (i < truth->len && (truth->edges[i].index != index
+				|| !truth->edges[i].pressed))
+				i++;
+			while (j < out->len && (out->edges[j].index != index
+				|| !out->edges[j].pressed))
+				j++;
+			if (i == truth->len && j == out->len)
+				break;
+
+			const struct edge *t = i < truth->len ? &truth->edges[i] : NULL;
+			const struct edge *o = j < out->len ? &out->edges[j] : NULL;
+			if (!t || (o && o->time_us < t->time_us))
+			{
+				result->false_positives++;
+				j++;
+			}
+			else if (!o || o->time_us - t->time_us > MATCH_US)
+			{
+				result->false_negatives++;
+				result->clicks++;
+				i++;
+			}
+			else
+			{
+				delay_sum += o->time_us - t->time_us;
+				matched++;
+				result->clicks++;
+				i++;
+				j++;
+			}
+		}
+	}
+	result->delay_us = matched ? delay_sum / matched : 0;
+}
+
+/** Run the filter over the input, expiring windows as time goes on. */
+static bool
+evaluate (const struct debounce_config *config, const struct edges *truth,
+	const struct edges *input, struct evaluation *result)
+{
+	struct edges out = { .len = 0 };
+	if (!(out.edges = calloc (input->len + 1, sizeof *out.edges)))
+		return false;
+	out.alloc = input->len + 1;
+
+	struct filter filter;
+	filter_init (&filter, config);
+
+	uint64_t start_ns = now_ns (), deadline_us;
+	int index;
+	for (size_t i = 0; i < input->len; i++)
+	{
+		const struct edge *e = &input->edges[i];
+		while ((index = filter_next_deadline (&filter, &deadline_us)) >= 0
+			&& deadline_us <= e->time_us)
+			edges_add (&out, deadline_us, index,
+				filter_expire (&filter, index, deadline_us));
+		if (filter_input (&filter, e->index, e->pressed, e->time_us))
+			edges_add (&out, e->time_us, e->index, e->pressed);
+	}
+	while ((index = filter_next_deadline (&filter, &deadline_us)) >= 0)
+		edges_add (&out, deadline_us, index,
+			filter_expire (&filter, index, deadline_us));
+
+	memset (result, 0, sizeof *result);
+	result->ns_per_event =
+		input->len ? (double) (now_ns () - start_ns) / input->len : 0;
+	evaluate_match (truth, &out, result);
+	free (out.edges);
+	return true;
+}
+
+static void
+evaluate_print (const char *name, const struct evaluation *r)
+{
+	double clicks = r->clicks ? r->clicks : 1;
+	printf ("%-16s %8lu %8lu %8lu %9.2f %9.2f %10.3f %9.1f\n", name,
+		r->clicks, r->false_positives, r->false_negatives,
+		100 * r->false_positives / clicks, 100 * r->false_negatives / clicks,
+		r->delay_us / 1e3, r->ns_per_event);
+}
+
+/** Compare fixed windows of various lengths with the adaptive filter over
+ *  a recorded trace with chatter added to it. */
+static bool
+evaluate_trace (const char *path, FILE *fp,
+	const struct debounce_config *config,
+	double probability, uint64_t chatter_us, uint64_t seed)
+{
+	struct edges truth = { .len = 0 }, input = { .len = 0 };
+	bool ok = trace_load (&truth, fp)
+		&& chatter_inject (&truth, &input, probability, chatter_us, seed);
+	if (!ok)
+	{
+		fprintf (stderr, "Error: %s: %s\n", path, strerror (errno));
+		goto out;
+	}
+	if (!truth.len)
+	{
+		fprintf (stderr, "Error: %s: no button transitions found\n", path);
+		ok = false;
+		goto out;
+	}
+
+	printf ("%zu transitions, %zu of them chatter up to %.1f ms, seed %"
+		PRIu64 "\n\n", input.len, input.len - truth.len, chatter_us / 1e3,
+		seed);
+	printf ("%-16s %8s %8s %8s %9s %9s %10s %9s\n", "filter", "clicks",
+		"false+", "false-", "false+ %", "false- %", "delay [ms]", "ns/event");
+
+	static const unsigned windows_ms[] = { 0, 1, 2, 4, 8, 16, 32 };
+	struct evaluation result;
+	char name[48];
+	for (size_t i = 0; ok && i < sizeof windows_ms / sizeof *windows_ms; i++)
+	{
+		struct debounce_config fixed =
+			{ .adaptive = false, .window_us = windows_ms[i] * 1000 };
+		snprintf (name, sizeof name, windows_ms[i] ? "fixed %u ms" : "none",
+			windows_ms[i]);
+		if ((ok = evaluate (&fixed, &truth, &input, &result)))
+			evaluate_print (name, &result);
+	}
+
+	struct debounce_config adaptive = *config;
+	adaptive.adaptive = true;
+	snprintf (name, sizeof name, "adaptive %g-%g", adaptive.min_us / 1e3,
+		adaptive.max_us / 1e3);
+	if (ok && (ok = evaluate (&adaptive, &truth, &input, &result)))
+		evaluate_print (name, &result);
+	if (!ok)
+		fprintf (stderr, "Error: %s\n", strerror (errno));
+
+out:
+	free (truth.edges);
+	free (input.edges);
+	return ok;
+}
+
+// --- uinput ------------------------------------------------------------------
+
+/** Copy the capabilities of an evdev device we're interested in. */
+static bool
+uinput_copy_bits (int source, int fd, int type, int request, size_t count)
+{
+	uint8_t bits[KEY_MAX / 8 + 1] = { 0 };
+	if (ioctl (source, EVIOCGBIT (type, sizeof bits), bits) < 0)
+		return false;
+
+	bool any = false;
+	for (size_t i = 0; i < count; i++)
+	{
+		if (!(bits[i / 8] >> i % 8 & 1))
+			continue;
+		if ((!any && ioctl (fd, UI_SET_EVBIT, type))
+		 || ioctl (fd, request, (int) i))
+			return false;
+		any = true;
+	}
+	return true;
+}
+
+/** Create a device that looks like the source, save for the bus. */
+static int
+uinput_clone (int source)
+{
+	int fd = open ("/dev/uinput", O_WRONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	struct uinput_setup setup = { .id = { .bustype = BUS_VIRTUAL } };
+	char name[UINPUT_MAX_NAME_SIZE] = "";
+	ioctl (source, EVIOCGNAME (sizeof name), name);
+	ioctl (source, EVIOCGID, &setup.id);
+	setup.id.bustype = BUS_VIRTUAL;
+	snprintf (setup.name, sizeof setup.name, "%.60s (debounced)", name);
+
+	if (!uinput_copy_bits (source, fd, EV_KEY, UI_SET_KEYBIT, KEY_CNT)
+	 || !uinput_copy_bits (source, fd, EV_REL, UI_SET_RELBIT, REL_CNT)
+	 || !uinput_copy_bits (source, fd, EV_MSC, UI_SET_MSCBIT, MSC_CNT)
+	 || ioctl (fd, UI_DEV_SETUP, &setup) || ioctl (fd, UI_DEV_CREATE))
+	{
+		int err = errno;
+		close (fd);
+		errno = err;
+		return -1;
+	}
+	return fd;
+}
+
+// --- Live filtering ----------------------------------------------------------
+
+struct live
+{
+	int source;                         ///< The grabbed evdev device
+	int sink;                           ///< Our uinput device
+	FILE *record;                       ///< Where to record transitions
+	struct filter filter;               ///< The filter
+
+	struct input_event out[64];         ///< Events of the current frame
+	size_t out_len;                     ///< Number of them
+	bool out_useful;                    ///< The frame isn't just noise
+	bool dropped;                       ///< Events have been lost
+
+	uint32_t *latencies_us;             ///< Latest forwarding latencies
+	size_t latencies_len;               ///< How many have been recorded
+};
+
+static uint64_t
+event_time_us (const struct input_event *event)
+{
+	return (uint64_t) event->input_event_sec * 1000000
+		+ event->input_event_usec;
+}
+
+static void
+live_emit (struct live *self, int type, int code, int value)
+{
+	if (self->out_len < sizeof self->out / sizeof *self->out - 1)
+		self->out[self->out_len++] = (struct input_event)
+			{ .type = type, .code = code, .value = value };
+	if (type != EV_MSC)
+		self->out_useful = true;
+}
+
+/** End the frame, writing it out unless the filter has emptied it. */
+static bool
+live_flush (struct live *self, uint64_t event_us)
+{
+	bool ok = true;
+	if (self->out_useful)
+	{
+		self->out[self->out_len++] = (struct input_event)
+			{ .type = EV_SYN, .code = SYN_REPORT };
+		ok = write (self->sink, self->out,
+			self->out_len * sizeof *self->out) >= 0;
+		if (self->latencies_us && event_us)
+			self->latencies_us[self->latencies_len++ % N_LATENCIES] =
+				now_us () - event_us;
+	}
+	self->out_len = 0;
+	self->out_useful = false;
+	return ok;
+}
+
+/** Pass on states that buttons have settled in by the end of windows. */
+static void
+live_expire (struct live *self, uint64_t time_us)
+{
+	uint64_t deadline_us;
+	int index;
+	while ((index = filter_next_deadline (&self->filter, &deadline_us)) >= 0
+		&& deadline_us <= time_us)
+		live_emit (self, EV_KEY, BTN_MOUSE + index,
+			filter_expire (&self->filter, index, deadline_us));
+}
+
+/** Feed a button transition to the filter, and record it if asked to. */
+static void
+live_button (struct live *self, unsigned index, bool pressed, uint64_t time_us)
+{
+	// Windows that have ended in the meantime come first
+	live_expire (self, time_us);
+	if (self->record)
+		fprintf (self->record, "%" PRIu64 " %u %d\n",
+			time_us, BTN_MOUSE + index, pressed);
+	if (filter_input (&self->filter, index, pressed, time_us))
+		live_emit (self, EV_KEY, BTN_MOUSE + index, pressed);
+}
+
+/** After losing events, catch up with the real state of the buttons. */
+static void
+live_resync (struct live *self)
+{
+	uint8_t keys[KEY_MAX / 8 + 1] = { 0 };
+	if (ioctl (self->source, EVIOCGKEY (sizeof keys), keys) < 0)
+		return;
+
+	uint64_t time_us = now_us ();
+	for (unsigned i = 0; i < N_BUTTONS; i++)
+		live_button (self, i,
+			keys[(BTN_MOUSE + i) / 8] >> (BTN_MOUSE + i) % 8 & 1, time_us);
+}
+
+static bool
+live_process (struct live *self, const struct input_event *event)
+{
+	if (event->type == EV_SYN && event->code == SYN_DROPPED)
+		self->dropped = true;
+	else if (self->dropped)
+	{
+		// Skip the rest of the frame, it's incomplete
+		if (event->type == EV_SYN && event->code == SYN_REPORT)
+		{
+			self->dropped = false;
+			live_resync (self);
+			return live_flush (self, 0);
+		}
+	}
+	else if (event->type == EV_SYN && event->code == SYN_REPORT)
+		return live_flush (self, event_time_us (event));
+	else if (event->type == EV_KEY && event->code >= BTN_MOUSE
+		&& event->code < BTN_MOUSE + N_BUTTONS && event->value != 2)
+		live_button (self, event->code - BTN_MOUSE, event->value,
+			event_time_us (event));
+	else if (event->type != EV_SYN)
+		live_emit (self, event->type, event->code, event->value);
+	return true;
+}
+
+static bool
+live_run (struct live *self)
+{
+	struct pollfd pfd = { .fd = self->source, .events = POLLIN };
+	while (!g_terminated)
+	{
+		// Windows end with microsecond precision, poll() only does ms
+		struct timespec timeout, *timeout_p = NULL;
+		uint64_t deadline_us, time_us = now_us ();
+		if (filter_next_deadline (&self->filter, &deadline_us) >= 0)
+		{
+			uint64_t left_us =
+				deadline_us > time_us ? deadline_us - time_us : 0;
+			timeout = (struct timespec)
+				{ left_us / 1000000, left_us % 1000000 * 1000 };
+			timeout_p = &timeout;
+		}
+
+		int ready = ppoll (&pfd, 1, timeout_p, NULL);
+		if (ready < 0 && errno != EINTR)
+			return false;
+		if (ready <= 0)
+		{
+			live_expire (self, now_us ());
+			if (!live_flush (self, 0))
+				return false;
+			continue;
+		}
+
+		struct input_event events[64];
+		ssize_t len = read (self->source, events, sizeof events);
+		if (len < 0 && (errno == EAGAIN || errno == EINTR))
+			continue;
+		if (len <= 0)
+			return false;
+		for (size_t i = 0; i < len / sizeof *events; i++)
+			if (!live_process (self, &events[i]))
+				return false;
+	}
+	return true;
+}
+
+static int
+compare_u32 (const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+	return (x > y) - (x < y);
+}
+
+static void
+live_print_stats (struct live *self)
+{
+	const struct filter *f = &self->filter;
+	fprintf (stderr, "%lu edges passed, %lu after a window,"
+		" %lu transitions suppressed\n", f->passed, f->delayed, f->suppressed);
+
+	size_t len = self->latencies_len < N_LATENCIES
+		? self->latencies_len : N_LATENCIES;
+	if (!len)
+		return;
+
+	uint32_t *l = self->latencies_us;
+	qsort (l, len, sizeof *l, compare_u32);
+	fprintf (stderr, "forwarding latency [us]: p50 %" PRIu32 ", p99 %"
+		PRIu32 ", max %" PRIu32 " over the last %zu frames\n",
+		l[len / 2], l[(size_t) (.99 * (len - 1))], l[len - 1], len);
+}
+
+// --- Main --------------------------------------------------------------------
+
+static void
+show_usage (const char *program_name)
+{
+	printf ("Usage: %s [OPTION]... DEVICE\n"
+	        "       %s --evaluate [OPTION]... TRACE\n",
+		program_name, program_name);
+	printf ("Filter out bouncing of mouse buttons.\n\n");
+	printf ("  -h, --help         Show this help\n");
+	printf ("  --version          Show program version and exit\n");
+	printf ("  --window MS        Use a fixed window, %g ms by default\n",
+		DEFAULT_WINDOW_US / 1e3);
+	printf ("  --adaptive MIN:MAX Adapt windows to the bounce of each"
+	                            " button\n");
+	printf ("  --record FILE      Record button transitions as they come\n");
+	printf ("  --stats            Print statistics when done\n");
+	printf ("  --evaluate         Evaluate filters over a recorded trace\n");
+	printf ("  --chatter P        Make the trace bounce with probability P,"
+	                            " 0.2 by default\n");
+	printf ("  --chatter-ms MS    Let bounce last up to MS, 5 ms by"
+	                            " default\n");
+	printf ("  --seed N           Seed the chatter, the time by default\n");
+	printf ("\nDEVICE is an evdev node, such as one in /dev/input/by-id.\n"
+	        "TRACE is what --record has written, standard input with `-'.\n");
+	printf ("\n");
+}
+
+#define ERROR(label, ...)                         \
+	do {                                          \
+		fprintf (stderr, "Error: " __VA_ARGS__);  \
+		status = 1;                               \
+		goto label;                               \
+	} while (0)
+
+int
+main (int argc, char *argv[])
+{
+	static struct option long_opts[] =
+	{
+		{ "help",       no_argument,       0, 'h' },
+		{ "version",    no_argument,       0, 'V' },
+		{ "window",     required_argument, 0, 'w' },
+		{ "adaptive",   required_argument, 0, 'a' },
+		{ "record",     required_argument, 0, 'r' },
+		{ "stats",      no_argument,       0, 's' },
+		{ "evaluate",   no_argument,       0, 'e' },
+		{ "chatter",    required_argument, 0, 'c' },
+		{ "chatter-ms", required_argument, 0, 'C' },
+		{ "seed",       required_argument, 0, 'S' },
+		{ 0,            0,                 0,  0  }
+	};
+
+	struct debounce_config config =
+		{ .window_us = DEFAULT_WINDOW_US, .min_us = 1000, .max_us = 30000 };
+	const char *record_path = NULL;
+	bool stats = false, evaluation = false;
+	double probability = .2;
+	uint64_t chatter_us = 5000, seed = time (NULL);
+	char *end;
+	int c;
+	while ((c = getopt_long (argc, argv, "h", long_opts, NULL)) != -1)
+	{
+	switch (c)
+	{
+	case 'h':
+		show_usage (argv[0]);
+		return EXIT_SUCCESS;
+	case 'V':
+		printf (PROJECT_NAME "-debounce " PROJECT_VERSION "\n");
+		return EXIT_SUCCESS;
+	case 'w':
+		if (!parse_ms (optarg, &config.window_us))
+		{
+			fprintf (stderr, "Error: invalid window: %s\n", optarg);
+			return EXIT_FAILURE;
+		}
+		config.adaptive = false;
+		break;
+	case 'a':
+		if (!parse_ms_range (optarg, &config.min_us, &config.max_us))
+		{
+			fprintf (stderr, "Error: invalid window range: %s\n", optarg);
+			return EXIT_FAILURE;
+		}
+		config.adaptive = true;
+		break;
+	case 'r':
+		record_path = optarg;
+		break;
+	case 's':
+		stats = true;
+		break;
+	case 'e':
+		evaluation = true;
+		break;
+	case 'c':
+		if ((probability = strtod (optarg, &end)) < 0 || probability > 1
+		 || !*optarg || *end)
+		{
+			fprintf (stderr, "Error: invalid probability: %s\n", optarg);
+			return EXIT_FAILURE;
+		}
+		break;
+	case 'C':
+		if (!parse_ms (optarg, &chatter_us))
+		{
+			fprintf (stderr, "Error: invalid duration: %s\n", optarg);
+			return EXIT_FAILURE;
+		}
+		break;
+	case 'S':
+		seed = strtoull (optarg, &end, 10);
+		if (!*optarg || *end)
+		{
+			fprintf (stderr, "Error: invalid seed: %s\n", optarg);
+			return EXIT_FAILURE;
+		}
+		break;
+	default:
+		return EXIT_FAILURE;
+	}
+	}
+
+	if (argc - optind != 1)
+	{
+		show_usage (argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	int status = 0;
+	const char *path = argv[optind];
+	if (evaluation)
+	{
+		FILE *fp = strcmp (path, "-") ? fopen (path, "r") : stdin;
+		if (!fp)
+			ERROR (error_evaluate, "%s: %s\n", path, strerror (errno));
+		// The generator gets stuck at zero
+		if (!evaluate_trace (path, fp, &config, probability, chatter_us,
+			seed ? seed : 1))
+			status = 1;
+		if (fp != stdin)
+			fclose (fp);
+	error_evaluate:
+		return status;
+	}
+
+	struct live live = { .source = -1, .sink = -1 };
+	filter_init (&live.filter, &config);
+	if (record_path && !(live.record = fopen (record_path, "w")))
+		ERROR (error_record, "%s: %s\n", record_path, strerror (errno));
+	if (stats && !(live.latencies_us =
+		calloc (N_LATENCIES, sizeof *live.latencies_us)))
+		ERROR (error_open, "%s\n", strerror (errno));
+
+	if ((live.source = open (path, O_RDONLY | O_NONBLOCK | O_CLOEXEC)) < 0)
+		ERROR (error_open, "%s: %s\n", path, strerror (errno));
+
+	// Timestamps are compared against our own clock
+	int clock = CLOCK_MONOTONIC;
+	if (ioctl (live.source, EVIOCSCLOCKID, &clock))
+		ERROR (error_source, "%s: %s\n", path, strerror (errno));
+	if ((live.sink = uinput_clone (live.source)) < 0)
+		ERROR (error_source, "/dev/uinput: %s\n", strerror (errno));
+	if (ioctl (live.source, EVIOCGRAB, 1))
+		ERROR (error_sink, "%s: cannot grab: %s\n", path, strerror (errno));
+
+	struct sigaction sa = { .sa_handler = on_terminate };
+	sigemptyset (&sa.sa_mask);
+	sigaction (SIGINT, &sa, NULL);
+	sigaction (SIGTERM, &sa, NULL);
+
+	if (!live_run (&live))
+		ERROR (error_grab, "%s: %s\n", path, strerror (errno));
+	if (stats)
+		live_print_stats (&live);
+
+error_grab:
+	ioctl (live.source, EVIOCGRAB, 0);
+error_sink:
+	ioctl (live.sink, UI_DEV_DESTROY);
+	close (live.sink);
+error_source:
+	close (live.source);
+error_open:
+	free (live.latencies_us);
+	if (live.record)
+		fclose (live.record);
+error_record:
+	return status;
+}
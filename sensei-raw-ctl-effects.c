@@ -0,0 +1,480 @@
+/*
+ * sensei-raw-ctl-effects.c: LED effects driven from the host
+ *
+ * The firmware can only pulse at three speeds, so anything fancier has to be
+ * done by setting the backlight intensity over and over again.  Frames are
+ * scheduled with a timerfd, never faster than the device is known to accept
+ * writes, and only frames that change the intensity are sent at all.
+ *
+ * Copyright (c) 2013, Přemysl Janouch <p.janouch@gmail.com>
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+#include <sys/resource.h>
+
+// For the error codes
+#include <libusb.h>
+
+#include "config.h"
+#include "sensei-raw.h"
+
+/** The fastest we ever go, there's no point in more. */
+#define DEFAULT_FPS  50
+/** How often the CPU meter looks at /proc/stat. */
+#define CPU_SAMPLE_MS  250
+
+// --- Effects -----------------------------------------------------------------
+
+struct engine;
+
+/** Compute brightness between 0 and 1 at @a t seconds from the start,
+ *  or a negative value when the effect is over. */
+typedef double (*effect_fn) (struct engine *self, double t);
+
+struct engine
+{
+	effect_fn effect;                   ///< What to show
+	double period;                      ///< Length of a cycle in seconds
+	unsigned count;                     ///< Cycles to run, zero for forever
+
+	uint64_t cpu_busy;                  ///< Last busy jiffies
+	uint64_t cpu_total;                 ///< Last total jiffies
+	double cpu_sampled;                 ///< When /proc/stat was last read
+	double cpu_load;                    ///< Last computed load
+
+	unsigned long frames;               ///< Timer expirations handled
+	unsigned long missed;               ///< Expirations we slept through
+	unsigned long writes;               ///< Frames sent to the device
+	double error_sum;                   ///< Sum of wake-up delays
+	double error_max;                   ///< Largest wake-up delay
+};
+
+/** Slowly fade in and out, a triangle wave looks fine with so few levels. */
+static double
+effect_breathe (struct engine *self, double t)
+{
+	double phase = t / self->period;
+	if (self->count && phase >= self->count)
+		return -1;
+
+	phase -= (uint64_t) phase;
+	return phase < .5 ? phase * 2 : 2 - phase * 2;
+}
+
+/** Blink at full intensity, as for notifications. */
+static double
+effect_flash (struct engine *self, double t)
+{
+	double phase = t / self->period;
+	if (self->count && phase >= self->count)
+		return -1;
+
+	phase -= (uint64_t) phase;
+	return phase < .5;
+}
+
+/** Show overall CPU load, which only needs looking at now and then. */
+static double
+effect_cpu (struct engine *self, double t)
+{
+	if (self->cpu_sampled && t - self->cpu_sampled < CPU_SAMPLE_MS / 1e3)
+		return self->cpu_load;
+	self->cpu_sampled = t;
+
+	FILE *fp = fopen ("/proc/stat", "r");
+	if (!fp)
+		return self->cpu_load;
+
+	uint64_t v[8] = { 0 };
+	int n = fscanf (fp, "cpu %" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNu64
+		" %" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNu64,
+		&v[0], &v[1], &v[2], &v[3], &v[4], &v[5], &v[6], &v[7]);
+	fclose (fp);
+	if (n < 4)
+		return self->cpu_load;
+
+	// Idle and I/O wait are what isn't busy
+	uint64_t total = 0;
+	for (int i = 0; i < 8; i++)
+		total += v[i];
+	uint64_t busy = total - v[3] - v[4];
+	if (self->cpu_total && total > self->cpu_total)
+		self->cpu_load = (double) (busy - self->cpu_busy)
+			/ (total - self->cpu_total);
+
+	self->cpu_busy = busy;
+	self->cpu_total = total;
+	return self->cpu_load;
+}
+
+static const struct
+{
+	const char *name;
+	effect_fn fn;
+}
+g_effects[] =
+{
+	{ "breathe", effect_breathe },
+	{ "flash",   effect_flash   },
+	{ "cpu",     effect_cpu     },
+};
+
+/** Map brightness to the four levels the device knows. */
+static enum sensei_intensity
+quantize (double brightness)
+{
+	int level = brightness * 3 + .5;
+	if (level < 0) level = 0;
+	if (level > 3) level = 3;
+	return INTENSITY_OFF + level;
+}
+
+// --- Main --------------------------------------------------------------------
+
+static volatile sig_atomic_t g_terminated;
+
+static void
+on_terminate (int signum)
+{
+	(void) signum;
+	g_terminated = true;
+}
+
+static double
+timespec_seconds (const struct timespec *ts)
+{
+	return ts->tv_sec + ts->tv_nsec / 1e9;
+}
+
+static double
+now_seconds (void)
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return timespec_seconds (&ts);
+}
+
+/** Run the effect until it ends, the duration runs out or we're told to
+ *  stop.  The timer may expire several times while we're busy writing,
+ *  in which case all but the latest frame get dropped. */
+static int
+run (struct engine *self, struct sensei_device *device,
+	unsigned frame_us, double duration)
+{
+	int fd = timerfd_create (CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if (fd < 0)
+		return LIBUSB_ERROR_OTHER;
+
+	struct itimerspec spec = { .it_interval =
+		{ frame_us / 1000000, frame_us % 1000000 * 1000 } };
+	clock_gettime (CLOCK_MONOTONIC, &spec.it_value);
+	double start = timespec_seconds (&spec.it_value);
+	if (timerfd_settime (fd, TFD_TIMER_ABSTIME, &spec, NULL))
+	{
+		close (fd);
+		return LIBUSB_ERROR_OTHER;
+	}
+
+	int result = 0;
+	int shown = -1;
+	uint64_t frame = 0, expirations;
+	while (!result && !g_terminated)
+	{
+		ssize_t len = read (fd, &expirations, sizeof expirations);
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len != sizeof expirations)
+		{
+			result = LIBUSB_ERROR_IO;
+			break;
+		}
+
+		// Expirations are counted from the first one, at the start
+		frame += expirations;
+		double scheduled = start + (frame - 1) * frame_us / 1e6;
+		double now = now_seconds (), error = now - scheduled;
+		self->frames++;
+		self->missed += expirations - 1;
+		self->error_sum += error;
+		if (error > self->error_max)
+			self->error_max = error;
+
+		double t = scheduled - start;
+		double brightness = self->effect (self, t);
+		if (brightness < 0 || (duration && t >= duration))
+			break;
+
+		enum sensei_intensity intensity = quantize (brightness);
+		if ((int) intensity == shown)
+			continue;
+		if (!(result = sensei_set_intensity (device, intensity)))
+		{
+			shown = intensity;
+			self->writes++;
+		}
+	}
+	close (fd);
+	return result;
+}
+
+/** Paths under /dev/bus/usb go through usbfs, anything else is hidraw. */
+static int
+open_device (const char *path, struct sensei_device **device)
+{
+	if (path && !strncmp (path, "/dev/bus/usb/", 13))
+		return sensei_usbfs_open (path, device);
+	return sensei_hidraw_open (path, device);
+}
+
+/** Don't go faster than the device has been measured to keep up with. */
+static unsigned
+frame_interval (const struct sensei_device *device, unsigned fps)
+{
+	unsigned frame_us = 1000000 / fps;
+	struct sensei_pacing pacing;
+	if (sensei_pacing_load (device->product, device->transport->name,
+		&pacing))
+	{
+		if (pacing.interval_us > frame_us)
+			frame_us = pacing.interval_us;
+		if (pacing.rtt_p99_us > frame_us)
+			frame_us = pacing.rtt_p99_us;
+	}
+	return frame_us;
+}
+
+static void
+show_usage (const char *program_name)
+{
+	printf ("Usage: %s [OPTION]... [EFFECT]\n", program_name);
+	printf ("Drive the backlight of a SteelSeries Sensei Raw device.\n\n");
+	printf ("  -h, --help      Show this help\n");
+	printf ("  --version       Show program version and exit\n");
+	printf ("  --device PATH   Use the device at /dev/bus/usb/BBB/DDD"
+	                         " or /dev/hidrawN\n");
+	printf ("  --period MS     Length of a cycle, 2000 by default\n");
+	printf ("  --count N       Stop after N cycles\n");
+	printf ("  --duration S    Stop after S seconds\n");
+	printf ("  --fps N         Frames per second at most, %d by default\n",
+		DEFAULT_FPS);
+	printf ("\nEFFECT is one of breathe (the default), flash and cpu."
+	        "  The original\nbacklight settings are restored afterwards.\n");
+	printf ("\n");
+}
+
+#define ERROR(label, ...)                         \
+	do {                                          \
+		fprintf (stderr, "Error: " __VA_ARGS__);  \
+		status = 1;                               \
+		goto label;                               \
+	} while (0)
+
+int
+main (int argc, char *argv[])
+{
+	static struct option long_opts[] =
+	{
+		{ "help",      no_argument,       0, 'h' },
+		{ "version",   no_argument,       0, 'V' },
+		{ "device",    required_argument, 0, 'd' },
+		{ "period",    required_argument, 0, 'p' },
+		{ "count",     required_argument, 0, 'c' },
+		{ "duration",  required_argument, 0, 'D' },
+		{ "fps",       required_argument, 0, 'f' },
+		{ 0,           0,                 0,  0  }
+	};
+
+	struct engine engine = { .effect = effect_breathe, .period = 2 };
+	const char *device_path = NULL;
+	double duration = 0;
+	unsigned fps = DEFAULT_FPS;
+	unsigned long value;
+	char *end;
+	int c;
+	while ((c = getopt_long (argc, argv, "h", long_opts, NULL)) != -1)
+	{
+	switch (c)
+	{
+	case 'h':
+		show_usage (argv[0]);
+		return EXIT_SUCCESS;
+	case 'V':
+		printf (PROJECT_NAME "-effects " PROJECT_VERSION "\n");
+		return EXIT_SUCCESS;
+	case 'd':
+		device_path = optarg;
+		break;
+	case 'p':
+		engine.period = strtod (optarg, &end) / 1e3;
+		if (!*optarg || *end || engine.period <= 0)
+		{
+			fprintf (stderr, "Error: invalid period: %s\n", optarg);
+			return EXIT_FAILURE;
+		}
+		break;
+	case 'c':
+		engine.count = value = strtoul (optarg, &end, 10);
+		if (!*optarg || *end || *optarg == '-' || !value || value > UINT_MAX)
+		{
+			fprintf (stderr, "Error: invalid count: %s\n", optarg);
+			return EXIT_FAILURE;
+		}
+		break;
+	case 'D':
+		duration = strtod (optarg, &end);
+		if (!*optarg || *end || duration <= 0)
+		{
+			fprintf (stderr, "Error: invalid duration: %s\n", optarg);
+			return EXIT_FAILURE;
+		}
+		break;
+	case 'f':
+		fps = value = strtoul (optarg, &end, 10);
+		if (!*optarg || *end || !value || value > 1000)
+		{
+			fprintf (stderr, "Error: invalid frame rate: %s\n", optarg);
+			return EXIT_FAILURE;
+		}
+		break;
+	default:
+		return EXIT_FAILURE;
+	}
+	}
+
+	if (optind < argc)
+	{
+		size_t i = 0;
+		while (i < sizeof g_effects / sizeof *g_effects
+			&& strcmp (g_effects[i].name, argv[optind]))
+			i++;
+		if (i == sizeof g_effects / sizeof *g_effects)
+		{
+			fprintf (stderr, "Error: unknown effect: %s\n", argv[optind]);
+			return EXIT_FAILURE;
+		}
+		engine.effect = g_effects[i].fn;
+		optind++;
+	}
+	if (optind < argc)
+	{
+		fprintf (stderr, "Error: extra parameters\n");
+		return EXIT_FAILURE;
+	}
+
+	int result, status = 0;
+	struct sensei_device *device = NULL;
+	result = open_device (device_path, &device);
+	if (result == LIBUSB_ERROR_NOT_FOUND)
+		ERROR (error_0, "no suitable device found\n");
+	if (result)
+		ERROR (error_0, "couldn't open device: %s\n",
+			sensei_error_name (result));
+
+	result = sensei_detach_kernel_driver (device);
+	if (result)
+		ERROR (error_1, "couldn't detach kernel driver: %s\n",
+			sensei_error_name (result));
+
+	result = sensei_claim_interface (device);
+	if (result)
+		ERROR (error_2, "couldn't claim interface: %s\n",
+			sensei_error_name (result));
+
+	// Frames come and go, only the net change of the whole run is recorded
+	struct sensei_journal_entry entry;
+	sensei_journal_begin (device, PROJECT_NAME "-effects", &entry);
+
+	// Firmware pulsation would fight with us
+	struct sensei_config config;
+	result = sensei_load_config (device, &config);
+	if (result)
+		ERROR (error_3, "couldn't read the configuration: %s\n",
+			sensei_error_name (result));
+	if (config.pulsation != PULSATION_STEADY
+	 && (result = sensei_set_pulsation (device, PULSATION_STEADY)))
+		ERROR (error_3, "couldn't stop pulsation: %s\n",
+			sensei_error_name (result));
+
+	// Without SA_RESTART, so that waiting for the timer gets interrupted
+	struct sigaction sa = { .sa_handler = on_terminate };
+	sigemptyset (&sa.sa_mask);
+	sigaction (SIGINT, &sa, NULL);
+	sigaction (SIGTERM, &sa, NULL);
+
+	unsigned frame_us = frame_interval (device, fps);
+	fprintf (stderr, "Running at %.1f frames per second\n", 1e6 / frame_us);
+
+	struct rusage usage;
+	double start = now_seconds ();
+	if ((result = run (&engine, device, frame_us, duration)))
+	{
+		fprintf (stderr, "Error: setting intensity failed: %s\n",
+			sensei_error_name (result));
+		status = 1;
+	}
+	double elapsed = now_seconds () - start;
+
+	getrusage (RUSAGE_SELF, &usage);
+	double cpu = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6
+		+ usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+	fprintf (stderr, "%lu frames, %lu written, %lu missed;"
+		" timing error %.0f us on average, %.0f us at most;"
+		" %.2f%% CPU\n", engine.frames, engine.writes, engine.missed,
+		engine.frames ? engine.error_sum / engine.frames * 1e6 : 0,
+		engine.error_max * 1e6, elapsed > 0 ? cpu / elapsed * 100 : 0);
+
+	struct sensei_command commands[SENSEI_MAX_COMMANDS];
+	size_t len = sensei_prepare_commands (&config,
+		SENSEI_FIELD_INTENSITY | SENSEI_FIELD_PULSATION, false, commands),
+		failed = len;
+	result = sensei_send_commands (device, commands, len, &failed);
+	sensei_journal_commit (&entry, commands, len, result ? failed : len, result);
+	if (result)
+		ERROR (error_3, "couldn't restore the backlight: %s\n",
+			sensei_error_name (result));
+
+error_3:
+	result = sensei_release_interface (device);
+	if (result)
+		ERROR (error_2, "couldn't release interface: %s\n",
+			sensei_error_name (result));
+
+error_2:
+	result = sensei_attach_kernel_driver (device);
+	if (result)
+		ERROR (error_1, "couldn't reattach kernel driver: %s\n",
+			sensei_error_name (result));
+
+error_1:
+	sensei_close (device);
+error_0:
+	return status;
+}
@@ -0,0 +1,620 @@
+/*
+ * sensei-raw-ctl-emu.c: SteelSeries Sensei Raw emulator
+ *
+ * Creates a virtual mouse through /dev/uhid that carries the real vendor and
+ * product ID's and answers Output and Feature reports the way the NOTES file
+ * describes, so that the hidraw and evdev paths can be exercised end to end
+ * without any hardware.  Linux only, obviously.
+ *
+ * Copyright (c) 2013, Přemysl Janouch <p.janouch@gmail.com>
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <signal.h>
+
+#include <getopt.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/timerfd.h>
+#include <linux/uhid.h>
+
+#include "config.h"
+#include "sensei-raw.h"
+
+/** Mouse buttons, relative X/Y and wheel, plus the vendor-defined control
+ *  collection with a 32-byte Output and a 256-byte Feature report.  None of
+ *  the reports are numbered, just like on the real device. */
+static const unsigned char report_descriptor[] =
+{
+	0x05, 0x01,             // Usage Page (Generic Desktop)
+	0x09, 0x02,             // Usage (Mouse)
+	0xa1, 0x01,             // Collection (Application)
+	0x09, 0x01,             //   Usage (Pointer)
+	0xa1, 0x00,             //   Collection (Physical)
+	0x05, 0x09,             //     Usage Page (Button)
+	0x19, 0x01,             //     Usage Minimum (1)
+	0x29, 0x08,             //     Usage Maximum (8)
+	0x15, 0x00,             //     Logical Minimum (0)
+	0x25, 0x01,             //     Logical Maximum (1)
+	0x95, 0x08,             //     Report Count (8)
+	0x75, 0x01,             //     Report Size (1)
+	0x81, 0x02,             //     Input (Data, Variable, Absolute)
+	0x05, 0x01,             //     Usage Page (Generic Desktop)
+	0x09, 0x30,             //     Usage (X)
+	0x09, 0x31,             //     Usage (Y)
+	0x16, 0x01, 0x80,       //     Logical Minimum (-32767)
+	0x26, 0xff, 0x7f,       //     Logical Maximum (32767)
+	0x75, 0x10,             //     Report Size (16)
+	0x95, 0x02,             //     Report Count (2)
+	0x81, 0x06,             //     Input (Data, Variable, Relative)
+	0x09, 0x38,             //     Usage (Wheel)
+	0x15, 0x81,             //     Logical Minimum (-127)
+	0x25, 0x7f,             //     Logical Maximum (127)
+	0x75, 0x08,             //     Report Size (8)
+	0x95, 0x01,             //     Report Count (1)
+	0x81, 0x06,             //     Input (Data, Variable, Relative)
+	0xc0,                   //   End Collection
+	0xc0,                   // End Collection
+
+	0x06, 0x00, 0xff,       // Usage Page (Vendor Defined 0xFF00)
+	0x09, 0x01,             // Usage (1)
+	0xa1, 0x01,             // Collection (Application)
+	0x15, 0x00,             //   Logical Minimum (0)
+	0x26, 0xff, 0x00,       //   Logical Maximum (255)
+	0x75, 0x08,             //   Report Size (8)
+	0x95, SENSEI_COMMAND_LENGTH,
+	                        //   Report Count (32)
+	0x09, 0x02,             //   Usage (2)
+	0x91, 0x02,             //   Output (Data, Variable, Absolute)
+	0x96, SENSEI_BLOB_LENGTH & 0xff, SENSEI_BLOB_LENGTH >> 8,
+	                        //   Report Count (256)
+	0x09, 0x03,             //   Usage (3)
+	0xb1, 0x02,             //   Feature (Data, Variable, Absolute)
+	0xc0,                   // End Collection
+};
+
+/** Length of our motion report: buttons, X, Y, wheel. */
+#define MOTION_REPORT_LENGTH  6
+/** How many reports it takes to travel one side of the square. */
+#define MOTION_SIDE  250
+/** Distance travelled with each report, in inches: two counts at 1600 CPI. */
+#define MOTION_INCHES  (1. / 800)
+
+/** Emulated device state. */
+struct emu
+{
+	int fd;                             ///< /dev/uhid
+	bool verbose;                       ///< Log every request
+	const char *rom_path;               ///< Where to persist saved settings
+
+	enum sensei_mode mode;              ///< Not part of the blob
+	unsigned char blob[SENSEI_BLOB_LENGTH];  ///< GET_REPORT contents
+
+	bool opened;                        ///< Somebody listens to input
+	long rate;                          ///< Motion reports per second
+	int timer;                          ///< timerfd for motion reports
+	unsigned long sequence;             ///< Motion reports sent
+	double residue;                     ///< Counts not reported yet
+	double cpi_error;                   ///< Sensor error at range ends, in %
+	unsigned long overruns;             ///< Timer ticks we didn't make
+	unsigned long commands;             ///< Commands processed
+};
+
+static volatile sig_atomic_t g_terminate;
+
+static void
+on_terminate (int signum)
+{
+	(void) signum;
+	g_terminate = true;
+}
+
+// --- Device model ------------------------------------------------------------
+
+static void
+emu_set_defaults (struct emu *emu)
+{
+	memset (emu->blob, 0, sizeof emu->blob);
+	emu->mode = MODE_LEGACY;
+	emu->blob[SENSEI_BLOB_INTENSITY] = INTENSITY_HIGH;
+	emu->blob[SENSEI_BLOB_PULSATION] = PULSATION_STEADY;
+	emu->blob[SENSEI_BLOB_CPI_OFF] = 800 / SENSEI_CPI_STEP;
+	emu->blob[SENSEI_BLOB_CPI_ON] = 1600 / SENSEI_CPI_STEP;
+	emu->blob[SENSEI_BLOB_POLLING] = POLLING_1000_HZ;
+}
+
+static void
+emu_load_rom (struct emu *emu)
+{
+	FILE *fp = fopen (emu->rom_path, "rb");
+	if (!fp)
+		return;
+	if (fread (emu->blob, 1, sizeof emu->blob, fp) != sizeof emu->blob)
+	{
+		fprintf (stderr, "Warning: %s: short ROM image, ignoring\n",
+			emu->rom_path);
+		emu_set_defaults (emu);
+	}
+	fclose (fp);
+}
+
+static void
+emu_save_rom (struct emu *emu)
+{
+	FILE *fp = fopen (emu->rom_path, "wb");
+	if (!fp || fwrite (emu->blob, 1, sizeof emu->blob, fp) != sizeof emu->blob)
+		fprintf (stderr, "Warning: %s: %s\n", emu->rom_path, strerror (errno));
+	if (fp)
+		fclose (fp);
+}
+
+static bool
+is_enum_value (unsigned char value)
+{
+	return value >= 1 && value <= 4;
+}
+
+/** Process an Output report; returns false for anything unrecognised.
+ *  Invalid arguments are silently ignored, as the real mouse seems to do. */
+static bool
+emu_process_command (struct emu *emu, const unsigned char *cmd, size_t len)
+{
+	unsigned char padded[SENSEI_COMMAND_LENGTH] = { 0 };
+	memcpy (padded, cmd, len < sizeof padded ? len : sizeof padded);
+	cmd = padded;
+
+	switch (cmd[0])
+	{
+	case SENSEI_CMD_MODE:
+		if (cmd[2] == MODE_LEGACY || cmd[2] == MODE_NORMAL)
+			emu->mode = cmd[2];
+		break;
+	case SENSEI_CMD_CPI:
+		if (cmd[2] < SENSEI_CPI_MIN || cmd[2] > SENSEI_CPI_MAX)
+			break;
+		if (cmd[1] == 1)
+			emu->blob[SENSEI_BLOB_CPI_OFF] = cmd[2];
+		else if (cmd[1] == 2)
+			emu->blob[SENSEI_BLOB_CPI_ON] = cmd[2];
+		break;
+	case SENSEI_CMD_POLLING:
+		if (is_enum_value (cmd[2]))
+			emu->blob[SENSEI_BLOB_POLLING] = cmd[2];
+		break;
+	case SENSEI_CMD_INTENSITY:
+		if (is_enum_value (cmd[2]))
+			emu->blob[SENSEI_BLOB_INTENSITY] = cmd[2];
+		break;
+	case SENSEI_CMD_PULSATION:
+		if (is_enum_value (cmd[2]))
+			emu->blob[SENSEI_BLOB_PULSATION] = cmd[2];
+		break;
+	case SENSEI_CMD_SAVE:
+		if (emu->rom_path)
+			emu_save_rom (emu);
+		break;
+	default:
+		return false;
+	}
+	emu->commands++;
+	return true;
+}
+
+// --- uhid --------------------------------------------------------------------
+
+static int
+emu_write_event (struct emu *emu, const struct uhid_event *ev)
+{
+	ssize_t written;
+	while ((written = write (emu->fd, ev, sizeof *ev)) < 0 && errno == EINTR)
+		;
+	if (written < 0)
+		return -errno;
+	return written == sizeof *ev ? 0 : -EFAULT;
+}
+
+static int
+emu_create (struct emu *emu, uint16_t product)
+{
+	struct uhid_event ev;
+	memset (&ev, 0, sizeof ev);
+	ev.type = UHID_CREATE2;
+
+	snprintf ((char *) ev.u.create2.name, sizeof ev.u.create2.name,
+		"SteelSeries Sensei Raw (" PROJECT_NAME " emulator)");
+	snprintf ((char *) ev.u.create2.phys, sizeof ev.u.create2.phys,
+		PROJECT_NAME "-emu/%ld", (long) getpid ());
+	memcpy (ev.u.create2.rd_data, report_descriptor, sizeof report_descriptor);
+	ev.u.create2.rd_size = sizeof report_descriptor;
+	ev.u.create2.bus = BUS_USB;
+	ev.u.create2.vendor = USB_VENDOR_STEELSERIES;
+	ev.u.create2.product = product;
+	return emu_write_event (emu, &ev);
+}
+
+/** Strip the leading report number that HID core always passes along. */
+static const unsigned char *
+emu_report_payload (const unsigned char *data, size_t *len)
+{
+	if (*len && data[0] == 0)
+	{
+		(*len)--;
+		return data + 1;
+	}
+	return data;
+}
+
+static int
+emu_on_get_report (struct emu *emu, const struct uhid_get_report_req *req)
+{
+	struct uhid_event ev;
+	memset (&ev, 0, sizeof ev);
+	ev.type = UHID_GET_REPORT_REPLY;
+	ev.u.get_report_reply.id = req->id;
+
+	if (req->rtype != UHID_FEATURE_REPORT || req->rnum != 0)
+		ev.u.get_report_reply.err = EIO;
+	else
+	{
+		// Report number first, then the blob
+		ev.u.get_report_reply.data[0] = 0;
+		memcpy (ev.u.get_report_reply.data + 1, emu->blob, sizeof emu->blob);
+		ev.u.get_report_reply.size = 1 + sizeof emu->blob;
+	}
+
+	if (emu->verbose)
+		fprintf (stderr, "GET_REPORT type %u number %u: %s\n",
+			req->rtype, req->rnum, ev.u.get_report_reply.err ? "EIO" : "ok");
+	return emu_write_event (emu, &ev);
+}
+
+static void
+emu_log_command (struct emu *emu, const unsigned char *cmd, size_t len,
+	bool known)
+{
+	if (!emu->verbose)
+		return;
+
+	fprintf (stderr, "%s:", known ? "command" : "unknown command");
+	for (size_t i = 0; i < len && i < 3; i++)
+		fprintf (stderr, " %02x", cmd[i]);
+	fprintf (stderr, "\n");
+}
+
+static int
+emu_on_set_report (struct emu *emu, const struct uhid_set_report_req *req)
+{
+	struct uhid_event ev;
+	memset (&ev, 0, sizeof ev);
+	ev.type = UHID_SET_REPORT_REPLY;
+	ev.u.set_report_reply.id = req->id;
+
+	size_t len = req->size;
+	const unsigned char *cmd = emu_report_payload (req->data, &len);
+	if (req->rtype != UHID_OUTPUT_REPORT || req->rnum != 0)
+		ev.u.set_report_reply.err = EIO;
+	else
+	{
+		bool known = emu_process_command (emu, cmd, len);
+		emu_log_command (emu, cmd, len, known);
+	}
+	return emu_write_event (emu, &ev);
+}
+
+static void
+emu_on_output (struct emu *emu, const struct uhid_output_req *req)
+{
+	size_t len = req->size;
+	const unsigned char *cmd = emu_report_payload (req->data, &len);
+	if (req->rtype == UHID_OUTPUT_REPORT)
+	{
+		bool known = emu_process_command (emu, cmd, len);
+		emu_log_command (emu, cmd, len, known);
+	}
+}
+
+/** Handle one event from the kernel. */
+static int
+emu_dispatch (struct emu *emu)
+{
+	struct uhid_event ev;
+	ssize_t len = read (emu->fd, &ev, sizeof ev);
+	if (len < 0)
+		return errno == EINTR || errno == EAGAIN ? 0 : -errno;
+
+	switch (ev.type)
+	{
+	case UHID_START:
+		if (emu->verbose)
+			fprintf (stderr, "device started\n");
+		break;
+	case UHID_STOP:
+		if (emu->verbose)
+			fprintf (stderr, "device stopped\n");
+		break;
+	case UHID_OPEN:
+		emu->opened = true;
+		break;
+	case UHID_CLOSE:
+		emu->opened = false;
+		break;
+	case UHID_OUTPUT:
+		emu_on_output (emu, &ev.u.output);
+		break;
+	case UHID_GET_REPORT:
+		return emu_on_get_report (emu, &ev.u.get_report);
+	case UHID_SET_REPORT:
+		return emu_on_set_report (emu, &ev.u.set_report);
+	}
+	return 0;
+}
+
+// --- Motion ------------------------------------------------------------------
+
+/** The CPI that the sensor really has at a step.  Real sensors tend to drift
+ *  away from the nominal value towards both ends of the range, and so can
+ *  this one, so that calibration has something to find. */
+static double
+emu_actual_cpi (const struct emu *emu, int step)
+{
+	double middle = (SENSEI_CPI_MIN + SENSEI_CPI_MAX) / 2.,
+		x = (step - middle) / (SENSEI_CPI_MAX - middle);
+	return step * SENSEI_CPI_STEP * (1 + emu->cpi_error / 100 * x * x * x);
+}
+
+/** Move the pointer around a square so that it stays in place on average.
+ *  The distance is always the same, so the counts depend on the CPI; the LED
+ *  isn't modelled and it's always taken to be on. */
+static int
+emu_send_motion (struct emu *emu)
+{
+	static const int directions[4][2] = { { 1, 0 }, { 0, 1 }, { -1, 0 },
+		{ 0, -1 } };
+	const int *d = directions[(emu->sequence / MOTION_SIDE) % 4];
+	double counts = emu->residue + MOTION_INCHES
+		* emu_actual_cpi (emu, emu->blob[SENSEI_BLOB_CPI_ON]);
+	int16_t distance = counts;
+	emu->residue = counts - distance;
+	int16_t dx = d[0] * distance, dy = d[1] * distance;
+
+	struct uhid_event ev;
+	memset (&ev, 0, sizeof ev);
+	ev.type = UHID_INPUT2;
+	ev.u.input2.size = MOTION_REPORT_LENGTH;
+	ev.u.input2.data[0] = 0;
+	ev.u.input2.data[1] = (uint16_t) dx & 0xff;
+	ev.u.input2.data[2] = (uint16_t) dx >> 8;
+	ev.u.input2.data[3] = (uint16_t) dy & 0xff;
+	ev.u.input2.data[4] = (uint16_t) dy >> 8;
+	ev.u.input2.data[5] = 0;
+
+	emu->sequence++;
+	return emu_write_event (emu, &ev);
+}
+
+static int
+emu_arm_timer (struct emu *emu)
+{
+	struct itimerspec its = { { 0, 0 }, { 0, 0 } };
+	if (emu->rate > 0)
+	{
+		long long period = 1000000000LL / emu->rate;
+		its.it_interval.tv_sec = period / 1000000000LL;
+		its.it_interval.tv_nsec = period % 1000000000LL;
+		its.it_value = its.it_interval;
+	}
+	return timerfd_settime (emu->timer, 0, &its, NULL) ? -errno : 0;
+}
+
+static int
+emu_on_timer (struct emu *emu)
+{
+	uint64_t expirations;
+	if (read (emu->timer, &expirations, sizeof expirations) < 0)
+		return errno == EINTR || errno == EAGAIN ? 0 : -errno;
+
+	// We'd rather stay on schedule than try to catch up
+	emu->overruns += expirations - 1;
+	if (!emu->opened)
+		return 0;
+	return emu_send_motion (emu);
+}
+
+// --- Main --------------------------------------------------------------------
+
+static void
+show_usage (const char *program_name)
+{
+	printf ("Usage: %s [OPTION]...\n", program_name);
+	printf ("Emulate a SteelSeries Sensei Raw through uhid.\n\n");
+	printf ("  -h, --help      Show this help\n");
+	printf ("  --version       Show program version and exit\n");
+	printf ("  -v, --verbose   Log every request received\n");
+	printf ("  --product X     Product to pose as"
+	                         " (sensei-raw or cod-bo2)\n");
+	printf ("  --rate X        Send X motion reports per second,"
+	                         " 0 disables motion\n");
+	printf ("  --rom FILE      Load settings from and save them to FILE\n");
+	printf ("  --cpi-error PCT Make the sensor PCT percent off at the highest"
+	                         " CPI, and the\n"
+	        "                  opposite at the lowest\n");
+	printf ("\n");
+}
+
+static void
+parse_options (int argc, char *argv[], struct emu *emu, uint16_t *product)
+{
+	static struct option long_opts[] =
+	{
+		{ "help",      no_argument,       0, 'h' },
+		{ "version",   no_argument,       0, 'V' },
+		{ "verbose",   no_argument,       0, 'v' },
+		{ "product",   required_argument, 0, 'p' },
+		{ "rate",      required_argument, 0, 'r' },
+		{ "rom",       required_argument, 0, 'R' },
+		{ "cpi-error", required_argument, 0, 'e' },
+		{ 0,           0,                 0,  0  }
+	};
+
+	int c;
+	char *end;
+	while ((c = getopt_long (argc, argv, "hv", long_opts, NULL)) != -1)
+	{
+	switch (c)
+	{
+	case 'h':
+		show_usage (argv[0]);
+		exit (EXIT_SUCCESS);
+	case 'V':
+		printf (PROJECT_NAME "-emu " PROJECT_VERSION "\n");
+		exit (EXIT_SUCCESS);
+	case 'v':
+		emu->verbose = true;
+		break;
+	case 'p':
+		if (!strcasecmp (optarg, "sensei-raw"))
+			*product = USB_PRODUCT_STEELSERIES_SENSEI_RAW;
+		else if (!strcasecmp (optarg, "cod-bo2"))
+			*product = USB_PRODUCT_STEELSERIES_COD_BO2;
+		else
+		{
+			fprintf (stderr, "Error: invalid product: %s\n", optarg);
+			exit (EXIT_FAILURE);
+		}
+		break;
+	case 'r':
+		emu->rate = strtol (optarg, &end, 10);
+		if (!*optarg || *end || emu->rate < 0 || emu->rate > 100000)
+		{
+			fprintf (stderr, "Error: invalid rate: %s\n", optarg);
+			exit (EXIT_FAILURE);
+		}
+		break;
+	case 'R':
+		emu->rom_path = optarg;
+		break;
+	case 'e':
+		emu->cpi_error = strtod (optarg, &end);
+		if (!*optarg || *end || emu->cpi_error <= -100 || emu->cpi_error >= 100)
+		{
+			fprintf (stderr, "Error: invalid CPI error: %s\n", optarg);
+			exit (EXIT_FAILURE);
+		}
+		break;
+	case '?':
+		exit (EXIT_FAILURE);
+	}
+	}
+
+	if (optind < argc)
+	{
+		fprintf (stderr, "Error: extra parameters\n");
+		exit (EXIT_FAILURE);
+	}
+}
+
+int
+main (int argc, char *argv[])
+{
+	struct emu emu = { .fd = -1, .timer = -1 };
+	uint16_t product = USB_PRODUCT_STEELSERIES_SENSEI_RAW;
+	parse_options (argc, argv, &emu, &product);
+
+	emu_set_defaults (&emu);
+	if (emu.rom_path)
+		emu_load_rom (&emu);
+
+	// No SA_RESTART, we want poll() to return
+	struct sigaction sa = { .sa_handler = on_terminate };
+	sigaction (SIGINT, &sa, NULL);
+	sigaction (SIGTERM, &sa, NULL);
+
+	int result, status = EXIT_FAILURE;
+	if ((emu.fd = open ("/dev/uhid", O_RDWR | O_CLOEXEC)) < 0)
+	{
+		fprintf (stderr, "Error: /dev/uhid: %s\n", strerror (errno));
+		goto out;
+	}
+	if ((emu.timer = timerfd_create (CLOCK_MONOTONIC,
+		TFD_NONBLOCK | TFD_CLOEXEC)) < 0
+	 || (result = emu_arm_timer (&emu)))
+	{
+		fprintf (stderr, "Error: timer: %s\n", strerror (errno));
+		goto out;
+	}
+	if ((result = emu_create (&emu, product)))
+	{
+		fprintf (stderr, "Error: couldn't create device: %s\n",
+			strerror (-result));
+		goto out;
+	}
+
+	fprintf (stderr, "Emulating %04x:%04x, press Ctrl-C to quit\n",
+		USB_VENDOR_STEELSERIES, product);
+
+	struct pollfd pfds[2] =
+	{
+		{ .fd = emu.fd,    .events = POLLIN },
+		{ .fd = emu.timer, .events = POLLIN },
+	};
+
+	status = EXIT_SUCCESS;
+	while (!g_terminate)
+	{
+		if (poll (pfds, 2, -1) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			fprintf (stderr, "Error: poll: %s\n", strerror (errno));
+			status = EXIT_FAILURE;
+			break;
+		}
+
+		result = 0;
+		if (pfds[0].revents & POLLIN)
+			result = emu_dispatch (&emu);
+		if (!result && (pfds[1].revents & POLLIN))
+			result = emu_on_timer (&emu);
+		if (result)
+		{
+			fprintf (stderr, "Error: uhid: %s\n", strerror (-result));
+			status = EXIT_FAILURE;
+			break;
+		}
+	}
+
+	fprintf (stderr, "%lu commands processed, %lu motion reports sent,"
+		" %lu timer overruns\n", emu.commands, emu.sequence, emu.overruns);
+
+	struct uhid_event ev = { .type = UHID_DESTROY };
+	emu_write_event (&emu, &ev);
+out:
+	if (emu.timer >= 0)
+		close (emu.timer);
+	if (emu.fd >= 0)
+		close (emu.fd);
+	return status;
+}
@@ -0,0 +1,639 @@
+/*
+ * sensei-raw-ctl-fuse.c: settings of all mice as files
+ *
+ * Mounts a directory with a subdirectory for each mouse, numbered from zero,
+ * containing one file per setting, the raw configuration blob and a "save"
+ * file.  Devices stay open for as long as the filesystem is mounted, and
+ * reads are served from a short-lived cache of the blob, so that scripts
+ * polling the files don't keep the mouse busy.  A value written to a file
+ * is applied as a single SET_REPORT once the file is closed.
+ *
+ * Copyright (c) 2013, Přemysl Janouch <p.janouch@gmail.com>
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#define FUSE_USE_VERSION 31
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <errno.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <fuse.h>
+
+// For the error codes
+#include <libusb.h>
+
+#include "config.h"
+#include "sensei-raw.h"
+
+/** How long a read blob stays valid by default, in milliseconds. */
+#define DEFAULT_CACHE_MS  1000
+/** Values are short, anything longer than this is a mistake. */
+#define VALUE_MAX  32
+
+// --- Files -------------------------------------------------------------------
+
+/** A file in the directory of a device. */
+struct file
+{
+	const char *name;                   ///< File name
+	const char *setting;                ///< Name for sensei_parse_setting()
+	unsigned field;                     ///< SENSEI_FIELD_*, if a setting
+	mode_t mode;                        ///< Permissions
+};
+
+/** The mode can only be set, it's not a part of the blob. */
+static const struct file g_files[] =
+{
+	{ "mode",      "mode",      SENSEI_FIELD_MODE,      0200 },
+	{ "polling",   "polling",   SENSEI_FIELD_POLLING,   0644 },
+	{ "intensity", "intensity", SENSEI_FIELD_INTENSITY, 0644 },
+	{ "pulsation", "pulsation", SENSEI_FIELD_PULSATION, 0644 },
+	{ "cpi_off",   "cpi-off",   SENSEI_FIELD_CPI_OFF,   0644 },
+	{ "cpi_on",    "cpi-on",    SENSEI_FIELD_CPI_ON,    0644 },
+	{ "blob",      NULL,        0,                      0444 },
+	{ "save",      NULL,        0,                      0200 },
+};
+
+#define N_FILES (sizeof g_files / sizeof g_files[0])
+
+/** A mouse, as long as the filesystem is mounted. */
+struct fs_device
+{
+	pthread_mutex_t lock;               ///< Serializes access to the device
+	struct sensei_device *device;       ///< The open device
+	bool detached;                      ///< Whether we've detached a driver
+	bool claimed;                       ///< Whether we've claimed it
+
+	unsigned char blob[SENSEI_BLOB_LENGTH];  ///< Cached configuration
+	double blob_time;                   ///< When it was read, zero if never
+};
+
+struct fs
+{
+	struct sensei_device_info *list;    ///< Devices found at startup
+	struct fs_device *devices;          ///< One for each listed device
+	size_t len;                         ///< Number of devices
+	double cache_ttl;                   ///< How long the cache is valid
+	time_t mounted;                     ///< Timestamp for all files
+};
+
+/** An open file, with whatever is being written to it. */
+struct open_file
+{
+	struct fs_device *device;           ///< Its device
+	const struct file *file;            ///< Which file it is
+	char buf[VALUE_MAX];                ///< The value being written
+	size_t len;                         ///< Length of the value
+	bool dirty;                         ///< Whether anything was written
+};
+
+static double
+now_seconds (void)
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+libusb_to_errno (int error)
+{
+	switch (error)
+	{
+	case LIBUSB_ERROR_ACCESS:         return EACCES;
+	case LIBUSB_ERROR_NO_DEVICE:      return ENODEV;
+	case LIBUSB_ERROR_NOT_FOUND:      return ENOENT;
+	case LIBUSB_ERROR_BUSY:           return EBUSY;
+	case LIBUSB_ERROR_TIMEOUT:        return ETIMEDOUT;
+	case LIBUSB_ERROR_PIPE:           return EPIPE;
+	case LIBUSB_ERROR_INTERRUPTED:    return EINTR;
+	case LIBUSB_ERROR_NO_MEM:         return ENOMEM;
+	case LIBUSB_ERROR_INVALID_PARAM:  return EINVAL;
+	case LIBUSB_ERROR_NOT_SUPPORTED:  return ENOTSUP;
+	default:                          return EIO;
+	}
+}
+
+/** Resolve a path to a device and a file, either of which may be NULL
+ *  for directories. */
+static int
+resolve (struct fs *fs, const char *path,
+	struct fs_device **device, const struct file **file)
+{
+	*device = NULL;
+	*file = NULL;
+	if (!strcmp (path, "/"))
+		return 0;
+
+	char *end;
+	errno = 0;
+	unsigned long index = strtoul (path + 1, &end, 10);
+	if (errno || end == path + 1 || index >= fs->len
+	 || (*end && *end != '/'))
+		return -ENOENT;
+
+	*device = &fs->devices[index];
+	if (!*end || !end[1])
+		return 0;
+
+	for (size_t i = 0; i < N_FILES; i++)
+		if (!strcmp (end + 1, g_files[i].name))
+		{
+			*file = &g_files[i];
+			return 0;
+		}
+	return -ENOENT;
+}
+
+/** Get the configuration, from the device if the cache is too old. */
+static int
+fs_device_load (struct fs *fs, struct fs_device *self)
+{
+	double now = now_seconds ();
+	if (self->blob_time && now - self->blob_time < fs->cache_ttl)
+		return 0;
+
+	int result = sensei_load_blob (self->device, self->blob);
+	self->blob_time = result ? 0 : now;
+	return result;
+}
+
+/** Render the contents of a file, returning its length. */
+static size_t
+render (const struct fs_device *self, const struct file *file,
+	char *buf, size_t buf_len)
+{
+	if (!file->setting)
+	{
+		size_t len = sizeof self->blob < buf_len ? sizeof self->blob : buf_len;
+		memcpy (buf, self->blob, len);
+		return len;
+	}
+
+	struct sensei_config config;
+	sensei_decode_blob (self->blob, &config);
+
+	const char *name = NULL;
+	int len;
+	switch (file->field)
+	{
+	case SENSEI_FIELD_POLLING:
+		name = sensei_polling_name (config.polling);
+		break;
+	case SENSEI_FIELD_INTENSITY:
+		name = sensei_intensity_name (config.intensity);
+		break;
+	case SENSEI_FIELD_PULSATION:
+		name = sensei_pulsation_name (config.pulsation);
+		break;
+	case SENSEI_FIELD_CPI_OFF:
+		len = snprintf (buf, buf_len, "%d\n", config.cpi_off * SENSEI_CPI_STEP);
+		return len < 0 ? 0 : (size_t) len;
+	case SENSEI_FIELD_CPI_ON:
+		len = snprintf (buf, buf_len, "%d\n", config.cpi_on * SENSEI_CPI_STEP);
+		return len < 0 ? 0 : (size_t) len;
+	}
+
+	len = snprintf (buf, buf_len, "%s\n", name ? name : "unknown");
+	return len < 0 ? 0 : (size_t) len;
+}
+
+/** Check whether a field has the same value in both configurations. */
+static bool
+unchanged (const struct sensei_config *a, const struct sensei_config *b,
+	unsigned field)
+{
+	switch (field)
+	{
+	case SENSEI_FIELD_POLLING:    return a->polling   == b->polling;
+	case SENSEI_FIELD_INTENSITY:  return a->intensity == b->intensity;
+	case SENSEI_FIELD_PULSATION:  return a->pulsation == b->pulsation;
+	case SENSEI_FIELD_CPI_OFF:    return a->cpi_off   == b->cpi_off;
+	case SENSEI_FIELD_CPI_ON:     return a->cpi_on    == b->cpi_on;
+	default:                      return false;
+	}
+}
+
+/** Apply what has been written to a file. */
+static int
+apply (struct fs *fs, struct open_file *self)
+{
+	// Whatever echo and printf put around the value doesn't matter
+	char *value = self->buf;
+	self->buf[self->len] = '\0';
+	value += strspn (value, " \t\r\n");
+	value[strcspn (value, " \t\r\n")] = '\0';
+
+	struct sensei_config config = { 0 };
+	unsigned fields = 0;
+	bool save = false;
+	if (self->file->setting)
+	{
+		if (!sensei_parse_setting (self->file->setting, value,
+			&config, &fields))
+			return -EINVAL;
+	}
+	else if (!strcmp (value, "1"))
+		save = true;
+	else
+		return -EINVAL;
+
+	// Don't bother the device with what it already has
+	struct fs_device *device = self->device;
+	if (fields && device->blob_time
+	 && now_seconds () - device->blob_time < fs->cache_ttl)
+	{
+		struct sensei_config current;
+		sensei_decode_blob (device->blob, &current);
+		if (unchanged (&config, &current, fields))
+			return 0;
+	}
+
+	struct sensei_command commands[SENSEI_MAX_COMMANDS];
+	size_t len = sensei_prepare_commands (&config, fields, save, commands),
+		failed;
+	int result = sensei_apply_commands (device->device,
+		PROJECT_NAME "-fuse", commands, len, &failed);
+
+	// Whether it's succeeded or not, the cache can't be trusted anymore
+	device->blob_time = 0;
+	return result ? -libusb_to_errno (result) : 0;
+}
+
+// --- Operations --------------------------------------------------------------
+
+static struct fs *
+get_fs (void)
+{
+	return fuse_get_context ()->private_data;
+}
+
+static int
+fs_getattr (const char *path, struct stat *st, struct fuse_file_info *fi)
+{
+	(void) fi;
+
+	struct fs *fs = get_fs ();
+	struct fs_device *device;
+	const struct file *file;
+	int result = resolve (fs, path, &device, &file);
+	if (result)
+		return result;
+
+	memset (st, 0, sizeof *st);
+	st->st_uid = getuid ();
+	st->st_gid = getgid ();
+	st->st_atime = st->st_mtime = st->st_ctime = fs->mounted;
+	if (!file)
+	{
+		st->st_mode = S_IFDIR | 0755;
+		st->st_nlink = 2;
+		return 0;
+	}
+
+	// Like in sysfs, the size isn't known until the file is read
+	st->st_mode = S_IFREG | file->mode;
+	st->st_nlink = 1;
+	st->st_size = file->setting ? 0 : SENSEI_BLOB_LENGTH;
+	return 0;
+}
+
+static int
+fs_readdir (const char *path, void *buf, fuse_fill_dir_t filler,
+	off_t offset, struct fuse_file_info *fi, enum fuse_readdir_flags flags)
+{
+	(void) offset;
+	(void) fi;
+	(void) flags;
+
+	struct fs *fs = get_fs ();
+	struct fs_device *device;
+	const struct file *file;
+	int result = resolve (fs, path, &device, &file);
+	if (result)
+		return result;
+	if (file)
+		return -ENOTDIR;
+
+	filler (buf, ".", NULL, 0, 0);
+	filler (buf, "..", NULL, 0, 0);
+	if (device)
+		for (size_t i = 0; i < N_FILES; i++)
+			filler (buf, g_files[i].name, NULL, 0, 0);
+	else
+		for (size_t i = 0; i < fs->len; i++)
+		{
+			char name[16];
+			snprintf (name, sizeof name, "%zu", i);
+			filler (buf, name, NULL, 0, 0);
+		}
+	return 0;
+}
+
+static int
+fs_open (const char *path, struct fuse_file_info *fi)
+{
+	struct fs_device *device;
+	const struct file *file;
+	int result = resolve (get_fs (), path, &device, &file);
+	if (result)
+		return result;
+	if (!file)
+		return -EISDIR;
+	if (!device->device)
+		return -ENODEV;
+
+	int access = fi->flags & O_ACCMODE;
+	if ((access != O_WRONLY && !(file->mode & 0400))
+	 || (access != O_RDONLY && !(file->mode & 0200)))
+		return -EACCES;
+
+	struct open_file *self = calloc (1, sizeof *self);
+	if (!self)
+		return -ENOMEM;
+
+	self->device = device;
+	self->file = file;
+	fi->fh = (uintptr_t) self;
+	fi->direct_io = true;
+	return 0;
+}
+
+static int
+fs_read (const char *path, char *buf, size_t size, off_t offset,
+	struct fuse_file_info *fi)
+{
+	(void) path;
+
+	struct open_file *self = (struct open_file *) (uintptr_t) fi->fh;
+	struct fs_device *device = self->device;
+	char contents[SENSEI_BLOB_LENGTH];
+
+	pthread_mutex_lock (&device->lock);
+	int result = fs_device_load (get_fs (), device);
+	size_t len = result ? 0 : render (device, self->file,
+		contents, sizeof contents);
+	pthread_mutex_unlock (&device->lock);
+	if (result)
+		return -libusb_to_errno (result);
+
+	if ((size_t) offset >= len)
+		return 0;
+	if (size > len - offset)
+		size = len - offset;
+	memcpy (buf, contents + offset, size);
+	return size;
+}
+
+static int
+fs_write (const char *path, const char *buf, size_t size, off_t offset,
+	struct fuse_file_info *fi)
+{
+	(void) path;
+
+	// Values arrive in one piece, but don't rely on that
+	struct open_file *self = (struct open_file *) (uintptr_t) fi->fh;
+	if (offset < 0 || (size_t) offset + size >= sizeof self->buf)
+		return -EFBIG;
+
+	memcpy (self->buf + offset, buf, size);
+	if ((size_t) offset + size > self->len)
+		self->len = offset + size;
+	self->dirty = true;
+	return size;
+}
+
+static int
+fs_truncate (const char *path, off_t size, struct fuse_file_info *fi)
+{
+	(void) size;
+	(void) fi;
+
+	// Shells truncate files before writing to them, there's nothing to do
+	struct fs_device *device;
+	const struct file *file;
+	int result = resolve (get_fs (), path, &device, &file);
+	if (result)
+		return result;
+	return file && (file->mode & 0200) ? 0 : -EACCES;
+}
+
+/** Writes are applied as soon as the file gets closed, so that errors
+ *  get reported to the writer. */
+static int
+fs_flush (const char *path, struct fuse_file_info *fi)
+{
+	(void) path;
+
+	struct open_file *self = (struct open_file *) (uintptr_t) fi->fh;
+	if (!self->dirty)
+		return 0;
+
+	pthread_mutex_lock (&self->device->lock);
+	int result = apply (get_fs (), self);
+	pthread_mutex_unlock (&self->device->lock);
+
+	self->dirty = false;
+	self->len = 0;
+	return result;
+}
+
+static int
+fs_release (const char *path, struct fuse_file_info *fi)
+{
+	(void) path;
+	free ((struct open_file *) (uintptr_t) fi->fh);
+	return 0;
+}
+
+/** Open all devices, which is done only after FUSE has daemonized.
+ *  Devices that fail to open stay in the tree to keep the numbering
+ *  stable, their files just can't be opened. */
+static void *
+fs_init (struct fuse_conn_info *conn, struct fuse_config *cfg)
+{
+	(void) conn;
+
+	// Nothing may be cached by the kernel, we're the cache
+	cfg->direct_io = true;
+	cfg->kernel_cache = false;
+	cfg->attr_timeout = 0;
+	cfg->entry_timeout = 0;
+
+	struct fs *fs = get_fs ();
+	for (size_t i = 0; i < fs->len; i++)
+	{
+		const struct sensei_device_info *info = &fs->list[i];
+		struct fs_device *device = &fs->devices[i];
+		pthread_mutex_init (&device->lock, NULL);
+
+		// hidraw leaves the kernel driver alone, so prefer it
+		const char *path = info->hidraw_path;
+		int result = path
+			? sensei_hidraw_open (path, &device->device)
+			: sensei_usbfs_open ((path = info->usb_path), &device->device);
+		if (result)
+		{
+			fprintf (stderr, "Warning: couldn't open %s: %s\n",
+				path, sensei_error_name (result));
+			continue;
+		}
+
+		sensei_use_pacing (device->device);
+		if (!(result = sensei_detach_kernel_driver (device->device)))
+			device->detached = true;
+		if (!result && !(result = sensei_claim_interface (device->device)))
+			device->claimed = true;
+		if (!result)
+			continue;
+
+		fprintf (stderr, "Warning: couldn't set up %s: %s\n",
+			path, sensei_error_name (result));
+		if (device->detached)
+			sensei_attach_kernel_driver (device->device);
+		sensei_close (device->device);
+		device->device = NULL;
+		device->detached = false;
+	}
+	return fs;
+}
+
+static void
+fs_destroy (void *private_data)
+{
+	struct fs *fs = private_data;
+	for (size_t i = 0; i < fs->len; i++)
+	{
+		struct fs_device *device = &fs->devices[i];
+		if (!device->device)
+			continue;
+
+		if (device->claimed)
+			sensei_release_interface (device->device);
+		if (device->detached)
+			sensei_attach_kernel_driver (device->device);
+		sensei_close (device->device);
+		device->device = NULL;
+	}
+}
+
+static const struct fuse_operations g_operations =
+{
+	.getattr  = fs_getattr,
+	.truncate = fs_truncate,
+	.open     = fs_open,
+	.read     = fs_read,
+	.write    = fs_write,
+	.flush    = fs_flush,
+	.release  = fs_release,
+	.readdir  = fs_readdir,
+	.init     = fs_init,
+	.destroy  = fs_destroy,
+};
+
+// --- Main --------------------------------------------------------------------
+
+struct options
+{
+	unsigned cache_ms;                  ///< How long the cache is valid
+	int show_help;                      ///< Whether to show help
+	int show_version;                   ///< Whether to show the version
+};
+
+static const struct fuse_opt g_options[] =
+{
+	{ "--cache-ms=%u", offsetof (struct options, cache_ms),     0 },
+	{ "-h",            offsetof (struct options, show_help),    1 },
+	{ "--help",        offsetof (struct options, show_help),    1 },
+	{ "--version",     offsetof (struct options, show_version), 1 },
+	FUSE_OPT_END
+};
+
+static void
+show_usage (const char *program_name)
+{
+	printf ("Usage: %s [OPTION]... MOUNTPOINT\n", program_name);
+	printf ("Expose SteelSeries Sensei Raw settings as files.\n\n");
+	printf ("  -h, --help      Show this help\n");
+	printf ("  --version       Show program version and exit\n");
+	printf ("  --cache-ms=MS   Read the device at most every MS milliseconds,"
+	                         " %d by default\n", DEFAULT_CACHE_MS);
+	printf ("\nEach mouse gets a directory numbered from zero, with files"
+	        " named after\nthe settings, \"blob\" for raw configuration"
+	        " and \"save\", which saves\nsettings to ROM when 1 is written"
+	        " to it.\n");
+	printf ("\n");
+}
+
+int
+main (int argc, char *argv[])
+{
+	struct fuse_args args = FUSE_ARGS_INIT (argc, argv);
+	struct options options = { .cache_ms = DEFAULT_CACHE_MS };
+	if (fuse_opt_parse (&args, &options, g_options, NULL))
+		return EXIT_FAILURE;
+
+	if (options.show_version)
+	{
+		printf (PROJECT_NAME "-fuse " PROJECT_VERSION "\n");
+		fuse_opt_free_args (&args);
+		return EXIT_SUCCESS;
+	}
+	if (options.show_help)
+	{
+		// Let FUSE describe its own options as well
+		show_usage (argv[0]);
+		fuse_opt_add_arg (&args, "--help");
+		args.argv[0][0] = '\0';
+		int status = fuse_main (args.argc, args.argv, &g_operations, NULL);
+		fuse_opt_free_args (&args);
+		return status;
+	}
+
+	struct fs fs = { .cache_ttl = options.cache_ms / 1e3,
+		.mounted = time (NULL) };
+	int result = sensei_sysfs_list (&fs.list, &fs.len);
+	if (result)
+	{
+		fprintf (stderr, "Error: couldn't list devices: %s\n",
+			sensei_error_name (result));
+		fuse_opt_free_args (&args);
+		return EXIT_FAILURE;
+	}
+	if (!fs.len || !(fs.devices = calloc (fs.len, sizeof *fs.devices)))
+	{
+		fprintf (stderr, "Error: %s\n", fs.len
+			? sensei_error_name (LIBUSB_ERROR_NO_MEM)
+			: "no suitable device found");
+		sensei_free_device_list (fs.list, fs.len);
+		fuse_opt_free_args (&args);
+		return EXIT_FAILURE;
+	}
+
+	int status = fuse_main (args.argc, args.argv, &g_operations, &fs);
+	free (fs.devices);
+	sensei_free_device_list (fs.list, fs.len);
+	fuse_opt_free_args (&args);
+	return status;
+}
@@ -0,0 +1,899 @@
+/*
+ * sensei-raw-ctl-macro.c: timed macro playback bound to mouse buttons
+ *
+ * Grabs an evdev mouse and passes its events on through a uinput device,
+ * except for buttons that have a macro bound to them.  Pressing those plays
+ * a sequence of key and button events instead, with the delays between them
+ * kept to within microseconds.  Macros are compiled into flat arrays of
+ * events ahead of time, and a dedicated thread writes them out, sleeping until
+ * shortly before each group of events is due and spinning for the rest.
+ *
+ * In the normal mode, the Sensei Raw reports its 6th and 7th button and the
+ * CPI button as the 6th, 7th and 8th mouse button, so those can be used.
+ *
+ * Copyright (c) 2013, Přemysl Janouch <p.janouch@gmail.com>
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+
+#include <getopt.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <linux/uinput.h>
+
+#include "config.h"
+
+/** How long before events are due to stop sleeping and start spinning. */
+#define DEFAULT_SPIN_US  100
+/** How many of the latest timing errors to keep for --stats. */
+#define N_ERRORS  65536
+/** How many presses may wait for their macros to be played. */
+#define QUEUE_LEN  16
+/** Longest sleep between checks for termination while waiting for events. */
+#define WAIT_SLICE_NS  100000000
+
+/** Mouse buttons, from BTN_MOUSE on, that can have a macro bound. */
+#define N_BUTTONS  8
+
+static volatile sig_atomic_t g_terminated;
+
+static void
+on_terminate (int signum)
+{
+	(void) signum;
+	g_terminated = true;
+}
+
+static uint64_t
+now_ns (void)
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// --- Key names ---------------------------------------------------------------
+
+#define K(name) { #name, KEY_ ## name }
+#define B(name) { "BTN_" #name, BTN_ ## name }
+
+/** Names of keys as in <linux/input-event-codes.h>, without the prefix. */
+static const struct key_name
+{
+	const char *name;                   ///< Name of the key
+	int code;                           ///< Its code
+}
+g_key_names[] =
+{
+	K(ESC), K(1), K(2), K(3), K(4), K(5), K(6), K(7), K(8), K(9), K(0),
+	K(MINUS), K(EQUAL), K(BACKSPACE), K(TAB), K(Q), K(W), K(E), K(R), K(T),
+	K(Y), K(U), K(I), K(O), K(P), K(LEFTBRACE), K(RIGHTBRACE), K(ENTER),
+	K(LEFTCTRL), K(A), K(S), K(D), K(F), K(G), K(H), K(J), K(K), K(L),
+	K(SEMICOLON), K(APOSTROPHE), K(GRAVE), K(LEFTSHIFT), K(BACKSLASH),
+	K(Z), K(X), K(C), K(V), K(B), K(N), K(M), K(COMMA), K(DOT), K(SLASH),
+	K(RIGHTSHIFT), K(KPASTERISK), K(LEFTALT), K(SPACE), K(CAPSLOCK),
+	K(F1), K(F2), K(F3), K(F4), K(F5), K(F6), K(F7), K(F8), K(F9), K(F10),
+	K(F11), K(F12), K(NUMLOCK), K(SCROLLLOCK), K(KP7), K(KP8), K(KP9),
+	K(KPMINUS), K(KP4), K(KP5), K(KP6), K(KPPLUS), K(KP1), K(KP2), K(KP3),
+	K(KP0), K(KPDOT), K(KPENTER), K(RIGHTCTRL), K(KPSLASH), K(SYSRQ),
+	K(RIGHTALT), K(HOME), K(UP), K(PAGEUP), K(LEFT), K(RIGHT), K(END),
+	K(DOWN), K(PAGEDOWN), K(INSERT), K(DELETE), K(MUTE), K(VOLUMEDOWN),
+	K(VOLUMEUP), K(PAUSE), K(LEFTMETA), K(RIGHTMETA), K(COMPOSE),
+	K(NEXTSONG), K(PLAYPAUSE), K(PREVIOUSSONG), K(STOPCD),
+	B(LEFT), B(RIGHT), B(MIDDLE), B(SIDE), B(EXTRA),
+	B(FORWARD), B(BACK), B(TASK),
+};
+
+#undef K
+#undef B
+
+/** Find a key by its name or number, returning -1 if there's no such key. */
+static int
+key_find (const char *name)
+{
+	for (size_t i = 0; i < sizeof g_key_names / sizeof *g_key_names; i++)
+		if (!strcasecmp (g_key_names[i].name, name))
+			return g_key_names[i].code;
+
+	char *end;
+	unsigned long code = strtoul (name, &end, 0);
+	if (!*name || *end || !code || code >= KEY_CNT)
+		return -1;
+	return code;
+}
+
+// --- Macros ------------------------------------------------------------------
+
+/** Events that are to be written out at once. */
+struct frame
+{
+	uint64_t offset_ns;                 ///< When, from the start of the macro
+	uint32_t first;                     ///< First event, in macro::events
+	uint32_t len;                       ///< Number of events, with the SYN
+};
+
+/** A macro compiled down to what gets written to uinput and when. */
+struct macro
+{
+	struct input_event *events;         ///< All events, frame after frame
+	size_t events_len;                  ///< Number of events
+	size_t events_alloc;                ///< Allocated length of the array
+
+	struct frame *frames;               ///< Frames, in order
+	size_t frames_len;                  ///< Number of frames
+	size_t frames_alloc;                ///< Allocated length of the array
+
+	uint64_t offset_ns;                 ///< Where the compiler is at
+	uint64_t delay_ns;                  ///< Delay between events
+	uint8_t held[KEY_MAX / 8 + 1];      ///< Keys left pressed down
+};
+
+static void
+macro_free (struct macro *self)
+{
+	free (self->events);
+	free (self->frames);
+	memset (self, 0, sizeof *self);
+}
+
+static bool
+macro_reserve (void **array, size_t *alloc, size_t len, size_t size)
+{
+	if (len < *alloc)
+		return true;
+
+	size_t new_alloc = *alloc ? *alloc * 2 : 16;
+	void *new_array = realloc (*array, new_alloc * size);
+	if (!new_array)
+		return false;
+	*array = new_array;
+	*alloc = new_alloc;
+	return true;
+}
+
+/** Append a key event at the current offset, keeping it in the same frame as
+ *  what precedes it, unless that would lose an earlier event of the key.
+ *  Every frame ends with a synchronization event. */
+static bool
+macro_add_key (struct macro *self, int code, bool pressed)
+{
+	struct frame *frame = self->frames_len
+		? &self->frames[self->frames_len - 1] : NULL;
+	bool same_frame = frame && frame->offset_ns == self->offset_ns;
+	for (uint32_t i = 0; same_frame && i + 1 < frame->len; i++)
+		if (self->events[frame->first + i].code == code)
+			same_frame = false;
+
+	if (!macro_reserve ((void **) &self->events, &self->events_alloc,
+		self->events_len + 1, sizeof *self->events))
+		return false;
+	if (same_frame)
+	{
+		self->events_len--;
+		frame->len--;
+	}
+	else
+	{
+		if (!macro_reserve ((void **) &self->frames, &self->frames_alloc,
+			self->frames_len, sizeof *self->frames))
+			return false;
+		frame = &self->frames[self->frames_len++];
+		*frame = (struct frame) { self->offset_ns, self->events_len, 0 };
+	}
+
+	self->events[self->events_len++] = (struct input_event)
+		{ .type = EV_KEY, .code = code, .value = pressed };
+	self->events[self->events_len++] = (struct input_event)
+		{ .type = EV_SYN, .code = SYN_REPORT };
+	frame->len += 2;
+
+	if (pressed)
+		self->held[code / 8] |= 1 << code % 8;
+	else
+		self->held[code / 8] &= ~(1 << code % 8);
+	self->offset_ns += self->delay_ns;
+	return true;
+}
+
+/** All macros, by mouse button. */
+struct macros
+{
+	struct macro buttons[N_BUTTONS];    ///< Macros, empty if unbound
+	uint8_t keys[KEY_MAX / 8 + 1];      ///< Keys used by any of them
+};
+
+static void
+macros_free (struct macros *self)
+{
+	for (int i = 0; i < N_BUTTONS; i++)
+		macro_free (&self->buttons[i]);
+}
+
+static bool
+parse_delay (const char *s, uint64_t *ns)
+{
+	char *end;
+	double ms = strtod (s, &end);
+	if (!*s || *end || ms < 0 || ms > 3600e3)
+		return false;
+	*ns = ms * 1e6 + .5;
+	return true;
+}
+
+/** Process a statement of a macro definition file. */
+static const char *
+macros_parse_line (struct macros *self, struct macro **current, char *line)
+{
+	char *words[3] = { NULL };
+	size_t n = 0;
+	for (char *save = NULL, *word = strtok_r (line, " \t\r\n", &save);
+		word && *word != '#'; word = strtok_r (NULL, " \t\r\n", &save))
+		if (n < 3)
+			words[n++] = word;
+		else
+			return "too many arguments";
+	if (!n)
+		return NULL;
+
+	if (*words[0] == '[')
+	{
+		char *end;
+		unsigned long button = strtoul (words[0] + 1, &end, 10);
+		if (n != 1 || strcmp (end, "]") || button < 1 || button > N_BUTTONS)
+			return "expected a button number from 1 to 8 in brackets";
+		*current = &self->buttons[button - 1];
+		if ((*current)->frames_len)
+			return "the button already has a macro";
+		return NULL;
+	}
+
+	struct macro *m = *current;
+	if (!m)
+		return "statements must follow a button";
+	if (n != 2)
+		return "expected a single argument";
+
+	uint64_t ns;
+	if (!strcasecmp (words[0], "wait"))
+	{
+		if (!parse_delay (words[1], &ns))
+			return "invalid number of milliseconds";
+		m->offset_ns += ns;
+		return NULL;
+	}
+	if (!strcasecmp (words[0], "delay"))
+	{
+		if (!parse_delay (words[1], &ns))
+			return "invalid number of milliseconds";
+		m->delay_ns = ns;
+		return NULL;
+	}
+
+	int code = key_find (words[1]);
+	if (code < 0)
+		return "unknown key";
+	self->keys[code / 8] |= 1 << code % 8;
+
+	bool ok;
+	if (!strcasecmp (words[0], "down"))
+		ok = macro_add_key (m, code, true);
+	else if (!strcasecmp (words[0], "up"))
+		ok = macro_add_key (m, code, false);
+	else if (!strcasecmp (words[0], "tap"))
+		ok = macro_add_key (m, code, true) && macro_add_key (m, code, false);
+	else
+		return "unknown statement";
+	return ok ? NULL : strerror (errno);
+}
+
+/** Load and compile macro definitions, printing any errors. */
+static bool
+macros_load (struct macros *self, const char *path)
+{
+	FILE *fp = fopen (path, "r");
+	if (!fp)
+	{
+		fprintf (stderr, "Error: %s: %s\n", path, strerror (errno));
+		return false;
+	}
+
+	struct macro *current = NULL;
+	const char *error = NULL;
+	char line[512];
+	unsigned line_no = 0;
+	while (!error && fgets (line, sizeof line, fp))
+	{
+		line_no++;
+		error = macros_parse_line (self, &current, line);
+	}
+	if (!error && ferror (fp))
+		error = strerror (errno);
+	fclose (fp);
+	if (error)
+	{
+		fprintf (stderr, "Error: %s:%u: %s\n", path, line_no, error);
+		return false;
+	}
+
+	// Keys would stay pressed until the next macro releases them
+	for (int i = 0; i < N_BUTTONS; i++)
+		for (size_t k = 0; k < sizeof self->buttons[i].held; k++)
+			if (self->buttons[i].held[k])
+			{
+				fprintf (stderr, "Error: %s: the macro of button %d"
+					" leaves keys pressed down\n", path, i + 1);
+				return false;
+			}
+	return true;
+}
+
+// --- Playback ----------------------------------------------------------------
+
+struct player
+{
+	const struct macros *macros;        ///< What to play
+	int fd;                             ///< uinput device, or -1
+	uint64_t spin_ns;                   ///< How long to spin before events
+	bool realtime;                      ///< Whether to ask for SCHED_FIFO
+
+	pthread_t thread;                   ///< The playback thread
+	pthread_mutex_t mutex;              ///< Protects the queue
+	pthread_cond_t cond;                ///< Signals changes to the queue
+	uint8_t queue[QUEUE_LEN];           ///< Buttons whose macros to play
+	size_t queue_head;                  ///< Where the next one is
+	size_t queue_len;                   ///< How many are waiting
+	bool quit;                          ///< The thread should finish
+
+	uint64_t *errors_ns;                ///< Latest timing errors
+	size_t errors_len;                  ///< How many have been recorded
+	unsigned long dropped;              ///< Presses that didn't fit
+};
+
+/** Queue up the macro of a button, not waiting for anything. */
+static void
+player_trigger (struct player *self, unsigned button)
+{
+	pthread_mutex_lock (&self->mutex);
+	if (self->queue_len == QUEUE_LEN)
+		self->dropped++;
+	else
+	{
+		self->queue[(self->queue_head + self->queue_len++) % QUEUE_LEN]
+			= button;
+		pthread_cond_signal (&self->cond);
+	}
+	pthread_mutex_unlock (&self->mutex);
+}
+
+/** Sleep until shortly before the deadline, then spin the rest of the way.
+ *  Returns false if termination has been requested in the meantime. */
+static bool
+wait_until (uint64_t deadline_ns, uint64_t spin_ns)
+{
+	// The signal is usually handled by another thread and doesn't interrupt
+	// our sleep, so long delays are slept through in slices
+	uint64_t now;
+	while (!g_terminated && (now = now_ns ()) + spin_ns < deadline_ns)
+	{
+		uint64_t wake_ns = deadline_ns - spin_ns;
+		if (wake_ns - now > WAIT_SLICE_NS)
+			wake_ns = now + WAIT_SLICE_NS;
+		struct timespec ts = { wake_ns / 1000000000, wake_ns % 1000000000 };
+		clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+	}
+	while (!g_terminated && now_ns () < deadline_ns)
+		;
+	return !g_terminated;
+}
+
+static bool
+player_play (struct player *self, const struct macro *macro)
+{
+	uint64_t start_ns = now_ns ();
+	for (size_t i = 0; i < macro->frames_len; i++)
+	{
+		const struct frame *frame = &macro->frames[i];
+		uint64_t deadline_ns = start_ns + frame->offset_ns;
+		if (!wait_until (deadline_ns, self->spin_ns))
+			break;
+
+		uint64_t sent_ns = now_ns ();
+		if (self->fd >= 0 && write (self->fd, macro->events + frame->first,
+			frame->len * sizeof *macro->events) < 0)
+			return false;
+		if (self->errors_ns)
+			self->errors_ns[self->errors_len++ % N_ERRORS] =
+				sent_ns - deadline_ns;
+	}
+	return true;
+}
+
+static void *
+player_run (void *user_data)
+{
+	struct player *self = user_data;
+
+	// Sleeps would otherwise be rounded up by the default 50 us of slack
+	prctl (PR_SET_TIMERSLACK, 1UL, 0UL, 0UL, 0UL);
+	if (self->realtime)
+	{
+		struct sched_param param =
+			{ .sched_priority = sched_get_priority_min (SCHED_FIFO) + 10 };
+		int err = pthread_setschedparam (pthread_self (), SCHED_FIFO, &param);
+		if (err)
+			fprintf (stderr, "Warning: SCHED_FIFO: %s\n", strerror (err));
+	}
+
+	pthread_mutex_lock (&self->mutex);
+	while (true)
+	{
+		while (!self->queue_len && !self->quit)
+			pthread_cond_wait (&self->cond, &self->mutex);
+		if (!self->queue_len)
+			break;
+
+		unsigned button = self->queue[self->queue_head];
+		self->queue_head = (self->queue_head + 1) % QUEUE_LEN;
+		self->queue_len--;
+		pthread_mutex_unlock (&self->mutex);
+
+		if (!player_play (self, &self->macros->buttons[button]))
+			fprintf (stderr, "Warning: writing events failed: %s\n",
+				strerror (errno));
+
+		pthread_mutex_lock (&self->mutex);
+	}
+	pthread_mutex_unlock (&self->mutex);
+	return NULL;
+}
+
+static bool
+player_start (struct player *self)
+{
+	pthread_mutex_init (&self->mutex, NULL);
+	pthread_cond_init (&self->cond, NULL);
+	int err = pthread_create (&self->thread, NULL, player_run, self);
+	if (err)
+	{
+		pthread_mutex_destroy (&self->mutex);
+		pthread_cond_destroy (&self->cond);
+		errno = err;
+		return false;
+	}
+	return true;
+}
+
+/** Let queued up macros finish and stop the thread.  Upon termination,
+ *  the one being played is cut short, as are those that remain. */
+static void
+player_stop (struct player *self)
+{
+	pthread_mutex_lock (&self->mutex);
+	self->quit = true;
+	pthread_cond_signal (&self->cond);
+	pthread_mutex_unlock (&self->mutex);
+
+	pthread_join (self->thread, NULL);
+	pthread_mutex_destroy (&self->mutex);
+	pthread_cond_destroy (&self->cond);
+}
+
+static int
+compare_u64 (const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+	return (x > y) - (x < y);
+}
+
+static double
+percentile_us (const uint64_t *sorted_ns, size_t len, double p)
+{
+	size_t i = p * (len - 1) + 0.5;
+	return sorted_ns[i] / 1e3;
+}
+
+static void
+player_print_stats (struct player *self)
+{
+	size_t len = self->errors_len < N_ERRORS ? self->errors_len : N_ERRORS;
+	if (self->dropped)
+		fprintf (stderr, "%lu presses dropped, the queue was full\n",
+			self->dropped);
+	if (!len)
+		return;
+
+	uint64_t *e = self->errors_ns;
+	qsort (e, len, sizeof *e, compare_u64);
+	fprintf (stderr, "timing error [us]: p50 %.1f, p99 %.1f, max %.1f"
+		" over the last %zu frames\n", percentile_us (e, len, .5),
+		percentile_us (e, len, .99), e[len - 1] / 1e3, len);
+}
+
+// --- uinput ------------------------------------------------------------------
+
+/** Copy the capabilities of an evdev device we're interested in,
+ *  with @a extra bits on top. */
+static bool
+uinput_copy_bits (int source, int fd, int type, int request, size_t count,
+	const uint8_t *extra)
+{
+	uint8_t bits[KEY_MAX / 8 + 1] = { 0 };
+	if (source >= 0 && ioctl (source, EVIOCGBIT (type, sizeof bits), bits) < 0)
+		return false;
+
+	bool any = false;
+	for (size_t i = 0; i < count; i++)
+	{
+		if (!((bits[i / 8] | (extra ? extra[i / 8] : 0)) >> i % 8 & 1))
+			continue;
+		if ((!any && ioctl (fd, UI_SET_EVBIT, type))
+		 || ioctl (fd, request, (int) i))
+			return false;
+		any = true;
+	}
+	return true;
+}
+
+/** Create a device that looks like the source, save for the bus, and that
+ *  can also send all the keys used by macros. */
+static int
+uinput_clone (int source, const uint8_t *keys)
+{
+	int fd = open ("/dev/uinput", O_WRONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	struct uinput_setup setup = { .id = { .bustype = BUS_VIRTUAL } };
+	char name[UINPUT_MAX_NAME_SIZE] = "";
+	if (source >= 0)
+	{
+		ioctl (source, EVIOCGNAME (sizeof name), name);
+		ioctl (source, EVIOCGID, &setup.id);
+		setup.id.bustype = BUS_VIRTUAL;
+	}
+	snprintf (setup.name, sizeof setup.name, "%.63s (macros)", name);
+
+	if (!uinput_copy_bits (source, fd, EV_KEY, UI_SET_KEYBIT, KEY_CNT, keys)
+	 || !uinput_copy_bits (source, fd, EV_REL, UI_SET_RELBIT, REL_CNT, NULL)
+	 || !uinput_copy_bits (source, fd, EV_MSC, UI_SET_MSCBIT, MSC_CNT, NULL)
+	 || ioctl (fd, UI_DEV_SETUP, &setup) || ioctl (fd, UI_DEV_CREATE))
+	{
+		int err = errno;
+		close (fd);
+		errno = err;
+		return -1;
+	}
+	return fd;
+}
+
+// --- Forwarding --------------------------------------------------------------
+
+struct forwarder
+{
+	int source;                         ///< The grabbed evdev device
+	int sink;                           ///< Our uinput device
+	const struct macros *macros;        ///< Which buttons are bound
+	struct player *player;              ///< Who plays the macros
+
+	struct input_event out[64];         ///< Events of the current frame
+	size_t out_len;                     ///< Number of them
+	bool out_useful;                    ///< The frame isn't just noise
+	bool dropped;                       ///< Events have been lost
+	uint16_t held;                      ///< Bound buttons pressed down
+};
+
+static void
+forwarder_emit (struct forwarder *self, const struct input_event *event)
+{
+	if (self->out_len < sizeof self->out / sizeof *self->out - 1)
+		self->out[self->out_len++] = *event;
+	if (event->type != EV_MSC)
+		self->out_useful = true;
+}
+
+/** End the frame, writing it out unless we've taken everything out of it. */
+static bool
+forwarder_flush (struct forwarder *self)
+{
+	bool ok = true;
+	if (self->out_useful)
+	{
+		self->out[self->out_len++] = (struct input_event)
+			{ .type = EV_SYN, .code = SYN_REPORT };
+		ok = write (self->sink, self->out,
+			self->out_len * sizeof *self->out) >= 0;
+	}
+	self->out_len = 0;
+	self->out_useful = false;
+	return ok;
+}
+
+static void
+forwarder_button (struct forwarder *self, unsigned button, bool pressed)
+{
+	if (pressed && !(self->held & 1 << button))
+		player_trigger (self->player, button);
+	if (pressed)
+		self->held |= 1 << button;
+	else
+		self->held &= ~(1 << button);
+}
+
+/** After losing events, catch up with the real state of bound buttons. */
+static void
+forwarder_resync (struct forwarder *self)
+{
+	uint8_t keys[KEY_MAX / 8 + 1] = { 0 };
+	if (ioctl (self->source, EVIOCGKEY (sizeof keys), keys) < 0)
+		return;
+
+	for (unsigned i = 0; i < N_BUTTONS; i++)
+		if (self->macros->buttons[i].frames_len)
+			forwarder_button (self, i,
+				keys[(BTN_MOUSE + i) / 8] >> (BTN_MOUSE + i) % 8 & 1);
+}
+
+static bool
+forwarder_process (struct forwarder *self, const struct input_event *event)
+{
+	if (event->type == EV_SYN && event->code == SYN_DROPPED)
+		self->dropped = true;
+	else if (self->dropped)
+	{
+		// Skip the rest of the frame, it's incomplete
+		if (event->type == EV_SYN && event->code == SYN_REPORT)
+		{
+			self->dropped = false;
+			forwarder_resync (self);
+		}
+	}
+	else if (event->type == EV_SYN && event->code == SYN_REPORT)
+		return forwarder_flush (self);
+	else if (event->type == EV_KEY && event->code >= BTN_MOUSE
+		&& event->code < BTN_MOUSE + N_BUTTONS && event->value != 2
+		&& self->macros->buttons[event->code - BTN_MOUSE].frames_len)
+		forwarder_button (self, event->code - BTN_MOUSE, event->value);
+	else if (event->type != EV_SYN)
+		forwarder_emit (self, event);
+	return true;
+}
+
+static bool
+forwarder_run (struct forwarder *self)
+{
+	struct pollfd pfd = { .fd = self->source, .events = POLLIN };
+	while (!g_terminated)
+	{
+		int ready = poll (&pfd, 1, -1);
+		if (ready < 0 && errno != EINTR)
+			return false;
+		if (ready <= 0)
+			continue;
+
+		struct input_event events[64];
+		ssize_t len = read (self->source, events, sizeof events);
+		if (len < 0 && (errno == EAGAIN || errno == EINTR))
+			continue;
+		if (len <= 0)
+			return false;
+		for (size_t i = 0; i < len / sizeof *events; i++)
+			if (!forwarder_process (self, &events[i]))
+				return false;
+	}
+	return true;
+}
+
+// --- Main --------------------------------------------------------------------
+
+static void
+show_usage (const char *program_name)
+{
+	printf ("Usage: %s [OPTION]... MACROS DEVICE\n"
+	        "       %s --play BUTTON [OPTION]... MACROS\n",
+		program_name, program_name);
+	printf ("Play macros bound to mouse buttons.\n\n");
+	printf ("  -h, --help      Show this help\n");
+	printf ("  --version       Show program version and exit\n");
+	printf ("  --play BUTTON   Play the macro of BUTTON once and exit\n");
+	printf ("  --dry-run       With --play, only measure timing\n");
+	printf ("  --spin-us US    Spin for the last US microseconds before"
+	                         " events,\n"
+	        "                  %d by default\n", DEFAULT_SPIN_US);
+	printf ("  --realtime      Lock memory and play with SCHED_FIFO\n");
+	printf ("  --stats         Print timing statistics when done\n");
+	printf ("\nMACROS is a file with lines like `[6]', which starts"
+	        " the macro of a button,\n"
+	        "`down KEY', `up KEY', `tap KEY', `wait MS' and `delay MS'."
+	        "  KEY is named\n"
+	        "like in <linux/input-event-codes.h>, without the KEY_ prefix,"
+	        " or a number.\n"
+	        "DEVICE is an evdev node, such as one in /dev/input/by-id.\n");
+	printf ("\n");
+}
+
+#define ERROR(label, ...)                         \
+	do {                                          \
+		fprintf (stderr, "Error: " __VA_ARGS__);  \
+		status = 1;                               \
+		goto label;                               \
+	} while (0)
+
+int
+main (int argc, char *argv[])
+{
+	static struct option long_opts[] =
+	{
+		{ "help",      no_argument,       0, 'h' },
+		{ "version",   no_argument,       0, 'V' },
+		{ "play",      required_argument, 0, 'p' },
+		{ "dry-run",   no_argument,       0, 'n' },
+		{ "spin-us",   required_argument, 0, 'S' },
+		{ "realtime",  no_argument,       0, 'r' },
+		{ "stats",     no_argument,       0, 's' },
+		{ 0,           0,                 0,  0  }
+	};
+
+	struct player player = { .fd = -1, .spin_ns = DEFAULT_SPIN_US * 1000 };
+	unsigned long play = 0, spin_us;
+	bool dry_run = false, stats = false;
+	char *end;
+	int c;
+	while ((c = getopt_long (argc, argv, "h", long_opts, NULL)) != -1)
+	{
+	switch (c)
+	{
+	case 'h':
+		show_usage (argv[0]);
+		return EXIT_SUCCESS;
+	case 'V':
+		printf (PROJECT_NAME "-macro " PROJECT_VERSION "\n");
+		return EXIT_SUCCESS;
+	case 'p':
+		play = strtoul (optarg, &end, 10);
+		if (!*optarg || *end || play < 1 || play > N_BUTTONS)
+		{
+			fprintf (stderr, "Error: invalid button: %s\n", optarg);
+			return EXIT_FAILURE;
+		}
+		break;
+	case 'n':
+		dry_run = true;
+		break;
+	case 'S':
+		spin_us = strtoul (optarg, &end, 10);
+		if (!*optarg || *end || spin_us > 1000000)
+		{
+			fprintf (stderr, "Error: invalid spin time: %s\n", optarg);
+			return EXIT_FAILURE;
+		}
+		player.spin_ns = spin_us * 1000;
+		break;
+	case 'r':
+		player.realtime = true;
+		break;
+	case 's':
+		stats = true;
+		break;
+	default:
+		return EXIT_FAILURE;
+	}
+	}
+
+	if (argc - optind != (play ? 1 : 2) || (dry_run && !play))
+	{
+		show_usage (argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	int status = 0;
+	struct macros macros;
+	memset (&macros, 0, sizeof macros);
+	if (!macros_load (&macros, argv[optind]))
+	{
+		status = 1;
+		goto error_macros;
+	}
+	if (play && !macros.buttons[play - 1].frames_len)
+		ERROR (error_macros, "button %lu has no macro\n", play);
+
+	player.macros = &macros;
+	if ((stats || play) && !(player.errors_ns =
+		calloc (N_ERRORS, sizeof *player.errors_ns)))
+		ERROR (error_macros, "%s\n", strerror (errno));
+	if (player.realtime && mlockall (MCL_CURRENT | MCL_FUTURE))
+		fprintf (stderr, "Warning: mlockall: %s\n", strerror (errno));
+
+	struct sigaction sa = { .sa_handler = on_terminate };
+	sigemptyset (&sa.sa_mask);
+	sigaction (SIGINT, &sa, NULL);
+	sigaction (SIGTERM, &sa, NULL);
+
+	if (play)
+	{
+		if (!dry_run && (player.fd = uinput_clone (-1, macros.keys)) < 0)
+			ERROR (error_errors, "/dev/uinput: %s\n", strerror (errno));
+		if (!player_start (&player))
+			ERROR (error_play, "%s\n", strerror (errno));
+
+		// Let whoever listens to new input devices open ours
+		if (player.fd >= 0)
+			usleep (500 * 1000);
+		player_trigger (&player, play - 1);
+		player_stop (&player);
+		player_print_stats (&player);
+	error_play:
+		if (player.fd >= 0)
+		{
+			ioctl (player.fd, UI_DEV_DESTROY);
+			close (player.fd);
+		}
+		goto error_errors;
+	}
+
+	const char *path = argv[optind + 1];
+	struct forwarder forwarder =
+		{ .macros = &macros, .player = &player, .sink = -1 };
+	if ((forwarder.source =
+		open (path, O_RDONLY | O_NONBLOCK | O_CLOEXEC)) < 0)
+		ERROR (error_errors, "%s: %s\n", path, strerror (errno));
+	if ((forwarder.sink = uinput_clone (forwarder.source, macros.keys)) < 0)
+		ERROR (error_source, "/dev/uinput: %s\n", strerror (errno));
+	if (ioctl (forwarder.source, EVIOCGRAB, 1))
+		ERROR (error_sink, "%s: cannot grab: %s\n", path, strerror (errno));
+
+	player.fd = forwarder.sink;
+	if (!player_start (&player))
+		ERROR (error_grab, "%s\n", strerror (errno));
+	if (!forwarder_run (&forwarder))
+	{
+		fprintf (stderr, "Error: %s: %s\n", path, strerror (errno));
+		status = 1;
+	}
+	player_stop (&player);
+	if (stats)
+		player_print_stats (&player);
+
+error_grab:
+	ioctl (forwarder.source, EVIOCGRAB, 0);
+error_sink:
+	ioctl (forwarder.sink, UI_DEV_DESTROY);
+	close (forwarder.sink);
+error_source:
+	close (forwarder.source);
+error_errors:
+	free (player.errors_ns);
+error_macros:
+	macros_free (&macros);
+	return status;
+}
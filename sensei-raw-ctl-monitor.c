@@ -0,0 +1,508 @@
+/*
+ * sensei-raw-ctl-monitor.c: live protocol monitor
+ *
+ * Reads USB traffic of a mouse from usbmon through its memory-mapped binary
+ * interface and decodes commands and GET_REPORT blobs as described in NOTES.
+ * Motion reports are only counted, there are up to a thousand of them every
+ * second.  The usbmon module needs to be loaded and /dev/usbmonN readable.
+ *
+ * Copyright (c) 2013, Přemysl Janouch <p.janouch@gmail.com>
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+
+#include <getopt.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include "config.h"
+#include "sensei-raw.h"
+
+// --- usbmon ------------------------------------------------------------------
+
+// The binary interface isn't exported to userspace headers,
+// see Documentation/usb/usbmon.rst in the kernel sources
+
+/** Event header, followed by captured data. */
+struct usbmon_packet
+{
+	uint64_t id;                        ///< URB ID, for matching completions
+	unsigned char type;                 ///< 'S'ubmission, 'C'allback, 'E'rror
+	unsigned char xfer_type;            ///< ISO, interrupt, control, bulk
+	unsigned char epnum;                ///< Endpoint number, 0x80 for IN
+	unsigned char devnum;               ///< Device address
+	uint16_t busnum;                    ///< Bus number
+	char flag_setup;                    ///< Zero if setup is present
+	char flag_data;                     ///< Zero if data is present
+	int64_t ts_sec;                     ///< Wall clock time
+	int32_t ts_usec;                    ///< Wall clock time
+	int32_t status;                     ///< Negative errno on failure
+	uint32_t length;                    ///< Length of the data
+	uint32_t len_cap;                   ///< Length of the captured data
+	unsigned char setup[8];             ///< Control setup packet
+	int32_t interval;                   ///< Interrupt and ISO only
+	int32_t start_frame;                ///< ISO only
+	uint32_t xfer_flags;                ///< URB transfer flags
+	uint32_t ndesc;                     ///< ISO only
+};
+
+struct usbmon_mfetch
+{
+	uint32_t *offvec;                   ///< Offsets of fetched events
+	uint32_t nfetch;                    ///< Events to fetch, or fetched
+	uint32_t nflush;                    ///< Events to release first
+};
+
+struct usbmon_stats
+{
+	uint32_t queued;                    ///< Events in the ring
+	uint32_t dropped;                   ///< Events lost since last time
+};
+
+#define MON_IOC_MAGIC       0x92
+#define MON_IOCG_STATS      _IOR (MON_IOC_MAGIC, 3, struct usbmon_stats)
+#define MON_IOCT_RING_SIZE  _IO (MON_IOC_MAGIC, 4)
+#define MON_IOCQ_RING_SIZE  _IO (MON_IOC_MAGIC, 5)
+#define MON_IOCX_MFETCH     _IOWR (MON_IOC_MAGIC, 7, struct usbmon_mfetch)
+
+#define USBMON_XFER_INTERRUPT  1
+#define USBMON_XFER_CONTROL    2
+
+/** Padding at the end of the ring, to be skipped. */
+#define USBMON_FILLER  '@'
+
+/** A generous ring, so that bursts of motion don't push anything out. */
+#define RING_SIZE  (1 << 20)
+/** How many events to fetch at once. */
+#define FETCH_BATCH  256
+/** How many control transfers can be in flight. */
+#define MAX_PENDING  16
+
+// --- Decoding ----------------------------------------------------------------
+
+/** Describe an Output report. */
+static void
+describe_command (const unsigned char *data, size_t len,
+	char *buf, size_t buf_len)
+{
+	const char *name;
+	if (len < 3)
+	{
+		snprintf (buf, buf_len, "short command");
+		return;
+	}
+
+	switch (data[0])
+	{
+	case SENSEI_CMD_MODE:
+		name = sensei_mode_name (data[2]);
+		snprintf (buf, buf_len, "mode %s", name ? name : "?");
+		break;
+	case SENSEI_CMD_CPI:
+		snprintf (buf, buf_len, "CPI with the LED %s %d",
+			data[1] == 0x02 ? "on" : "off", data[2] * SENSEI_CPI_STEP);
+		break;
+	case SENSEI_CMD_POLLING:
+		name = sensei_polling_name (data[2]);
+		snprintf (buf, buf_len, "polling %s Hz", name ? name : "?");
+		break;
+	case SENSEI_CMD_INTENSITY:
+		name = sensei_intensity_name (data[2]);
+		snprintf (buf, buf_len, "intensity %s", name ? name : "?");
+		break;
+	case SENSEI_CMD_PULSATION:
+		name = sensei_pulsation_name (data[2]);
+		snprintf (buf, buf_len, "pulsation %s", name ? name : "?");
+		break;
+	case SENSEI_CMD_SAVE:
+		snprintf (buf, buf_len, "save to ROM");
+		break;
+	default:
+		snprintf (buf, buf_len, "unknown command %02x %02x %02x",
+			data[0], data[1], data[2]);
+	}
+}
+
+/** Describe the settings within a GET_REPORT blob. */
+static void
+describe_blob (const unsigned char *data, size_t len,
+	char *buf, size_t buf_len)
+{
+	if (len < SENSEI_BLOB_LENGTH)
+	{
+		snprintf (buf, buf_len, "short blob of %zu bytes", len);
+		return;
+	}
+
+	struct sensei_config config;
+	sensei_decode_blob (data, &config);
+	const char *intensity = sensei_intensity_name (config.intensity),
+		*pulsation = sensei_pulsation_name (config.pulsation),
+		*polling = sensei_polling_name (config.polling);
+	snprintf (buf, buf_len, "intensity %s, pulsation %s, CPI %d/%d,"
+		" polling %s Hz", intensity ? intensity : "?",
+		pulsation ? pulsation : "?", config.cpi_off * SENSEI_CPI_STEP,
+		config.cpi_on * SENSEI_CPI_STEP, polling ? polling : "?");
+}
+
+// --- Monitor -----------------------------------------------------------------
+
+/** A control transfer waiting for its completion. */
+struct pending
+{
+	uint64_t id;                        ///< URB ID, zero if unused
+	double submitted;                   ///< When it was submitted, in seconds
+	unsigned char setup[8];             ///< The setup packet
+	unsigned char data[SENSEI_COMMAND_LENGTH];  ///< Output data, if any
+	size_t data_len;                    ///< Length of the data
+};
+
+struct monitor
+{
+	unsigned bus;                       ///< Bus number to filter by
+	unsigned address;                   ///< Device address to filter by
+	bool verbose;                       ///< Print unknown transfers as well
+
+	struct pending pending[MAX_PENDING];  ///< Control transfers in flight
+	unsigned long events;               ///< Events of our device
+	unsigned long motion;               ///< Interrupt IN completions
+	unsigned long motion_in_second;     ///< Those within the current second
+	int64_t motion_second;              ///< Second being counted
+	unsigned long dropped;              ///< Events lost by usbmon
+	unsigned long untracked;            ///< Control transfers without a slot
+};
+
+static double
+packet_time (const struct usbmon_packet *packet)
+{
+	return packet->ts_sec + packet->ts_usec / 1e6;
+}
+
+static void
+print_event (const struct usbmon_packet *packet, const char *kind,
+	const char *description, double latency)
+{
+	time_t sec = packet->ts_sec;
+	struct tm tm;
+	char stamp[16];
+	strftime (stamp, sizeof stamp, "%H:%M:%S", localtime_r (&sec, &tm));
+
+	printf ("%s.%06d  %-10s  %s", stamp, (int) packet->ts_usec,
+		kind, description);
+	if (latency >= 0)
+		printf ("  (%.3f ms)", latency * 1e3);
+	if (packet->status)
+		printf ("  failed: %s", strerror (-packet->status));
+	printf ("\n");
+}
+
+static void
+on_submission (struct monitor *self, const struct usbmon_packet *packet,
+	const unsigned char *data)
+{
+	struct pending *slot = NULL;
+	for (size_t i = 0; !slot && i < MAX_PENDING; i++)
+		if (!self->pending[i].id)
+			slot = &self->pending[i];
+
+	if (packet->flag_setup)
+		return;
+
+	// Whatever doesn't fit is going to be printed without a latency
+	if (!slot)
+	{
+		self->untracked++;
+		return;
+	}
+
+	slot->id = packet->id;
+	slot->submitted = packet_time (packet);
+	memcpy (slot->setup, packet->setup, sizeof slot->setup);
+	slot->data_len = 0;
+	if (!packet->flag_data)
+	{
+		slot->data_len = packet->len_cap < sizeof slot->data
+			? packet->len_cap : sizeof slot->data;
+		memcpy (slot->data, data, slot->data_len);
+	}
+}
+
+static void
+on_completion (struct monitor *self, const struct usbmon_packet *packet,
+	const unsigned char *data)
+{
+	struct pending *slot = NULL;
+	for (size_t i = 0; !slot && i < MAX_PENDING; i++)
+		if (self->pending[i].id == packet->id)
+			slot = &self->pending[i];
+
+	// Without the setup packet, there's nothing to decode it by
+	char description[128];
+	if (!slot)
+	{
+		snprintf (description, sizeof description,
+			"untracked completion, %u bytes", (unsigned) packet->length);
+		print_event (packet, "control", description, -1);
+		return;
+	}
+
+	slot->id = 0;
+	double latency = packet_time (packet) - slot->submitted;
+	uint8_t request_type = slot->setup[0], request = slot->setup[1];
+	if (request_type == 0x21 && request == USB_SET_REPORT)
+	{
+		describe_command (slot->data, slot->data_len,
+			description, sizeof description);
+		print_event (packet, "SET_REPORT", description, latency);
+	}
+	else if (request_type == 0xa1 && request == USB_GET_REPORT)
+	{
+		describe_blob (data, packet->flag_data ? 0 : packet->len_cap,
+			description, sizeof description);
+		print_event (packet, "GET_REPORT", description, latency);
+	}
+	else if (self->verbose)
+	{
+		snprintf (description, sizeof description,
+			"bmRequestType %02x bRequest %02x", request_type, request);
+		print_event (packet, "control", description, latency);
+	}
+}
+
+static void
+on_motion (struct monitor *self, const struct usbmon_packet *packet)
+{
+	if (packet->ts_sec != self->motion_second)
+	{
+		if (self->verbose && self->motion_second)
+		{
+			char description[64];
+			snprintf (description, sizeof description, "%lu reports/s",
+				self->motion_in_second);
+			print_event (packet, "interrupt", description, -1);
+		}
+		self->motion_second = packet->ts_sec;
+		self->motion_in_second = 0;
+	}
+
+	self->motion++;
+	self->motion_in_second++;
+}
+
+static void
+process_event (struct monitor *self, const struct usbmon_packet *packet)
+{
+	if (packet->type == USBMON_FILLER
+	 || packet->busnum != self->bus || packet->devnum != self->address)
+		return;
+
+	self->events++;
+	const unsigned char *data = (const unsigned char *) (packet + 1);
+	if (packet->xfer_type == USBMON_XFER_CONTROL)
+	{
+		if (packet->type == 'S')
+			on_submission (self, packet, data);
+		else
+			on_completion (self, packet, data);
+	}
+	else if (packet->xfer_type == USBMON_XFER_INTERRUPT
+		&& (packet->epnum & 0x80) && packet->type == 'C')
+		on_motion (self, packet);
+}
+
+// --- Main --------------------------------------------------------------------
+
+static volatile sig_atomic_t g_terminated;
+
+static void
+on_terminate (int signum)
+{
+	(void) signum;
+	g_terminated = true;
+}
+
+/** Fetch events in batches, releasing the previous batch at the same time,
+ *  so that there's just a single system call per batch. */
+static int
+run (struct monitor *self, int fd, const unsigned char *ring)
+{
+	uint32_t offsets[FETCH_BATCH];
+	struct usbmon_mfetch fetch = { .offvec = offsets };
+	uint32_t to_flush = 0;
+	while (!g_terminated)
+	{
+		fetch.nfetch = FETCH_BATCH;
+		fetch.nflush = to_flush;
+		if (ioctl (fd, MON_IOCX_MFETCH, &fetch) < 0)
+		{
+			// The flush has happened either way
+			to_flush = 0;
+			if (errno == EINTR)
+				continue;
+
+			fprintf (stderr, "Error: fetching events: %s\n", strerror (errno));
+			return -1;
+		}
+
+		for (uint32_t i = 0; i < fetch.nfetch; i++)
+			process_event (self,
+				(const struct usbmon_packet *) (ring + offsets[i]));
+		to_flush = fetch.nfetch;
+
+		struct usbmon_stats stats;
+		if (!ioctl (fd, MON_IOCG_STATS, &stats) && stats.dropped)
+		{
+			fprintf (stderr, "Warning: usbmon dropped %u events\n",
+				stats.dropped);
+			self->dropped += stats.dropped;
+		}
+		fflush (stdout);
+	}
+	return 0;
+}
+
+/** Find the first supported device if none is given. */
+static bool
+find_device (struct monitor *self, const char *path)
+{
+	if (path)
+		return sscanf (path, "/dev/bus/usb/%u/%u",
+			&self->bus, &self->address) == 2;
+
+	struct sensei_device_info *list;
+	size_t len;
+	if (sensei_sysfs_list (&list, &len))
+		return false;
+
+	bool found = false;
+	for (size_t i = 0; !found && i < len; i++)
+		found = list[i].usb_path && sscanf (list[i].usb_path,
+			"/dev/bus/usb/%u/%u", &self->bus, &self->address) == 2;
+	sensei_free_device_list (list, len);
+	return found;
+}
+
+static void
+show_usage (const char *program_name)
+{
+	printf ("Usage: %s [OPTION]...\n", program_name);
+	printf ("Decode traffic of SteelSeries Sensei Raw devices"
+	        " as seen by usbmon.\n\n");
+	printf ("  -h, --help      Show this help\n");
+	printf ("  --version       Show program version and exit\n");
+	printf ("  --device PATH   Monitor the device at /dev/bus/usb/BBB/DDD\n");
+	printf ("  -v, --verbose   Also show other control transfers and"
+	                         " motion report rates\n");
+	printf ("\n");
+}
+
+int
+main (int argc, char *argv[])
+{
+	static struct option long_opts[] =
+	{
+		{ "help",      no_argument,       0, 'h' },
+		{ "version",   no_argument,       0, 'V' },
+		{ "device",    required_argument, 0, 'd' },
+		{ "verbose",   no_argument,       0, 'v' },
+		{ 0,           0,                 0,  0  }
+	};
+
+	struct monitor monitor = { 0 };
+	const char *device_path = NULL;
+	int c;
+	while ((c = getopt_long (argc, argv, "hv", long_opts, NULL)) != -1)
+	{
+	switch (c)
+	{
+	case 'h':
+		show_usage (argv[0]);
+		return EXIT_SUCCESS;
+	case 'V':
+		printf (PROJECT_NAME "-monitor " PROJECT_VERSION "\n");
+		return EXIT_SUCCESS;
+	case 'd':
+		device_path = optarg;
+		break;
+	case 'v':
+		monitor.verbose = true;
+		break;
+	default:
+		return EXIT_FAILURE;
+	}
+	}
+
+	if (optind < argc)
+	{
+		fprintf (stderr, "Error: extra parameters\n");
+		return EXIT_FAILURE;
+	}
+	if (!find_device (&monitor, device_path))
+	{
+		fprintf (stderr, "Error: no suitable device found\n");
+		return EXIT_FAILURE;
+	}
+
+	char usbmon_path[32];
+	snprintf (usbmon_path, sizeof usbmon_path, "/dev/usbmon%u", monitor.bus);
+	int fd = open (usbmon_path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+	{
+		fprintf (stderr, "Error: %s: %s\n", usbmon_path, strerror (errno));
+		return EXIT_FAILURE;
+	}
+
+	// The kernel may cap the size, so ask what we've really got
+	ioctl (fd, MON_IOCT_RING_SIZE, RING_SIZE);
+	int ring_size = ioctl (fd, MON_IOCQ_RING_SIZE);
+	void *ring = ring_size <= 0 ? MAP_FAILED
+		: mmap (NULL, ring_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (ring == MAP_FAILED)
+	{
+		fprintf (stderr, "Error: mapping the ring: %s\n", strerror (errno));
+		close (fd);
+		return EXIT_FAILURE;
+	}
+
+	// Without SA_RESTART, so that fetching gets interrupted
+	struct sigaction sa = { .sa_handler = on_terminate };
+	sigemptyset (&sa.sa_mask);
+	sigaction (SIGINT, &sa, NULL);
+	sigaction (SIGTERM, &sa, NULL);
+
+	fprintf (stderr, "Monitoring /dev/bus/usb/%03u/%03u\n",
+		monitor.bus, monitor.address);
+	int status = run (&monitor, fd, ring) ? EXIT_FAILURE : EXIT_SUCCESS;
+	fprintf (stderr, "%lu events, %lu motion reports, %lu dropped,"
+		" %lu untracked\n", monitor.events, monitor.motion, monitor.dropped,
+		monitor.untracked);
+
+	munmap (ring, ring_size);
+	close (fd);
+	return status;
+}
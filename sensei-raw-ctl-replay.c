@@ -0,0 +1,488 @@
+/*
+ * sensei-raw-ctl-replay.c: motion trace replay through uinput
+ *
+ * Reads motion reports captured by usbmon in its text format, such as with
+ * `cat /sys/kernel/debug/usb/usbmon/1u', and emits them again through
+ * a uinput device with the original timing.  Sleeping alone tends to
+ * overshoot by tens of microseconds, so it only sleeps until shortly before
+ * each report is due and spins for the rest.  Reports are expected to be laid
+ * out like the emulator's: buttons, 16-bit X and Y, and an optional wheel.
+ *
+ * Copyright (c) 2013, Přemysl Janouch <p.janouch@gmail.com>
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+
+#include <getopt.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <linux/uinput.h>
+
+#include "config.h"
+
+/** How long before a report is due to stop sleeping and start spinning. */
+#define DEFAULT_SPIN_US  100
+/** Reports later than this are counted as missed. */
+#define LATE_US  1000
+/** Time for whoever listens to new input devices to open ours. */
+#define SETTLE_MS  500
+
+/** Buttons as reported by the mouse, in bit order. */
+static const int g_buttons[] =
+{
+	BTN_LEFT, BTN_RIGHT, BTN_MIDDLE, BTN_SIDE,
+	BTN_EXTRA, BTN_FORWARD, BTN_BACK, BTN_TASK
+};
+
+#define N_BUTTONS (sizeof g_buttons / sizeof g_buttons[0])
+
+static volatile sig_atomic_t g_terminated;
+
+static void
+on_terminate (int signum)
+{
+	(void) signum;
+	g_terminated = true;
+}
+
+static uint64_t
+now_ns (void)
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// --- Traces ------------------------------------------------------------------
+
+/** A decoded motion report. */
+struct report
+{
+	uint64_t time_us;                   ///< When it was captured
+	uint8_t buttons;                    ///< Button bits
+	int16_t dx;                         ///< Relative X
+	int16_t dy;                         ///< Relative Y
+	int8_t wheel;                       ///< Wheel, if there is one
+};
+
+struct trace
+{
+	struct report *reports;             ///< The reports, in order
+	size_t len;                         ///< Number of reports
+	size_t alloc;                       ///< Allocated length of the array
+
+	char address[32];                   ///< Which endpoint we're following
+	uint32_t last_stamp;                ///< Last raw timestamp
+	uint64_t epoch_us;                  ///< Added to wrapped timestamps
+};
+
+/** Parse the data words of an event, returning the number of bytes. */
+static size_t
+parse_data (const char *s, uint8_t *data, size_t data_len)
+{
+	size_t len = 0;
+	unsigned byte;
+	while (len < data_len)
+	{
+		s += strspn (s, " ");
+		if (sscanf (s, "%2x", &byte) != 1 || !s[1])
+			break;
+		data[len++] = byte;
+		s += 2;
+	}
+	return len;
+}
+
+/** Process a line of usbmon text output, such as:
+ *  ffff88003b8e8600 2860113283 C Ii:1:004:1 0:1 6 = 00feff01 0000
+ *  Only successful interrupt IN completions are of any interest. */
+static bool
+trace_add_line (struct trace *self, const char *line)
+{
+	uint32_t stamp;
+	char type, address[32], status[16], equals[2];
+	unsigned length;
+	int data_offset;
+	if (sscanf (line, "%*s %" SCNu32 " %c %31s %15s %u %1s%n", &stamp,
+		&type, address, status, &length, equals, &data_offset) != 6
+	 || type != 'C' || strncmp (address, "Ii:", 3) || strncmp (status, "0:", 2)
+	 || *equals != '=')
+		return true;
+
+	// Follow the first device to send anything, unless told otherwise
+	if (!*self->address)
+		snprintf (self->address, sizeof self->address, "%s", address);
+	if (strcmp (self->address, address))
+		return true;
+
+	uint8_t data[8];
+	size_t len = parse_data (line + data_offset, data, sizeof data);
+	if (len < 5)
+		return true;
+
+	if (self->len == self->alloc)
+	{
+		size_t alloc = self->alloc ? self->alloc * 2 : 4096;
+		struct report *reports =
+			realloc (self->reports, alloc * sizeof *reports);
+		if (!reports)
+			return false;
+		self->reports = reports;
+		self->alloc = alloc;
+	}
+
+	// The timestamps are 32-bit microseconds, wrapping around every hour
+	if (self->len && stamp < self->last_stamp)
+		self->epoch_us += (uint64_t) 1 << 32;
+	self->last_stamp = stamp;
+
+	struct report *report = &self->reports[self->len++];
+	report->time_us = self->epoch_us + stamp;
+	report->buttons = data[0];
+	report->dx = (int16_t) (data[1] | data[2] << 8);
+	report->dy = (int16_t) (data[3] | data[4] << 8);
+	report->wheel = len > 5 ? (int8_t) data[5] : 0;
+	return true;
+}
+
+static bool
+trace_load (struct trace *self, FILE *fp)
+{
+	char line[512];
+	while (fgets (line, sizeof line, fp))
+		if (!trace_add_line (self, line))
+			return false;
+	return !ferror (fp);
+}
+
+// --- uinput ------------------------------------------------------------------
+
+static int
+uinput_create (void)
+{
+	int fd = open ("/dev/uinput", O_WRONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	bool ok = !ioctl (fd, UI_SET_EVBIT, EV_KEY)
+		&& !ioctl (fd, UI_SET_EVBIT, EV_REL)
+		&& !ioctl (fd, UI_SET_RELBIT, REL_X)
+		&& !ioctl (fd, UI_SET_RELBIT, REL_Y)
+		&& !ioctl (fd, UI_SET_RELBIT, REL_WHEEL);
+	for (size_t i = 0; ok && i < N_BUTTONS; i++)
+		ok = !ioctl (fd, UI_SET_KEYBIT, g_buttons[i]);
+
+	struct uinput_setup setup = { .id = { .bustype = BUS_VIRTUAL } };
+	snprintf (setup.name, sizeof setup.name, PROJECT_NAME " replay");
+	if (!ok || ioctl (fd, UI_DEV_SETUP, &setup) || ioctl (fd, UI_DEV_CREATE))
+	{
+		int err = errno;
+		close (fd);
+		errno = err;
+		return -1;
+	}
+	return fd;
+}
+
+/** Translate a report into events, given the buttons held before. */
+static size_t
+uinput_encode (const struct report *report, uint8_t buttons,
+	struct input_event *events)
+{
+	size_t len = 0;
+	for (size_t i = 0; i < N_BUTTONS; i++)
+		if ((report->buttons ^ buttons) & 1 << i)
+			events[len++] = (struct input_event) { .type = EV_KEY,
+				.code = g_buttons[i], .value = report->buttons >> i & 1 };
+	if (report->dx)
+		events[len++] = (struct input_event)
+			{ .type = EV_REL, .code = REL_X, .value = report->dx };
+	if (report->dy)
+		events[len++] = (struct input_event)
+			{ .type = EV_REL, .code = REL_Y, .value = report->dy };
+	if (report->wheel)
+		events[len++] = (struct input_event)
+			{ .type = EV_REL, .code = REL_WHEEL, .value = report->wheel };
+	events[len++] = (struct input_event)
+		{ .type = EV_SYN, .code = SYN_REPORT };
+	return len;
+}
+
+// --- Scheduling --------------------------------------------------------------
+
+/** Sleep until shortly before the deadline, then spin the rest of the way. */
+static void
+wait_until (uint64_t deadline_ns, uint64_t spin_ns)
+{
+	if (deadline_ns > spin_ns)
+	{
+		uint64_t wake_ns = deadline_ns - spin_ns;
+		struct timespec ts = { wake_ns / 1000000000, wake_ns % 1000000000 };
+		while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL)
+			== EINTR && !g_terminated)
+			;
+	}
+	while (now_ns () < deadline_ns && !g_terminated)
+		;
+}
+
+/** Ask for as little interference as we can get. */
+static void
+go_realtime (void)
+{
+	if (mlockall (MCL_CURRENT | MCL_FUTURE))
+		fprintf (stderr, "Warning: mlockall: %s\n", strerror (errno));
+
+	struct sched_param param =
+		{ .sched_priority = sched_get_priority_min (SCHED_FIFO) + 10 };
+	if (sched_setscheduler (0, SCHED_FIFO, &param))
+		fprintf (stderr, "Warning: SCHED_FIFO: %s\n", strerror (errno));
+}
+
+static int
+compare_u64 (const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+	return (x > y) - (x < y);
+}
+
+static double
+percentile_us (const uint64_t *sorted_ns, size_t len, double p)
+{
+	size_t i = p * (len - 1) + 0.5;
+	return sorted_ns[i] / 1e3;
+}
+
+static void
+print_errors (uint64_t *errors_ns, size_t len, double elapsed)
+{
+	printf ("%zu reports in %.3f s, %.1f per second\n",
+		len, elapsed, elapsed > 0 ? len / elapsed : 0);
+	if (!len)
+		return;
+
+	qsort (errors_ns, len, sizeof *errors_ns, compare_u64);
+	double sum = 0;
+	size_t late = 0;
+	for (size_t i = 0; i < len; i++)
+	{
+		sum += errors_ns[i];
+		late += errors_ns[i] > LATE_US * 1000;
+	}
+
+	printf ("%-10s %9s %9s %9s %9s %9s %9s %9s\n", "error [us]",
+		"min", "p50", "p90", "p99", "p99.9", "max", "mean");
+	printf ("%-10s %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n", "",
+		errors_ns[0] / 1e3,
+		percentile_us (errors_ns, len, .5),
+		percentile_us (errors_ns, len, .9),
+		percentile_us (errors_ns, len, .99),
+		percentile_us (errors_ns, len, .999),
+		errors_ns[len - 1] / 1e3, sum / len / 1e3);
+	printf ("%zu reports more than %d us late\n", late, LATE_US);
+}
+
+// --- Main --------------------------------------------------------------------
+
+static void
+show_usage (const char *program_name)
+{
+	printf ("Usage: %s [OPTION]... [TRACE]\n", program_name);
+	printf ("Replay mouse motion captured by usbmon through uinput.\n\n");
+	printf ("  -h, --help      Show this help\n");
+	printf ("  --version       Show program version and exit\n");
+	printf ("  --address A     Follow the endpoint A, such as Ii:1:004:1,"
+	                         " instead of\n"
+	        "                  the first one found\n");
+	printf ("  --speed X       Play X times faster than recorded\n");
+	printf ("  --spin-us US    Spin for the last US microseconds before"
+	                         " each report,\n"
+	        "                  %d by default\n", DEFAULT_SPIN_US);
+	printf ("  --realtime      Lock memory and run with SCHED_FIFO\n");
+	printf ("  --dry-run       Only measure timing, don't create a device\n");
+	printf ("\nTRACE is usbmon text output, standard input by default.\n");
+	printf ("\n");
+}
+
+#define ERROR(label, ...)                         \
+	do {                                          \
+		fprintf (stderr, "Error: " __VA_ARGS__);  \
+		status = 1;                               \
+		goto label;                               \
+	} while (0)
+
+int
+main (int argc, char *argv[])
+{
+	static struct option long_opts[] =
+	{
+		{ "help",      no_argument,       0, 'h' },
+		{ "version",   no_argument,       0, 'V' },
+		{ "address",   required_argument, 0, 'a' },
+		{ "speed",     required_argument, 0, 's' },
+		{ "spin-us",   required_argument, 0, 'S' },
+		{ "realtime",  no_argument,       0, 'r' },
+		{ "dry-run",   no_argument,       0, 'n' },
+		{ 0,           0,                 0,  0  }
+	};
+
+	struct trace trace = { .len = 0 };
+	double speed = 1;
+	unsigned long spin_us = DEFAULT_SPIN_US;
+	bool realtime = false, dry_run = false;
+	char *end;
+	int c;
+	while ((c = getopt_long (argc, argv, "h", long_opts, NULL)) != -1)
+	{
+	switch (c)
+	{
+	case 'h':
+		show_usage (argv[0]);
+		return EXIT_SUCCESS;
+	case 'V':
+		printf (PROJECT_NAME "-replay " PROJECT_VERSION "\n");
+		return EXIT_SUCCESS;
+	case 'a':
+		snprintf (trace.address, sizeof trace.address, "%s", optarg);
+		break;
+	case 's':
+		if ((speed = strtod (optarg, &end)) <= 0 || *end)
+		{
+			fprintf (stderr, "Error: invalid speed: %s\n", optarg);
+			return EXIT_FAILURE;
+		}
+		break;
+	case 'S':
+		spin_us = strtoul (optarg, &end, 10);
+		if (!*optarg || *end || spin_us > 1000000)
+		{
+			fprintf (stderr, "Error: invalid spin time: %s\n", optarg);
+			return EXIT_FAILURE;
+		}
+		break;
+	case 'r':
+		realtime = true;
+		break;
+	case 'n':
+		dry_run = true;
+		break;
+	default:
+		return EXIT_FAILURE;
+	}
+	}
+
+	if (argc - optind > 1)
+	{
+		fprintf (stderr, "Error: extra parameters\n");
+		return EXIT_FAILURE;
+	}
+
+	int status = 0, fd = -1;
+	uint64_t *errors_ns = NULL;
+	const char *path = optind < argc ? argv[optind] : "-";
+	FILE *fp = strcmp (path, "-") ? fopen (path, "r") : stdin;
+	if (!fp)
+		ERROR (error_open, "%s: %s\n", path, strerror (errno));
+	if (!trace_load (&trace, fp))
+		ERROR (error_load, "%s: %s\n", path, strerror (errno));
+	if (!trace.len)
+		ERROR (error_load, "%s: no motion reports found\n", path);
+	if (!(errors_ns = calloc (trace.len, sizeof *errors_ns)))
+		ERROR (error_load, "%s\n", strerror (errno));
+
+	if (!dry_run && (fd = uinput_create ()) < 0)
+		ERROR (error_load, "/dev/uinput: %s\n", strerror (errno));
+
+	struct sigaction sa = { .sa_handler = on_terminate };
+	sigemptyset (&sa.sa_mask);
+	sigaction (SIGINT, &sa, NULL);
+	sigaction (SIGTERM, &sa, NULL);
+
+	// Sleeps would otherwise be rounded up by the default 50 us of slack
+	prctl (PR_SET_TIMERSLACK, 1UL, 0UL, 0UL, 0UL);
+	if (realtime)
+		go_realtime ();
+	if (fd >= 0)
+		usleep (SETTLE_MS * 1000);
+
+	fprintf (stderr, "Replaying %zu reports from %s over %.3f s\n",
+		trace.len, trace.address, (trace.reports[trace.len - 1].time_us
+		- trace.reports[0].time_us) / 1e6 / speed);
+
+	uint8_t buttons = 0;
+	size_t done = 0;
+	uint64_t start_ns = now_ns (), spin_ns = spin_us * 1000;
+	for (; done < trace.len && !g_terminated; done++)
+	{
+		const struct report *report = &trace.reports[done];
+		uint64_t deadline_ns = start_ns + (uint64_t)
+			((report->time_us - trace.reports[0].time_us) * 1e3 / speed);
+
+		// Prepare everything in advance, so that only the write follows
+		struct input_event events[N_BUTTONS + 4];
+		size_t len = uinput_encode (report, buttons, events);
+		buttons = report->buttons;
+
+		wait_until (deadline_ns, spin_ns);
+		uint64_t sent_ns = now_ns ();
+		errors_ns[done] = sent_ns - deadline_ns;
+		if (fd >= 0 && write (fd, events, len * sizeof *events) < 0)
+			ERROR (error_write, "writing events failed: %s\n",
+				strerror (errno));
+	}
+
+	print_errors (errors_ns, done, (now_ns () - start_ns) / 1e9);
+
+	// Don't leave any buttons held down
+	if (fd >= 0 && buttons)
+	{
+		struct input_event events[N_BUTTONS + 4];
+		size_t len = uinput_encode (&(struct report) { .buttons = 0 },
+			buttons, events);
+		if (write (fd, events, len * sizeof *events) < 0)
+			ERROR (error_write, "writing events failed: %s\n",
+				strerror (errno));
+	}
+
+error_write:
+	if (fd >= 0)
+	{
+		ioctl (fd, UI_DEV_DESTROY);
+		close (fd);
+	}
+error_load:
+	free (errors_ns);
+	free (trace.reports);
+	if (fp != stdin)
+		fclose (fp);
+error_open:
+	return status;
+}
@@ -0,0 +1,253 @@
+/*
+ * sensei-raw-ctl-udev.c: apply a stored profile to a freshly plugged mouse
+ *
+ * Meant to be run by udev for each new hidraw node, which it gets passed in
+ * the DEVNAME environment variable.  It uses libusb's headers for error codes
+ * but doesn't link against the library, doesn't scan any buses and doesn't
+ * detach any drivers, so that it finishes quickly and doesn't get in the way
+ * of the rest of the boot.  For the same reason it doesn't touch anything
+ * under the state directory, which may not even be mounted yet, unless asked
+ * to with --journal: no pacing hints are read and the change isn't recorded.
+ *
+ * Copyright (c) 2013, Přemysl Janouch <p.janouch@gmail.com>
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+
+// Only for the error codes, which the whole library uses; the header is
+// needed to build, but the library isn't linked in
+#include <libusb.h>
+
+#include "config.h"
+#include "sensei-raw.h"
+
+/** Profiles are tiny, anything larger than this is a mistake. */
+#define PROFILE_MAX  4096
+
+// --- Profile -----------------------------------------------------------------
+
+/** Read the whole file in a single go, without stdio buffering. */
+static ssize_t
+read_profile (const char *path, char *buf, size_t buf_len)
+{
+	int fd = open (path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	ssize_t len = 0, n = 0;
+	while ((size_t) len < buf_len
+		&& ((n = read (fd, buf + len, buf_len - len)) > 0
+			|| (n < 0 && errno == EINTR)))
+		len += n > 0 ? n : 0;
+
+	int saved_errno = errno;
+	close (fd);
+	errno = saved_errno;
+	return n < 0 ? -1 : len;
+}
+
+/** Parse "name value" lines, with names like the control utility's long
+ *  options.  Empty lines and lines starting with '#' are ignored. */
+static bool
+parse_profile (char *buf, struct sensei_config *config, unsigned *fields)
+{
+	unsigned line_no = 0;
+	for (char *line = buf, *next; line; line = next)
+	{
+		line_no++;
+		if ((next = strchr (line, '\n')))
+			*next++ = '\0';
+
+		char *name = line + strspn (line, " \t\r");
+		if (!*name || *name == '#')
+			continue;
+
+		char *value = name + strcspn (name, " \t\r");
+		if (*value)
+			*value++ = '\0';
+		value += strspn (value, " \t\r");
+		value[strcspn (value, " \t\r")] = '\0';
+
+		if (!sensei_parse_setting (name, value, config, fields))
+		{
+			fprintf (stderr, "Error: profile line %u: invalid setting: %s\n",
+				line_no, name);
+			return false;
+		}
+	}
+	return true;
+}
+
+// --- Main --------------------------------------------------------------------
+
+static void
+show_usage (const char *program_name)
+{
+	printf ("Usage: %s [OPTION]... [DEVICE]\n", program_name);
+	printf ("Apply a stored profile to a SteelSeries Sensei Raw device.\n\n");
+	printf ("  -h, --help      Show this help\n");
+	printf ("  --version       Show program version and exit\n");
+	printf ("  --profile FILE  Read settings from FILE instead of\n"
+	        "                  " PROJECT_PROFILE "\n");
+	printf ("  --journal       Use pacing hints and record the change,\n"
+	        "                  at the cost of reading the device back\n");
+	printf ("\nDEVICE defaults to $DEVNAME, as set by udev.  Paths under"
+	        " /dev/bus/usb\nare opened through usbfs, anything else"
+	        " through hidraw.\n");
+	printf ("\n");
+}
+
+#define ERROR(label, ...)                         \
+	do {                                          \
+		fprintf (stderr, "Error: " __VA_ARGS__);  \
+		status = 1;                               \
+		goto label;                               \
+	} while (0)
+
+int
+main (int argc, char *argv[])
+{
+	static struct option long_opts[] =
+	{
+		{ "help",      no_argument,       0, 'h' },
+		{ "version",   no_argument,       0, 'V' },
+		{ "profile",   required_argument, 0, 'p' },
+		{ "journal",   no_argument,       0, 'j' },
+		{ 0,           0,                 0,  0  }
+	};
+
+	const char *profile = PROJECT_PROFILE;
+	bool journal = false;
+	int c;
+	while ((c = getopt_long (argc, argv, "h", long_opts, NULL)) != -1)
+	{
+	switch (c)
+	{
+	case 'h':
+		show_usage (argv[0]);
+		return EXIT_SUCCESS;
+	case 'V':
+		printf (PROJECT_NAME " " PROJECT_VERSION "\n");
+		return EXIT_SUCCESS;
+	case 'p':
+		profile = optarg;
+		break;
+	case 'j':
+		journal = true;
+		break;
+	default:
+		return EXIT_FAILURE;
+	}
+	}
+
+	const char *path = getenv ("DEVNAME");
+	if (optind < argc)
+		path = argv[optind++];
+	if (optind < argc)
+	{
+		fprintf (stderr, "Error: extra parameters\n");
+		return EXIT_FAILURE;
+	}
+	if (!path)
+	{
+		fprintf (stderr, "Error: no device given and DEVNAME not set\n");
+		return EXIT_FAILURE;
+	}
+
+	// An empty or missing profile simply means there's nothing to do,
+	// so don't even bother opening the device
+	char buf[PROFILE_MAX + 1];
+	ssize_t len = read_profile (profile, buf, PROFILE_MAX);
+	if (len < 0 && errno == ENOENT)
+		return EXIT_SUCCESS;
+	if (len < 0)
+	{
+		fprintf (stderr, "Error: couldn't read %s: %s\n",
+			profile, strerror (errno));
+		return EXIT_FAILURE;
+	}
+	buf[len] = '\0';
+
+	struct sensei_config config = { 0 };
+	unsigned fields = 0;
+	if (!parse_profile (buf, &config, &fields))
+		return EXIT_FAILURE;
+	if (!fields)
+		return EXIT_SUCCESS;
+
+	int result, status = 0;
+	struct sensei_device *device = NULL;
+
+	bool usbfs = !strncmp (path, "/dev/bus/usb/", 13);
+	result = usbfs
+		? sensei_usbfs_open (path, &device)
+		: sensei_hidraw_open (path, &device);
+
+	// udev runs us for every interface of the mouse, ignore the others
+	if (result == LIBUSB_ERROR_NOT_FOUND)
+		return EXIT_SUCCESS;
+	if (result)
+		ERROR (error_0, "couldn't open %s: %s\n",
+			path, sensei_error_name (result));
+	if (journal)
+		sensei_use_pacing (device);
+
+	result = sensei_detach_kernel_driver (device);
+	if (result)
+		ERROR (error_1, "couldn't detach kernel driver: %s\n",
+			sensei_error_name (result));
+
+	result = sensei_claim_interface (device);
+	if (result)
+		ERROR (error_2, "couldn't claim interface: %s\n",
+			sensei_error_name (result));
+
+	struct sensei_command commands[SENSEI_MAX_COMMANDS];
+	size_t n_commands = sensei_prepare_commands (&config, fields, false,
+		commands), failed;
+	result = journal
+		? sensei_apply_commands (device,
+			PROJECT_NAME "-udev", commands, n_commands, &failed)
+		: sensei_send_commands (device, commands, n_commands, &failed);
+	if (result)
+		ERROR (error_3, "%s failed: %s\n",
+			commands[failed].step, sensei_error_name (result));
+
+error_3:
+	result = sensei_release_interface (device);
+	if (result)
+		ERROR (error_2, "couldn't release interface: %s\n",
+			sensei_error_name (result));
+
+error_2:
+	result = sensei_attach_kernel_driver (device);
+	if (result)
+		ERROR (error_1, "couldn't reattach kernel driver: %s\n",
+			sensei_error_name (result));
+
+error_1:
+	sensei_close (device);
+error_0:
+	return status;
+}
@@ -26,229 +26,26 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
+#include <limits.h>
 #include <stdbool.h>
-#include <assert.h>
+#include <inttypes.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
 
 #include <getopt.h>
 #include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/stat.h>
 #include <libusb.h>
 
 #include "config.h"
-
-// --- Utilities ---------------------------------------------------------------
-
-/** Search for a device with given vendor and product ID. */
-static libusb_device_handle *
-find_device (int vendor, int product, int *error)
-{
-	libusb_device **list;
-	libusb_device *found = NULL;
-	libusb_device_handle *handle = NULL;
-	int err = 0;
-
-	ssize_t cnt = libusb_get_device_list (NULL, &list);
-	if (cnt < 0)
-		goto out;
-
-	ssize_t i = 0;
-	for (i = 0; i < cnt; i++)
-	{
-		libusb_device *device = list[i];
-
-		struct libusb_device_descriptor desc;
-		if (libusb_get_device_descriptor (device, &desc))
-			continue;
-
-		if (desc.idVendor == vendor && desc.idProduct == product)
-		{
-			found = device;
-			break;
-		}
-	}
-
-	if (found)
-	{
-		err = libusb_open (found, &handle);
-		if (err)
-			goto out_free;
-	}
-
-out_free:
-	libusb_free_device_list(list, 1);
-out:
-	if (error != NULL && err != 0)
-		*error = err;
-	return handle;
-}
-
-/** Search for a device under various product ID's. */
-static libusb_device_handle *
-find_device_list (int vendor,
-	const int *products, size_t n_products, int *error)
-{
-	int err = 0;
-	libusb_device_handle *handle;
-
-	while (n_products--)
-	{
-		handle = find_device (vendor, *products++, &err);
-		if (handle)
-			return handle;
-		if (err)
-			break;
-	}
-
-	if (error != NULL && err != 0)
-		*error = err;
-	return NULL;
-}
-
-// --- Device configuration ----------------------------------------------------
-
-#define USB_VENDOR_STEELSERIES  0x1038
-#define USB_PRODUCT_STEELSERIES_SENSEI_RAW  0x1369
-#define USB_PRODUCT_STEELSERIES_COD_BO2  0x136f
-
-#define USB_GET_REPORT  0x01
-#define USB_SET_REPORT  0x09
-
-#define SENSEI_CTL_IFACE  0
-
-#define SENSEI_CPI_MIN  0x01
-#define SENSEI_CPI_MAX  0x3f
-#define SENSEI_CPI_STEP  90
-
-/** Backlight pulsation. */
-enum sensei_pulsation
-{
-	PULSATION_STEADY = 1,
-	PULSATION_SLOW,
-	PULSATION_MEDIUM,
-	PULSATION_FAST
-};
-
-/** Device mode. */
-/* Just guessing the names, could be anything */
-enum sensei_mode
-{
-	MODE_LEGACY = 1,
-	MODE_NORMAL
-};
-
-/** Backlight intensity. */
-enum sensei_intensity
-{
-	INTENSITY_OFF = 1,
-	INTENSITY_LOW,
-	INTENSITY_MEDIUM,
-	INTENSITY_HIGH
-};
-
-/** Polling frequency. */
-enum sensei_polling
-{
-	POLLING_1000_HZ = 1,
-	POLLING_500_HZ,
-	POLLING_250_HZ,
-	POLLING_125_HZ
-};
-
-/** Overall device configuration. */
-struct sensei_config
-{
-	enum sensei_mode mode;
-	int cpi_off;
-	int cpi_on;
-	enum sensei_pulsation pulsation;
-	enum sensei_intensity intensity;
-	enum sensei_polling polling;
-};
-
-/** Send a command to the mouse via SET_REPORT. */
-static int
-sensei_send_command (libusb_device_handle *device,
-	unsigned char *data, uint16_t length)
-{
-	int result = libusb_control_transfer (device, LIBUSB_ENDPOINT_OUT
-		| LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
-		USB_SET_REPORT, 0x0200, 0x0000, data, length, 0);
-	return result < 0 ? result : 0;
-}
-
-/** Set the operating mode of the mouse. */
-static int
-sensei_set_mode (libusb_device_handle *device,
-	enum sensei_mode mode)
-{
-	unsigned char cmd[32] = { 0x02, 0x00, mode };
-	return sensei_send_command (device, cmd, sizeof cmd);
-}
-
-/** Set backlight intensity. */
-static int
-sensei_set_intensity (libusb_device_handle *device,
-	enum sensei_intensity intensity)
-{
-	unsigned char cmd[32] = { 0x05, 0x01, intensity };
-	return sensei_send_command (device, cmd, sizeof cmd);
-}
-
-/** Set pulsation speed. */
-static int
-sensei_set_pulsation (libusb_device_handle *device,
-	enum sensei_pulsation pulsation)
-{
-	unsigned char cmd[32] = { 0x07, 0x01, pulsation };
-	return sensei_send_command (device, cmd, sizeof cmd);
-}
-
-/** Set sensitivity in CPI. */
-static int
-sensei_set_cpi (libusb_device_handle *device,
-	int cpi, bool led_status)
-{
-	assert (cpi >= SENSEI_CPI_MIN && cpi <= SENSEI_CPI_MAX);
-	unsigned char cmd[32] = { 0x03, led_status ? 2 : 1, cpi };
-	return sensei_send_command (device, cmd, sizeof cmd);
-}
-
-/** Set the polling frequency. */
-static int
-sensei_set_polling (libusb_device_handle *device,
-	enum sensei_polling polling)
-{
-	unsigned char cmd[32] = { 0x04, 0x00, polling };
-	return sensei_send_command (device, cmd, sizeof cmd);
-}
-
-/** Save the current configuration to ROM. */
-static int
-sensei_save_to_rom (libusb_device_handle *device)
-{
-	unsigned char cmd[32] = { 0x09, 0x00, 0x00 };
-	return sensei_send_command (device, cmd, sizeof cmd);
-}
-
-/** Read device configuration. */
-static int
-sensei_load_config (libusb_device_handle *device,
-	struct sensei_config *config)
-{
-	unsigned char data[256];
-
-	int result = libusb_control_transfer (device, LIBUSB_ENDPOINT_IN
-		| LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
-		USB_GET_REPORT, 0x0300, 0x0000, data, sizeof data, 0);
-	if (result < 0)
-		return result;
-
-	config->intensity = data[102];
-	config->pulsation = data[103];
-	config->cpi_off   = data[107];
-	config->cpi_on    = data[108];
-	config->polling   = data[128];
-	return 0;
-}
+#include "sensei-raw.h"
 
 // --- Control utility ---------------------------------------------------------
 
@@ -289,9 +86,40 @@ sensei_display_config (const struct sensei_config *config)
 	}
 }
 
+/** Transport backends selectable from the command line. */
+enum backend
+{
+	BACKEND_LIBUSB,
+	BACKEND_USBFS,
+	BACKEND_HIDRAW
+};
+
 struct options
 {
+	enum backend backend;
+	const char *device_path;
+	const char *metrics_file;
+
+	const char *power_control;          ///< New power/control
+	const char *autosuspend_delay;      ///< New power/autosuspend_delay_ms
+	const char *wakeup;                 ///< New power/wakeup
+	const char *irq_pin;                ///< CPUs to pin interrupts to
+	const char *cpi_on;                 ///< Requested CPI with the LED on
+	const char *cpi_off;                ///< Requested CPI with the LED off
+	unsigned watch_ms;                  ///< Interval between --watch samples
+	uint64_t since_us;                  ///< Start of the --journal range
+	uint64_t until_us;                  ///< End of the --journal range
+
 	unsigned show_config   : 1;
+	unsigned watch         : 1;
+	unsigned json          : 1;
+	unsigned journal       : 1;
+	unsigned probe         : 1;
+	unsigned audit         : 1;
+	unsigned sync          : 1;
+	unsigned power         : 1;
+	unsigned measure_resume : 1;
+	unsigned irq           : 1;
 	unsigned save_to_rom   : 1;
 	unsigned set_pulsation : 1;
 	unsigned set_mode      : 1;
@@ -309,6 +137,24 @@ show_usage (const char *program_name)
 	printf ("  -h, --help      Show this help\n");
 	printf ("  --version       Show program version and exit\n");
 	printf ("  --show          Show current mouse settings and exit\n");
+	printf ("  --watch[=MS]    Print settings as they change, reading them"
+	                         " every MS\n"
+	        "                  milliseconds (1000 by default)\n");
+	printf ("  --json          Print changes as JSON objects, one per line\n");
+	printf ("  --journal       Show changes made to mice and exit\n");
+	printf ("  --since WHEN    Only show changes since WHEN, such as 7d,"
+	                         " 12h, 30m or\n"
+	        "                  2013-11-01 12:00\n");
+	printf ("  --until WHEN    Only show changes until WHEN\n");
+	printf ("  --probe-transport\n"
+	        "                  Measure how fast the mouse accepts commands,"
+	                         " remember it\n"
+	        "                  and exit\n");
+	printf ("  --audit         Print a digest of the settings of all mice"
+	                         " and exit\n");
+	printf ("  --sync          Apply settings to all mice at the same time,"
+	                         " so that they\n"
+	        "                  pulse in phase\n");
 	printf ("  --mode X        Set the mode of the mouse"
 	                         " (can be either 'legacy' or 'normal')\n");
 	printf ("  --polling X     Set polling to X Hz (1000, 500, 250, 125)\n");
@@ -319,36 +165,163 @@ show_usage (const char *program_name)
 	printf ("  --intensity X   Set the backlight intensity"
 	                         " (off, low, medium, high)\n");
 	printf ("  --save          Save the current configuration to ROM\n");
+	printf ("  --backend X     How to talk to the device (libusb"
+#ifdef __linux__
+	                         ", usbfs, hidraw"
+#endif // __linux__
+	                         ")\n");
+	printf ("  --device PATH   Use the device at /dev/bus/usb/BBB/DDD"
+#ifdef __linux__
+	                         " or /dev/hidrawN"
+#endif // __linux__
+	                         "\n");
+	printf ("  --metrics-file PATH\n"
+	        "                  Accumulate statistics in PATH, in Prometheus"
+	                         " text format\n");
+#ifdef __linux__
+	printf ("  --power         Show USB power management settings and exit\n");
+	printf ("  --power-control X\n"
+	        "                  Keep the mouse powered (on) or let it suspend"
+	                         " when idle (auto)\n");
+	printf ("  --autosuspend-delay MS\n"
+	        "                  Idle time before suspending,"
+	                         " negative to never suspend\n");
+	printf ("  --wakeup X      Whether the mouse may wake the system up"
+	                         " (enabled, disabled)\n");
+	printf ("  --measure-resume\n"
+	        "                  Measure the delay of the first transfer after"
+	                         " idle under each\n"
+	        "                  policy, a GET_REPORT standing in for the first"
+	                         " input report\n");
+	printf ("  --irq           Show where interrupts of the USB host controller"
+	                         " go, how those\n"
+	        "                  CPUs are set up, and measure round trips\n");
+	printf ("  --irq-pin CPUS  Pin the interrupts to a list of CPUs like 0-3,8"
+	                         " and measure\n"
+	        "                  round trips before and after\n");
+#endif // __linux__
 	printf ("\n");
 }
 
+/** Turn a CPI value into a step.  With a calibration table, the step that
+ *  has been measured to come closest is used instead of the nominal one. */
 static int
-encode_cpi (const char *str)
+encode_cpi (const char *str, const struct sensei_cpi_table *table)
 {
-	char *end;
-	long cpi = strtol (str, &end, 10);
-	if (!*str || *end || cpi < 0)
+	int cpi;
+	if (!sensei_parse_cpi (str, &cpi))
 	{
 		fprintf (stderr, "Error: invalid CPI value\n");
 		exit (EXIT_FAILURE);
 	}
-
-	cpi /= SENSEI_CPI_STEP;
-	if (cpi < 1)
+	if (table)
 	{
+		long requested = strtol (str, NULL, 10);
+		int step = sensei_cpi_nearest (table, requested);
+		if (step != cpi)
+			fprintf (stderr, "Notice: calibrated CPI %.0f comes closer to %ld"
+				" than %d, using step %d\n", sensei_cpi_actual (table, step),
+				requested, cpi * SENSEI_CPI_STEP, step);
+		return step;
+	}
+
+	long requested = strtol (str, NULL, 10) / SENSEI_CPI_STEP;
+	if (requested < SENSEI_CPI_MIN)
 		fprintf (stderr, "Notice: CPI too low, using %d\n",
 			SENSEI_CPI_MIN * SENSEI_CPI_STEP);
-		cpi = 1;
-	}
-	if (cpi > SENSEI_CPI_MAX)
-	{
+	if (requested > SENSEI_CPI_MAX)
 		fprintf (stderr, "Notice: CPI too high, using %d\n",
 			SENSEI_CPI_MAX * SENSEI_CPI_STEP);
-		cpi = SENSEI_CPI_MAX;
-	}
 	return cpi;
 }
 
+/** Turn requested CPI values into steps, printing notices just this once. */
+static void
+encode_requested_cpi (const struct options *options,
+	struct sensei_config *new_config, const struct sensei_cpi_table *table)
+{
+	if (options->set_cpi_on)
+		new_config->cpi_on = encode_cpi (options->cpi_on, table);
+	if (options->set_cpi_off)
+		new_config->cpi_off = encode_cpi (options->cpi_off, table);
+}
+
+static uint64_t
+wall_clock_us (void)
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_REALTIME, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/** Parse a point in time: a number of days, hours, minutes or seconds ago
+ *  such as "7d", a date with an optional time in local time, or "now". */
+static bool
+parse_time (const char *str, uint64_t *time_us)
+{
+	uint64_t now_us = wall_clock_us ();
+	if (!strcmp (str, "now"))
+	{
+		*time_us = now_us;
+		return true;
+	}
+
+	char *end;
+	errno = 0;
+	unsigned long long amount = strtoull (str, &end, 10);
+	if (!errno && end != str && *end && !end[1])
+	{
+		uint64_t unit;
+		switch (*end)
+		{
+		case 'd':  unit = 24 * 3600;  break;
+		case 'h':  unit = 3600;       break;
+		case 'm':  unit = 60;         break;
+		case 's':  unit = 1;          break;
+		default:   return false;
+		}
+		uint64_t ago_us = amount * unit * 1000000;
+		if (amount > now_us / 1000000 / unit || ago_us > now_us)
+			return false;
+		*time_us = now_us - ago_us;
+		return true;
+	}
+
+	struct tm tm = { .tm_isdst = -1 };
+	int consumed = 0;
+	if (sscanf (str, "%4d-%2d-%2d%n",
+		&tm.tm_year, &tm.tm_mon, &tm.tm_mday, &consumed) != 3)
+		return false;
+	if (str[consumed] == 'T' || str[consumed] == ' ')
+	{
+		const char *rest = str + consumed + 1;
+		consumed = 0;
+		if (sscanf (rest, "%2d:%2d%n", &tm.tm_hour, &tm.tm_min, &consumed) != 2)
+			return false;
+		if (rest[consumed] == ':')
+		{
+			rest += consumed + 1;
+			consumed = 0;
+			if (sscanf (rest, "%2d%n", &tm.tm_sec, &consumed) != 1)
+				return false;
+		}
+		str = rest;
+	}
+	if (str[consumed] || tm.tm_mon < 1 || tm.tm_mon > 12
+	 || tm.tm_mday < 1 || tm.tm_mday > 31 || tm.tm_hour < 0
+	 || tm.tm_hour > 23 || tm.tm_min < 0 || tm.tm_min > 59
+	 || tm.tm_sec < 0 || tm.tm_sec > 60)
+		return false;
+
+	tm.tm_year -= 1900;
+	tm.tm_mon -= 1;
+	time_t t = mktime (&tm);
+	if (t == (time_t) -1 || t < 0)
+		return false;
+	*time_us = (uint64_t) t * 1000000;
+	return true;
+}
+
 static void
 parse_options (int argc, char *argv[],
 	struct options *options, struct sensei_config *new_config)
@@ -358,6 +331,14 @@ parse_options (int argc, char *argv[],
 		{ "help",      no_argument,       0, 'h' },
 		{ "version",   no_argument,       0, 'V' },
 		{ "show",      no_argument,       0, 's' },
+		{ "watch",     optional_argument, 0, 'x' },
+		{ "json",      no_argument,       0, 'j' },
+		{ "journal",   no_argument,       0, 'J' },
+		{ "since",     required_argument, 0, 'f' },
+		{ "until",     required_argument, 0, 'u' },
+		{ "probe-transport", no_argument, 0, 'T' },
+		{ "audit",     no_argument,       0, 'a' },
+		{ "sync",      no_argument,       0, 'y' },
 		{ "save",      no_argument,       0, 'S' },
 		{ "mode",      required_argument, 0, 'm' },
 		{ "polling",   required_argument, 0, 'p' },
@@ -365,6 +346,18 @@ parse_options (int argc, char *argv[],
 		{ "cpi-off",   required_argument, 0, 'C' },
 		{ "pulsation", required_argument, 0, 'P' },
 		{ "intensity", required_argument, 0, 'i' },
+		{ "backend",   required_argument, 0, 'b' },
+		{ "device",    required_argument, 0, 'd' },
+		{ "metrics-file", required_argument, 0, 'M' },
+#ifdef __linux__
+		{ "power",     no_argument,       0, 'w' },
+		{ "power-control", required_argument, 0, 'o' },
+		{ "autosuspend-delay", required_argument, 0, 'D' },
+		{ "wakeup",    required_argument, 0, 'W' },
+		{ "measure-resume", no_argument,  0, 'R' },
+		{ "irq",       no_argument,       0, 'q' },
+		{ "irq-pin",   required_argument, 0, 'Q' },
+#endif // __linux__
 		{ 0,           0,                 0,  0  }
 	};
 
@@ -388,15 +381,48 @@ parse_options (int argc, char *argv[],
 	case 's':
 		options->show_config = true;
 		break;
+	case 'x':
+	{
+		char *end;
+		unsigned long ms = optarg ? strtoul (optarg, &end, 10) : 1000;
+		if (optarg && (!*optarg || *end || !ms || ms > 3600 * 1000))
+		{
+			fprintf (stderr, "Error: invalid interval: %s\n", optarg);
+			exit (EXIT_FAILURE);
+		}
+		options->watch_ms = ms;
+		options->watch = true;
+		break;
+	}
+	case 'j':
+		options->json = true;
+		break;
+	case 'J':
+		options->journal = true;
+		break;
+	case 'f':
+	case 'u':
+		if (!parse_time (optarg,
+			c == 'f' ? &options->since_us : &options->until_us))
+		{
+			fprintf (stderr, "Error: invalid time: %s\n", optarg);
+			exit (EXIT_FAILURE);
+		}
+		break;
+	case 'T':
+		options->probe = true;
+		break;
+	case 'a':
+		options->audit = true;
+		break;
+	case 'y':
+		options->sync = true;
+		break;
 	case 'S':
 		options->save_to_rom = true;
 		break;
 	case 'm':
-		if (!strcasecmp (optarg, "legacy"))
-			new_config->mode = MODE_LEGACY;
-		else if (!strcasecmp (optarg, "normal"))
-			new_config->mode = MODE_NORMAL;
-		else
+		if (!sensei_parse_mode (optarg, &new_config->mode))
 		{
 			fprintf (stderr, "Error: invalid mode: %s\n", optarg);
 			exit (EXIT_FAILURE);
@@ -404,15 +430,7 @@ parse_options (int argc, char *argv[],
 		options->set_mode = true;
 		break;
 	case 'p':
-		if (!strcmp (optarg, "1000"))
-			new_config->polling = POLLING_1000_HZ;
-		else if (!strcmp (optarg, "500"))
-			new_config->polling = POLLING_500_HZ;
-		else if (!strcmp (optarg, "250"))
-			new_config->polling = POLLING_250_HZ;
-		else if (!strcmp (optarg, "125"))
-			new_config->polling = POLLING_125_HZ;
-		else
+		if (!sensei_parse_polling (optarg, &new_config->polling))
 		{
 			fprintf (stderr, "Error: invalid polling frequency: %s\n", optarg);
 			exit (EXIT_FAILURE);
@@ -420,23 +438,26 @@ parse_options (int argc, char *argv[],
 		options->set_polling = true;
 		break;
 	case 'c':
-		new_config->cpi_on = encode_cpi (optarg);
+		// Only validated here, calibration isn't known until later
+		if (!sensei_parse_cpi (optarg, &new_config->cpi_on))
+		{
+			fprintf (stderr, "Error: invalid CPI value\n");
+			exit (EXIT_FAILURE);
+		}
+		options->cpi_on = optarg;
 		options->set_cpi_on = true;
 		break;
 	case 'C':
-		new_config->cpi_off = encode_cpi (optarg);
+		if (!sensei_parse_cpi (optarg, &new_config->cpi_off))
+		{
+			fprintf (stderr, "Error: invalid CPI value\n");
+			exit (EXIT_FAILURE);
+		}
+		options->cpi_off = optarg;
 		options->set_cpi_off = true;
 		break;
 	case 'P':
-		if (!strcasecmp (optarg, "steady"))
-			new_config->pulsation = PULSATION_STEADY;
-		else if (!strcasecmp (optarg, "slow"))
-			new_config->pulsation = PULSATION_SLOW;
-		else if (!strcasecmp (optarg, "medium"))
-			new_config->pulsation = PULSATION_MEDIUM;
-		else if (!strcasecmp (optarg, "fast"))
-			new_config->pulsation = PULSATION_FAST;
-		else
+		if (!sensei_parse_pulsation (optarg, &new_config->pulsation))
 		{
 			fprintf (stderr, "Error: invalid backlight pulsation: %s\n", optarg);
 			exit (EXIT_FAILURE);
@@ -444,21 +465,80 @@ parse_options (int argc, char *argv[],
 		options->set_pulsation = true;
 		break;
 	case 'i':
-		if (!strcasecmp (optarg, "off"))
-			new_config->intensity = INTENSITY_OFF;
-		else if (!strcasecmp (optarg, "low"))
-			new_config->intensity = INTENSITY_LOW;
-		else if (!strcasecmp (optarg, "medium"))
-			new_config->intensity = INTENSITY_MEDIUM;
-		else if (!strcasecmp (optarg, "high"))
-			new_config->intensity = INTENSITY_HIGH;
-		else
+		if (!sensei_parse_intensity (optarg, &new_config->intensity))
 		{
 			fprintf (stderr, "Error: invalid backlight intensity: %s\n", optarg);
 			exit (EXIT_FAILURE);
 		}
 		options->set_intensity = true;
 		break;
+	case 'b':
+		if (!strcasecmp (optarg, "libusb"))
+			options->backend = BACKEND_LIBUSB;
+#ifdef __linux__
+		else if (!strcasecmp (optarg, "usbfs"))
+			options->backend = BACKEND_USBFS;
+		else if (!strcasecmp (optarg, "hidraw"))
+			options->backend = BACKEND_HIDRAW;
+#endif // __linux__
+		else
+		{
+			fprintf (stderr, "Error: invalid backend: %s\n", optarg);
+			exit (EXIT_FAILURE);
+		}
+		break;
+	case 'd':
+		options->device_path = optarg;
+		break;
+	case 'M':
+		options->metrics_file = optarg;
+		break;
+	case 'w':
+		options->power = true;
+		break;
+	case 'o':
+		if (strcmp (optarg, "on") && strcmp (optarg, "auto"))
+		{
+			fprintf (stderr, "Error: invalid power control: %s\n", optarg);
+			exit (EXIT_FAILURE);
+		}
+		options->power_control = optarg;
+		options->power = true;
+		break;
+	case 'D':
+	{
+		char *end;
+		errno = 0;
+		long delay = strtol (optarg, &end, 10);
+		if (errno || *end || end == optarg || delay < INT_MIN
+		 || delay > INT_MAX)
+		{
+			fprintf (stderr, "Error: invalid autosuspend delay: %s\n", optarg);
+			exit (EXIT_FAILURE);
+		}
+		options->autosuspend_delay = optarg;
+		options->power = true;
+		break;
+	}
+	case 'W':
+		if (strcmp (optarg, "enabled") && strcmp (optarg, "disabled"))
+		{
+			fprintf (stderr, "Error: invalid wakeup setting: %s\n", optarg);
+			exit (EXIT_FAILURE);
+		}
+		options->wakeup = optarg;
+		options->power = true;
+		break;
+	case 'R':
+		options->measure_resume = true;
+		options->power = true;
+		break;
+	case 'Q':
+		options->irq_pin = optarg;
+		// Fall through
+	case 'q':
+		options->irq = true;
+		break;
 	case '?':
 		exit (EXIT_FAILURE);
 	}
@@ -471,137 +551,1803 @@ parse_options (int argc, char *argv[],
 	}
 }
 
-static int
-apply_options (libusb_device_handle *device,
-	struct options *options, struct sensei_config *new_config)
+/** Return SENSEI_FIELD_* bits of settings given on the command line. */
+static unsigned
+requested_fields (const struct options *options)
 {
-	int result;
-	if (options->show_config)
-	{
-		struct sensei_config config;
-		if ((result = sensei_load_config (device, &config)))
-			return result;
-		sensei_display_config (&config);
-		return 0;
-	}
+	unsigned fields = 0;
+	if (options->set_mode)       fields |= SENSEI_FIELD_MODE;
+	if (options->set_polling)    fields |= SENSEI_FIELD_POLLING;
+	if (options->set_intensity)  fields |= SENSEI_FIELD_INTENSITY;
+	if (options->set_pulsation)  fields |= SENSEI_FIELD_PULSATION;
+	if (options->set_cpi_off)    fields |= SENSEI_FIELD_CPI_OFF;
+	if (options->set_cpi_on)     fields |= SENSEI_FIELD_CPI_ON;
+	return fields;
+}
 
-	if (options->set_mode)
-		if ((result = sensei_set_mode (device, new_config->mode)))
-			return result;
-	if (options->set_polling)
-		if ((result = sensei_set_polling (device, new_config->polling)))
-			return result;
-	if (options->set_intensity)
-		if ((result = sensei_set_intensity (device, new_config->intensity)))
-			return result;
-	if (options->set_pulsation)
-		if ((result = sensei_set_pulsation (device, new_config->pulsation)))
-			return result;
+/** Prepare the chain of commands requested on the command line. */
+static size_t
+prepare_commands (const struct options *options,
+	const struct sensei_config *new_config, struct sensei_command *commands)
+{
+	return sensei_prepare_commands (new_config, requested_fields (options),
+		options->save_to_rom, commands);
+}
 
-	if (options->set_cpi_off)
-		if ((result = sensei_set_cpi (device, new_config->cpi_off, false)))
-			return result;
-	if (options->set_cpi_on)
-		if ((result = sensei_set_cpi (device, new_config->cpi_on, true)))
-			return result;
+// --- Transport probe ---------------------------------------------------------
 
-	if (options->save_to_rom)
-		if ((result = sensei_save_to_rom (device)))
-			return result;
+/** Intervals between writes to try, from the slowest, in microseconds. */
+static const unsigned g_probe_intervals[] =
+	{ 8000, 4000, 2000, 1000, 500, 250, 0 };
 
-	return 0;
-}
+#define N_PROBE_INTERVALS \
+	(sizeof g_probe_intervals / sizeof g_probe_intervals[0])
 
-#define ERROR(label, ...)                         \
-	do {                                          \
-		fprintf (stderr, "Error: " __VA_ARGS__);  \
-		status = 1;                               \
-		goto label;                               \
-	} while (0)
+/** Writes per interval. */
+#define PROBE_WRITES  100
 
-int
-main (int argc, char *argv[])
+static double
+now_seconds (void)
 {
-	struct options options = { 0 };
-	struct sensei_config new_config = { 0 };
-
-	parse_options (argc, argv, &options, &new_config);
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
-	int result, status = 0;
+static int
+compare_doubles (const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+	return (x > y) - (x < y);
+}
 
-	result = libusb_init (NULL);
-	if (result)
-		ERROR (error_0, "libusb initialisation failed: %s\n",
-			libusb_error_name (result));
+/** Nearest-rank percentile of sorted values. */
+static double
+percentile (const double *values, size_t len, double percentile)
+{
+	size_t rank = percentile / 100 * len;
+	return values[rank < len ? rank : len - 1];
+}
 
-	static const int products[] =
+/** Repeat a command at the given interval, storing sorted round trips in
+ *  microseconds and the rate achieved. */
+static int
+probe_run (struct sensei_device *device, const struct sensei_command *command,
+	unsigned interval_us, double rtt_us[PROBE_WRITES], double *rate)
+{
+	int result = 0;
+	double start = now_seconds ();
+	for (size_t i = 0; !result && i < PROBE_WRITES; i++)
 	{
-		USB_PRODUCT_STEELSERIES_SENSEI_RAW,
-		USB_PRODUCT_STEELSERIES_COD_BO2
-	};
+		double wait = start + i * interval_us / 1e6 - now_seconds ();
+		if (wait > 0)
+		{
+			struct timespec ts = { wait, (wait - (time_t) wait) * 1e9 };
+			while (nanosleep (&ts, &ts) && errno == EINTR)
+				;
+		}
 
-	result = 0;
-	libusb_device_handle *device = find_device_list (USB_VENDOR_STEELSERIES,
-		products, sizeof products / sizeof products[0], &result);
-	if (!device)
-	{
-		if (result)
-			ERROR (error_1, "couldn't open device: %s\n",
-				libusb_error_name (result));
-		else
-			ERROR (error_1, "no suitable device found\n");
+		unsigned char data[SENSEI_COMMAND_LENGTH];
+		memcpy (data, command->data, sizeof data);
+		double t0 = now_seconds ();
+		result = sensei_send_command (device, data, sizeof data);
+		rtt_us[i] = (now_seconds () - t0) * 1e6;
 	}
 
-	bool reattach_driver = false;
-
-	result = libusb_kernel_driver_active (device, SENSEI_CTL_IFACE);
-	switch (result)
-	{
-	case 0:
-	case LIBUSB_ERROR_NOT_SUPPORTED:
-		break;
-	case 1:
-		reattach_driver = true;
-		result = libusb_detach_kernel_driver (device, SENSEI_CTL_IFACE);
-		if (result)
-			ERROR (error_2, "couldn't detach kernel driver: %s\n",
-				libusb_error_name (result));
-		break;
-	default:
-		ERROR (error_2, "coudn't detect kernel driver presence: %s\n",
-			libusb_error_name (result));
-	}
+	*rate = PROBE_WRITES / (now_seconds () - start);
+	qsort (rtt_us, PROBE_WRITES, sizeof *rtt_us, compare_doubles);
+	return result;
+}
 
-	result = libusb_claim_interface (device, SENSEI_CTL_IFACE);
+/** Find out how fast writes can go before the device starts refusing them
+ *  or lagging behind, which is when round trips double, and store that. */
+static int
+probe_transport (struct sensei_device *device)
+{
+	// Re-setting the current intensity is harmless
+	struct sensei_config config;
+	int result = sensei_load_config (device, &config);
 	if (result)
-		ERROR (error_3, "couldn't claim interface: %s\n",
-			libusb_error_name (result));
+		return result;
 
-	result = apply_options (device, &options, &new_config);
-	if (result)
-		ERROR (error_4, "operation failed: %s\n",
-			libusb_error_name (result));
+	struct sensei_command command;
+	sensei_command_intensity (&command, config.intensity);
 
-error_4:
-	result = libusb_release_interface (device, SENSEI_CTL_IFACE);
-	if (result)
-		ERROR (error_3, "couldn't release interface: %s\n",
-			libusb_error_name (result));
+	struct sensei_pacing pacing = { 0 };
+	double rtt_us[PROBE_WRITES], rate, baseline_p99 = 0;
+	bool found = false;
 
-error_3:
-	if (reattach_driver)
+	printf ("%10s %10s %10s %10s %10s\n",
+		"interval", "writes/s", "p50 RTT", "p99 RTT", "max RTT");
+	for (size_t i = 0; i < N_PROBE_INTERVALS; i++)
 	{
-		result = libusb_attach_kernel_driver (device, SENSEI_CTL_IFACE);
-		if (result)
-			ERROR (error_2, "couldn't reattach kernel driver: %s\n",
-				libusb_error_name (result));
+		unsigned interval = g_probe_intervals[i];
+		if ((result = probe_run (device, &command, interval, rtt_us, &rate)))
+		{
+			printf ("%8u us  failed: %s\n",
+				interval, sensei_error_name (result));
+			break;
+		}
+
+		double p50 = percentile (rtt_us, PROBE_WRITES, 50),
+			p99 = percentile (rtt_us, PROBE_WRITES, 99);
+		printf ("%8u us %10.1f %7.0f us %7.0f us %7.0f us\n",
+			interval, rate, p50, p99, rtt_us[PROBE_WRITES - 1]);
+
+		// The slowest run tells us what an unloaded round trip looks like
+		if (!i)
+		{
+			baseline_p99 = p99;
+			pacing.rtt_p50_us = p50;
+			pacing.rtt_p99_us = p99;
+		}
+		else if (p99 > 2 * baseline_p99)
+		{
+			printf ("Round trips have doubled, stopping\n");
+			break;
+		}
+
+		pacing.interval_us = interval;
+		found = true;
 	}
 
-error_2:
-	libusb_close (device);
-error_1:
-	libusb_exit (NULL);
-error_0:
-	return status;
+	if (!found)
+		return result ? result : LIBUSB_ERROR_OTHER;
+
+	printf ("Sustainable interval between writes: %u us\n",
+		pacing.interval_us);
+
+	char path[PATH_MAX];
+	if (!sensei_pacing_store (device->product, device->transport->name,
+		&pacing))
+		fprintf (stderr, "Warning: couldn't store the pacing hint: %s\n",
+			strerror (errno));
+	else if (sensei_pacing_path (path, sizeof path))
+		printf ("Pacing hint stored in %s\n", path);
+	return 0;
 }
 
+// --- Watching ----------------------------------------------------------------
+
+static volatile sig_atomic_t g_watch_stopped;
+
+static void
+on_watch_stop (int signum)
+{
+	(void) signum;
+	g_watch_stopped = true;
+}
+
+/** Write the time as an ISO 8601 timestamp with milliseconds. */
+static void
+format_timestamp (uint64_t time_us, char *buf, size_t len)
+{
+	time_t seconds = time_us / 1000000;
+	struct tm tm;
+	localtime_r (&seconds, &tm);
+
+	char date[32], zone[8];
+	strftime (date, sizeof date, "%Y-%m-%dT%H:%M:%S", &tm);
+	strftime (zone, sizeof zone, "%z", &tm);
+	snprintf (buf, len, "%s.%03u%s", date,
+		(unsigned) (time_us % 1000000 / 1000), zone);
+}
+
+/** Print a setting that has changed, or that we see for the first time. */
+static void
+watch_print_field (const struct options *options, const char *timestamp,
+	bool first, const char *name, const char *value, bool is_number)
+{
+	if (!options->json)
+		printf ("%s %s %s\n", timestamp, name, value ? value : "unknown");
+	else if (!value)
+		printf ("%s\"%s\": null", first ? "" : ", ", name);
+	else
+		printf (is_number ? "%s\"%s\": %s" : "%s\"%s\": \"%s\"",
+			first ? "" : ", ", name, value);
+}
+
+/** Print fields of the blob that differ from the previous one. */
+static void
+watch_print_changes (const struct options *options,
+	const unsigned char *previous, const unsigned char *blob)
+{
+	struct sensei_config config;
+	sensei_decode_blob (blob, &config);
+
+	char timestamp[48], number[16];
+	format_timestamp (wall_clock_us (), timestamp, sizeof timestamp);
+	if (options->json)
+		printf ("{\"time\": \"%s\", \"changes\": {", timestamp);
+
+	bool printed = false;
+	for (size_t i = 0; i < SENSEI_BLOB_LENGTH; i++)
+	{
+		if (previous && previous[i] == blob[i])
+			continue;
+
+		const char *name = NULL, *value = NULL;
+		bool is_number = false;
+		switch (i)
+		{
+		case SENSEI_BLOB_INTENSITY:
+			name = "intensity";
+			value = sensei_intensity_name (config.intensity);
+			break;
+		case SENSEI_BLOB_PULSATION:
+			name = "pulsation";
+			value = sensei_pulsation_name (config.pulsation);
+			break;
+		case SENSEI_BLOB_CPI_OFF:
+		case SENSEI_BLOB_CPI_ON:
+			name = i == SENSEI_BLOB_CPI_OFF ? "cpi-off" : "cpi-on";
+			snprintf (number, sizeof number, "%d", SENSEI_CPI_STEP
+				* (i == SENSEI_BLOB_CPI_OFF ? config.cpi_off : config.cpi_on));
+			value = number;
+			is_number = true;
+			break;
+		case SENSEI_BLOB_POLLING:
+			name = "polling";
+			value = sensei_polling_name (config.polling);
+			is_number = true;
+			break;
+		default:
+			// Bytes we don't understand might still tell us something,
+			// just don't flood the output with them on the first sample
+			if (!previous)
+				continue;
+		}
+
+		char byte_name[16];
+		if (!name)
+		{
+			snprintf (byte_name, sizeof byte_name, "byte-%zu", i);
+			snprintf (number, sizeof number, "%u", blob[i]);
+			name = byte_name;
+			value = number;
+			is_number = true;
+		}
+		watch_print_field (options, timestamp, !printed,
+			name, value, is_number);
+		printed = true;
+	}
+
+	if (options->json)
+		printf ("}}\n");
+	fflush (stdout);
+}
+
+/** Re-read the blob at a regular interval, reporting what has changed,
+ *  until interrupted.  Every sample costs a single transfer. */
+static int
+watch (struct sensei_device *device, const struct options *options)
+{
+	struct sigaction sa = { .sa_handler = on_watch_stop };
+	sigemptyset (&sa.sa_mask);
+	sigaction (SIGINT, &sa, NULL);
+	sigaction (SIGTERM, &sa, NULL);
+
+	unsigned char blobs[2][SENSEI_BLOB_LENGTH];
+	const unsigned char *previous = NULL;
+	double next = now_seconds ();
+	for (unsigned n = 0; !g_watch_stopped; n++)
+	{
+		unsigned char *blob = blobs[n % 2];
+		int result = sensei_load_blob (device, blob);
+		if (result < 0)
+			return g_watch_stopped ? 0 : result;
+		if (!previous || memcmp (previous, blob, SENSEI_BLOB_LENGTH))
+			watch_print_changes (options, previous, blob);
+		previous = blob;
+
+		// Keep to the schedule, skipping samples we've been too slow for
+		double now = now_seconds ();
+		do
+			next += options->watch_ms / 1e3;
+		while (next < now);
+
+		double wait = next - now;
+		struct timespec ts = { wait, (wait - (time_t) wait) * 1e9 };
+		while (nanosleep (&ts, &ts) && errno == EINTR && !g_watch_stopped)
+			;
+	}
+	return 0;
+}
+
+/** On failure, @a failed_step describes what went wrong, if known. */
+static int
+apply_options (struct sensei_device *device,
+	struct options *options, struct sensei_config *new_config,
+	const char **failed_step)
+{
+	int result;
+	if (options->show_config)
+	{
+		struct sensei_config config;
+		if ((result = sensei_load_config (device, &config)))
+			return result;
+		sensei_display_config (&config);
+		return 0;
+	}
+	if (options->watch)
+		return watch (device, options);
+	if (options->probe)
+		return probe_transport (device);
+
+	// Only now do we know which model's calibration to use
+	struct sensei_cpi_table table;
+	bool calibrated = (options->set_cpi_on || options->set_cpi_off)
+		&& sensei_cpi_load (device->product, &table);
+	encode_requested_cpi (options, new_config, calibrated ? &table : NULL);
+
+	struct sensei_command commands[SENSEI_MAX_COMMANDS];
+	size_t len = prepare_commands (options, new_config, commands), failed;
+	if ((result = sensei_apply_commands (device, PROJECT_NAME,
+		commands, len, &failed)))
+		*failed_step = commands[failed].step;
+	return result;
+}
+
+#define ERROR(label, ...)                         \
+	do {                                          \
+		fprintf (stderr, "Error: " __VA_ARGS__);  \
+		status = 1;                               \
+		goto label;                               \
+	} while (0)
+
+static int
+open_device (const struct options *options, struct sensei_device **device)
+{
+	switch (options->backend)
+	{
+#ifdef __linux__
+	case BACKEND_USBFS:
+		return sensei_usbfs_open (options->device_path, device);
+	case BACKEND_HIDRAW:
+		return sensei_hidraw_open (options->device_path, device);
+#endif // __linux__
+	default:
+		return sensei_libusb_open (options->device_path, device);
+	}
+}
+
+// --- Metrics -----------------------------------------------------------------
+
+#define METRICS_PREFIX  "sensei_raw_ctl_"
+
+/** Phases of an invocation that get timed. */
+enum phase
+{
+	PHASE_OPEN, PHASE_DETACH, PHASE_CLAIM, PHASE_APPLY,
+	PHASE_RELEASE, PHASE_ATTACH, PHASE_TOTAL, PHASE_COUNT
+};
+
+static const char *g_phase_names[PHASE_COUNT] =
+{
+	"open", "detach", "claim", "apply", "release", "attach", "total"
+};
+
+/** Upper bounds of histogram buckets for phase durations, in seconds. */
+static const double g_phase_buckets[] =
+{
+	0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005,
+	0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5
+};
+
+#define N_PHASE_BUCKETS (sizeof g_phase_buckets / sizeof g_phase_buckets[0])
+
+/** Metric families that we write, in order. */
+static const struct metric_family
+{
+	const char *name;                   ///< Name without the prefix
+	const char *type;                   ///< Prometheus metric type
+	const char *help;                   ///< Description
+}
+g_metric_families[] =
+{
+	{ "runs_total", "counter", "Invocations of the utility" },
+	{ "failures_total", "counter", "Invocations that have failed" },
+	{ "errors_total", "counter", "Failures by libusb error name" },
+	{ "transfers_total", "counter", "Reports sent and received" },
+	{ "syscalls_total", "counter", "System calls issued by fd backends" },
+	{ "retries_total", "counter", "Interrupted system calls repeated" },
+	{ "detaches_total", "counter", "Kernel drivers detached" },
+	{ "reattaches_total", "counter", "Kernel drivers reattached" },
+	{ "phase_duration_seconds", "histogram", "Duration of each phase" },
+	{ "last_run_timestamp_seconds", "gauge", "When the last run finished" },
+	{ "last_run_success", "gauge", "Whether the last run has succeeded" },
+};
+
+#define N_METRIC_FAMILIES \
+	(sizeof g_metric_families / sizeof g_metric_families[0])
+
+/** What happened during this invocation. */
+struct run_metrics
+{
+	double phase_start[PHASE_COUNT];    ///< When each phase started
+	double phase_seconds[PHASE_COUNT];  ///< How long each phase took
+	bool phase_done[PHASE_COUNT];       ///< Whether each phase has run
+	int error;                          ///< The first error, if any
+	struct sensei_stats stats;          ///< Statistics from the device
+};
+
+static void
+phase_start (struct run_metrics *self, enum phase phase)
+{
+	self->phase_start[phase] = now_seconds ();
+}
+
+/** End a phase, remembering the first error to come out of any of them. */
+static void
+phase_end (struct run_metrics *self, enum phase phase, int result)
+{
+	self->phase_seconds[phase] = now_seconds () - self->phase_start[phase];
+	self->phase_done[phase] = true;
+	if (result && !self->error)
+		self->error = result;
+}
+
+/** A single sample, keyed by its name and labels. */
+struct metric
+{
+	char *key;                          ///< Name including labels
+	double value;                       ///< The value
+};
+
+/** Samples, in the order that they first appeared in. */
+struct metric_set
+{
+	struct metric *items;               ///< The samples
+	size_t len;                         ///< Number of samples
+	size_t alloc;                       ///< Allocated length of the array
+};
+
+static struct metric *
+metric_set_get (struct metric_set *self, const char *key)
+{
+	for (size_t i = 0; i < self->len; i++)
+		if (!strcmp (self->items[i].key, key))
+			return &self->items[i];
+
+	if (self->len == self->alloc)
+	{
+		self->alloc = self->alloc ? self->alloc * 2 : 64;
+		if (!(self->items =
+			realloc (self->items, self->alloc * sizeof *self->items)))
+			abort ();
+	}
+
+	struct metric *metric = &self->items[self->len++];
+	if (!(metric->key = strdup (key)))
+		abort ();
+	metric->value = 0;
+	return metric;
+}
+
+static void
+metric_set_free (struct metric_set *self)
+{
+	for (size_t i = 0; i < self->len; i++)
+		free (self->items[i].key);
+	free (self->items);
+}
+
+static void
+metric_add (struct metric_set *self, const char *format, double value, ...)
+{
+	char key[256];
+	va_list ap;
+	va_start (ap, value);
+	vsnprintf (key, sizeof key, format, ap);
+	va_end (ap);
+	metric_set_get (self, key)->value += value;
+}
+
+/** Pick up samples from a previous run, so that counters keep counting. */
+static void
+metric_set_load (struct metric_set *self, FILE *fp)
+{
+	char line[512];
+	while (fgets (line, sizeof line, fp))
+	{
+		line[strcspn (line, "\n")] = '\0';
+		char *space = strrchr (line, ' '), *end;
+		if (*line == '#' || !space)
+			continue;
+
+		*space++ = '\0';
+		double value = strtod (space, &end);
+		if (!*end)
+			metric_set_get (self, line)->value = value;
+	}
+}
+
+/** Whether a sample belongs to the given family. */
+static bool
+metric_in_family (const char *key, const struct metric_family *family)
+{
+	size_t prefix_len = sizeof METRICS_PREFIX - 1;
+	size_t name_len = strlen (family->name);
+	if (strncmp (key, METRICS_PREFIX, prefix_len)
+	 || strncmp (key + prefix_len, family->name, name_len))
+		return false;
+
+	const char *rest = key + prefix_len + name_len;
+	if (!strcmp (family->type, "histogram"))
+	{
+		static const char *suffixes[] = { "_bucket", "_sum", "_count" };
+		for (size_t i = 0; i < 3; i++)
+			if (!strncmp (rest, suffixes[i], strlen (suffixes[i])))
+				rest += strlen (suffixes[i]);
+	}
+	return !*rest || *rest == '{';
+}
+
+static void
+metric_set_write (const struct metric_set *self, FILE *fp)
+{
+	for (size_t i = 0; i < N_METRIC_FAMILIES; i++)
+	{
+		const struct metric_family *family = &g_metric_families[i];
+		fprintf (fp, "# HELP " METRICS_PREFIX "%s %s\n",
+			family->name, family->help);
+		fprintf (fp, "# TYPE " METRICS_PREFIX "%s %s\n",
+			family->name, family->type);
+		for (size_t k = 0; k < self->len; k++)
+			if (metric_in_family (self->items[k].key, family))
+				fprintf (fp, "%s %.17g\n",
+					self->items[k].key, self->items[k].value);
+	}
+}
+
+/** Add this run to the set. */
+static void
+metric_set_update (struct metric_set *self, const struct run_metrics *run)
+{
+	metric_add (self, METRICS_PREFIX "runs_total", 1);
+	metric_add (self, METRICS_PREFIX "failures_total", run->error != 0);
+	if (run->error)
+		metric_add (self, METRICS_PREFIX "errors_total{error=\"%s\"}", 1,
+			sensei_error_name (run->error));
+
+	metric_add (self, METRICS_PREFIX "transfers_total", run->stats.transfers);
+	metric_add (self, METRICS_PREFIX "syscalls_total", run->stats.syscalls);
+	metric_add (self, METRICS_PREFIX "retries_total", run->stats.retries);
+	metric_add (self, METRICS_PREFIX "detaches_total", run->stats.detaches);
+	metric_add (self, METRICS_PREFIX "reattaches_total",
+		run->stats.reattaches);
+
+	for (int phase = 0; phase < PHASE_COUNT; phase++)
+	{
+		const char *name = g_phase_names[phase];
+		bool done = run->phase_done[phase];
+		double seconds = run->phase_seconds[phase];
+
+		// Cumulative buckets, all of them, so that the series are complete
+		for (size_t i = 0; i < N_PHASE_BUCKETS; i++)
+		{
+			bool inside = done && seconds <= g_phase_buckets[i];
+			metric_add (self, METRICS_PREFIX "phase_duration_seconds_bucket"
+				"{phase=\"%s\",le=\"%g\"}", inside, name, g_phase_buckets[i]);
+		}
+		metric_add (self, METRICS_PREFIX "phase_duration_seconds_bucket"
+			"{phase=\"%s\",le=\"+Inf\"}", done, name);
+		metric_add (self, METRICS_PREFIX "phase_duration_seconds_sum"
+			"{phase=\"%s\"}", done ? seconds : 0, name);
+		metric_add (self, METRICS_PREFIX "phase_duration_seconds_count"
+			"{phase=\"%s\"}", done, name);
+	}
+
+	metric_set_get (self, METRICS_PREFIX "last_run_timestamp_seconds")->value
+		= time (NULL);
+	metric_set_get (self, METRICS_PREFIX "last_run_success")->value
+		= !run->error;
+}
+
+/** Merge this run into the metrics file, replacing it atomically.  Runs
+ *  are serialized by locking the directory, the file itself gets replaced. */
+static bool
+write_metrics (const char *path, const struct run_metrics *run)
+{
+	size_t tmp_path_len = strlen (path) + sizeof ".XXXXXX";
+	char *path_copy = strdup (path), *tmp_path = malloc (tmp_path_len);
+	if (!path_copy || !tmp_path)
+	{
+		free (path_copy);
+		free (tmp_path);
+		return false;
+	}
+	snprintf (tmp_path, tmp_path_len, "%s.XXXXXX", path);
+
+	bool ok = false;
+	int dir_fd = open (dirname (path_copy), O_RDONLY | O_DIRECTORY);
+	if (dir_fd < 0 || flock (dir_fd, LOCK_EX))
+		goto out;
+
+	struct metric_set set = { 0 };
+	FILE *fp = fopen (path, "r");
+	if (fp)
+	{
+		metric_set_load (&set, fp);
+		fclose (fp);
+	}
+	metric_set_update (&set, run);
+
+	int fd = mkstemp (tmp_path);
+	if (fd >= 0 && (fchmod (fd, 0644), fp = fdopen (fd, "w")))
+	{
+		metric_set_write (&set, fp);
+		ok = !ferror (fp);
+		ok = !fclose (fp) && ok && !rename (tmp_path, path);
+	}
+	else if (fd >= 0)
+		close (fd);
+
+	if (!ok && fd >= 0)
+		unlink (tmp_path);
+	metric_set_free (&set);
+
+out:
+	if (dir_fd >= 0)
+		close (dir_fd);
+	free (path_copy);
+	free (tmp_path);
+	return ok;
+}
+
+// --- Audit -------------------------------------------------------------------
+
+/** List all devices, with hidraw nodes where the platform has them. */
+static int
+list_devices (struct sensei_device_info **list, size_t *len)
+{
+#ifdef __linux__
+	return sensei_sysfs_list (list, len);
+#else // ! __linux__
+	return sensei_libusb_list (list, len);
+#endif // ! __linux__
+}
+
+/** Open a listed device, preferring hidraw, where there's no kernel driver
+ *  to detach.  Stores which transport and node were used. */
+static int
+open_listed (const struct sensei_device_info *info,
+	const char **transport, const char **path, struct sensei_device **device)
+{
+#ifdef __linux__
+	if (info->hidraw_path)
+	{
+		*transport = "hidraw";
+		*path = info->hidraw_path;
+		return sensei_hidraw_open (*path, device);
+	}
+
+	*transport = "usbfs";
+	*path = info->usb_path;
+	return sensei_usbfs_open (*path, device);
+#else // ! __linux__
+	*transport = "libusb";
+	*path = info->usb_path;
+	return sensei_libusb_open (*path, device);
+#endif // ! __linux__
+}
+
+/** Reading out a single device in an audit. */
+struct audit_job
+{
+	const struct sensei_device_info *info;  ///< The device
+	pthread_t thread;                   ///< The thread doing the work
+	bool have_thread;                   ///< Whether the thread was started
+
+	const char *transport;              ///< What we used to access it
+	const char *path;                   ///< Which node we used
+	int result;                         ///< Zero or a libusb error code
+	unsigned char blob[SENSEI_BLOB_LENGTH];  ///< What we've read
+};
+
+static void *
+audit_device (void *data)
+{
+	struct audit_job *job = data;
+	struct sensei_device *device = NULL;
+	if ((job->result = open_listed (job->info,
+		&job->transport, &job->path, &device)))
+		return NULL;
+
+	if (!(job->result = sensei_detach_kernel_driver (device)))
+	{
+		if (!(job->result = sensei_claim_interface (device)))
+		{
+			job->result = sensei_load_blob (device, job->blob);
+			sensei_release_interface (device);
+		}
+
+		int result = sensei_attach_kernel_driver (device);
+		if (!job->result)
+			job->result = result;
+	}
+	sensei_close (device);
+	return NULL;
+}
+
+/** Read out all devices in parallel and print a line for each of them:
+ *  host, device node, product ID, transport and either the digest of known
+ *  settings followed by their values, or "error" and the error name. */
+static int
+audit (void)
+{
+	struct sensei_device_info *list;
+	size_t len;
+	int result = list_devices (&list, &len);
+	if (result)
+	{
+		fprintf (stderr, "Error: couldn't list devices: %s\n",
+			sensei_error_name (result));
+		return 1;
+	}
+	if (!len)
+	{
+		fprintf (stderr, "Error: no suitable device found\n");
+		free (list);
+		return 1;
+	}
+
+	char host[256] = "-";
+	if (!gethostname (host, sizeof host))
+		host[sizeof host - 1] = '\0';
+
+	struct audit_job *jobs = calloc (len, sizeof *jobs);
+	if (!jobs)
+	{
+		fprintf (stderr, "Error: %s\n",
+			sensei_error_name (LIBUSB_ERROR_NO_MEM));
+		sensei_free_device_list (list, len);
+		return 1;
+	}
+
+	// Every device gets its own thread, there won't be many of them
+	for (size_t i = 0; i < len; i++)
+	{
+		jobs[i].info = &list[i];
+		jobs[i].have_thread =
+			!pthread_create (&jobs[i].thread, NULL, audit_device, &jobs[i]);
+		if (!jobs[i].have_thread)
+			audit_device (&jobs[i]);
+	}
+
+	int status = 0;
+	for (size_t i = 0; i < len; i++)
+	{
+		struct audit_job *job = &jobs[i];
+		if (job->have_thread)
+			pthread_join (job->thread, NULL);
+
+		printf ("%s %s %04x %s ", host, job->path ? job->path : "-",
+			job->info->product, job->transport);
+		if (job->result)
+		{
+			printf ("error %s\n", sensei_error_name (job->result));
+			status = 1;
+			continue;
+		}
+
+		printf ("%016" PRIx64 " ", sensei_blob_digest (job->blob));
+		for (size_t k = 0; k < sensei_blob_known_len; k++)
+			printf ("%02x", job->blob[sensei_blob_known[k]]);
+		printf ("\n");
+	}
+
+	free (jobs);
+	sensei_free_device_list (list, len);
+	return status;
+}
+
+// --- Synchronized settings ---------------------------------------------------
+
+/** A chain of commands split around the one that sets the LED phase. */
+enum sync_part
+{
+	SYNC_BEFORE,                        ///< Sent while waiting for others
+	SYNC_AT,                            ///< Released from the barrier
+	SYNC_AFTER,                         ///< Sent afterwards, such as saving
+	SYNC_PARTS
+};
+
+struct sync_chain
+{
+	struct sensei_command commands[SYNC_PARTS][SENSEI_MAX_COMMANDS];
+	size_t len[SYNC_PARTS];             ///< Length of each part
+};
+
+/** Applying settings to a single device together with all the others. */
+struct sync_job
+{
+	const struct sensei_device_info *info;  ///< The device
+	const struct sync_chain *chain;     ///< What to send
+	pthread_mutex_t *start_lock;        ///< Held until all threads exist
+	pthread_barrier_t *barrier;         ///< Where all jobs meet
+	pthread_t thread;                   ///< The thread doing the work
+
+	const char *transport;              ///< What we used to access it
+	const char *path;                   ///< Which node we used
+	int result;                         ///< Zero or a libusb error code
+	const char *failed_step;            ///< The failed command, if any
+	size_t sent;                        ///< Commands that went through
+	double released;                    ///< When the barrier let us go
+	double landed;                      ///< When the device took it
+};
+
+static int
+sync_send (struct sync_job *job, struct sensei_device *device,
+	enum sync_part part)
+{
+	size_t failed;
+	int result = sensei_send_commands (device,
+		job->chain->commands[part], job->chain->len[part], &failed);
+	if (result)
+		job->failed_step = job->chain->commands[part][failed].step;
+	job->sent += result ? failed : job->chain->len[part];
+	return result;
+}
+
+/** Record what has been sent to the device as a single change. */
+static void
+sync_journal (struct sync_job *job, struct sensei_journal_entry *entry)
+{
+	struct sensei_command commands[SENSEI_MAX_COMMANDS];
+	size_t len = 0;
+	for (int part = 0; part < SYNC_PARTS; part++)
+		for (size_t i = 0; i < job->chain->len[part]; i++)
+			commands[len++] = job->chain->commands[part][i];
+	if (len)
+		sensei_journal_commit (entry, commands, len, job->sent, job->result);
+}
+
+static void *
+sync_device (void *data)
+{
+	struct sync_job *job = data;
+	pthread_mutex_lock (job->start_lock);
+	pthread_mutex_unlock (job->start_lock);
+
+	// Do everything that takes time before meeting the others
+	struct sensei_device *device = NULL;
+	struct sensei_journal_entry entry;
+	bool detached = false, claimed = false;
+	if (!(job->result = open_listed (job->info,
+		&job->transport, &job->path, &device)))
+	{
+		sensei_use_pacing (device);
+		detached = !(job->result = sensei_detach_kernel_driver (device));
+		if (detached)
+			claimed = !(job->result = sensei_claim_interface (device));
+		if (claimed)
+		{
+			sensei_journal_begin (device, PROJECT_NAME, &entry);
+			job->result = sync_send (job, device, SYNC_BEFORE);
+		}
+		// So that pacing can't delay the first command after the barrier
+		if (!job->result)
+			sensei_wait_for_pacing (device);
+	}
+
+	// Everyone has to turn up, even those that have already failed
+	pthread_barrier_wait (job->barrier);
+	job->released = now_seconds ();
+	if (!job->result && !(job->result = sync_send (job, device, SYNC_AT)))
+	{
+		job->landed = now_seconds ();
+		job->result = sync_send (job, device, SYNC_AFTER);
+	}
+
+	if (claimed)
+	{
+		sync_journal (job, &entry);
+		sensei_release_interface (device);
+	}
+	if (detached)
+	{
+		int result = sensei_attach_kernel_driver (device);
+		if (!job->result)
+			job->result = result;
+	}
+	if (device)
+		sensei_close (device);
+	return NULL;
+}
+
+/** Split the requested settings so that the command restarting pulsation,
+ *  or setting intensity when pulsation stays as it is, goes out alone. */
+static bool
+sync_prepare (const struct options *options,
+	const struct sensei_config *new_config, struct sync_chain *chain)
+{
+	unsigned fields = requested_fields (options), at;
+	if (fields & SENSEI_FIELD_PULSATION)
+		at = SENSEI_FIELD_PULSATION;
+	else if (fields & SENSEI_FIELD_INTENSITY)
+		at = SENSEI_FIELD_INTENSITY;
+	else
+		return false;
+
+	unsigned before = fields & ~at & (SENSEI_FIELD_MODE
+		| SENSEI_FIELD_POLLING | SENSEI_FIELD_INTENSITY);
+	unsigned after = fields & (SENSEI_FIELD_CPI_OFF | SENSEI_FIELD_CPI_ON);
+	chain->len[SYNC_BEFORE] = sensei_prepare_commands (new_config,
+		before, false, chain->commands[SYNC_BEFORE]);
+	chain->len[SYNC_AT] = sensei_prepare_commands (new_config,
+		at, false, chain->commands[SYNC_AT]);
+	chain->len[SYNC_AFTER] = sensei_prepare_commands (new_config,
+		after, options->save_to_rom, chain->commands[SYNC_AFTER]);
+	return true;
+}
+
+/** Apply settings to all devices, each on its own thread, releasing them
+ *  together from a barrier.  Prints how far apart they took the command. */
+static int
+sync_devices (const struct options *options,
+	const struct sensei_config *new_config)
+{
+	struct sync_chain chain;
+	if (!sync_prepare (options, new_config, &chain))
+	{
+		fprintf (stderr, "Error: --sync needs --pulsation or --intensity\n");
+		return 1;
+	}
+
+	struct sensei_device_info *list;
+	size_t len;
+	int result = list_devices (&list, &len);
+	if (result)
+	{
+		fprintf (stderr, "Error: couldn't list devices: %s\n",
+			sensei_error_name (result));
+		return 1;
+	}
+
+	struct sync_job *jobs = calloc (len, sizeof *jobs);
+	if (!len || !jobs)
+	{
+		fprintf (stderr, "Error: %s\n", len
+			? sensei_error_name (LIBUSB_ERROR_NO_MEM)
+			: "no suitable device found");
+		free (jobs);
+		sensei_free_device_list (list, len);
+		return 1;
+	}
+
+	// The barrier can only be sized once we know how many threads there are
+	pthread_mutex_t start_lock = PTHREAD_MUTEX_INITIALIZER;
+	pthread_barrier_t barrier;
+	pthread_mutex_lock (&start_lock);
+	size_t started = 0;
+	while (started < len)
+	{
+		struct sync_job *job = &jobs[started];
+		job->info = &list[started];
+		job->chain = &chain;
+		job->start_lock = &start_lock;
+		job->barrier = &barrier;
+		if (pthread_create (&job->thread, NULL, sync_device, job))
+			break;
+		started++;
+	}
+	if (started)
+		pthread_barrier_init (&barrier, NULL, started);
+	pthread_mutex_unlock (&start_lock);
+
+	int status = 0;
+	double first = 0, last = 0, first_released = 0, last_released = 0;
+	for (size_t i = 0; i < started; i++)
+		pthread_join (jobs[i].thread, NULL);
+	for (size_t i = 0; i < len; i++)
+	{
+		struct sync_job *job = &jobs[i];
+		if (i >= started)
+			job->result = LIBUSB_ERROR_NO_MEM;
+		if (job->result)
+		{
+			printf ("%s: %s%s%s\n", job->path ? job->path : "-",
+				job->failed_step ? job->failed_step : "",
+				job->failed_step ? " failed: " : "",
+				sensei_error_name (job->result));
+			status = 1;
+			continue;
+		}
+
+		if (!first || job->landed < first)
+			first = job->landed;
+		if (job->landed > last)
+			last = job->landed;
+		if (!first_released || job->released < first_released)
+			first_released = job->released;
+		if (job->released > last_released)
+			last_released = job->released;
+	}
+
+	for (size_t i = 0; i < len; i++)
+		if (!jobs[i].result)
+			printf ("%s: %s, took it %.0f us after the first device,"
+				" in %.0f us\n", jobs[i].path, jobs[i].transport,
+				(jobs[i].landed - first) * 1e6,
+				(jobs[i].landed - jobs[i].released) * 1e6);
+	if (first)
+		printf ("Skew: %.0f us, threads released within %.0f us\n",
+			(last - first) * 1e6, (last_released - first_released) * 1e6);
+
+	if (started)
+		pthread_barrier_destroy (&barrier);
+	free (jobs);
+	sensei_free_device_list (list, len);
+	return status;
+}
+
+// --- Change journal ----------------------------------------------------------
+
+/** Entries collected from all journals we can read. */
+struct journal_list
+{
+	const char *device;                 ///< Only entries for this device
+	struct sensei_journal_entry *entries;
+	size_t len;                         ///< Number of entries
+	size_t alloc;                       ///< Allocated entries
+};
+
+static bool
+journal_collect (const struct sensei_journal_entry *entry, void *user_data)
+{
+	struct journal_list *list = user_data;
+	if (list->device && strcmp (list->device, entry->node)
+	 && strcmp (list->device, entry->port))
+		return true;
+
+	if (list->len == list->alloc)
+	{
+		size_t alloc = list->alloc ? list->alloc * 2 : 64;
+		void *entries = realloc (list->entries, alloc * sizeof *list->entries);
+		if (!entries)
+			return false;
+		list->entries = entries;
+		list->alloc = alloc;
+	}
+	list->entries[list->len++] = *entry;
+	return true;
+}
+
+static int
+compare_journal_entries (const void *a, const void *b)
+{
+	const struct sensei_journal_entry *x = a, *y = b;
+	if (x->time_us != y->time_us)
+		return x->time_us < y->time_us ? -1 : 1;
+	return (x->pid > y->pid) - (x->pid < y->pid);
+}
+
+/** Describe the value that a command sets, or the one from @a config
+ *  when not NULL.  Returns the name of the setting, or NULL. */
+static const char *
+journal_setting (const unsigned char *command,
+	const struct sensei_config *config, char *value, size_t len,
+	bool *is_number)
+{
+	const char *name = NULL, *string = NULL;
+	int number = -1;
+	*is_number = false;
+	switch (command[0])
+	{
+	case SENSEI_CMD_MODE:
+		name = "mode";
+		string = sensei_mode_name (config ? config->mode : command[2]);
+		break;
+	case SENSEI_CMD_POLLING:
+		name = "polling";
+		string = sensei_polling_name (config ? config->polling : command[2]);
+		*is_number = true;
+		break;
+	case SENSEI_CMD_INTENSITY:
+		name = "intensity";
+		string = sensei_intensity_name
+			(config ? config->intensity : command[2]);
+		break;
+	case SENSEI_CMD_PULSATION:
+		name = "pulsation";
+		string = sensei_pulsation_name
+			(config ? config->pulsation : command[2]);
+		break;
+	case SENSEI_CMD_CPI:
+		name = command[1] == 1 ? "cpi-off" : "cpi-on";
+		number = command[2];
+		if (config)
+			number = command[1] == 1 ? config->cpi_off : config->cpi_on;
+		*is_number = true;
+		break;
+	default:
+		return NULL;
+	}
+
+	if (number >= SENSEI_CPI_MIN && number <= SENSEI_CPI_MAX)
+		snprintf (value, len, "%d", number * SENSEI_CPI_STEP);
+	else if (string)
+		snprintf (value, len, "%s", string);
+	else
+		*value = '\0';
+	return name;
+}
+
+static void
+journal_print (const struct options *options,
+	const struct sensei_journal_entry *entry)
+{
+	char timestamp[48];
+	format_timestamp (entry->time_us, timestamp, sizeof timestamp);
+	const char *device = *entry->port ? entry->port : entry->node;
+	if (options->json)
+		printf ("{\"time\": \"%s\", \"caller\": \"%s\", \"pid\": %" PRIu32
+			", \"uid\": %" PRIu32 ", \"product\": \"%04x\", \"port\": \"%s\""
+			", \"node\": \"%s\", \"changes\": [", timestamp, entry->caller,
+			entry->pid, entry->uid, entry->product, entry->port, entry->node);
+	else
+		printf ("%s %s[%" PRIu32 "] uid %" PRIu32 " %s:", timestamp,
+			entry->caller, entry->pid, entry->uid, *device ? device : "-");
+
+	bool saved = false, first = true;
+	for (size_t i = 0; i < entry->commands_len; i++)
+	{
+		const unsigned char *command = entry->commands[i];
+		if (command[0] == SENSEI_CMD_SAVE)
+		{
+			saved = true;
+			continue;
+		}
+
+		// The mode can't be read from the device, so it's never known
+		bool have_before =
+			entry->before_known && command[0] != SENSEI_CMD_MODE;
+		char before[16] = "", after[16];
+		bool is_number;
+		const char *name =
+			journal_setting (command, NULL, after, sizeof after, &is_number);
+		if (!name)
+			continue;
+		if (have_before)
+			journal_setting (command, &entry->before,
+				before, sizeof before, &is_number);
+
+		if (!options->json)
+			printf ("%s %s %s -> %s", first ? "" : ",", name,
+				*before ? before : "?", *after ? after : "?");
+		else
+		{
+			printf ("%s{\"setting\": \"%s\"", first ? "" : ", ", name);
+			const char *format =
+				is_number ? ", \"%s\": %s" : ", \"%s\": \"%s\"";
+			if (*before)
+				printf (format, "before", before);
+			else
+				printf (", \"before\": null");
+			if (*after)
+				printf (format, "after", after);
+			else
+				printf (", \"after\": null");
+			printf ("}");
+		}
+		first = false;
+	}
+
+	const char *error =
+		entry->result ? sensei_error_name (entry->result) : NULL;
+	if (options->json)
+	{
+		printf ("], \"saved\": %s, \"error\": ", saved ? "true" : "false");
+		if (error)
+			printf ("\"%s\"}\n", error);
+		else
+			printf ("null}\n");
+		return;
+	}
+	if (saved)
+		printf ("%s saved to ROM", first ? "" : ",");
+	if (error)
+		printf ("; failed: %s", error);
+	printf ("\n");
+}
+
+/** Print changes from the system journal and the user's, in time order. */
+static int
+journal (const struct options *options)
+{
+	struct journal_list list = { .device = options->device_path };
+	char paths[2][PATH_MAX] = { "", "" };
+	bool any = false;
+	for (int system = 1; system >= 0; system--)
+	{
+		char *path = paths[system];
+		if (!sensei_journal_path (system, path, PATH_MAX)
+		 || (!system && !strcmp (path, paths[1])))
+			continue;
+		if (sensei_journal_query (path, options->since_us, options->until_us,
+			journal_collect, &list))
+			any = true;
+		else if (errno != ENOENT)
+			fprintf (stderr, "Warning: couldn't read %s: %s\n",
+				path, strerror (errno));
+	}
+	if (!any)
+	{
+		fprintf (stderr, "Error: no journal has been written yet\n");
+		return 1;
+	}
+
+	qsort (list.entries, list.len, sizeof *list.entries,
+		compare_journal_entries);
+	for (size_t i = 0; i < list.len; i++)
+		journal_print (options, &list.entries[i]);
+	free (list.entries);
+	return 0;
+}
+
+#ifdef __linux__
+// --- Power management --------------------------------------------------------
+
+/** The kernel may take a moment longer than the delay to suspend. */
+#define RESUME_IDLE_MARGIN_MS  1000
+/** Idle periods measured under each policy. */
+#define RESUME_ROUNDS  3
+
+static void
+show_power (const char *port_path, const struct sensei_power *power)
+{
+	printf ("Port:           %s\n", port_path);
+	printf ("Control:        %s\n", power->control);
+	if (power->autosuspend_delay_ms < 0)
+		printf ("Autosuspend:    never\n");
+	else
+		printf ("Autosuspend:    after %d ms\n", power->autosuspend_delay_ms);
+	printf ("Wakeup:         %s\n", *power->wakeup ? power->wakeup : "-");
+	printf ("Runtime status: %s\n",
+		*power->runtime_status ? power->runtime_status : "-");
+}
+
+/** Time how long it takes to open the device and read its configuration,
+ *  which includes resuming it if it's suspended. */
+static int
+time_first_transfer (const struct options *options, double *seconds)
+{
+	struct sensei_device *device = NULL;
+	struct sensei_config config;
+	double start = now_seconds ();
+	int result = open_device (options, &device);
+	if (result)
+		return result;
+
+	if (!(result = sensei_detach_kernel_driver (device)))
+	{
+		if (!(result = sensei_claim_interface (device)))
+		{
+			result = sensei_load_config (device, &config);
+			*seconds = now_seconds () - start;
+			sensei_release_interface (device);
+		}
+
+		int attach_result = sensei_attach_kernel_driver (device);
+		if (!result)
+			result = attach_result;
+	}
+	sensei_close (device);
+	return result;
+}
+
+static int
+compare_ints (const void *a, const void *b)
+{
+	int x = *(const int *) a, y = *(const int *) b;
+	return (x > y) - (x < y);
+}
+
+/** Let the device go idle under each policy, then compare the first transfer
+ *  against one made right after it.  The difference is what resuming costs,
+ *  and it's what the first movement after idle pays as well.  Input reports
+ *  only come when the mouse moves, which we can't time from here, so
+ *  a GET_REPORT control transfer stands in for the first of them. */
+static int
+measure_resume (const struct options *options, const char *port_path,
+	const struct sensei_power *power)
+{
+	static const char *policies[] = { "on", "auto" };
+	unsigned idle_ms = RESUME_IDLE_MARGIN_MS;
+	if (power->autosuspend_delay_ms < 0)
+		fprintf (stderr, "Warning: autosuspend is disabled by a negative"
+			" delay, expect no difference\n");
+	else
+		idle_ms += power->autosuspend_delay_ms;
+
+	printf ("\n%-6s %5s %-12s %12s %12s\n",
+		"policy", "round", "status", "after idle", "next");
+	int result = 0;
+	for (size_t i = 0; !result && i < sizeof policies / sizeof *policies; i++)
+	{
+		if ((result = sensei_power_set (port_path, "control", policies[i])))
+			break;
+
+		int delays_us[RESUME_ROUNDS];
+		for (int round = 0; !result && round < RESUME_ROUNDS; round++)
+		{
+			struct timespec ts = { idle_ms / 1000, idle_ms % 1000 * 1000000 };
+			while (nanosleep (&ts, &ts) && errno == EINTR)
+				;
+
+			// Check whether the kernel has actually suspended the device
+			struct sensei_power state;
+			double first = 0, next = 0;
+			if ((result = sensei_power_get (port_path, &state))
+			 || (result = time_first_transfer (options, &first))
+			 || (result = time_first_transfer (options, &next)))
+				break;
+
+			printf ("%-6s %5d %-12s %9.0f us %9.0f us\n", policies[i],
+				round + 1, state.runtime_status, first * 1e6, next * 1e6);
+			delays_us[round] = (first - next) * 1e6;
+		}
+		if (!result)
+		{
+			qsort (delays_us, RESUME_ROUNDS, sizeof *delays_us, compare_ints);
+			printf ("%-6s median resume delay: %d us\n",
+				policies[i], delays_us[RESUME_ROUNDS / 2]);
+		}
+	}
+
+	// Leave things the way they were
+	int restore_result =
+		sensei_power_set (port_path, "control", power->control);
+	return result ? result : restore_result;
+}
+
+/** Find the USB port of the device, and make sure measurements reopen this
+ *  very device by storing its node in @a node.  Prints errors. */
+static bool
+find_port (struct options *options, char port_path[64], char node[PATH_MAX])
+{
+	struct sensei_device *device = NULL;
+	int result = open_device (options, &device);
+	if (result == LIBUSB_ERROR_NOT_FOUND)
+	{
+		fprintf (stderr, "Error: no suitable device found\n");
+		return false;
+	}
+	if (result)
+	{
+		fprintf (stderr, "Error: couldn't open device: %s\n",
+			sensei_error_name (result));
+		return false;
+	}
+
+	snprintf (node, PATH_MAX, "%s", device->path);
+	options->device_path = node;
+	result = sensei_get_port_path (device, port_path, 64);
+	sensei_close (device);
+	if (result)
+	{
+		fprintf (stderr, "Error: couldn't find the USB port: %s\n",
+			sensei_error_name (result));
+		return false;
+	}
+	return true;
+}
+
+/** Show and change power management settings of the device, which doesn't
+ *  stay open so that it can actually go idle. */
+static int
+power (struct options *options)
+{
+	char port_path[64], node[PATH_MAX];
+	if (!find_port (options, port_path, node))
+		return 1;
+
+	// Set the delay first, so that "auto" starts with the right one
+	const char *name = NULL;
+	int result;
+	if ((options->autosuspend_delay && (result = sensei_power_set (port_path,
+		name = "autosuspend_delay_ms", options->autosuspend_delay)))
+	 || (options->wakeup && (result = sensei_power_set (port_path,
+		name = "wakeup", options->wakeup)))
+	 || (options->power_control && (result = sensei_power_set (port_path,
+		name = "control", options->power_control))))
+	{
+		fprintf (stderr, "Error: couldn't set %s: %s\n",
+			name, sensei_error_name (result));
+		return 1;
+	}
+
+	struct sensei_power state;
+	if ((result = sensei_power_get (port_path, &state)))
+	{
+		fprintf (stderr, "Error: couldn't read power settings: %s\n",
+			sensei_error_name (result));
+		return 1;
+	}
+	show_power (port_path, &state);
+
+	if (options->measure_resume
+	 && (result = measure_resume (options, port_path, &state)))
+	{
+		fprintf (stderr, "Error: measurement failed: %s\n",
+			sensei_error_name (result));
+		return 1;
+	}
+	return 0;
+}
+
+// --- Interrupt affinity ------------------------------------------------------
+
+/** GET_REPORT round trips per measurement. */
+#define IRQ_ROUNDS  200
+/** Highest CPU number that we handle. */
+#define IRQ_MAX_CPUS  1024
+/** Idle states that take longer than this to leave are worth a mention. */
+#define IRQ_IDLE_HINT_US  20
+
+/** Parse a CPU list like "0-3,8", as used by the kernel. */
+static bool
+parse_cpu_list (const char *list, bool cpus[IRQ_MAX_CPUS])
+{
+	memset (cpus, 0, IRQ_MAX_CPUS * sizeof *cpus);
+	bool any = false;
+	while (*list)
+	{
+		char *end;
+		unsigned long first = strtoul (list, &end, 10), last = first;
+		if (end == list)
+			return false;
+		if (*end == '-')
+		{
+			list = end + 1;
+			last = strtoul (list, &end, 10);
+			if (end == list)
+				return false;
+		}
+		if (first > last || last >= IRQ_MAX_CPUS)
+			return false;
+		for (; first <= last; first++)
+			cpus[first] = any = true;
+
+		if (*end == ',' && end[1])
+			end++;
+		else if (*end)
+			return false;
+		list = end;
+	}
+	return any;
+}
+
+/** Round trips through the controller, and who has serviced them. */
+struct irq_latency
+{
+	double p50_us;                      ///< Median round trip
+	double p99_us;                      ///< 99th percentile round trip
+	int cpu;                            ///< CPU with most interrupts, or -1
+	uint64_t interrupts;                ///< Interrupts on that CPU
+};
+
+/** Add up interrupt counts of all vectors of the controller per CPU. */
+static int
+irq_count (const struct sensei_controller *controller,
+	uint64_t totals[IRQ_MAX_CPUS])
+{
+	uint64_t counts[IRQ_MAX_CPUS];
+	memset (totals, 0, IRQ_MAX_CPUS * sizeof *totals);
+	for (size_t i = 0; i < controller->irqs_len; i++)
+	{
+		int result = sensei_irq_counts (controller->irqs[i],
+			counts, IRQ_MAX_CPUS);
+		if (result)
+			return result;
+		for (size_t cpu = 0; cpu < IRQ_MAX_CPUS; cpu++)
+			totals[cpu] += counts[cpu];
+	}
+	return 0;
+}
+
+/** Time GET_REPORT round trips, each of which completes with an interrupt
+ *  from the controller, watching which CPU takes them.  Other devices on
+ *  the same controller add to the counts, but rarely enough to matter. */
+static int
+irq_measure (const struct options *options,
+	const struct sensei_controller *controller, struct irq_latency *latency)
+{
+	struct sensei_device *device = NULL;
+	int result = open_device (options, &device);
+	if (result)
+		return result;
+	if ((result = sensei_detach_kernel_driver (device)))
+		goto out;
+	if ((result = sensei_claim_interface (device)))
+		goto attach;
+
+	static uint64_t before[IRQ_MAX_CPUS], after[IRQ_MAX_CPUS];
+	double rtt_us[IRQ_ROUNDS];
+	unsigned char blob[SENSEI_BLOB_LENGTH];
+	if ((result = irq_count (controller, before)))
+		goto release;
+	for (size_t i = 0; i < IRQ_ROUNDS; i++)
+	{
+		double t0 = now_seconds ();
+		if ((result = sensei_load_blob (device, blob)) < 0)
+			goto release;
+		rtt_us[i] = (now_seconds () - t0) * 1e6;
+	}
+	if ((result = irq_count (controller, after)))
+		goto release;
+
+	qsort (rtt_us, IRQ_ROUNDS, sizeof *rtt_us, compare_doubles);
+	latency->p50_us = percentile (rtt_us, IRQ_ROUNDS, 50);
+	latency->p99_us = percentile (rtt_us, IRQ_ROUNDS, 99);
+	latency->cpu = -1;
+	latency->interrupts = 0;
+	for (int cpu = 0; cpu < IRQ_MAX_CPUS; cpu++)
+		if (after[cpu] - before[cpu] > latency->interrupts)
+		{
+			latency->cpu = cpu;
+			latency->interrupts = after[cpu] - before[cpu];
+		}
+	result = 0;
+
+release:
+	sensei_release_interface (device);
+attach:
+	sensei_attach_kernel_driver (device);
+out:
+	sensei_close (device);
+	return result;
+}
+
+static void
+show_latency (const char *label, const struct irq_latency *latency)
+{
+	printf ("%-8s %9.0f us %9.0f us", label, latency->p50_us, latency->p99_us);
+	if (latency->cpu < 0)
+		printf ("   -\n");
+	else
+		printf ("   CPU %d (%" PRIu64 " interrupts)\n",
+			latency->cpu, latency->interrupts);
+}
+
+/** Describe a CPU that may service the controller, and suggest what might
+ *  make it respond faster. */
+static void
+show_cpu (unsigned cpu, const struct sensei_controller *controller)
+{
+	struct sensei_cpu info;
+	int result = sensei_cpu_get (cpu, &info);
+	if (result)
+	{
+		printf ("CPU %-11u %s\n", cpu, sensei_error_name (result));
+		return;
+	}
+
+	printf ("CPU %-11u node %d, governor %s", cpu, info.node,
+		*info.governor ? info.governor : "-");
+	if (info.cur_khz && info.max_khz)
+		printf (", %u of %u MHz", info.cur_khz / 1000, info.max_khz / 1000);
+	printf ("\n");
+
+	const struct sensei_cpu_idle *deepest = NULL;
+	for (size_t i = 0; i < info.idle_len; i++)
+	{
+		const struct sensei_cpu_idle *state = &info.idle[i];
+		printf ("%s %s %u us%s", i ? "," : "                idle states",
+			state->name, state->latency_us,
+			state->disabled ? " (disabled)" : "");
+		if (!state->disabled
+		 && (!deepest || state->latency_us > deepest->latency_us))
+			deepest = state;
+	}
+	if (info.idle_len)
+		printf ("\n");
+
+	if (*info.governor && strcmp (info.governor, "performance"))
+		printf ("Hint: CPU %u uses the %s governor, 'performance' keeps"
+			" it from clocking down between reports\n", cpu, info.governor);
+	if (deepest && deepest->latency_us > IRQ_IDLE_HINT_US)
+		printf ("Hint: CPU %u may sleep in %s, which takes %u us to leave,"
+			" disabling it or holding /dev/cpu_dma_latency open avoids that\n",
+			cpu, deepest->name, deepest->latency_us);
+	if (controller->numa_node >= 0 && info.node >= 0
+	 && controller->numa_node != info.node)
+		printf ("Hint: CPU %u is on NUMA node %d, but the controller is on"
+			" node %d\n", cpu, info.node, controller->numa_node);
+}
+
+/** Map the device to the interrupts of its host controller, show where they
+ *  go and how the CPUs there are set up, and optionally pin them elsewhere,
+ *  measuring round trips before and after. */
+static int
+irq (struct options *options)
+{
+	static bool cpus[IRQ_MAX_CPUS], pinned[IRQ_MAX_CPUS];
+	if (options->irq_pin && !parse_cpu_list (options->irq_pin, pinned))
+	{
+		fprintf (stderr, "Error: invalid CPU list: %s\n", options->irq_pin);
+		return 1;
+	}
+
+	char port_path[64], node[PATH_MAX];
+	if (!find_port (options, port_path, node))
+		return 1;
+
+	struct sensei_controller controller;
+	int result = sensei_controller_get (port_path, &controller);
+	if (result)
+	{
+		fprintf (stderr, "Error: couldn't find the host controller: %s\n",
+			sensei_error_name (result));
+		return 1;
+	}
+	if (!controller.irqs_len)
+	{
+		fprintf (stderr, "Error: the host controller has no interrupts\n");
+		return 1;
+	}
+
+	printf ("Port:           %s\n", port_path);
+	printf ("Controller:     %s, %s, NUMA node %d\n", controller.address,
+		*controller.driver ? controller.driver : "no driver",
+		controller.numa_node);
+
+	memset (cpus, 0, sizeof cpus);
+	for (size_t i = 0; i < controller.irqs_len; i++)
+	{
+		struct sensei_irq info;
+		bool irq_cpus[IRQ_MAX_CPUS];
+		if ((result = sensei_irq_get (controller.irqs[i], &info)))
+		{
+			printf ("IRQ %-11u %s\n",
+				controller.irqs[i], sensei_error_name (result));
+			continue;
+		}
+
+		printf ("IRQ %-11u allowed on %s, goes to %s\n", controller.irqs[i],
+			info.affinity, *info.effective ? info.effective : "-");
+		if (parse_cpu_list (*info.effective ? info.effective : info.affinity,
+			irq_cpus))
+			for (size_t cpu = 0; cpu < IRQ_MAX_CPUS; cpu++)
+				cpus[cpu] |= irq_cpus[cpu];
+	}
+	for (unsigned cpu = 0; cpu < IRQ_MAX_CPUS; cpu++)
+		if (cpus[cpu])
+			show_cpu (cpu, &controller);
+
+	struct irq_latency before, after;
+	printf ("\n%-8s %12s %12s   %s\n",
+		"", "median", "99th pct.", "serviced by");
+	if ((result = irq_measure (options, &controller, &before)))
+	{
+		fprintf (stderr, "Error: measurement failed: %s\n",
+			sensei_error_name (result));
+		return 1;
+	}
+	show_latency (options->irq_pin ? "before" : "now", &before);
+	if (!options->irq_pin)
+		return 0;
+
+	for (size_t i = 0; i < controller.irqs_len; i++)
+		if ((result = sensei_irq_set_affinity (controller.irqs[i],
+			options->irq_pin)))
+		{
+			fprintf (stderr, "Error: couldn't pin IRQ %u: %s\n",
+				controller.irqs[i], sensei_error_name (result));
+			return 1;
+		}
+	if ((result = irq_measure (options, &controller, &after)))
+	{
+		fprintf (stderr, "Error: measurement failed: %s\n",
+			sensei_error_name (result));
+		return 1;
+	}
+	show_latency ("after", &after);
+
+	printf ("\n");
+	for (unsigned cpu = 0; cpu < IRQ_MAX_CPUS; cpu++)
+		if (pinned[cpu] && !cpus[cpu])
+			show_cpu (cpu, &controller);
+	fprintf (stderr, "Notice: irqbalance, if it's running, may move the"
+		" interrupts again\n");
+	return 0;
+}
+#endif // __linux__
+
+// --- Main --------------------------------------------------------------------
+
+int
+main (int argc, char *argv[])
+{
+	struct options options = { .until_us = UINT64_MAX };
+	struct sensei_config new_config = { 0 };
+
+	parse_options (argc, argv, &options, &new_config);
+	if (options.journal)
+		return journal (&options);
+	if (options.audit)
+		return audit ();
+	if (options.sync)
+	{
+		// Models may differ between devices, so go with nominal values
+		encode_requested_cpi (&options, &new_config, NULL);
+		return sync_devices (&options, &new_config);
+	}
+#ifdef __linux__
+	if (options.power)
+		return power (&options);
+	if (options.irq)
+		return irq (&options);
+#endif // __linux__
+
+	int result, status = 0;
+	struct run_metrics metrics = { 0 };
+	phase_start (&metrics, PHASE_TOTAL);
+
+	struct sensei_device *device = NULL;
+	phase_start (&metrics, PHASE_OPEN);
+	result = open_device (&options, &device);
+	phase_end (&metrics, PHASE_OPEN, result);
+	if (result == LIBUSB_ERROR_NOT_FOUND)
+		ERROR (error_0, "no suitable device found\n");
+	if (result)
+		ERROR (error_0, "couldn't open device: %s\n",
+			sensei_error_name (result));
+	if (!options.probe)
+		sensei_use_pacing (device);
+
+	phase_start (&metrics, PHASE_DETACH);
+	result = sensei_detach_kernel_driver (device);
+	phase_end (&metrics, PHASE_DETACH, result);
+	if (result)
+		ERROR (error_1, "couldn't detach kernel driver: %s\n",
+			sensei_error_name (result));
+
+	phase_start (&metrics, PHASE_CLAIM);
+	result = sensei_claim_interface (device);
+	phase_end (&metrics, PHASE_CLAIM, result);
+	if (result)
+		ERROR (error_2, "couldn't claim interface: %s\n",
+			sensei_error_name (result));
+
+	const char *failed_step = NULL;
+	phase_start (&metrics, PHASE_APPLY);
+	result = apply_options (device, &options, &new_config, &failed_step);
+	phase_end (&metrics, PHASE_APPLY, result);
+	if (result && failed_step)
+		ERROR (error_3, "%s failed: %s\n",
+			failed_step, sensei_error_name (result));
+	if (result)
+		ERROR (error_3, "operation failed: %s\n",
+			sensei_error_name (result));
+
+error_3:
+	phase_start (&metrics, PHASE_RELEASE);
+	result = sensei_release_interface (device);
+	phase_end (&metrics, PHASE_RELEASE, result);
+	if (result)
+		ERROR (error_2, "couldn't release interface: %s\n",
+			sensei_error_name (result));
+
+error_2:
+	phase_start (&metrics, PHASE_ATTACH);
+	result = sensei_attach_kernel_driver (device);
+	phase_end (&metrics, PHASE_ATTACH, result);
+	if (result)
+		ERROR (error_1, "couldn't reattach kernel driver: %s\n",
+			sensei_error_name (result));
+
+error_1:
+	metrics.stats = device->stats;
+	sensei_close (device);
+error_0:
+	phase_end (&metrics, PHASE_TOTAL, 0);
+	if (options.metrics_file && !write_metrics (options.metrics_file, &metrics))
+	{
+		fprintf (stderr, "Error: couldn't write %s: %s\n",
+			options.metrics_file, strerror (errno));
+		status = 1;
+	}
+	return status;
+}
@@ -0,0 +1,512 @@
+/*
+ * sensei-raw-journal.c: append-only journal of configuration changes
+ *
+ * Every change is a fixed-size record in a file that gets mapped into memory.
+ * The file starts with a header and an index of blocks of records, each with
+ * the earliest and latest time within it, so that queries for a time range
+ * only look at blocks that may contain something, even when the clock has
+ * jumped back at some point.  The layout is:
+ *
+ *   0                    struct journal_header
+ *   JOURNAL_INDEX        JOURNAL_BLOCKS times struct journal_block
+ *   JOURNAL_RECORDS      struct journal_record, one after another
+ *
+ * The file grows a block at a time.  Every so often, older records of changes
+ * that haven't changed anything, typically the boot-time helper re-applying
+ * the same settings, are compacted away.  Writers and readers synchronize
+ * with flock(), which also serializes appends from concurrent processes.
+ *
+ * Copyright (c) 2013, Přemysl Janouch <p.janouch@gmail.com>
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "sensei-raw.h"
+
+#define JOURNAL_MAGIC      "SRCJRNL1"
+
+/** Records per block of the index. */
+#define JOURNAL_BLOCK_LEN  256
+/** Blocks the index has room for, which limits the number of records. */
+#define JOURNAL_BLOCKS     8192
+#define JOURNAL_CAPACITY   ((uint64_t) JOURNAL_BLOCKS * JOURNAL_BLOCK_LEN)
+
+#define JOURNAL_INDEX      4096
+#define JOURNAL_RECORDS \
+	(JOURNAL_INDEX + JOURNAL_BLOCKS * sizeof (struct journal_block))
+
+/** Compact after this many appends. */
+#define JOURNAL_COMPACT_EVERY  1024
+/** Changes that haven't changed anything are kept for this long. */
+#define JOURNAL_NOOP_TTL_US    (7 * 24 * 3600 * UINT64_C (1000000))
+
+/** The first part of the file. */
+struct journal_header
+{
+	char magic[8];                      ///< JOURNAL_MAGIC
+	uint32_t record_size;               ///< Size of a record
+	uint32_t block_len;                 ///< JOURNAL_BLOCK_LEN
+	uint64_t count;                     ///< Number of records
+	uint64_t appended;                  ///< Appends since compaction
+};
+
+/** Time range of a block of records. */
+struct journal_block
+{
+	uint64_t min_us;                    ///< Earliest time
+	uint64_t max_us;                    ///< Latest time
+};
+
+/** Settings in the order of SENSEI_FIELD_* bits. */
+enum { JOURNAL_SETTINGS = 6 };
+
+/** Flags of a record. */
+enum
+{
+	JOURNAL_BEFORE_KNOWN = 1 << 0       ///< The before state is valid
+};
+
+/** A journal entry as stored in the file. */
+struct journal_record
+{
+	uint64_t time_us;                   ///< Wall clock time of the change
+	uint32_t pid;                       ///< Process that has made it
+	uint32_t uid;                       ///< User running the process
+	int32_t result;                     ///< Zero or a libusb error code
+	uint16_t product;                   ///< USB product ID
+	uint8_t commands_len;               ///< Number of commands
+	uint8_t flags;                      ///< JOURNAL_* flags
+
+	char caller[32];                    ///< Name of the program
+	char port[32];                      ///< USB port path, if known
+	char node[64];                      ///< Device node that was used
+
+	uint8_t before[JOURNAL_SETTINGS];   ///< Settings before
+	uint8_t after[JOURNAL_SETTINGS];    ///< Settings after
+	uint8_t commands[SENSEI_MAX_COMMANDS][SENSEI_JOURNAL_COMMAND_BYTES];
+	uint8_t reserved[64];               ///< Room for future extensions
+};
+
+/** Compilation fails here if records don't have the expected size. */
+typedef char journal_record_size_check
+	[sizeof (struct journal_record) == 256 ? 1 : -1];
+
+// --- Records -----------------------------------------------------------------
+
+static void
+config_to_bytes (const struct sensei_config *config, uint8_t *bytes)
+{
+	bytes[0] = config->mode;
+	bytes[1] = config->polling;
+	bytes[2] = config->intensity;
+	bytes[3] = config->pulsation;
+	bytes[4] = config->cpi_off;
+	bytes[5] = config->cpi_on;
+}
+
+static void
+config_from_bytes (struct sensei_config *config, const uint8_t *bytes)
+{
+	config->mode      = bytes[0];
+	config->polling   = bytes[1];
+	config->intensity = bytes[2];
+	config->pulsation = bytes[3];
+	config->cpi_off   = bytes[4];
+	config->cpi_on    = bytes[5];
+}
+
+static void
+record_encode (const struct sensei_journal_entry *entry,
+	struct journal_record *record)
+{
+	memset (record, 0, sizeof *record);
+	record->time_us = entry->time_us;
+	record->pid = entry->pid;
+	record->uid = entry->uid;
+	record->result = entry->result;
+	record->product = entry->product;
+	record->commands_len = entry->commands_len;
+	record->flags = entry->before_known ? JOURNAL_BEFORE_KNOWN : 0;
+
+	// The strings are always terminated within the entry
+	memcpy (record->caller, entry->caller, sizeof record->caller);
+	memcpy (record->port, entry->port, sizeof record->port);
+	memcpy (record->node, entry->node, sizeof record->node);
+
+	config_to_bytes (&entry->before, record->before);
+	config_to_bytes (&entry->after, record->after);
+	memcpy (record->commands, entry->commands, sizeof record->commands);
+}
+
+static void
+record_decode (const struct journal_record *record,
+	struct sensei_journal_entry *entry)
+{
+	memset (entry, 0, sizeof *entry);
+	entry->time_us = record->time_us;
+	entry->pid = record->pid;
+	entry->uid = record->uid;
+	entry->result = record->result;
+	entry->product = record->product;
+	entry->commands_len = record->commands_len < SENSEI_MAX_COMMANDS
+		? record->commands_len : SENSEI_MAX_COMMANDS;
+	entry->before_known = record->flags & JOURNAL_BEFORE_KNOWN;
+
+	// Don't trust the file to have them terminated
+	memcpy (entry->caller, record->caller, sizeof entry->caller - 1);
+	memcpy (entry->port, record->port, sizeof entry->port - 1);
+	memcpy (entry->node, record->node, sizeof entry->node - 1);
+
+	config_from_bytes (&entry->before, record->before);
+	config_from_bytes (&entry->after, record->after);
+	memcpy (entry->commands, record->commands, sizeof entry->commands);
+}
+
+/** Whether the record can go in compaction: a successful change of nothing
+ *  that hasn't even saved anything to ROM. */
+static bool
+record_is_noop (const struct journal_record *record)
+{
+	if (!(record->flags & JOURNAL_BEFORE_KNOWN) || record->result
+	 || memcmp (record->before, record->after, sizeof record->before))
+		return false;
+	for (size_t i = 0; i < record->commands_len
+		&& i < SENSEI_MAX_COMMANDS; i++)
+		if (record->commands[i][0] == SENSEI_CMD_SAVE)
+			return false;
+	return true;
+}
+
+// --- Journal file ------------------------------------------------------------
+
+/** A locked and mapped journal. */
+struct journal
+{
+	int fd;                             ///< The open file
+	void *map;                          ///< Its mapping
+	size_t map_len;                     ///< Length of the mapping
+
+	struct journal_header *header;      ///< The header
+	struct journal_block *blocks;       ///< The index
+	struct journal_record *records;     ///< The records
+};
+
+/** File size needed for a number of records, in whole blocks. */
+static size_t
+journal_size (uint64_t count)
+{
+	uint64_t blocks = (count + JOURNAL_BLOCK_LEN - 1) / JOURNAL_BLOCK_LEN;
+	return JOURNAL_RECORDS + blocks * JOURNAL_BLOCK_LEN
+		* sizeof (struct journal_record);
+}
+
+static bool
+journal_header_valid (const struct journal_header *header)
+{
+	return !memcmp (header->magic, JOURNAL_MAGIC, sizeof header->magic)
+		&& header->record_size == sizeof (struct journal_record)
+		&& header->block_len == JOURNAL_BLOCK_LEN
+		&& header->count <= JOURNAL_CAPACITY;
+}
+
+/** Open and lock the journal, creating it if writable, and map enough of it
+ *  for @a extra more records. */
+static bool
+journal_open (struct journal *self, const char *path, bool writable,
+	uint64_t extra)
+{
+	memset (self, 0, sizeof *self);
+	self->fd = writable
+		? open (path, O_RDWR | O_CREAT | O_CLOEXEC, 0644)
+		: open (path, O_RDONLY | O_CLOEXEC);
+	if (self->fd < 0)
+		return false;
+
+	struct journal_header header;
+	struct stat st;
+	if (flock (self->fd, writable ? LOCK_EX : LOCK_SH)
+	 || fstat (self->fd, &st))
+		goto fail;
+
+	if (writable && !st.st_size)
+	{
+		memset (&header, 0, sizeof header);
+		memcpy (header.magic, JOURNAL_MAGIC, sizeof header.magic);
+		header.record_size = sizeof (struct journal_record);
+		header.block_len = JOURNAL_BLOCK_LEN;
+		if (pwrite (self->fd, &header, sizeof header, 0) != sizeof header
+		 || ftruncate (self->fd, JOURNAL_RECORDS))
+			goto fail;
+		st.st_size = JOURNAL_RECORDS;
+	}
+
+	if (pread (self->fd, &header, sizeof header, 0) != sizeof header
+	 || !journal_header_valid (&header))
+	{
+		errno = EINVAL;
+		goto fail;
+	}
+
+	uint64_t count = header.count + extra;
+	if (count > JOURNAL_CAPACITY)
+		count = JOURNAL_CAPACITY;
+	self->map_len = journal_size (count);
+	if ((off_t) self->map_len > st.st_size)
+	{
+		if (!writable)
+			self->map_len = st.st_size;
+		else if (ftruncate (self->fd, self->map_len))
+			goto fail;
+	}
+	if (self->map_len < journal_size (header.count))
+	{
+		errno = EINVAL;
+		goto fail;
+	}
+
+	self->map = mmap (NULL, self->map_len, PROT_READ
+		| (writable ? PROT_WRITE : 0), MAP_SHARED, self->fd, 0);
+	if (self->map == MAP_FAILED)
+		goto fail;
+
+	self->header = self->map;
+	self->blocks = (struct journal_block *)
+		((char *) self->map + JOURNAL_INDEX);
+	self->records = (struct journal_record *)
+		((char *) self->map + JOURNAL_RECORDS);
+	return true;
+
+fail:
+	{
+		int err = errno;
+		close (self->fd);
+		errno = err;
+	}
+	return false;
+}
+
+/** Unmap the journal, trim the file to what it needs, and unlock it. */
+static void
+journal_close (struct journal *self, bool trim)
+{
+	uint64_t count = self->header->count;
+	munmap (self->map, self->map_len);
+	if (trim && journal_size (count) < self->map_len)
+		(void) ftruncate (self->fd, journal_size (count));
+	close (self->fd);
+}
+
+/** Extend the time range of the block containing a record. */
+static void
+journal_index (struct journal *self, uint64_t i)
+{
+	struct journal_block *block = &self->blocks[i / JOURNAL_BLOCK_LEN];
+	uint64_t time_us = self->records[i].time_us;
+	if (i % JOURNAL_BLOCK_LEN == 0 || time_us < block->min_us)
+		block->min_us = time_us;
+	if (i % JOURNAL_BLOCK_LEN == 0 || time_us > block->max_us)
+		block->max_us = time_us;
+}
+
+/** Drop old records of changes that haven't changed anything, and when the
+ *  journal is full, also the oldest eighth of it. */
+static void
+journal_compact (struct journal *self, uint64_t now_us)
+{
+	uint64_t count = self->header->count, kept = 0, i = 0;
+	if (count >= JOURNAL_CAPACITY)
+		i = JOURNAL_CAPACITY / 8;
+
+	for (; i < count; i++)
+	{
+		const struct journal_record *record = &self->records[i];
+		if (record_is_noop (record)
+		 && record->time_us + JOURNAL_NOOP_TTL_US < now_us)
+			continue;
+		if (kept != i)
+			self->records[kept] = *record;
+		kept++;
+	}
+
+	memset (self->blocks, 0, JOURNAL_BLOCKS * sizeof *self->blocks);
+	for (i = 0; i < kept; i++)
+		journal_index (self, i);
+	self->header->count = kept;
+	self->header->appended = 0;
+}
+
+static bool
+journal_append (const char *path, const struct journal_record *record)
+{
+	struct journal self;
+	if (!journal_open (&self, path, true, 1))
+		return false;
+
+	if (self.header->count >= JOURNAL_CAPACITY)
+		journal_compact (&self, record->time_us);
+
+	uint64_t i = self.header->count;
+	self.records[i] = *record;
+	journal_index (&self, i);
+	self.header->count = i + 1;
+
+	if (++self.header->appended >= JOURNAL_COMPACT_EVERY)
+		journal_compact (&self, record->time_us);
+	journal_close (&self, true);
+	return true;
+}
+
+bool
+sensei_journal_query (const char *path, uint64_t since_us, uint64_t until_us,
+	sensei_journal_fn callback, void *user_data)
+{
+	struct journal self;
+	if (!journal_open (&self, path, false, 0))
+		return false;
+
+	uint64_t count = self.header->count;
+	bool more = true;
+	for (uint64_t b = 0; more && b * JOURNAL_BLOCK_LEN < count; b++)
+	{
+		const struct journal_block *block = &self.blocks[b];
+		if (block->max_us < since_us || block->min_us > until_us)
+			continue;
+
+		struct sensei_journal_entry entry;
+		uint64_t end = (b + 1) * JOURNAL_BLOCK_LEN;
+		for (uint64_t i = b * JOURNAL_BLOCK_LEN; more && i < end
+			&& i < count; i++)
+		{
+			const struct journal_record *record = &self.records[i];
+			if (record->time_us < since_us || record->time_us > until_us)
+				continue;
+			record_decode (record, &entry);
+			more = callback (&entry, user_data);
+		}
+	}
+	journal_close (&self, false);
+	return true;
+}
+
+// --- Recording changes -------------------------------------------------------
+
+bool
+sensei_journal_path (bool system, char *path, size_t path_len)
+{
+	return sensei_state_path ("journal", system, path, path_len);
+}
+
+void
+sensei_journal_begin (struct sensei_device *device, const char *caller,
+	struct sensei_journal_entry *entry)
+{
+	memset (entry, 0, sizeof *entry);
+	entry->pid = getpid ();
+	entry->uid = geteuid ();
+	entry->product = device->product;
+	snprintf (entry->caller, sizeof entry->caller, "%s", caller);
+	snprintf (entry->node, sizeof entry->node, "%s",
+		device->path ? device->path : "");
+	if (sensei_get_port_path (device, entry->port, sizeof entry->port))
+		*entry->port = '\0';
+
+	// The mode can't be read back, leave it unknown
+	entry->before_known = !sensei_load_config (device, &entry->before);
+	if (!entry->before_known)
+		memset (&entry->before, 0, sizeof entry->before);
+	entry->before.mode = 0;
+}
+
+/** Apply the effect of a command to settings. */
+static void
+apply_command (const unsigned char *data, struct sensei_config *config)
+{
+	switch (data[0])
+	{
+	case SENSEI_CMD_MODE:       config->mode      = data[2];  break;
+	case SENSEI_CMD_POLLING:    config->polling   = data[2];  break;
+	case SENSEI_CMD_INTENSITY:  config->intensity = data[2];  break;
+	case SENSEI_CMD_PULSATION:  config->pulsation = data[2];  break;
+	case SENSEI_CMD_CPI:
+		if (data[1] == 1)
+			config->cpi_off = data[2];
+		else
+			config->cpi_on = data[2];
+	}
+}
+
+bool
+sensei_journal_commit (struct sensei_journal_entry *entry,
+	const struct sensei_command *commands, size_t len, size_t sent,
+	int result)
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_REALTIME, &ts);
+	entry->time_us = (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	entry->result = result;
+
+	// Include the command that has failed, if any
+	entry->after = entry->before;
+	entry->commands_len = sent < len ? sent + 1 : len;
+	if (entry->commands_len > SENSEI_MAX_COMMANDS)
+		entry->commands_len = SENSEI_MAX_COMMANDS;
+	for (size_t i = 0; i < entry->commands_len; i++)
+	{
+		memcpy (entry->commands[i], commands[i].data,
+			SENSEI_JOURNAL_COMMAND_BYTES);
+		if (i < sent)
+			apply_command (commands[i].data, &entry->after);
+	}
+
+	char path[PATH_MAX];
+	struct journal_record record;
+	record_encode (entry, &record);
+	return sensei_journal_path (!geteuid (), path, sizeof path)
+		&& sensei_make_parents (path) && journal_append (path, &record);
+}
+
+int
+sensei_apply_commands (struct sensei_device *device, const char *caller,
+	const struct sensei_command *commands, size_t len, size_t *failed)
+{
+	if (!len)
+		return 0;
+
+	struct sensei_journal_entry entry;
+	sensei_journal_begin (device, caller, &entry);
+
+	size_t index = len;
+	int result = sensei_send_commands (device, commands, len, &index);
+	if (result && failed)
+		*failed = index;
+
+	// The change has been made either way, the journal is just a bonus
+	sensei_journal_commit (&entry, commands, len, result ? index : len,
+		result);
+	return result;
+}
@@ -0,0 +1,332 @@
+/*
+ * sensei-raw-libusb.c: SteelSeries Sensei Raw device access via libusb
+ *
+ * Copyright (c) 2013, Přemysl Janouch <p.janouch@gmail.com>
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libusb.h>
+
+#include "sensei-raw.h"
+
+struct sensei_libusb_device
+{
+	struct sensei_device super;         ///< Parent class
+	libusb_context *ctx;                ///< Our own libusb context
+	libusb_device_handle *handle;       ///< The opened device
+	bool reattach_driver;               ///< Whether we've detached usbhid
+};
+
+// --- Utilities ---------------------------------------------------------------
+
+/** Search for a device with given vendor and product ID, and optionally
+ *  a bus number and device address (set them to -1 to match any). */
+static libusb_device_handle *
+find_device (libusb_context *ctx, int vendor, int product,
+	int bus, int address, int *error)
+{
+	libusb_device **list;
+	libusb_device *found = NULL;
+	libusb_device_handle *handle = NULL;
+	int err = 0;
+
+	ssize_t cnt = libusb_get_device_list (ctx, &list);
+	if (cnt < 0)
+		goto out;
+
+	ssize_t i = 0;
+	for (i = 0; i < cnt; i++)
+	{
+		libusb_device *device = list[i];
+		if (bus != -1 && libusb_get_bus_number (device) != bus)
+			continue;
+		if (address != -1 && libusb_get_device_address (device) != address)
+			continue;
+
+		struct libusb_device_descriptor desc;
+		if (libusb_get_device_descriptor (device, &desc))
+			continue;
+
+		if (desc.idVendor == vendor && desc.idProduct == product)
+		{
+			found = device;
+			break;
+		}
+	}
+
+	if (found)
+	{
+		err = libusb_open (found, &handle);
+		if (err)
+			goto out_free;
+	}
+
+out_free:
+	libusb_free_device_list(list, 1);
+out:
+	if (error != NULL && err != 0)
+		*error = err;
+	return handle;
+}
+
+/** Search for a device under various product ID's. */
+static libusb_device_handle *
+find_device_list (libusb_context *ctx, int vendor,
+	const uint16_t *products, size_t n_products, int bus, int address,
+	uint16_t *product, int *error)
+{
+	int err = 0;
+	libusb_device_handle *handle;
+
+	while (n_products--)
+	{
+		*product = *products;
+		handle = find_device (ctx, vendor, *products++, bus, address, &err);
+		if (handle)
+			return handle;
+		if (err)
+			break;
+	}
+
+	if (error != NULL && err != 0)
+		*error = err;
+	return NULL;
+}
+
+// --- Transport ---------------------------------------------------------------
+
+static int
+transport_detach (struct sensei_device *device)
+{
+	struct sensei_libusb_device *self = (struct sensei_libusb_device *) device;
+	int result = libusb_kernel_driver_active (self->handle, SENSEI_CTL_IFACE);
+	switch (result)
+	{
+	case 0:
+	case LIBUSB_ERROR_NOT_SUPPORTED:
+		return 0;
+	case 1:
+		if ((result = libusb_detach_kernel_driver
+			(self->handle, SENSEI_CTL_IFACE)))
+			return result;
+		self->reattach_driver = true;
+		self->super.stats.detaches++;
+		return 0;
+	default:
+		return result;
+	}
+}
+
+static int
+transport_claim (struct sensei_device *device)
+{
+	struct sensei_libusb_device *self = (struct sensei_libusb_device *) device;
+	return libusb_claim_interface (self->handle, SENSEI_CTL_IFACE);
+}
+
+static int
+transport_release (struct sensei_device *device)
+{
+	struct sensei_libusb_device *self = (struct sensei_libusb_device *) device;
+	return libusb_release_interface (self->handle, SENSEI_CTL_IFACE);
+}
+
+static int
+transport_attach (struct sensei_device *device)
+{
+	struct sensei_libusb_device *self = (struct sensei_libusb_device *) device;
+	if (!self->reattach_driver)
+		return 0;
+
+	self->reattach_driver = false;
+	int result = libusb_attach_kernel_driver (self->handle, SENSEI_CTL_IFACE);
+	if (!result)
+		self->super.stats.reattaches++;
+	return result;
+}
+
+static int
+transport_send (struct sensei_device *device,
+	unsigned char *data, uint16_t length)
+{
+	struct sensei_libusb_device *self = (struct sensei_libusb_device *) device;
+	int result = libusb_control_transfer (self->handle, LIBUSB_ENDPOINT_OUT
+		| LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
+		USB_SET_REPORT, 0x0200, SENSEI_CTL_IFACE, data, length, 0);
+	return result < 0 ? result : 0;
+}
+
+static int
+transport_get_report (struct sensei_device *device,
+	unsigned char *data, uint16_t length)
+{
+	struct sensei_libusb_device *self = (struct sensei_libusb_device *) device;
+	int result = libusb_control_transfer (self->handle, LIBUSB_ENDPOINT_IN
+		| LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
+		USB_GET_REPORT, 0x0300, SENSEI_CTL_IFACE, data, length, 0);
+	return result < 0 ? result : 0;
+}
+
+static int
+transport_port_path (struct sensei_device *device, char *path, size_t len)
+{
+	struct sensei_libusb_device *self = (struct sensei_libusb_device *) device;
+	libusb_device *usb_device = libusb_get_device (self->handle);
+
+	// USB 3.0 limits the depth of the tree to 7
+	uint8_t ports[7];
+	int n_ports = libusb_get_port_numbers (usb_device, ports, sizeof ports);
+	if (n_ports < 0)
+		return n_ports;
+
+	int offset = snprintf (path, len, "%u",
+		libusb_get_bus_number (usb_device));
+	for (int i = 0; i < n_ports && offset > 0 && (size_t) offset < len; i++)
+		offset += snprintf (path + offset, len - offset,
+			"%c%u", i ? '.' : '-', ports[i]);
+	return offset > 0 && (size_t) offset < len
+		? 0 : LIBUSB_ERROR_OVERFLOW;
+}
+
+static void
+transport_close (struct sensei_device *device)
+{
+	struct sensei_libusb_device *self = (struct sensei_libusb_device *) device;
+	libusb_close (self->handle);
+	libusb_exit (self->ctx);
+	free (self->super.path);
+	free (self);
+}
+
+static const struct sensei_transport libusb_transport =
+{
+	.name       = "libusb",
+	.detach     = transport_detach,
+	.claim      = transport_claim,
+	.release    = transport_release,
+	.attach     = transport_attach,
+	.send       = transport_send,
+	.get_report = transport_get_report,
+	.send_batch = NULL,
+	.port_path  = transport_port_path,
+	.close      = transport_close,
+};
+
+/** Returns LIBUSB_ERROR_NOT_FOUND when there's no suitable device. */
+int
+sensei_libusb_open (const char *path, struct sensei_device **device)
+{
+	int bus = -1, address = -1;
+	if (path && sscanf (path, "/dev/bus/usb/%d/%d", &bus, &address) != 2)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	libusb_context *ctx = NULL;
+	int result = libusb_init (&ctx);
+	if (result)
+		return result;
+
+	uint16_t product = 0;
+	libusb_device_handle *handle = find_device_list (ctx,
+		USB_VENDOR_STEELSERIES, sensei_products, sensei_products_len,
+		bus, address, &product, &result);
+	if (!handle)
+	{
+		libusb_exit (ctx);
+		return result ? result : LIBUSB_ERROR_NOT_FOUND;
+	}
+
+	struct sensei_libusb_device *self = calloc (1, sizeof *self);
+	char *node = malloc (sizeof "/dev/bus/usb/BBB/DDD");
+	if (!self || !node)
+	{
+		free (self);
+		free (node);
+		libusb_close (handle);
+		libusb_exit (ctx);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	libusb_device *usb_device = libusb_get_device (handle);
+	snprintf (node, sizeof "/dev/bus/usb/BBB/DDD", "/dev/bus/usb/%03u/%03u",
+		libusb_get_bus_number (usb_device),
+		libusb_get_device_address (usb_device));
+
+	self->super.transport = &libusb_transport;
+	self->super.product = product;
+	self->super.path = node;
+	self->ctx = ctx;
+	self->handle = handle;
+	*device = &self->super;
+	return 0;
+}
+
+int
+sensei_libusb_list (struct sensei_device_info **list, size_t *len)
+{
+	libusb_context *ctx = NULL;
+	int result = libusb_init (&ctx);
+	if (result)
+		return result;
+
+	libusb_device **devices;
+	ssize_t cnt = libusb_get_device_list (ctx, &devices);
+	if (cnt < 0)
+	{
+		libusb_exit (ctx);
+		return cnt;
+	}
+
+	// Allocate for the worst case, this is bound to be a short list
+	struct sensei_device_info *found = calloc (cnt + 1, sizeof *found);
+	size_t n_found = 0;
+	for (ssize_t i = 0; found && i < cnt; i++)
+	{
+		struct libusb_device_descriptor desc;
+		if (libusb_get_device_descriptor (devices[i], &desc)
+		 || desc.idVendor != USB_VENDOR_STEELSERIES
+		 || !sensei_product_supported (desc.idProduct))
+			continue;
+
+		struct sensei_device_info *info = &found[n_found++];
+		info->product = desc.idProduct;
+		if (!(info->usb_path = malloc (sizeof "/dev/bus/usb/BBB/DDD")))
+			result = LIBUSB_ERROR_NO_MEM;
+		else
+			snprintf (info->usb_path, sizeof "/dev/bus/usb/BBB/DDD",
+				"/dev/bus/usb/%03u/%03u", libusb_get_bus_number (devices[i]),
+				libusb_get_device_address (devices[i]));
+	}
+	if (!found)
+		result = LIBUSB_ERROR_NO_MEM;
+
+	libusb_free_device_list (devices, 1);
+	libusb_exit (ctx);
+
+	if (result)
+	{
+		if (found)
+			sensei_free_device_list (found, n_found);
+		return result;
+	}
+
+	*list = found;
+	*len = n_found;
+	return 0;
+}
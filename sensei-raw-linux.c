@@ -0,0 +1,1238 @@
+/*
+ * sensei-raw-linux.c: SteelSeries Sensei Raw device access via Linux usbfs
+ * and hidraw
+ *
+ * usbfs talks to /dev/bus/usb directly, which avoids libusb initialisation
+ * and a full bus enumeration; handy for short-lived helpers.  hidraw goes
+ * through the kernel HID driver, so nothing needs to be detached at all.
+ *
+ * Copyright (c) 2013, Přemysl Janouch <p.janouch@gmail.com>
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <endian.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/ioctl.h>
+#include <linux/usbdevice_fs.h>
+#include <linux/usb/ch9.h>
+#include <linux/hidraw.h>
+
+// Only for the error codes, we don't link against the library
+#include <libusb.h>
+
+#include "config.h"
+#include "sensei-raw.h"
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif // HAVE_LIBURING
+
+struct sensei_usbfs_device
+{
+	struct sensei_device super;         ///< Parent class
+	int fd;                             ///< /dev/bus/usb/BBB/DDD
+	bool reattach_driver;               ///< Whether we've detached usbhid
+};
+
+// --- Utilities ---------------------------------------------------------------
+
+/** Translate errno values the way libusb's own Linux backend does. */
+static int
+errno_to_libusb (int err)
+{
+	switch (err)
+	{
+	case 0:          return LIBUSB_SUCCESS;
+	case EACCES:
+	case EPERM:      return LIBUSB_ERROR_ACCESS;
+	case ENODEV:
+	case ESHUTDOWN:  return LIBUSB_ERROR_NO_DEVICE;
+	case ENOENT:     return LIBUSB_ERROR_NOT_FOUND;
+	case EBUSY:      return LIBUSB_ERROR_BUSY;
+	case ETIMEDOUT:  return LIBUSB_ERROR_TIMEOUT;
+	case EOVERFLOW:  return LIBUSB_ERROR_OVERFLOW;
+	case EPIPE:      return LIBUSB_ERROR_PIPE;
+	case EINTR:      return LIBUSB_ERROR_INTERRUPTED;
+	case ENOMEM:     return LIBUSB_ERROR_NO_MEM;
+	case EINVAL:     return LIBUSB_ERROR_INVALID_PARAM;
+	case ENOSYS:
+	case ENOTTY:     return LIBUSB_ERROR_NOT_SUPPORTED;
+	default:         return LIBUSB_ERROR_IO;
+	}
+}
+
+/** ioctl() that retries when interrupted by a signal. */
+static int
+xioctl (struct sensei_stats *stats, int fd, unsigned long request, void *arg)
+{
+	int result;
+	stats->syscalls++;
+	while ((result = ioctl (fd, request, arg)) < 0 && errno == EINTR)
+		stats->syscalls++, stats->retries++;
+	return result;
+}
+
+/** Read a hexadecimal sysfs attribute. */
+static bool
+read_sysfs_hex (const char *dir, const char *name, unsigned *value)
+{
+	char path[PATH_MAX], buf[16];
+	snprintf (path, sizeof path, "%s/%s", dir, name);
+
+	FILE *fp = fopen (path, "r");
+	if (!fp)
+		return false;
+	bool ok = fgets (buf, sizeof buf, fp) && sscanf (buf, "%x", value) == 1;
+	fclose (fp);
+	return ok;
+}
+
+/** Read a decimal sysfs attribute. */
+static bool
+read_sysfs_dec (const char *dir, const char *name, unsigned *value)
+{
+	char path[PATH_MAX], buf[16];
+	snprintf (path, sizeof path, "%s/%s", dir, name);
+
+	FILE *fp = fopen (path, "r");
+	if (!fp)
+		return false;
+	bool ok = fgets (buf, sizeof buf, fp) && sscanf (buf, "%u", value) == 1;
+	fclose (fp);
+	return ok;
+}
+
+/** Read a sysfs or procfs attribute as a string, without the newline. */
+static bool
+read_attribute (const char *dir, const char *name,
+	char *value, size_t value_len)
+{
+	char path[PATH_MAX];
+	snprintf (path, sizeof path, "%s/%s", dir, name);
+
+	FILE *fp = fopen (path, "r");
+	if (!fp)
+		return false;
+	bool ok = fgets (value, value_len, fp);
+	fclose (fp);
+	if (ok)
+		value[strcspn (value, "\n")] = '\0';
+	return ok;
+}
+
+/** Store the name of a USB device directory, which is its port path. */
+static int
+sysfs_port_path (const char *dir, char *path, size_t len)
+{
+	char resolved[PATH_MAX];
+	unsigned bus;
+	if (!realpath (dir, resolved))
+		return errno_to_libusb (errno);
+
+	// Interfaces have a colon in their name, whole devices have a bus number
+	const char *name = strrchr (resolved, '/');
+	name = name ? name + 1 : resolved;
+	if (strchr (name, ':') || !read_sysfs_dec (resolved, "busnum", &bus))
+		return LIBUSB_ERROR_NOT_FOUND;
+	if ((size_t) snprintf (path, len, "%s", name) >= len)
+		return LIBUSB_ERROR_OVERFLOW;
+	return 0;
+}
+
+/** Find the usbfs node of the first device with the given product ID. */
+static bool
+find_usbfs_node (uint16_t product, char *node, size_t node_len)
+{
+	DIR *dir = opendir ("/sys/bus/usb/devices");
+	if (!dir)
+		return false;
+
+	bool found = false;
+	struct dirent *entry;
+	while (!found && (entry = readdir (dir)))
+	{
+		// Interfaces have a colon in their name, we want whole devices
+		if (entry->d_name[0] == '.' || strchr (entry->d_name, ':'))
+			continue;
+
+		char path[PATH_MAX];
+		snprintf (path, sizeof path, "/sys/bus/usb/devices/%s", entry->d_name);
+
+		unsigned vendor, id, bus, address;
+		if (!read_sysfs_hex (path, "idVendor", &vendor)
+		 || !read_sysfs_hex (path, "idProduct", &id)
+		 || vendor != USB_VENDOR_STEELSERIES || id != product
+		 || !read_sysfs_dec (path, "busnum", &bus)
+		 || !read_sysfs_dec (path, "devnum", &address))
+			continue;
+
+		snprintf (node, node_len, "/dev/bus/usb/%03u/%03u", bus, address);
+		found = true;
+	}
+	closedir (dir);
+	return found;
+}
+
+// --- usbfs -----------------------------------------------------------------
+
+static int
+usbfs_detach (struct sensei_device *device)
+{
+	struct sensei_usbfs_device *self = (struct sensei_usbfs_device *) device;
+
+	struct usbdevfs_getdriver getdriver = { .interface = SENSEI_CTL_IFACE };
+	if (xioctl (&self->super.stats, self->fd, USBDEVFS_GETDRIVER, &getdriver))
+		return errno == ENODATA ? 0 : errno_to_libusb (errno);
+
+	// That would be somebody else using usbfs, there's nothing to detach
+	if (!strcmp (getdriver.driver, "usbfs"))
+		return 0;
+
+	struct usbdevfs_ioctl command =
+	{
+		.ifno = SENSEI_CTL_IFACE,
+		.ioctl_code = USBDEVFS_DISCONNECT,
+		.data = NULL
+	};
+	if (xioctl (&self->super.stats, self->fd, USBDEVFS_IOCTL, &command) < 0)
+		return errno == ENODATA ? 0 : errno_to_libusb (errno);
+
+	self->reattach_driver = true;
+	self->super.stats.detaches++;
+	return 0;
+}
+
+static int
+usbfs_claim (struct sensei_device *device)
+{
+	struct sensei_usbfs_device *self = (struct sensei_usbfs_device *) device;
+	unsigned int interface = SENSEI_CTL_IFACE;
+	if (xioctl (&self->super.stats, self->fd,
+		USBDEVFS_CLAIMINTERFACE, &interface))
+		return errno_to_libusb (errno);
+	return 0;
+}
+
+static int
+usbfs_release (struct sensei_device *device)
+{
+	struct sensei_usbfs_device *self = (struct sensei_usbfs_device *) device;
+	unsigned int interface = SENSEI_CTL_IFACE;
+	if (xioctl (&self->super.stats, self->fd,
+		USBDEVFS_RELEASEINTERFACE, &interface))
+		return errno_to_libusb (errno);
+	return 0;
+}
+
+static int
+usbfs_attach (struct sensei_device *device)
+{
+	struct sensei_usbfs_device *self = (struct sensei_usbfs_device *) device;
+	if (!self->reattach_driver)
+		return 0;
+
+	self->reattach_driver = false;
+	struct usbdevfs_ioctl command =
+	{
+		.ifno = SENSEI_CTL_IFACE,
+		.ioctl_code = USBDEVFS_CONNECT,
+		.data = NULL
+	};
+	if (xioctl (&self->super.stats, self->fd, USBDEVFS_IOCTL, &command) < 0)
+		return errno_to_libusb (errno);
+
+	self->super.stats.reattaches++;
+	return 0;
+}
+
+static int
+usbfs_control (struct sensei_usbfs_device *self, uint8_t request_type,
+	uint8_t request, uint16_t value, unsigned char *data, uint16_t length)
+{
+	struct usbdevfs_ctrltransfer transfer =
+	{
+		.bRequestType = request_type,
+		.bRequest = request,
+		.wValue = value,
+		.wIndex = SENSEI_CTL_IFACE,
+		.wLength = length,
+		.timeout = 0,
+		.data = data
+	};
+	if (xioctl (&self->super.stats, self->fd, USBDEVFS_CONTROL, &transfer) < 0)
+		return errno_to_libusb (errno);
+	return 0;
+}
+
+static int
+usbfs_send (struct sensei_device *device,
+	unsigned char *data, uint16_t length)
+{
+	return usbfs_control ((struct sensei_usbfs_device *) device,
+		USB_DIR_OUT | USB_TYPE_CLASS | USB_RECIP_INTERFACE,
+		USB_SET_REPORT, 0x0200, data, length);
+}
+
+static int
+usbfs_get_report (struct sensei_device *device,
+	unsigned char *data, uint16_t length)
+{
+	return usbfs_control ((struct sensei_usbfs_device *) device,
+		USB_DIR_IN | USB_TYPE_CLASS | USB_RECIP_INTERFACE,
+		USB_GET_REPORT, 0x0300, data, length);
+}
+
+static int
+usbfs_port_path (struct sensei_device *device, char *path, size_t len)
+{
+	unsigned bus, address;
+	if (sscanf (device->path, "/dev/bus/usb/%u/%u", &bus, &address) != 2)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	DIR *dir = opendir ("/sys/bus/usb/devices");
+	if (!dir)
+		return errno_to_libusb (errno);
+
+	int result = LIBUSB_ERROR_NOT_FOUND;
+	struct dirent *entry;
+	while (result == LIBUSB_ERROR_NOT_FOUND && (entry = readdir (dir)))
+	{
+		char dir_path[PATH_MAX];
+		snprintf (dir_path, sizeof dir_path,
+			"/sys/bus/usb/devices/%s", entry->d_name);
+
+		unsigned entry_bus, entry_address;
+		if (entry->d_name[0] != '.'
+		 && read_sysfs_dec (dir_path, "busnum", &entry_bus)
+		 && read_sysfs_dec (dir_path, "devnum", &entry_address)
+		 && entry_bus == bus && entry_address == address)
+			result = sysfs_port_path (dir_path, path, len);
+	}
+	closedir (dir);
+	return result;
+}
+
+static void
+usbfs_close (struct sensei_device *device)
+{
+	struct sensei_usbfs_device *self = (struct sensei_usbfs_device *) device;
+	close (self->fd);
+	free (self->super.path);
+	free (self);
+}
+
+static const struct sensei_transport usbfs_transport =
+{
+	.name       = "usbfs",
+	.detach     = usbfs_detach,
+	.claim      = usbfs_claim,
+	.release    = usbfs_release,
+	.attach     = usbfs_attach,
+	.send       = usbfs_send,
+	.get_report = usbfs_get_report,
+	.send_batch = NULL,
+	.port_path  = usbfs_port_path,
+	.close      = usbfs_close,
+};
+
+/** Take over an open usbfs node, closing it on failure. */
+static int
+usbfs_adopt (const char *node, int fd, struct sensei_device **device)
+{
+	// Reading the node yields the device descriptor first, wherever
+	// the file offset of an inherited descriptor might be
+	struct usb_device_descriptor desc;
+	ssize_t len = pread (fd, &desc, sizeof desc, 0);
+	if (len != sizeof desc)
+	{
+		close (fd);
+		return len < 0 ? errno_to_libusb (errno) : LIBUSB_ERROR_IO;
+	}
+
+	// Descriptors are little-endian, as is everything else on the bus
+	uint16_t vendor = le16toh (desc.idVendor),
+		product = le16toh (desc.idProduct);
+	if (vendor != USB_VENDOR_STEELSERIES || !sensei_product_supported (product))
+	{
+		close (fd);
+		return LIBUSB_ERROR_NOT_FOUND;
+	}
+
+	struct sensei_usbfs_device *self = calloc (1, sizeof *self);
+	char *node_copy = strdup (node);
+	if (!self || !node_copy)
+	{
+		free (self);
+		free (node_copy);
+		close (fd);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	self->super.transport = &usbfs_transport;
+	self->super.product = product;
+	self->super.path = node_copy;
+	self->fd = fd;
+	*device = &self->super;
+	return 0;
+}
+
+/** Returns LIBUSB_ERROR_NOT_FOUND when there's no suitable device. */
+int
+sensei_usbfs_open (const char *path, struct sensei_device **device)
+{
+	char node[PATH_MAX];
+	if (path)
+		snprintf (node, sizeof node, "%s", path);
+	else
+	{
+		size_t i = 0;
+		while (i < sensei_products_len
+			&& !find_usbfs_node (sensei_products[i], node, sizeof node))
+			i++;
+		if (i == sensei_products_len)
+			return LIBUSB_ERROR_NOT_FOUND;
+	}
+
+	int fd = open (node, O_RDWR | O_CLOEXEC);
+	if (fd < 0)
+		return errno_to_libusb (errno);
+	return usbfs_adopt (node, fd, device);
+}
+
+int
+sensei_usbfs_open_fd (const char *path, int fd, struct sensei_device **device)
+{
+	int result = usbfs_adopt (path, fd, device);
+	if (!result)
+		((struct sensei_usbfs_device *) *device)->reattach_driver = true;
+	return result;
+}
+
+// --- hidraw ------------------------------------------------------------------
+
+struct sensei_hidraw_device
+{
+	struct sensei_device super;         ///< Parent class
+	int fd;                             ///< /dev/hidrawN
+#ifdef HAVE_LIBURING
+	struct io_uring ring;               ///< For batched submission
+	unsigned ring_entries;              ///< Size of the ring, if set up
+	unsigned char (*buffers)[1 + SENSEI_COMMAND_LENGTH];
+	                                    ///< Reports in flight
+#endif // HAVE_LIBURING
+};
+
+/** Check that a hidraw node belongs to the control interface of a device
+ *  of ours and return its product ID.  Emulated devices have no USB
+ *  interface to check, only the HID ID's. */
+static bool
+check_hidraw_node (const char *name, uint16_t *product)
+{
+	char path[PATH_MAX], line[64];
+	snprintf (path, sizeof path, "/sys/class/hidraw/%s/device/uevent", name);
+
+	FILE *fp = fopen (path, "r");
+	if (!fp)
+		return false;
+
+	unsigned bus, vendor, id;
+	bool found = false;
+	while (!found && fgets (line, sizeof line, fp))
+		found = sscanf (line, "HID_ID=%x:%x:%x", &bus, &vendor, &id) == 3;
+	fclose (fp);
+	if (!found || vendor != USB_VENDOR_STEELSERIES
+	 || !sensei_product_supported (id))
+		return false;
+
+	// "device" is the HID device, its parent is the USB interface, if any
+	unsigned interface;
+	snprintf (path, sizeof path, "/sys/class/hidraw/%s/device/..", name);
+	if (read_sysfs_hex (path, "bInterfaceNumber", &interface)
+	 && interface != SENSEI_CTL_IFACE)
+		return false;
+
+	*product = id;
+	return true;
+}
+
+/** Find the hidraw node of the first control interface of a device with
+ *  the given product ID. */
+static bool
+find_hidraw_node (uint16_t product, char *node, size_t node_len)
+{
+	DIR *dir = opendir ("/sys/class/hidraw");
+	if (!dir)
+		return false;
+
+	bool found = false;
+	struct dirent *entry;
+	while (!found && (entry = readdir (dir)))
+	{
+		uint16_t id;
+		if (entry->d_name[0] == '.'
+		 || !check_hidraw_node (entry->d_name, &id) || id != product)
+			continue;
+
+		snprintf (node, node_len, "/dev/%s", entry->d_name);
+		found = true;
+	}
+	closedir (dir);
+	return found;
+}
+
+static int
+hidraw_nothing (struct sensei_device *device)
+{
+	(void) device;
+	return 0;
+}
+
+/** hidraw wants the report number first, zero for unnumbered reports. */
+static int
+hidraw_send (struct sensei_device *device,
+	unsigned char *data, uint16_t length)
+{
+	struct sensei_hidraw_device *self = (struct sensei_hidraw_device *) device;
+	unsigned char buf[1 + length];
+	buf[0] = 0;
+	memcpy (buf + 1, data, length);
+
+	ssize_t written;
+	self->super.stats.syscalls++;
+	while ((written = write (self->fd, buf, sizeof buf)) < 0 && errno == EINTR)
+		self->super.stats.syscalls++, self->super.stats.retries++;
+	if (written < 0)
+		return errno_to_libusb (errno);
+	return written == (ssize_t) sizeof buf ? 0 : LIBUSB_ERROR_IO;
+}
+
+static int
+hidraw_get_report (struct sensei_device *device,
+	unsigned char *data, uint16_t length)
+{
+	struct sensei_hidraw_device *self = (struct sensei_hidraw_device *) device;
+	unsigned char buf[1 + length];
+	memset (buf, 0, sizeof buf);
+
+	int result = xioctl (&self->super.stats,
+		self->fd, HIDIOCGFEATURE (sizeof buf), buf);
+	if (result < 0)
+		return errno_to_libusb (errno);
+
+	// Just like with USB, anything we didn't get is supposed to be zero
+	memcpy (data, buf + 1, length);
+	return 0;
+}
+
+#ifdef HAVE_LIBURING
+
+static void
+hidraw_ring_destroy (struct sensei_hidraw_device *self)
+{
+	if (self->ring_entries)
+		io_uring_queue_exit (&self->ring);
+	self->ring_entries = 0;
+	free (self->buffers);
+	self->buffers = NULL;
+}
+
+static int
+hidraw_ring_prepare (struct sensei_hidraw_device *self, size_t len)
+{
+	if (self->ring_entries >= len)
+		return 0;
+
+	hidraw_ring_destroy (self);
+	if (!(self->buffers = calloc (len, sizeof *self->buffers)))
+		return LIBUSB_ERROR_NO_MEM;
+
+	self->super.stats.syscalls++;
+	int result = io_uring_queue_init (len, &self->ring, 0);
+	if (result < 0)
+	{
+		hidraw_ring_destroy (self);
+		return errno_to_libusb (-result);
+	}
+	self->ring_entries = len;
+	return 0;
+}
+
+/** Submit the whole chain as linked writes in a single io_uring_enter(),
+ *  so that a failure cancels everything that follows it. */
+static int
+hidraw_send_batch (struct sensei_device *device,
+	const struct sensei_command *commands, size_t len, size_t *failed)
+{
+	struct sensei_hidraw_device *self = (struct sensei_hidraw_device *) device;
+	int result = hidraw_ring_prepare (self, len);
+	if (result)
+	{
+		*failed = 0;
+		return result;
+	}
+
+	for (size_t i = 0; i < len; i++)
+	{
+		unsigned char *buffer = self->buffers[i];
+		buffer[0] = 0;
+		memcpy (buffer + 1, commands[i].data, SENSEI_COMMAND_LENGTH);
+
+		struct io_uring_sqe *sqe = io_uring_get_sqe (&self->ring);
+		io_uring_prep_write (sqe, self->fd,
+			buffer, sizeof *self->buffers, 0);
+		io_uring_sqe_set_data (sqe, (void *) (uintptr_t) i);
+		if (i + 1 < len)
+			sqe->flags |= IOSQE_IO_LINK;
+	}
+
+	self->super.stats.syscalls++;
+	while ((result = io_uring_submit_and_wait (&self->ring, len)) == -EINTR)
+		self->super.stats.syscalls++, self->super.stats.retries++;
+	if (result < 0)
+	{
+		// We don't know what has made it, assume nothing has
+		hidraw_ring_destroy (self);
+		*failed = 0;
+		return errno_to_libusb (-result);
+	}
+
+	// The first request to fail is the culprit, the rest gets -ECANCELED;
+	// submit_and_wait() has normally already collected all of them
+	size_t reaped = 0, first_failed = len;
+	int error = 0;
+	while (reaped < len)
+	{
+		struct io_uring_cqe *cqe;
+		if ((result = io_uring_peek_cqe (&self->ring, &cqe)) == -EAGAIN)
+		{
+			self->super.stats.syscalls++;
+			result = io_uring_wait_cqe (&self->ring, &cqe);
+		}
+		if (result == -EINTR)
+		{
+			self->super.stats.retries++;
+			continue;
+		}
+		if (result < 0)
+		{
+			// Tearing the ring down is the only way to be sure that nothing
+			// is in flight anymore; the device itself stays usable
+			hidraw_ring_destroy (self);
+			*failed = first_failed < len ? first_failed : reaped;
+			return errno_to_libusb (-result);
+		}
+
+		size_t i = (uintptr_t) io_uring_cqe_get_data (cqe);
+		int res = cqe->res;
+		io_uring_cqe_seen (&self->ring, cqe);
+		reaped++;
+
+		if (i >= first_failed)
+			continue;
+		if (res < 0)
+			error = errno_to_libusb (-res);
+		else if (res != (int) sizeof *self->buffers)
+			error = LIBUSB_ERROR_IO;
+		else
+			continue;
+		first_failed = i;
+	}
+
+	if (first_failed == len)
+		return 0;
+
+	*failed = first_failed;
+	return error;
+}
+
+#endif // HAVE_LIBURING
+
+static int
+hidraw_port_path (struct sensei_device *device, char *path, size_t len)
+{
+	const char *name = strrchr (device->path, '/');
+	name = name ? name + 1 : device->path;
+
+	// "device" is the HID device, then the interface, then the device
+	char dir[PATH_MAX];
+	snprintf (dir, sizeof dir, "/sys/class/hidraw/%s/device/../..", name);
+	return sysfs_port_path (dir, path, len);
+}
+
+static void
+hidraw_close (struct sensei_device *device)
+{
+	struct sensei_hidraw_device *self = (struct sensei_hidraw_device *) device;
+#ifdef HAVE_LIBURING
+	hidraw_ring_destroy (self);
+#endif // HAVE_LIBURING
+	close (self->fd);
+	free (self->super.path);
+	free (self);
+}
+
+static const struct sensei_transport hidraw_transport =
+{
+	.name       = "hidraw",
+	.detach     = hidraw_nothing,
+	.claim      = hidraw_nothing,
+	.release    = hidraw_nothing,
+	.attach     = hidraw_nothing,
+	.send       = hidraw_send,
+	.get_report = hidraw_get_report,
+#ifdef HAVE_LIBURING
+	.send_batch = hidraw_send_batch,
+#else // ! HAVE_LIBURING
+	.send_batch = NULL,
+#endif // ! HAVE_LIBURING
+	.port_path  = hidraw_port_path,
+	.close      = hidraw_close,
+};
+
+/** Take over an open hidraw node that has been checked already,
+ *  closing it on failure. */
+static int
+hidraw_adopt (const char *node, int fd, uint16_t product,
+	struct sensei_device **device)
+{
+	struct sensei_hidraw_device *self = calloc (1, sizeof *self);
+	char *node_copy = strdup (node);
+	if (!self || !node_copy)
+	{
+		free (self);
+		free (node_copy);
+		close (fd);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	self->super.transport = &hidraw_transport;
+	self->super.product = product;
+	self->super.path = node_copy;
+	self->fd = fd;
+	*device = &self->super;
+	return 0;
+}
+
+/** Returns LIBUSB_ERROR_NOT_FOUND when there's no suitable device. */
+int
+sensei_hidraw_open (const char *path, struct sensei_device **device)
+{
+	char node[PATH_MAX];
+	if (path)
+		snprintf (node, sizeof node, "%s", path);
+	else
+	{
+		size_t i = 0;
+		while (i < sensei_products_len
+			&& !find_hidraw_node (sensei_products[i], node, sizeof node))
+			i++;
+		if (i == sensei_products_len)
+			return LIBUSB_ERROR_NOT_FOUND;
+	}
+
+	// Mice have more than one HID interface, make sure it's the right one
+	const char *name = strrchr (node, '/');
+	uint16_t product;
+	if (!check_hidraw_node (name ? name + 1 : node, &product))
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	int fd = open (node, O_RDWR | O_CLOEXEC);
+	if (fd < 0)
+		return errno_to_libusb (errno);
+	return hidraw_adopt (node, fd, product, device);
+}
+
+int
+sensei_hidraw_open_fd (const char *path, int fd, struct sensei_device **device)
+{
+	const char *name = strrchr (path, '/');
+	uint16_t product;
+	if (check_hidraw_node (name ? name + 1 : path, &product))
+		return hidraw_adopt (path, fd, product, device);
+
+	close (fd);
+	return LIBUSB_ERROR_NOT_FOUND;
+}
+
+int
+sensei_get_fd (struct sensei_device *device)
+{
+	if (device->transport == &usbfs_transport)
+		return ((struct sensei_usbfs_device *) device)->fd;
+	if (device->transport == &hidraw_transport)
+		return ((struct sensei_hidraw_device *) device)->fd;
+	return -1;
+}
+
+// --- Listing -----------------------------------------------------------------
+
+/** A growing list of devices. */
+struct device_list
+{
+	struct sensei_device_info *devices; ///< The devices
+	char **sysfs_paths;                 ///< Resolved USB device directories
+	size_t len;                         ///< Number of devices
+	size_t alloc;                       ///< Allocated length of the arrays
+};
+
+static struct sensei_device_info *
+device_list_add (struct device_list *self, const char *sysfs_path)
+{
+	if (self->len == self->alloc)
+	{
+		size_t alloc = self->alloc ? self->alloc * 2 : 8;
+		struct sensei_device_info *devices =
+			realloc (self->devices, alloc * sizeof *devices);
+		if (devices)
+			self->devices = devices;
+		char **sysfs_paths =
+			realloc (self->sysfs_paths, alloc * sizeof *sysfs_paths);
+		if (sysfs_paths)
+			self->sysfs_paths = sysfs_paths;
+		if (!devices || !sysfs_paths)
+			return NULL;
+		self->alloc = alloc;
+	}
+
+	char *path_copy = NULL;
+	if (sysfs_path && !(path_copy = strdup (sysfs_path)))
+		return NULL;
+
+	struct sensei_device_info *info = &self->devices[self->len];
+	memset (info, 0, sizeof *info);
+	self->sysfs_paths[self->len++] = path_copy;
+	return info;
+}
+
+/** Find USB devices of ours. */
+static int
+list_usb_devices (struct device_list *list)
+{
+	DIR *dir = opendir ("/sys/bus/usb/devices");
+	if (!dir)
+		return errno == ENOENT ? 0 : errno_to_libusb (errno);
+
+	int result = 0;
+	struct dirent *entry;
+	while (!result && (entry = readdir (dir)))
+	{
+		// Interfaces have a colon in their name, we want whole devices
+		if (entry->d_name[0] == '.' || strchr (entry->d_name, ':'))
+			continue;
+
+		char path[PATH_MAX], resolved[PATH_MAX];
+		snprintf (path, sizeof path, "/sys/bus/usb/devices/%s", entry->d_name);
+
+		unsigned vendor, id, bus, address;
+		if (!read_sysfs_hex (path, "idVendor", &vendor)
+		 || !read_sysfs_hex (path, "idProduct", &id)
+		 || vendor != USB_VENDOR_STEELSERIES || !sensei_product_supported (id)
+		 || !read_sysfs_dec (path, "busnum", &bus)
+		 || !read_sysfs_dec (path, "devnum", &address)
+		 || !realpath (path, resolved))
+			continue;
+
+		struct sensei_device_info *info = device_list_add (list, resolved);
+		if (!info || !(info->usb_path = malloc (sizeof "/dev/bus/usb/BBB/DDD")))
+		{
+			result = LIBUSB_ERROR_NO_MEM;
+			break;
+		}
+
+		info->product = id;
+		snprintf (info->usb_path, sizeof "/dev/bus/usb/BBB/DDD",
+			"/dev/bus/usb/%03u/%03u", bus, address);
+	}
+	closedir (dir);
+	return result;
+}
+
+/** Pair control interface hidraw nodes with the USB devices they belong to,
+ *  adding the rest as separate devices. */
+static int
+list_hidraw_nodes (struct device_list *list)
+{
+	DIR *dir = opendir ("/sys/class/hidraw");
+	if (!dir)
+		return errno == ENOENT ? 0 : errno_to_libusb (errno);
+
+	int result = 0;
+	struct dirent *entry;
+	while (!result && (entry = readdir (dir)))
+	{
+		uint16_t product;
+		if (entry->d_name[0] == '.'
+		 || !check_hidraw_node (entry->d_name, &product))
+			continue;
+
+		// "device" is the HID device, then the interface, then the device
+		char path[PATH_MAX], resolved[PATH_MAX];
+		snprintf (path, sizeof path,
+			"/sys/class/hidraw/%s/device/../..", entry->d_name);
+		bool have_parent = realpath (path, resolved) != NULL;
+
+		struct sensei_device_info *info = NULL;
+		for (size_t i = 0; have_parent && !info && i < list->len; i++)
+			if (list->sysfs_paths[i]
+			 && !strcmp (list->sysfs_paths[i], resolved))
+				info = &list->devices[i];
+		if (!info && (info = device_list_add (list, NULL)))
+			info->product = product;
+
+		if (!info)
+			result = LIBUSB_ERROR_NO_MEM;
+		else if (asprintf (&info->hidraw_path, "/dev/%s", entry->d_name) < 0)
+		{
+			info->hidraw_path = NULL;
+			result = LIBUSB_ERROR_NO_MEM;
+		}
+	}
+	closedir (dir);
+	return result;
+}
+
+int
+sensei_sysfs_list (struct sensei_device_info **list, size_t *len)
+{
+	struct device_list found = { 0 };
+	int result = list_usb_devices (&found);
+	if (!result)
+		result = list_hidraw_nodes (&found);
+
+	for (size_t i = 0; i < found.len; i++)
+		free (found.sysfs_paths[i]);
+	free (found.sysfs_paths);
+
+	if (result)
+	{
+		sensei_free_device_list (found.devices, found.len);
+		return result;
+	}
+
+	*list = found.devices;
+	*len = found.len;
+	return 0;
+}
+
+// --- Power management --------------------------------------------------------
+
+/** Don't let port paths escape /sys/bus/usb/devices. */
+static bool
+check_port_path (const char *port_path)
+{
+	return *port_path && *port_path != '.' && !strchr (port_path, '/');
+}
+
+/** Read a power attribute of a device as a string, without the newline. */
+static bool
+read_power_attribute (const char *port_path, const char *name,
+	char *value, size_t value_len)
+{
+	char dir[PATH_MAX];
+	snprintf (dir, sizeof dir, "/sys/bus/usb/devices/%s/power", port_path);
+	return read_attribute (dir, name, value, value_len);
+}
+
+int
+sensei_power_get (const char *port_path, struct sensei_power *power)
+{
+	if (!check_port_path (port_path))
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	memset (power, 0, sizeof *power);
+	errno = 0;
+	if (!read_power_attribute (port_path, "control",
+		power->control, sizeof power->control))
+		return errno ? errno_to_libusb (errno) : LIBUSB_ERROR_IO;
+
+	// Not all kernels have all of these
+	char delay[16];
+	power->autosuspend_delay_ms = -1;
+	if (read_power_attribute (port_path, "autosuspend_delay_ms",
+		delay, sizeof delay))
+		power->autosuspend_delay_ms = atoi (delay);
+	read_power_attribute (port_path, "wakeup",
+		power->wakeup, sizeof power->wakeup);
+	read_power_attribute (port_path, "runtime_status",
+		power->runtime_status, sizeof power->runtime_status);
+	return 0;
+}
+
+int
+sensei_power_set (const char *port_path, const char *name, const char *value)
+{
+	if (!check_port_path (port_path))
+		return LIBUSB_ERROR_INVALID_PARAM;
+	if (strcmp (name, "control") && strcmp (name, "autosuspend_delay_ms")
+	 && strcmp (name, "wakeup"))
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	char path[PATH_MAX];
+	snprintf (path, sizeof path,
+		"/sys/bus/usb/devices/%s/power/%s", port_path, name);
+
+	int fd = open (path, O_WRONLY | O_CLOEXEC);
+	if (fd < 0)
+		return errno_to_libusb (errno);
+
+	// sysfs takes the whole value in a single write or refuses it
+	size_t len = strlen (value);
+	ssize_t written;
+	while ((written = write (fd, value, len)) < 0 && errno == EINTR)
+		;
+	int result = written < 0 ? errno_to_libusb (errno)
+		: (size_t) written != len ? LIBUSB_ERROR_IO : 0;
+	close (fd);
+	return result;
+}
+
+// --- Interrupt affinity ------------------------------------------------------
+
+/** Whether a sysfs directory name looks like a PCI address. */
+static bool
+is_pci_address (const char *name)
+{
+	unsigned domain, bus, slot, function;
+	int len = 0;
+	return sscanf (name, "%x:%x:%x.%x%n",
+		&domain, &bus, &slot, &function, &len) == 4 && !name[len];
+}
+
+static int
+compare_unsigned (const void *a, const void *b)
+{
+	unsigned x = *(const unsigned *) a, y = *(const unsigned *) b;
+	return (x > y) - (x < y);
+}
+
+int
+sensei_controller_get (const char *port_path,
+	struct sensei_controller *controller)
+{
+	if (!check_port_path (port_path))
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	// Leave room for names of attributes after the resolved path
+	char path[PATH_MAX + 16], resolved[PATH_MAX];
+	snprintf (path, sizeof path, "/sys/bus/usb/devices/%s", port_path);
+	if (!realpath (path, resolved))
+		return errno_to_libusb (errno);
+
+	// The device sits somewhere below the PCI function of its controller
+	char *name;
+	while ((name = strrchr (resolved, '/')) && !is_pci_address (name + 1))
+		*name = '\0';
+	if (!name)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	memset (controller, 0, sizeof *controller);
+	snprintf (controller->address, sizeof controller->address,
+		"%s", name + 1);
+
+	char driver[PATH_MAX];
+	snprintf (path, sizeof path, "%s/driver", resolved);
+	ssize_t len = readlink (path, driver, sizeof driver - 1);
+	if (len > 0)
+	{
+		driver[len] = '\0';
+		const char *base = strrchr (driver, '/');
+		snprintf (controller->driver, sizeof controller->driver,
+			"%.15s", base ? base + 1 : driver);
+	}
+
+	char node[16];
+	controller->numa_node = -1;
+	if (read_attribute (resolved, "numa_node", node, sizeof node))
+		controller->numa_node = atoi (node);
+
+	// MSI and MSI-X vectors each have an entry here, named by their number
+	snprintf (path, sizeof path, "%s/msi_irqs", resolved);
+	DIR *dir = opendir (path);
+	if (dir)
+	{
+		struct dirent *entry;
+		while ((entry = readdir (dir))
+			&& controller->irqs_len < SENSEI_CONTROLLER_MAX_IRQS)
+		{
+			char *end;
+			unsigned long irq = strtoul (entry->d_name, &end, 10);
+			if (*entry->d_name != '.' && !*end)
+				controller->irqs[controller->irqs_len++] = irq;
+		}
+		closedir (dir);
+		qsort (controller->irqs, controller->irqs_len,
+			sizeof *controller->irqs, compare_unsigned);
+	}
+
+	unsigned irq;
+	if (!controller->irqs_len && read_sysfs_dec (resolved, "irq", &irq) && irq)
+		controller->irqs[controller->irqs_len++] = irq;
+	return 0;
+}
+
+int
+sensei_irq_get (unsigned irq, struct sensei_irq *info)
+{
+	char dir[64];
+	snprintf (dir, sizeof dir, "/proc/irq/%u", irq);
+
+	memset (info, 0, sizeof *info);
+	errno = 0;
+	if (!read_attribute (dir, "smp_affinity_list",
+		info->affinity, sizeof info->affinity))
+		return errno ? errno_to_libusb (errno) : LIBUSB_ERROR_IO;
+
+	// Only some interrupt controllers can tell
+	read_attribute (dir, "effective_affinity_list",
+		info->effective, sizeof info->effective);
+	return 0;
+}
+
+int
+sensei_irq_set_affinity (unsigned irq, const char *cpus)
+{
+	char path[64];
+	snprintf (path, sizeof path, "/proc/irq/%u/smp_affinity_list", irq);
+
+	int fd = open (path, O_WRONLY | O_CLOEXEC);
+	if (fd < 0)
+		return errno_to_libusb (errno);
+
+	size_t len = strlen (cpus);
+	ssize_t written;
+	while ((written = write (fd, cpus, len)) < 0 && errno == EINTR)
+		;
+	int result = written < 0 ? errno_to_libusb (errno)
+		: (size_t) written != len ? LIBUSB_ERROR_IO : 0;
+	close (fd);
+	return result;
+}
+
+int
+sensei_irq_counts (unsigned irq, uint64_t *counts, size_t len)
+{
+	FILE *fp = fopen ("/proc/interrupts", "r");
+	if (!fp)
+		return errno_to_libusb (errno);
+
+	// The header names the CPUs that the columns belong to, which may skip
+	// some that are offline
+	char *line = NULL;
+	size_t line_len = 0, n_columns = 0;
+	unsigned *columns = NULL;
+	int result = LIBUSB_ERROR_NOT_FOUND;
+	if (getline (&line, &line_len, fp) < 0)
+		goto out;
+	for (char *p = line; (p = strstr (p, "CPU")); p += 3)
+	{
+		unsigned *resized =
+			realloc (columns, (n_columns + 1) * sizeof *columns);
+		if (!resized)
+		{
+			result = LIBUSB_ERROR_NO_MEM;
+			goto out;
+		}
+		columns = resized;
+		columns[n_columns++] = strtoul (p + 3, NULL, 10);
+	}
+
+	memset (counts, 0, len * sizeof *counts);
+	while (getline (&line, &line_len, fp) >= 0)
+	{
+		char *p;
+		if (strtoul (line, &p, 10) != irq || *p != ':' || p == line)
+			continue;
+
+		p++;
+		for (size_t i = 0; i < n_columns; i++)
+		{
+			char *end;
+			unsigned long long count = strtoull (p, &end, 10);
+			if (end == p)
+				break;
+			if (columns[i] < len)
+				counts[columns[i]] = count;
+			p = end;
+		}
+		result = 0;
+		break;
+	}
+
+out:
+	free (columns);
+	free (line);
+	fclose (fp);
+	return result;
+}
+
+int
+sensei_cpu_get (unsigned cpu, struct sensei_cpu *info)
+{
+	char dir[64], path[PATH_MAX];
+	snprintf (dir, sizeof dir, "/sys/devices/system/cpu/cpu%u", cpu);
+
+	memset (info, 0, sizeof *info);
+	info->node = -1;
+	DIR *entries = opendir (dir);
+	if (!entries)
+		return errno_to_libusb (errno);
+
+	// The NUMA node is a link called nodeN
+	struct dirent *entry;
+	while ((entry = readdir (entries)))
+	{
+		char *end;
+		if (!strncmp (entry->d_name, "node", 4) && entry->d_name[4])
+		{
+			unsigned long node = strtoul (entry->d_name + 4, &end, 10);
+			if (!*end)
+				info->node = node;
+		}
+	}
+	closedir (entries);
+
+	// Neither frequency scaling nor idle states need to be there at all
+	snprintf (path, sizeof path, "%s/cpufreq", dir);
+	read_attribute (path, "scaling_governor",
+		info->governor, sizeof info->governor);
+	read_sysfs_dec (path, "scaling_cur_freq", &info->cur_khz);
+	read_sysfs_dec (path, "cpuinfo_max_freq", &info->max_khz);
+
+	for (size_t i = 0; i < SENSEI_CPU_MAX_IDLE_STATES; i++)
+	{
+		struct sensei_cpu_idle *state = &info->idle[i];
+		snprintf (path, sizeof path, "%s/cpuidle/state%zu", dir, i);
+		if (!read_attribute (path, "name", state->name, sizeof state->name))
+			break;
+
+		unsigned disabled = 0;
+		read_sysfs_dec (path, "latency", &state->latency_us);
+		read_sysfs_dec (path, "disable", &disabled);
+		state->disabled = disabled;
+		info->idle_len++;
+	}
+	return 0;
+}
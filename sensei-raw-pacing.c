@@ -0,0 +1,204 @@
+/*
+ * sensei-raw-pacing.c: persisted pacing hints for writes
+ *
+ * The hints are produced by `sensei-raw-ctl --probe-transport' and kept in
+ * a small text file with a line per device model and transport:
+ *
+ *   <product ID in hex> <transport> <interval> <median RTT> <99th pct. RTT>
+ *
+ * with all times in microseconds.  Other state files that are keyed
+ * the same way share the code to read and replace lines here.
+ *
+ * Copyright (c) 2013, Přemysl Janouch <p.janouch@gmail.com>
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "config.h"
+#include "sensei-raw.h"
+
+/** Longest line that we care about. */
+#define LINE_MAX_LEN  128
+
+bool
+sensei_state_path (const char *name, bool system,
+	char *path, size_t path_len)
+{
+	const char *state_home = getenv ("XDG_STATE_HOME"), *home;
+	int len;
+	if (system)
+		len = snprintf (path, path_len, "%s/%s", PROJECT_STATE_DIR, name);
+	else if (state_home && *state_home == '/')
+		len = snprintf (path, path_len, "%s/%s/%s",
+			state_home, PROJECT_NAME, name);
+	else if ((home = getenv ("HOME")))
+		len = snprintf (path, path_len, "%s/.local/state/%s/%s",
+			home, PROJECT_NAME, name);
+	else
+		return false;
+	return len > 0 && (size_t) len < path_len;
+}
+
+bool
+sensei_make_parents (char *path)
+{
+	for (char *p = strchr (path + 1, '/'); p; p = strchr (p + 1, '/'))
+	{
+		*p = '\0';
+		bool ok = !mkdir (path, 0755) || errno == EEXIST;
+		*p = '/';
+		if (!ok)
+			return false;
+	}
+	return true;
+}
+
+/** Pass all lines of a file to the callback, returning whether any of them
+ *  has been accepted, or false if the file can't be read. */
+static bool
+state_read_file (const char *path, sensei_state_fn fn, void *user_data)
+{
+	char line[LINE_MAX_LEN];
+	FILE *fp = fopen (path, "r");
+	if (!fp)
+		return false;
+
+	bool found = false;
+	while (fgets (line, sizeof line, fp))
+		found |= fn (line, user_data);
+	fclose (fp);
+	return found;
+}
+
+bool
+sensei_state_read (const char *name, sensei_state_fn fn, void *user_data)
+{
+	char path[PATH_MAX];
+	bool system = !geteuid ();
+	if (sensei_state_path (name, system, path, sizeof path)
+	 && state_read_file (path, fn, user_data))
+		return true;
+
+	// Users that haven't stored anything of their own share root's data
+	return !system && sensei_state_path (name, true, path, sizeof path)
+		&& state_read_file (path, fn, user_data);
+}
+
+bool
+sensei_state_replace (const char *name, sensei_state_fn fn, void *user_data,
+	const char *lines)
+{
+	char path[PATH_MAX], tmp_path[PATH_MAX + 8], line[LINE_MAX_LEN];
+	if (!sensei_state_path (name, !geteuid (), path, sizeof path)
+	 || !sensei_make_parents (path))
+		return false;
+
+	snprintf (tmp_path, sizeof tmp_path, "%s.XXXXXX", path);
+	int fd = mkstemp (tmp_path);
+	FILE *out = fd < 0 ? NULL : fdopen (fd, "w");
+	if (!out)
+	{
+		if (fd >= 0)
+			close (fd);
+		return false;
+	}
+
+	// Keep everything else, replacing the lines that the callback accepts
+	fchmod (fd, 0644);
+	FILE *in = fopen (path, "r");
+	while (in && fgets (line, sizeof line, in))
+		if (!fn (line, user_data))
+			fputs (line, out);
+	if (in)
+		fclose (in);
+	fputs (lines, out);
+
+	bool ok = !ferror (out);
+	if (fclose (out) || !ok || rename (tmp_path, path))
+	{
+		unlink (tmp_path);
+		return false;
+	}
+	return true;
+}
+
+bool
+sensei_pacing_path (char *path, size_t path_len)
+{
+	return sensei_state_path ("pacing", !geteuid (), path, path_len);
+}
+
+/** What a line of the file is matched against. */
+struct pacing_key
+{
+	uint16_t product;                   ///< USB product ID
+	const char *transport;              ///< Name of the transport
+	struct sensei_pacing *pacing;       ///< Where to put the hints
+};
+
+/** Parse a line, returning whether it's for the given model and transport. */
+static bool
+parse_line (const char *line, void *user_data)
+{
+	struct pacing_key *key = user_data;
+	unsigned id, interval, p50, p99;
+	char name[32];
+	if (sscanf (line, "%x %31s %u %u %u", &id, name, &interval, &p50, &p99) != 5
+	 || id != key->product || strcmp (name, key->transport))
+		return false;
+
+	key->pacing->interval_us = interval;
+	key->pacing->rtt_p50_us = p50;
+	key->pacing->rtt_p99_us = p99;
+	return true;
+}
+
+bool
+sensei_pacing_load (uint16_t product, const char *transport,
+	struct sensei_pacing *pacing)
+{
+	struct pacing_key key = { product, transport, pacing };
+	return sensei_state_read ("pacing", parse_line, &key);
+}
+
+bool
+sensei_pacing_store (uint16_t product, const char *transport,
+	const struct sensei_pacing *pacing)
+{
+	char line[LINE_MAX_LEN];
+	snprintf (line, sizeof line, "%04x %s %u %u %u\n", product, transport,
+		pacing->interval_us, pacing->rtt_p50_us, pacing->rtt_p99_us);
+
+	struct sensei_pacing unused;
+	struct pacing_key key = { product, transport, &unused };
+	return sensei_state_replace ("pacing", parse_line, &key, line);
+}
+
+void
+sensei_use_pacing (struct sensei_device *device)
+{
+	struct sensei_pacing pacing;
+	if (sensei_pacing_load (device->product, device->transport->name, &pacing))
+		device->pacing_us = pacing.interval_us;
+}
@@ -0,0 +1,543 @@
+/*
+ * sensei-raw.c: SteelSeries Sensei Raw device access
+ *
+ * Transport-independent parts: commands and the configuration blob.
+ *
+ * Copyright (c) 2013, Přemysl Janouch <p.janouch@gmail.com>
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <time.h>
+
+#include <strings.h>
+
+// Only for the error codes, this file must not depend on the library itself
+#include <libusb.h>
+
+#include "sensei-raw.h"
+
+const uint16_t sensei_products[] =
+{
+	USB_PRODUCT_STEELSERIES_SENSEI_RAW,
+	USB_PRODUCT_STEELSERIES_COD_BO2
+};
+
+const size_t sensei_products_len =
+	sizeof sensei_products / sizeof sensei_products[0];
+
+bool
+sensei_product_supported (uint16_t product)
+{
+	for (size_t i = 0; i < sensei_products_len; i++)
+		if (sensei_products[i] == product)
+			return true;
+	return false;
+}
+
+// --- Setting values ----------------------------------------------------------
+
+static const char *mode_names[] =
+	{ [MODE_LEGACY] = "legacy", [MODE_NORMAL] = "normal" };
+static const char *polling_names[] =
+	{ [POLLING_1000_HZ] = "1000", [POLLING_500_HZ] = "500",
+	  [POLLING_250_HZ] = "250", [POLLING_125_HZ] = "125" };
+static const char *pulsation_names[] =
+	{ [PULSATION_STEADY] = "steady", [PULSATION_SLOW] = "slow",
+	  [PULSATION_MEDIUM] = "medium", [PULSATION_FAST] = "fast" };
+static const char *intensity_names[] =
+	{ [INTENSITY_OFF] = "off", [INTENSITY_LOW] = "low",
+	  [INTENSITY_MEDIUM] = "medium", [INTENSITY_HIGH] = "high" };
+
+#define N_ELEMENTS(a) (sizeof (a) / sizeof (a)[0])
+
+/** Look a value up in a table of names, returning its index or zero. */
+static int
+find_name (const char **names, size_t len, const char *value)
+{
+	for (size_t i = 1; i < len; i++)
+		if (!strcasecmp (names[i], value))
+			return i;
+	return 0;
+}
+
+static const char *
+name_of (const char **names, size_t len, int value)
+{
+	return value > 0 && (size_t) value < len ? names[value] : NULL;
+}
+
+bool
+sensei_parse_mode (const char *value, enum sensei_mode *mode)
+{
+	int i = find_name (mode_names, N_ELEMENTS (mode_names), value);
+	return i ? (*mode = i, true) : false;
+}
+
+bool
+sensei_parse_polling (const char *value, enum sensei_polling *polling)
+{
+	int i = find_name (polling_names, N_ELEMENTS (polling_names), value);
+	return i ? (*polling = i, true) : false;
+}
+
+bool
+sensei_parse_pulsation (const char *value,
+	enum sensei_pulsation *pulsation)
+{
+	int i = find_name (pulsation_names, N_ELEMENTS (pulsation_names), value);
+	return i ? (*pulsation = i, true) : false;
+}
+
+bool
+sensei_parse_intensity (const char *value,
+	enum sensei_intensity *intensity)
+{
+	int i = find_name (intensity_names, N_ELEMENTS (intensity_names), value);
+	return i ? (*intensity = i, true) : false;
+}
+
+bool
+sensei_parse_cpi (const char *value, int *cpi)
+{
+	char *end;
+	long n = strtol (value, &end, 10);
+	if (!*value || *end || n < 0)
+		return false;
+
+	n /= SENSEI_CPI_STEP;
+	if (n < SENSEI_CPI_MIN)
+		n = SENSEI_CPI_MIN;
+	if (n > SENSEI_CPI_MAX)
+		n = SENSEI_CPI_MAX;
+
+	*cpi = n;
+	return true;
+}
+
+bool
+sensei_parse_setting (const char *name, const char *value,
+	struct sensei_config *config, unsigned *fields)
+{
+	bool ok = false;
+	unsigned field = 0;
+	if (!strcasecmp (name, "mode"))
+		ok = sensei_parse_mode (value, &config->mode),
+		field = SENSEI_FIELD_MODE;
+	else if (!strcasecmp (name, "polling"))
+		ok = sensei_parse_polling (value, &config->polling),
+		field = SENSEI_FIELD_POLLING;
+	else if (!strcasecmp (name, "intensity"))
+		ok = sensei_parse_intensity (value, &config->intensity),
+		field = SENSEI_FIELD_INTENSITY;
+	else if (!strcasecmp (name, "pulsation"))
+		ok = sensei_parse_pulsation (value, &config->pulsation),
+		field = SENSEI_FIELD_PULSATION;
+	else if (!strcasecmp (name, "cpi-off"))
+		ok = sensei_parse_cpi (value, &config->cpi_off),
+		field = SENSEI_FIELD_CPI_OFF;
+	else if (!strcasecmp (name, "cpi-on"))
+		ok = sensei_parse_cpi (value, &config->cpi_on),
+		field = SENSEI_FIELD_CPI_ON;
+
+	if (ok)
+		*fields |= field;
+	return ok;
+}
+
+const char *
+sensei_mode_name (enum sensei_mode mode)
+{
+	return name_of (mode_names, N_ELEMENTS (mode_names), mode);
+}
+
+const char *
+sensei_polling_name (enum sensei_polling polling)
+{
+	return name_of (polling_names, N_ELEMENTS (polling_names), polling);
+}
+
+const char *
+sensei_pulsation_name (enum sensei_pulsation pulsation)
+{
+	return name_of (pulsation_names, N_ELEMENTS (pulsation_names), pulsation);
+}
+
+const char *
+sensei_intensity_name (enum sensei_intensity intensity)
+{
+	return name_of (intensity_names, N_ELEMENTS (intensity_names), intensity);
+}
+
+// --- Devices -----------------------------------------------------------------
+
+/** Same as libusb_error_name(), which we can't call from here. */
+const char *
+sensei_error_name (int error)
+{
+	switch (error)
+	{
+	case LIBUSB_SUCCESS:              return "LIBUSB_SUCCESS";
+	case LIBUSB_ERROR_IO:             return "LIBUSB_ERROR_IO";
+	case LIBUSB_ERROR_INVALID_PARAM:  return "LIBUSB_ERROR_INVALID_PARAM";
+	case LIBUSB_ERROR_ACCESS:         return "LIBUSB_ERROR_ACCESS";
+	case LIBUSB_ERROR_NO_DEVICE:      return "LIBUSB_ERROR_NO_DEVICE";
+	case LIBUSB_ERROR_NOT_FOUND:      return "LIBUSB_ERROR_NOT_FOUND";
+	case LIBUSB_ERROR_BUSY:           return "LIBUSB_ERROR_BUSY";
+	case LIBUSB_ERROR_TIMEOUT:        return "LIBUSB_ERROR_TIMEOUT";
+	case LIBUSB_ERROR_OVERFLOW:       return "LIBUSB_ERROR_OVERFLOW";
+	case LIBUSB_ERROR_PIPE:           return "LIBUSB_ERROR_PIPE";
+	case LIBUSB_ERROR_INTERRUPTED:    return "LIBUSB_ERROR_INTERRUPTED";
+	case LIBUSB_ERROR_NO_MEM:         return "LIBUSB_ERROR_NO_MEM";
+	case LIBUSB_ERROR_NOT_SUPPORTED:  return "LIBUSB_ERROR_NOT_SUPPORTED";
+	case LIBUSB_ERROR_OTHER:          return "LIBUSB_ERROR_OTHER";
+	default:                          return "**UNKNOWN**";
+	}
+}
+
+void
+sensei_free_device_list (struct sensei_device_info *list, size_t len)
+{
+	for (size_t i = 0; i < len; i++)
+	{
+		free (list[i].usb_path);
+		free (list[i].hidraw_path);
+	}
+	free (list);
+}
+
+int
+sensei_detach_kernel_driver (struct sensei_device *device)
+{
+	return device->transport->detach (device);
+}
+
+int
+sensei_claim_interface (struct sensei_device *device)
+{
+	return device->transport->claim (device);
+}
+
+int
+sensei_release_interface (struct sensei_device *device)
+{
+	return device->transport->release (device);
+}
+
+int
+sensei_attach_kernel_driver (struct sensei_device *device)
+{
+	return device->transport->attach (device);
+}
+
+int
+sensei_get_port_path (struct sensei_device *device, char *path, size_t len)
+{
+	if (!device->transport->port_path)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+	return device->transport->port_path (device, path, len);
+}
+
+void
+sensei_close (struct sensei_device *device)
+{
+	device->transport->close (device);
+}
+
+// --- Commands ----------------------------------------------------------------
+
+static void
+command_init (struct sensei_command *command, const char *step,
+	unsigned char code, unsigned char selector, unsigned char value)
+{
+	memset (command->data, 0, sizeof command->data);
+	command->data[0] = code;
+	command->data[1] = selector;
+	command->data[2] = value;
+	command->step = step;
+}
+
+void
+sensei_command_mode (struct sensei_command *command,
+	enum sensei_mode mode)
+{
+	command_init (command, "setting the mode",
+		SENSEI_CMD_MODE, 0x00, mode);
+}
+
+void
+sensei_command_intensity (struct sensei_command *command,
+	enum sensei_intensity intensity)
+{
+	command_init (command, "setting backlight intensity",
+		SENSEI_CMD_INTENSITY, 0x01, intensity);
+}
+
+void
+sensei_command_pulsation (struct sensei_command *command,
+	enum sensei_pulsation pulsation)
+{
+	command_init (command, "setting backlight pulsation",
+		SENSEI_CMD_PULSATION, 0x01, pulsation);
+}
+
+void
+sensei_command_cpi (struct sensei_command *command,
+	int cpi, bool led_status)
+{
+	assert (cpi >= SENSEI_CPI_MIN && cpi <= SENSEI_CPI_MAX);
+	command_init (command, led_status
+		? "setting CPI with the LED on" : "setting CPI with the LED off",
+		SENSEI_CMD_CPI, led_status ? 2 : 1, cpi);
+}
+
+void
+sensei_command_polling (struct sensei_command *command,
+	enum sensei_polling polling)
+{
+	command_init (command, "setting the polling frequency",
+		SENSEI_CMD_POLLING, 0x00, polling);
+}
+
+void
+sensei_command_save (struct sensei_command *command)
+{
+	command_init (command, "saving to ROM", SENSEI_CMD_SAVE, 0x00, 0x00);
+}
+
+size_t
+sensei_prepare_commands (const struct sensei_config *config,
+	unsigned fields, bool save, struct sensei_command *commands)
+{
+	size_t len = 0;
+	if (fields & SENSEI_FIELD_MODE)
+		sensei_command_mode (&commands[len++], config->mode);
+	if (fields & SENSEI_FIELD_POLLING)
+		sensei_command_polling (&commands[len++], config->polling);
+	if (fields & SENSEI_FIELD_INTENSITY)
+		sensei_command_intensity (&commands[len++], config->intensity);
+	if (fields & SENSEI_FIELD_PULSATION)
+		sensei_command_pulsation (&commands[len++], config->pulsation);
+
+	if (fields & SENSEI_FIELD_CPI_OFF)
+		sensei_command_cpi (&commands[len++], config->cpi_off, false);
+	if (fields & SENSEI_FIELD_CPI_ON)
+		sensei_command_cpi (&commands[len++], config->cpi_on, true);
+
+	if (save)
+		sensei_command_save (&commands[len++]);
+	return len;
+}
+
+/** Monotonic time, for pacing writes. */
+static uint64_t
+now_us (void)
+{
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void
+sensei_wait_for_pacing (struct sensei_device *device)
+{
+	uint64_t now = now_us (), due = device->last_send_us + device->pacing_us;
+	if (device->pacing_us && device->last_send_us && now < due)
+	{
+		struct timespec ts =
+			{ (due - now) / 1000000, (due - now) % 1000000 * 1000 };
+		while (nanosleep (&ts, &ts) && errno == EINTR)
+			;
+	}
+}
+
+/** Wait until the device is ready for another write, if it's being paced. */
+static void
+pace (struct sensei_device *device)
+{
+	if (!device->pacing_us)
+		return;
+
+	sensei_wait_for_pacing (device);
+	device->last_send_us = now_us ();
+}
+
+/** Send a command to the mouse via SET_REPORT. */
+int
+sensei_send_command (struct sensei_device *device,
+	unsigned char *data, uint16_t length)
+{
+	pace (device);
+	device->stats.transfers++;
+	return device->transport->send (device, data, length);
+}
+
+int
+sensei_send_commands (struct sensei_device *device,
+	const struct sensei_command *commands, size_t len, size_t *failed)
+{
+	if (!len)
+		return 0;
+
+	size_t failed_index = 0;
+	int result = 0;
+	// Not worth the setup for a single command, and it can't be paced
+	if (device->transport->send_batch && len > 1 && !device->pacing_us)
+	{
+		result = device->transport->send_batch
+			(device, commands, len, &failed_index);
+		device->stats.transfers += result ? failed_index + 1 : len;
+	}
+	else for (; failed_index < len; failed_index++)
+	{
+		unsigned char data[SENSEI_COMMAND_LENGTH];
+		memcpy (data, commands[failed_index].data, sizeof data);
+		if ((result = sensei_send_command (device, data, sizeof data)))
+			break;
+	}
+
+	if (result && failed)
+		*failed = failed_index;
+	return result;
+}
+
+static int
+send_prepared (struct sensei_device *device,
+	const struct sensei_command *command)
+{
+	return sensei_send_commands (device, command, 1, NULL);
+}
+
+/** Set the operating mode of the mouse. */
+int
+sensei_set_mode (struct sensei_device *device,
+	enum sensei_mode mode)
+{
+	struct sensei_command command;
+	sensei_command_mode (&command, mode);
+	return send_prepared (device, &command);
+}
+
+/** Set backlight intensity. */
+int
+sensei_set_intensity (struct sensei_device *device,
+	enum sensei_intensity intensity)
+{
+	struct sensei_command command;
+	sensei_command_intensity (&command, intensity);
+	return send_prepared (device, &command);
+}
+
+/** Set pulsation speed. */
+int
+sensei_set_pulsation (struct sensei_device *device,
+	enum sensei_pulsation pulsation)
+{
+	struct sensei_command command;
+	sensei_command_pulsation (&command, pulsation);
+	return send_prepared (device, &command);
+}
+
+/** Set sensitivity in CPI. */
+int
+sensei_set_cpi (struct sensei_device *device,
+	int cpi, bool led_status)
+{
+	struct sensei_command command;
+	sensei_command_cpi (&command, cpi, led_status);
+	return send_prepared (device, &command);
+}
+
+/** Set the polling frequency. */
+int
+sensei_set_polling (struct sensei_device *device,
+	enum sensei_polling polling)
+{
+	struct sensei_command command;
+	sensei_command_polling (&command, polling);
+	return send_prepared (device, &command);
+}
+
+/** Save the current configuration to ROM. */
+int
+sensei_save_to_rom (struct sensei_device *device)
+{
+	struct sensei_command command;
+	sensei_command_save (&command);
+	return send_prepared (device, &command);
+}
+
+int
+sensei_load_blob (struct sensei_device *device,
+	unsigned char blob[SENSEI_BLOB_LENGTH])
+{
+	device->stats.transfers++;
+	return device->transport->get_report (device, blob, SENSEI_BLOB_LENGTH);
+}
+
+void
+sensei_decode_blob (const unsigned char blob[SENSEI_BLOB_LENGTH],
+	struct sensei_config *config)
+{
+	config->intensity = blob[SENSEI_BLOB_INTENSITY];
+	config->pulsation = blob[SENSEI_BLOB_PULSATION];
+	config->cpi_off   = blob[SENSEI_BLOB_CPI_OFF];
+	config->cpi_on    = blob[SENSEI_BLOB_CPI_ON];
+	config->polling   = blob[SENSEI_BLOB_POLLING];
+}
+
+/** Read device configuration. */
+int
+sensei_load_config (struct sensei_device *device,
+	struct sensei_config *config)
+{
+	unsigned char data[SENSEI_BLOB_LENGTH];
+
+	int result = sensei_load_blob (device, data);
+	if (result < 0)
+		return result;
+
+	sensei_decode_blob (data, config);
+	return 0;
+}
+
+const size_t sensei_blob_known[] =
+{
+	SENSEI_BLOB_INTENSITY,
+	SENSEI_BLOB_PULSATION,
+	SENSEI_BLOB_CPI_OFF,
+	SENSEI_BLOB_CPI_ON,
+	SENSEI_BLOB_POLLING,
+};
+
+const size_t sensei_blob_known_len = N_ELEMENTS (sensei_blob_known);
+
+/** 64-bit FNV-1a over the known fields. */
+uint64_t
+sensei_blob_digest (const unsigned char blob[SENSEI_BLOB_LENGTH])
+{
+	uint64_t hash = 0xcbf29ce484222325;
+	for (size_t i = 0; i < sensei_blob_known_len; i++)
+	{
+		hash ^= blob[sensei_blob_known[i]];
+		hash *= 0x100000001b3;
+	}
+	return hash;
+}
@@ -0,0 +1,510 @@
+/*
+ * sensei-raw.h: SteelSeries Sensei Raw protocol and device access
+ *
+ * See the NOTES file for a description of the protocol.  The transports are
+ * implemented in sensei-raw-libusb.c and, on Linux, sensei-raw-linux.c.
+ *
+ * Copyright (c) 2013, Přemysl Janouch <p.janouch@gmail.com>
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#ifndef SENSEI_RAW_H
+#define SENSEI_RAW_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define USB_VENDOR_STEELSERIES  0x1038
+#define USB_PRODUCT_STEELSERIES_SENSEI_RAW  0x1369
+#define USB_PRODUCT_STEELSERIES_COD_BO2  0x136f
+
+#define SENSEI_CTL_IFACE  0
+
+#define USB_GET_REPORT  0x01
+#define USB_SET_REPORT  0x09
+
+/* All commands are sent as Output reports of this length */
+#define SENSEI_COMMAND_LENGTH  32
+/* GET_REPORT always returns this blob, padded with zeroes if asked for more */
+#define SENSEI_BLOB_LENGTH  256
+
+/* Command codes, the first byte of an Output report */
+#define SENSEI_CMD_MODE       0x02
+#define SENSEI_CMD_CPI        0x03
+#define SENSEI_CMD_POLLING    0x04
+#define SENSEI_CMD_INTENSITY  0x05
+#define SENSEI_CMD_PULSATION  0x07
+#define SENSEI_CMD_SAVE       0x09
+
+/* Offsets of known settings within the GET_REPORT blob */
+#define SENSEI_BLOB_INTENSITY  102
+#define SENSEI_BLOB_PULSATION  103
+#define SENSEI_BLOB_CPI_OFF    107
+#define SENSEI_BLOB_CPI_ON     108
+#define SENSEI_BLOB_POLLING    128
+
+#define SENSEI_CPI_MIN  0x01
+#define SENSEI_CPI_MAX  0x3f
+#define SENSEI_CPI_STEP  90
+
+/** Backlight pulsation. */
+enum sensei_pulsation
+{
+	PULSATION_STEADY = 1,
+	PULSATION_SLOW,
+	PULSATION_MEDIUM,
+	PULSATION_FAST
+};
+
+/** Device mode. */
+/* Just guessing the names, could be anything */
+enum sensei_mode
+{
+	MODE_LEGACY = 1,
+	MODE_NORMAL
+};
+
+/** Backlight intensity. */
+enum sensei_intensity
+{
+	INTENSITY_OFF = 1,
+	INTENSITY_LOW,
+	INTENSITY_MEDIUM,
+	INTENSITY_HIGH
+};
+
+/** Polling frequency. */
+enum sensei_polling
+{
+	POLLING_1000_HZ = 1,
+	POLLING_500_HZ,
+	POLLING_250_HZ,
+	POLLING_125_HZ
+};
+
+/** Overall device configuration. */
+struct sensei_config
+{
+	enum sensei_mode mode;
+	int cpi_off;
+	int cpi_on;
+	enum sensei_pulsation pulsation;
+	enum sensei_intensity intensity;
+	enum sensei_polling polling;
+};
+
+/** Product ID's we know how to handle, in order of preference. */
+extern const uint16_t sensei_products[];
+extern const size_t sensei_products_len;
+
+bool sensei_product_supported (uint16_t product);
+
+/** The longest chain of commands that makes sense: mode, polling,
+ *  intensity, pulsation, both CPI settings and saving to ROM. */
+#define SENSEI_MAX_COMMANDS  7
+
+/** A prepared command, so that whole chains of them can be sent at once. */
+struct sensei_command
+{
+	unsigned char data[SENSEI_COMMAND_LENGTH];  ///< The Output report
+	const char *step;                   ///< What it does, for messages
+};
+
+/** Bits selecting fields of struct sensei_config. */
+enum sensei_field
+{
+	SENSEI_FIELD_MODE      = 1 << 0,
+	SENSEI_FIELD_POLLING   = 1 << 1,
+	SENSEI_FIELD_INTENSITY = 1 << 2,
+	SENSEI_FIELD_PULSATION = 1 << 3,
+	SENSEI_FIELD_CPI_OFF   = 1 << 4,
+	SENSEI_FIELD_CPI_ON    = 1 << 5,
+	SENSEI_FIELD_ALL       = (1 << 6) - 1
+};
+
+/** Parse setting values as used on the command line, case-insensitively. */
+bool sensei_parse_mode (const char *value, enum sensei_mode *mode);
+bool sensei_parse_polling (const char *value, enum sensei_polling *polling);
+bool sensei_parse_pulsation (const char *value,
+	enum sensei_pulsation *pulsation);
+bool sensei_parse_intensity (const char *value,
+	enum sensei_intensity *intensity);
+/** Convert CPI to the nearest lower device setting, clamping it to range.
+ *  Returns false if the value isn't a number at all. */
+bool sensei_parse_cpi (const char *value, int *cpi);
+
+/** Parse a setting named like the command line option that changes it,
+ *  store it in @a config and mark it in @a fields. */
+bool sensei_parse_setting (const char *name, const char *value,
+	struct sensei_config *config, unsigned *fields);
+
+/** Setting values as accepted by the parsers, or NULL if invalid. */
+const char *sensei_mode_name (enum sensei_mode mode);
+const char *sensei_polling_name (enum sensei_polling polling);
+const char *sensei_pulsation_name (enum sensei_pulsation pulsation);
+const char *sensei_intensity_name (enum sensei_intensity intensity);
+
+// --- Devices -----------------------------------------------------------------
+
+struct sensei_device;
+
+/** Transport backend operations.  All of them return zero on success or
+ *  a negative libusb error code, whatever the underlying interface is. */
+struct sensei_transport
+{
+	const char *name;
+
+	int (*detach) (struct sensei_device *device);
+	int (*claim) (struct sensei_device *device);
+	int (*release) (struct sensei_device *device);
+	int (*attach) (struct sensei_device *device);
+
+	/** Send an Output report via SET_REPORT. */
+	int (*send) (struct sensei_device *device,
+		unsigned char *data, uint16_t length);
+	/** Receive the configuration blob via GET_REPORT. */
+	int (*get_report) (struct sensei_device *device,
+		unsigned char *data, uint16_t length);
+	/** Send a chain of commands in order, stopping at the first failure,
+	 *  whose index is then stored in @a failed.  May be NULL. */
+	int (*send_batch) (struct sensei_device *device,
+		const struct sensei_command *commands, size_t len, size_t *failed);
+	/** Store the USB port path of the device, such as "1-2.3", which is
+	 *  its name in /sys/bus/usb/devices.  May be NULL. */
+	int (*port_path) (struct sensei_device *device, char *path, size_t len);
+
+	void (*close) (struct sensei_device *device);
+};
+
+/** Transfer statistics. */
+struct sensei_stats
+{
+	unsigned long transfers;            ///< Reports sent and received
+	unsigned long syscalls;             ///< Issued by fd-based backends
+	unsigned long retries;              ///< Interrupted calls repeated
+	unsigned long detaches;             ///< Kernel drivers detached
+	unsigned long reattaches;           ///< Kernel drivers reattached
+};
+
+/** An opened device, backends extend this structure. */
+struct sensei_device
+{
+	const struct sensei_transport *transport;
+	uint16_t product;                   ///< USB product ID
+	char *path;                         ///< Device node, for messages
+	struct sensei_stats stats;          ///< Transfer statistics
+
+	unsigned pacing_us;                 ///< Minimum time between writes
+	uint64_t last_send_us;              ///< When the last write started
+};
+
+/** A supported device present in the system. */
+struct sensei_device_info
+{
+	uint16_t product;                   ///< USB product ID
+	char *usb_path;                     ///< /dev/bus/usb/BBB/DDD, or NULL
+	char *hidraw_path;                  ///< The control interface, or NULL
+};
+
+void sensei_free_device_list (struct sensei_device_info *list, size_t len);
+
+/** Open a device through libusb, optionally at /dev/bus/usb/BBB/DDD. */
+int sensei_libusb_open (const char *path, struct sensei_device **device);
+/** List all supported devices through libusb, never with hidraw nodes. */
+int sensei_libusb_list (struct sensei_device_info **list, size_t *len);
+
+#ifdef __linux__
+/** Open a device through usbfs directly, optionally at /dev/bus/usb/BBB/DDD,
+ *  without ever initialising libusb. */
+int sensei_usbfs_open (const char *path, struct sensei_device **device);
+/** Open a device through hidraw, optionally at /dev/hidrawN.  The kernel
+ *  driver stays bound, so there's nothing to detach or claim. */
+int sensei_hidraw_open (const char *path, struct sensei_device **device);
+/** Take over a descriptor of a device node that has been opened before,
+ *  possibly by another process, such as one kept in the systemd file
+ *  descriptor store.  It is closed on failure.  usbfs descriptors are
+ *  expected to have their interface claimed and detached from the kernel
+ *  driver, which is then reattached as usual. */
+int sensei_usbfs_open_fd (const char *path, int fd,
+	struct sensei_device **device);
+int sensei_hidraw_open_fd (const char *path, int fd,
+	struct sensei_device **device);
+/** The descriptor of a device opened through usbfs or hidraw, or -1. */
+int sensei_get_fd (struct sensei_device *device);
+/** List all supported devices from sysfs, along with hidraw nodes of their
+ *  control interfaces.  Devices with only a hidraw node, such as emulated
+ *  ones, are included as well. */
+int sensei_sysfs_list (struct sensei_device_info **list, size_t *len);
+
+/** Runtime power management attributes of a USB device, from the power
+ *  directory in sysfs.  Strings are empty for missing attributes. */
+struct sensei_power
+{
+	char control[8];                    ///< "on", or "auto" to autosuspend
+	char wakeup[16];                    ///< "enabled" or "disabled"
+	char runtime_status[16];            ///< "active", "suspended", ...
+	int autosuspend_delay_ms;           ///< Idle time before suspending
+};
+
+/** Read the power management attributes of the device at a port path. */
+int sensei_power_get (const char *port_path, struct sensei_power *power);
+/** Set "control", "autosuspend_delay_ms" or "wakeup", which needs root. */
+int sensei_power_set (const char *port_path,
+	const char *name, const char *value);
+
+#define SENSEI_CONTROLLER_MAX_IRQS  16
+
+/** The PCI host controller that a USB device is attached to. */
+struct sensei_controller
+{
+	char address[16];                   ///< PCI address, like 0000:00:14.0
+	char driver[16];                    ///< Kernel driver, like xhci_hcd
+	int numa_node;                      ///< NUMA node, or -1 if unknown
+	/** MSI or MSI-X vectors if it has any, otherwise the legacy interrupt. */
+	unsigned irqs[SENSEI_CONTROLLER_MAX_IRQS];
+	size_t irqs_len;                    ///< Number of interrupts
+};
+
+/** Find the host controller of the device at a port path.  Returns
+ *  LIBUSB_ERROR_NOT_SUPPORTED when it isn't on PCI. */
+int sensei_controller_get (const char *port_path,
+	struct sensei_controller *controller);
+
+/** Where an interrupt may be serviced, as CPU lists like "0-3,8". */
+struct sensei_irq
+{
+	char affinity[64];                  ///< CPUs it's allowed to go to
+	char effective[64];                 ///< Where it goes, empty if unknown
+};
+
+int sensei_irq_get (unsigned irq, struct sensei_irq *info);
+/** Restrict an interrupt to a list of CPUs, which needs root. */
+int sensei_irq_set_affinity (unsigned irq, const char *cpus);
+/** Read how many times each CPU has serviced an interrupt, indexed by CPU
+ *  number, from /proc/interrupts.  CPUs not listed there are left zero. */
+int sensei_irq_counts (unsigned irq, uint64_t *counts, size_t len);
+
+#define SENSEI_CPU_MAX_IDLE_STATES  10
+
+/** An idle state of a CPU. */
+struct sensei_cpu_idle
+{
+	char name[16];                      ///< Like POLL, C1 or C6
+	unsigned latency_us;                ///< Exit latency
+	bool disabled;                      ///< Whether it's been turned off
+};
+
+/** Power management settings of a CPU that affect how fast it responds.
+ *  Strings are empty and numbers zero for what the system doesn't have. */
+struct sensei_cpu
+{
+	int node;                           ///< NUMA node, or -1 if unknown
+	char governor[16];                  ///< cpufreq scaling governor
+	unsigned cur_khz;                   ///< Current frequency
+	unsigned max_khz;                   ///< Maximum frequency
+	struct sensei_cpu_idle idle[SENSEI_CPU_MAX_IDLE_STATES];
+	size_t idle_len;                    ///< Number of idle states
+};
+
+int sensei_cpu_get (unsigned cpu, struct sensei_cpu *info);
+#endif // __linux__
+
+const char *sensei_error_name (int error);
+/** Returns LIBUSB_ERROR_NOT_SUPPORTED when the transport can't tell, and
+ *  LIBUSB_ERROR_NOT_FOUND for devices that aren't on USB at all. */
+int sensei_get_port_path (struct sensei_device *device,
+	char *path, size_t len);
+
+/** How fast a device model accepts writes through a given transport. */
+struct sensei_pacing
+{
+	unsigned interval_us;               ///< Minimum time between writes
+	unsigned rtt_p50_us;                ///< Median round trip
+	unsigned rtt_p99_us;                ///< 99th percentile round trip
+};
+
+/** Where state file @a name is kept: under PROJECT_STATE_DIR for the system,
+ *  in $XDG_STATE_HOME for a user. */
+bool sensei_state_path (const char *name, bool system,
+	char *path, size_t path_len);
+/** Create all parent directories of a path. */
+bool sensei_make_parents (char *path);
+
+/** Receives a line of a keyed state file, returning whether it's a match. */
+typedef bool (*sensei_state_fn) (const char *line, void *user_data);
+/** Pass all lines of state file @a name to @a fn, returning whether any has
+ *  matched.  Users without a matching line of their own fall back to the
+ *  system file, so that what root has stored applies to everyone. */
+bool sensei_state_read (const char *name, sensei_state_fn fn, void *user_data);
+/** Atomically replace the lines of state file @a name that @a fn matches
+ *  with @a lines, keeping the rest.  Root writes the system file. */
+bool sensei_state_replace (const char *name, sensei_state_fn fn,
+	void *user_data, const char *lines);
+
+/** Where pacing hints are stored: under PROJECT_STATE_DIR for root,
+ *  in $XDG_STATE_HOME for everyone else, who also read root's hints
+ *  when they have none of their own. */
+bool sensei_pacing_path (char *path, size_t path_len);
+bool sensei_pacing_load (uint16_t product, const char *transport,
+	struct sensei_pacing *pacing);
+bool sensei_pacing_store (uint16_t product, const char *transport,
+	const struct sensei_pacing *pacing);
+/** CPI that each step of a device model has been measured to yield. */
+struct sensei_cpi_table
+{
+	double measured[SENSEI_CPI_MAX + 1];  ///< Indexed by step, 0 if unknown
+};
+
+/** Where CPI calibration is stored, like pacing hints. */
+bool sensei_cpi_path (char *path, size_t path_len);
+bool sensei_cpi_load (uint16_t product, struct sensei_cpi_table *table);
+bool sensei_cpi_store (uint16_t product, const struct sensei_cpi_table *table);
+/** The CPI that a step yields, which is the nominal one unless measured.
+ *  The table may be NULL. */
+double sensei_cpi_actual (const struct sensei_cpi_table *table, int step);
+/** The step that comes closest to the requested CPI. */
+int sensei_cpi_nearest (const struct sensei_cpi_table *table, double cpi);
+
+/** Pace writes to the device according to stored hints, if there are any.
+ *  Chains of commands then aren't submitted at once. */
+void sensei_use_pacing (struct sensei_device *device);
+/** Wait until a paced device is ready for another write, so that the next
+ *  one can go out right away. */
+void sensei_wait_for_pacing (struct sensei_device *device);
+
+/** Temporarily unbind the kernel driver from the control interface. */
+int sensei_detach_kernel_driver (struct sensei_device *device);
+int sensei_claim_interface (struct sensei_device *device);
+int sensei_release_interface (struct sensei_device *device);
+/** Rebind the kernel driver if we've detached it before. */
+int sensei_attach_kernel_driver (struct sensei_device *device);
+void sensei_close (struct sensei_device *device);
+
+// --- Commands ----------------------------------------------------------------
+
+void sensei_command_mode (struct sensei_command *command,
+	enum sensei_mode mode);
+void sensei_command_intensity (struct sensei_command *command,
+	enum sensei_intensity intensity);
+void sensei_command_pulsation (struct sensei_command *command,
+	enum sensei_pulsation pulsation);
+void sensei_command_cpi (struct sensei_command *command,
+	int cpi, bool led_status);
+void sensei_command_polling (struct sensei_command *command,
+	enum sensei_polling polling);
+void sensei_command_save (struct sensei_command *command);
+
+/** Prepare commands for the selected fields, in a fixed order, optionally
+ *  followed by saving to ROM.  Returns the number of commands. */
+size_t sensei_prepare_commands (const struct sensei_config *config,
+	unsigned fields, bool save, struct sensei_command *commands);
+
+int sensei_send_command (struct sensei_device *device,
+	unsigned char *data, uint16_t length);
+/** Send a chain of prepared commands, in a single submission where the
+ *  backend supports it.  On failure, @a failed is set to the index of the
+ *  command that didn't make it. */
+int sensei_send_commands (struct sensei_device *device,
+	const struct sensei_command *commands, size_t len, size_t *failed);
+int sensei_set_mode (struct sensei_device *device,
+	enum sensei_mode mode);
+int sensei_set_intensity (struct sensei_device *device,
+	enum sensei_intensity intensity);
+int sensei_set_pulsation (struct sensei_device *device,
+	enum sensei_pulsation pulsation);
+int sensei_set_cpi (struct sensei_device *device,
+	int cpi, bool led_status);
+int sensei_set_polling (struct sensei_device *device,
+	enum sensei_polling polling);
+int sensei_save_to_rom (struct sensei_device *device);
+
+/** Read the raw GET_REPORT blob. */
+int sensei_load_blob (struct sensei_device *device,
+	unsigned char blob[SENSEI_BLOB_LENGTH]);
+/** Extract settings from the GET_REPORT blob; the mode isn't stored there. */
+void sensei_decode_blob (const unsigned char blob[SENSEI_BLOB_LENGTH],
+	struct sensei_config *config);
+int sensei_load_config (struct sensei_device *device,
+	struct sensei_config *config);
+
+/** The blob offsets that we know the meaning of, in a fixed order. */
+extern const size_t sensei_blob_known[];
+extern const size_t sensei_blob_known_len;
+
+/** A digest of the known fields of the blob, so that configurations of many
+ *  devices can be compared cheaply.  It doesn't change between versions. */
+uint64_t sensei_blob_digest (const unsigned char blob[SENSEI_BLOB_LENGTH]);
+
+// --- Change journal ----------------------------------------------------------
+
+/** How much of each command the journal keeps, enough for all we send. */
+#define SENSEI_JOURNAL_COMMAND_BYTES  4
+
+/** A change made to a device, as recorded in the journal. */
+struct sensei_journal_entry
+{
+	uint64_t time_us;                   ///< Wall clock time of the change
+	uint32_t pid;                       ///< Process that has made it
+	uint32_t uid;                       ///< User running the process
+	char caller[32];                    ///< Name of the program
+	char port[32];                      ///< USB port path, if known
+	char node[64];                      ///< Device node that was used
+	uint16_t product;                   ///< USB product ID
+
+	bool before_known;                  ///< Whether @a before could be read
+	struct sensei_config before;        ///< Settings before, the mode is 0
+	struct sensei_config after;         ///< Settings after the change
+
+	/** Beginnings of commands that have been attempted. */
+	unsigned char commands[SENSEI_MAX_COMMANDS][SENSEI_JOURNAL_COMMAND_BYTES];
+	size_t commands_len;                ///< Number of commands
+	int result;                         ///< Zero or a libusb error code
+};
+
+/** Where the journal is kept, see sensei_state_path().  Changes go to the
+ *  system journal when made by root, to that of the user otherwise. */
+bool sensei_journal_path (bool system, char *path, size_t path_len);
+/** Start an entry for changes about to be made to the device, reading the
+ *  settings it has now, which costs a transfer. */
+void sensei_journal_begin (struct sensei_device *device, const char *caller,
+	struct sensei_journal_entry *entry);
+/** Complete the entry with @a len commands, of which @a sent went through,
+ *  and append it to the journal. */
+bool sensei_journal_commit (struct sensei_journal_entry *entry,
+	const struct sensei_command *commands, size_t len, size_t sent,
+	int result);
+/** Like sensei_send_commands(), recording the change in the journal.
+ *  Programs change settings through this, with a few exceptions that call
+ *  sensei_journal_begin() and sensei_journal_commit() themselves: --sync,
+ *  which sends from several threads at once, and the LED effects engine and
+ *  CPI calibration, which only record the net change of a whole run, not
+ *  each frame or step.  --probe-transport and the benchmarks aren't recorded
+ *  at all, as they either set values that are already there or only ever
+ *  talk to the emulator, and neither is the udev helper unless it's given
+ *  --journal, so as to stay cheap during boot. */
+int sensei_apply_commands (struct sensei_device *device, const char *caller,
+	const struct sensei_command *commands, size_t len, size_t *failed);
+
+/** Receives journal entries, returning false to stop. */
+typedef bool (*sensei_journal_fn) (const struct sensei_journal_entry *entry,
+	void *user_data);
+/** Go through entries made between the two times, inclusive, in the order
+ *  they were appended.  A journal that doesn't exist fails with ENOENT. */
+bool sensei_journal_query (const char *path, uint64_t since_us,
+	uint64_t until_us, sensei_journal_fn callback, void *user_data);
+
+#endif // ! SENSEI_RAW_H